@@ -0,0 +1,690 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <memory>
+#include <new>
+#include <optional>
+#include <random>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+#include <getopt.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <linux/videodev2.h>
+
+#include "./camera.h"
+#include "./convert.h"
+#include "./convert_kernels.h"
+#include "./dmabuf.h"
+#include "./encoder.h"
+#include "./encoder_sw.h"
+#include "./fourcc.h"
+#include "./frame_source.h"
+#include "./motion.h"
+#include "./output.h"
+#include "./output_writer.h"
+#include "./recording.h"
+#include "./sink.h"
+
+// Checks every conversion kernel set usable on this CPU against the scalar
+// reference, and frames DmabufHandoff imports into the software encoder
+// against copied ones, then reports throughput of the kernels. Exits with 1
+// on mismatch.
+//
+// Then drives convert, encode and write the way capture does, with frames of
+// a synthetic or a raw file source, and reports rates, latency percentiles
+// of each step and allocations per frame.
+
+// Counts allocations through operator new. Allocations of C libraries, like
+// libjpeg, aren't seen.
+static std::atomic<size_t> allocation_count{0};
+
+void *operator new(size_t size) {
+  allocation_count.fetch_add(1, std::memory_order_relaxed);
+  if (auto *p = malloc(size == 0 ? 1 : size)) {
+    return p;
+  }
+  throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept { free(p); }
+void operator delete(void *p, size_t) noexcept { free(p); }
+
+struct Format {
+  const char *name;
+  uint32_t four_cc;
+  uint32_t bytes_per_pixel;
+};
+
+static const Format FORMATS[] = {
+    {"YUYV", V4L2_PIX_FMT_YUYV, 2},
+    {"UYVY", V4L2_PIX_FMT_UYVY, 2},
+    {"NV12", V4L2_PIX_FMT_NV12, 1},
+    {"RGB24", V4L2_PIX_FMT_RGB24, 3},
+};
+
+static size_t input_size(const Format &format, uint32_t stride,
+                         uint32_t height) {
+  auto size = size_t(stride) * height;
+  if (format.four_cc == V4L2_PIX_FMT_NV12) {
+    size += size_t(stride) * ((height + 1) / 2);
+  }
+  return size;
+}
+
+static std::vector<uint8_t> random_frame(size_t size, std::mt19937 &random) {
+  std::vector<uint8_t> frame(size);
+  for (auto &byte : frame) {
+    byte = random();
+  }
+  return frame;
+}
+
+static bool check(const std::vector<const ConvertKernels *> &kernels) {
+  // Sizes cover SIMD tails, odd sizes and padded strides.
+  struct Size {
+    uint32_t width, height, padding;
+  };
+  static const Size sizes[] = {{2, 2, 0},   {16, 2, 0},  {34, 3, 0},
+                               {64, 4, 8},  {98, 5, 0},  {33, 7, 5},
+                               {640, 480, 0}, {1282, 9, 64}};
+
+  std::mt19937 random{1};
+  bool ok = true;
+  for (const auto &format : FORMATS) {
+    for (const auto &size : sizes) {
+      if (format.bytes_per_pixel == 2 && size.width % 2 != 0) {
+        continue;
+      }
+      const auto stride = size.width * format.bytes_per_pixel + size.padding;
+      const auto input =
+          random_frame(input_size(format, stride, size.height), random);
+      const auto output_size = output_size_i420(size.width, size.height);
+
+      std::vector<uint8_t> expected(output_size);
+      convert_to_i420(*kernels.front(), format.four_cc, input.data(), stride,
+                      size.width, size.height, expected.data());
+      for (const auto set : kernels) {
+        std::vector<uint8_t> actual(output_size);
+        convert_to_i420(*set, format.four_cc, input.data(), stride,
+                        size.width, size.height, actual.data());
+        if (actual != expected) {
+          fprintf(stderr, "%s %s %ux%u stride %u: mismatch\n",
+                  convert_kernels_name(*set), format.name, size.width,
+                  size.height, stride);
+          ok = false;
+        }
+      }
+    }
+  }
+
+  // Halving kernels, including widths past SIMD blocks.
+  for (const auto &size : sizes) {
+    const auto stride = 2 * size.width + size.padding;
+    const auto input = random_frame(size_t(stride) * 2 * size.height, random);
+    const auto output_size = size_t(size.width) * size.height;
+    std::vector<uint8_t> expected(output_size);
+    halve_plane(*kernels.front(), input.data(), stride, size.width,
+                size.height, expected.data());
+    for (const auto set : kernels) {
+      std::vector<uint8_t> actual(output_size);
+      halve_plane(*set, input.data(), stride, size.width, size.height,
+                  actual.data());
+      if (actual != expected) {
+        fprintf(stderr, "%s halve %ux%u stride %u: mismatch\n",
+                convert_kernels_name(*set), size.width, size.height, stride);
+        ok = false;
+      }
+    }
+  }
+
+  // Block sums of absolute differences.
+  for (const auto &size : sizes) {
+    const auto a = random_frame(size_t(size.width) * size.height, random);
+    const auto b = random_frame(a.size(), random);
+    const auto blocks = size_t((size.width + SAD_BLOCK - 1) / SAD_BLOCK) *
+                        ((size.height + SAD_BLOCK - 1) / SAD_BLOCK);
+    std::vector<uint32_t> expected(blocks);
+    sad_plane(*kernels.front(), a.data(), b.data(), size.width, size.height,
+              expected.data());
+    for (const auto set : kernels) {
+      std::vector<uint32_t> actual(blocks, 1);
+      sad_plane(*set, a.data(), b.data(), size.width, size.height,
+                actual.data());
+      if (actual != expected) {
+        fprintf(stderr, "%s sad %ux%u: mismatch\n", convert_kernels_name(*set),
+                size.width, size.height);
+        ok = false;
+      }
+    }
+  }
+
+  // Downscaler, which fuses conversion with the first halving, against
+  // converting and halving one after another.
+  for (const auto &format : FORMATS) {
+    constexpr uint32_t width = 650, height = 250, padding = 6;
+    const auto stride = width * format.bytes_per_pixel + padding;
+    const auto input =
+        random_frame(input_size(format, stride, height), random);
+    std::vector<uint8_t> converted(output_size_i420(width, height));
+    convert_to_i420(*kernels.front(), format.four_cc, input.data(), stride,
+                    width, height, converted.data());
+
+    // Two halvings, into 162x62.
+    uint32_t level_width = width, level_height = height;
+    uint32_t level_stride = width;
+    std::vector<uint8_t> level = converted;
+    for (int i = 0; i < 2; ++i) {
+      const auto next_width = level_width / 4 * 2;
+      const auto next_height = level_height / 4 * 2;
+      std::vector<uint8_t> next(output_size_i420(next_width, next_height));
+      const auto u = level.data() + size_t(level_stride) * level_height;
+      const auto chroma_stride = (level_stride + 1) / 2;
+      const auto v = u + size_t(chroma_stride) * ((level_height + 1) / 2);
+      const auto next_u = next.data() + size_t(next_width) * next_height;
+      const auto next_v = next_u + size_t(next_width / 2) * (next_height / 2);
+      halve_plane(*kernels.front(), level.data(), level_stride, next_width,
+                  next_height, next.data());
+      halve_plane(*kernels.front(), u, chroma_stride, next_width / 2,
+                  next_height / 2, next_u);
+      halve_plane(*kernels.front(), v, chroma_stride, next_width / 2,
+                  next_height / 2, next_v);
+      level = std::move(next);
+      level_width = level_stride = next_width;
+      level_height = next_height;
+    }
+
+    Downscaler downscaler{format.four_cc, width, height, stride, 200, 100};
+    const auto actual = downscaler.downscale(input.data(), input.size());
+    if (downscaler.output_width() != level_width ||
+        downscaler.output_height() != level_height ||
+        !std::equal(actual.begin(), actual.end(), level.begin(),
+                    level.end())) {
+      fprintf(stderr, "%s downscale: mismatch\n", format.name);
+      ok = false;
+    }
+  }
+  return ok;
+}
+
+// Frame buffers in memfds, which encoders map the way they map dmabufs, so
+// handoff can be checked without a camera.
+class MemfdBuffers : public BufferExporter, public FrameOwner {
+public:
+  MemfdBuffers(size_t count, size_t length) : length(length) {
+    allocate(count);
+  }
+  ~MemfdBuffers() { release(); }
+
+  size_t count() const override { return buffers.size(); }
+  size_t buffer_length(unsigned int) const override { return length; }
+  int export_buffer(unsigned int index) override {
+    return buffers[index].fd;
+  }
+  unsigned int generation() const override { return _generation; }
+  void clean_after_read(unsigned int) override {}
+
+  // Put data into buffer and hand it out like a dequeued frame.
+  FrameView frame(unsigned int index, const std::vector<uint8_t> &data) {
+    memcpy(buffers[index].start, data.data(), data.size());
+    return FrameView{*this, index,
+                     static_cast<const uint8_t *>(buffers[index].start),
+                     data.size()};
+  }
+  // New buffers, like those of a camera which reconnected.
+  void reallocate(void) {
+    const auto count = buffers.size();
+    release();
+    allocate(count);
+    ++_generation;
+  }
+
+protected:
+  struct Buffer {
+    int fd;
+    void *start;
+  };
+
+  void allocate(size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+      const auto fd = memfd_create("v4l2-mmal-bench", MFD_CLOEXEC);
+      if (fd == -1 || ftruncate(fd, length) == -1) {
+        throw std::runtime_error("Failed to create memfd");
+      }
+      auto *start =
+          mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+      if (start == MAP_FAILED) {
+        throw std::runtime_error("Failed to map memfd");
+      }
+      buffers.push_back(Buffer{fd, start});
+    }
+  }
+  void release(void) {
+    for (const auto &buffer : buffers) {
+      munmap(buffer.start, length);
+      close(buffer.fd);
+    }
+    buffers.clear();
+  }
+
+  const size_t length;
+  std::vector<Buffer> buffers;
+  unsigned int _generation = 0;
+};
+
+static bool check_handoff(void) {
+  constexpr uint32_t width = 320, height = 240;
+  constexpr size_t count = 3;
+  const auto size = output_size_i420(width, height);
+  MemfdBuffers buffers{count, size};
+  // Importing and copying handoffs of identical encoders.
+  SoftwareEncoder imported_encoder{ENCODING_I420, width, height,
+                                   ENCODING_JPEG};
+  SoftwareEncoder copied_encoder{ENCODING_I420, width, height, ENCODING_JPEG};
+  DmabufHandoff imported{buffers, imported_encoder};
+  DmabufHandoff copied{buffers, copied_encoder, false};
+  if (imported.imported_count() != count) {
+    fprintf(stderr, "handoff: imported %zu of %zu buffers\n",
+            imported.imported_count(), count);
+    return false;
+  }
+
+  std::mt19937 random{2};
+  bool ok = true;
+  // Second round is after reconnect, so frames only match when new buffers
+  // were imported again.
+  for (int round = 0; round < 2; ++round) {
+    if (round == 1) {
+      buffers.reallocate();
+    }
+    for (unsigned int i = 0; i < count; ++i) {
+      const auto data = random_frame(size, random);
+      const auto frame = buffers.frame(i, data);
+      if (imported.encode(frame) != copied.encode(frame)) {
+        fprintf(stderr, "handoff: buffer %u of generation %u mismatch\n", i,
+                buffers.generation());
+        ok = false;
+      }
+    }
+  }
+  if (imported.imported_count() != count) {
+    fprintf(stderr, "handoff: %zu of %zu buffers imported after reconnect\n",
+            imported.imported_count(), count);
+    ok = false;
+  }
+  return ok;
+}
+
+static void measure(const std::vector<const ConvertKernels *> &kernels,
+                    uint32_t width, uint32_t height) {
+  using Clock = std::chrono::steady_clock;
+  constexpr auto DURATION = std::chrono::milliseconds(500);
+
+  std::mt19937 random{2};
+  std::vector<uint8_t> output(output_size_i420(width, height));
+  printf("%ux%u, MB/s of input\n", width, height);
+  for (const auto &format : FORMATS) {
+    const auto stride = width * format.bytes_per_pixel;
+    const auto input = random_frame(input_size(format, stride, height), random);
+    for (const auto set : kernels) {
+      size_t frames = 0;
+      const auto begin = Clock::now();
+      auto now = begin;
+      while (now - begin < DURATION) {
+        convert_to_i420(*set, format.four_cc, input.data(), stride, width,
+                        height, output.data());
+        ++frames;
+        now = Clock::now();
+      }
+      const std::chrono::duration<double> elapsed = now - begin;
+      printf("  %-6s %-7s %9.1f MB/s %8.1f fps\n", format.name,
+             convert_kernels_name(*set),
+             frames * input.size() / elapsed.count() / 1e6,
+             frames / elapsed.count());
+    }
+  }
+
+  // Luma plane into half its size, the bulk of a thumbnail.
+  const auto plane = random_frame(size_t(width) * height, random);
+  for (const auto set : kernels) {
+    size_t frames = 0;
+    const auto begin = Clock::now();
+    auto now = begin;
+    while (now - begin < DURATION) {
+      halve_plane(*set, plane.data(), width, width / 2, height / 2,
+                  output.data());
+      ++frames;
+      now = Clock::now();
+    }
+    const std::chrono::duration<double> elapsed = now - begin;
+    printf("  %-6s %-7s %9.1f MB/s %8.1f fps\n", "halve",
+           convert_kernels_name(*set),
+           frames * plane.size() / elapsed.count() / 1e6,
+           frames / elapsed.count());
+  }
+
+  // Motion detection of an idle scene, which is what every frame costs when
+  // nothing happens.
+  printf("%ux%u motion detection, us per frame\n", width, height);
+  for (const auto &format : FORMATS) {
+    const auto stride = width * format.bytes_per_pixel;
+    const auto input = random_frame(input_size(format, stride, height), random);
+    MotionDetector detector{format.four_cc, width, height, stride, {}};
+    size_t frames = 0;
+    const auto begin = Clock::now();
+    auto now = begin;
+    while (now - begin < DURATION) {
+      detector.detect(input.data(), input.size());
+      ++frames;
+      now = Clock::now();
+    }
+    const std::chrono::duration<double, std::micro> elapsed = now - begin;
+    printf("  %-6s %-7s %9.1f us\n", format.name, detector.kernels_name(),
+           elapsed.count() / frames);
+  }
+}
+
+using Clock = std::chrono::steady_clock;
+
+static double milliseconds(Clock::duration duration) {
+  return std::chrono::duration<double, std::milli>(duration).count();
+}
+
+static void print_percentiles(const char *name, std::vector<double> samples) {
+  if (samples.empty()) {
+    return;
+  }
+  std::sort(samples.begin(), samples.end());
+  const auto at = [&](double p) {
+    return samples[std::min(samples.size() - 1, size_t(p * samples.size()))];
+  };
+  printf("    %-8s p50 %8.3f  p90 %8.3f  p99 %8.3f  max %8.3f ms\n", name,
+         at(0.5), at(0.9), at(0.99), samples.back());
+}
+
+// Frames go through the same steps as in Pipeline: conversion into a buffer,
+// encoding into an arena, then writing the arena into a file. With a writer,
+// frames are encoded into its buffers and write is the time taken to hand
+// them over, as in Pipeline. First frame is left out, as it sets up encoder
+// and buffers.
+static void measure_pipeline(FrameSource &source, bool to_i420,
+                             EncoderBackend backend, uint32_t output_four_cc,
+                             size_t frame_count,
+                             const std::filesystem::path &output_path,
+                             OutputWriter *writer) {
+  std::unique_ptr<Converter> converter;
+  if (to_i420) {
+    converter = std::make_unique<Converter>(source.fourcc(), source.width(),
+                                            source.height(),
+                                            source.bytesperline());
+  }
+  const auto encoder = Encoder::create(
+      backend, converter ? ENCODING_I420 : source.fourcc(), source.width(),
+      source.height(), output_four_cc, converter ? 0 : source.bytesperline());
+  std::vector<uint8_t> converted(converter ? converter->output_size() : 0);
+  ArenaSink encoded;
+
+  std::vector<double> convert_ms, encode_ms, write_ms, total_ms;
+  size_t input_bytes = 0, output_bytes = 0, allocations = 0;
+  Clock::duration elapsed{};
+  for (size_t i = 0; i <= frame_count; ++i) {
+    const auto frame = source.next();
+    if (!frame.has_value()) {
+      break;
+    }
+    const auto allocations_before = allocation_count.load();
+    const auto begin = Clock::now();
+
+    auto input = frame->data;
+    if (converter) {
+      converter->convert(input.data(), input.size(), converted.data());
+      input = ByteView(converted.data(), converted.size());
+    }
+    const auto converted_at = Clock::now();
+
+    Clock::time_point encoded_at;
+    size_t encoded_size;
+    if (writer) {
+      auto output = writer->buffer();
+      VectorSink sink{output};
+      encoder->encode(input.data(), input.size(), sink);
+      encoded_at = Clock::now();
+      encoded_size = output.size();
+      writer->write(output_path, std::move(output));
+    } else {
+      encoded.clear();
+      encoder->encode(input.data(), input.size(), encoded);
+      encoded_at = Clock::now();
+      encoded_size = encoded.size();
+      if (!write_file(output_path, encoded.data().data(), encoded.size())) {
+        fprintf(stderr, "Failed to write %s\n", output_path.c_str());
+        return;
+      }
+    }
+    const auto end = Clock::now();
+
+    if (i == 0) {
+      continue;
+    }
+    allocations += allocation_count.load() - allocations_before;
+    if (converter) {
+      convert_ms.push_back(milliseconds(converted_at - begin));
+    }
+    encode_ms.push_back(milliseconds(encoded_at - converted_at));
+    write_ms.push_back(milliseconds(end - encoded_at));
+    total_ms.push_back(milliseconds(end - begin));
+    input_bytes += frame->data.size();
+    output_bytes += encoded_size;
+    elapsed += end - begin;
+  }
+  if (writer) {
+    writer->drain();
+  }
+
+  const auto frames = total_ms.size();
+  if (frames == 0) {
+    return;
+  }
+  const auto seconds = std::chrono::duration<double>(elapsed).count();
+  printf("  %-6s %4ux%-4u %-6s %-11s %8.1f fps %8.1f MB/s in %7.1f KiB out "
+         "%5.1f allocs/frame\n",
+         fourcc_to_string(source.fourcc()).c_str(), source.width(),
+         source.height(), converter ? "i420" : "direct",
+         encoder_backend_name(encoder->backend()), frames / seconds,
+         input_bytes / seconds / 1e6, output_bytes / 1024.0 / frames,
+         double(allocations) / frames);
+  print_percentiles("convert", convert_ms);
+  print_percentiles("encode", encode_ms);
+  print_percentiles("write", write_ms);
+  print_percentiles("total", total_ms);
+}
+
+static void usage(const char *name) {
+  printf("Usage: %s [OPTIONS]\n"
+         "\n"
+         "Options:\n"
+         "  -k, --check           check conversion kernels and dmabuf "
+         "handoff only\n"
+         "  -C, --convert         measure conversion kernels only\n"
+         "  -P, --pipeline        measure convert, encode and write only\n"
+         "  -n, --frames N        frames for each pipeline case (default: "
+         "30)\n"
+         "  -e, --encoder NAME    encoder backend: auto, mmal or software "
+         "(default: auto)\n"
+         "  -o, --output PATH     file frames are written into, its extension "
+         "picks encoding (default: <temp dir>/v4l2-mmal-bench.jpg)\n"
+         "  -R, --raw FILE        replay raw frames of FILE instead of "
+         "synthetic ones, needs --format and --size\n"
+         "  -r, --replay FILE     replay frames of a recording made with "
+         "--record\n"
+         "  -f, --format FOURCC   format of raw frames\n"
+         "  -S, --size WxH        size of raw frames\n"
+         "  -W, --writer NAME     write through output writer: auto, io_uring "
+         "or threads (default: blocking writes)\n"
+         "  -Y, --fsync POLICY    fsync policy of the writer: none, data or "
+         "full (default: data)\n"
+         "  -h, --help            print this message\n",
+         name);
+}
+
+int main(int argc, char **argv) {
+  static const option long_options[] = {
+      {"check", no_argument, nullptr, 'k'},
+      {"convert", no_argument, nullptr, 'C'},
+      {"pipeline", no_argument, nullptr, 'P'},
+      {"frames", required_argument, nullptr, 'n'},
+      {"encoder", required_argument, nullptr, 'e'},
+      {"output", required_argument, nullptr, 'o'},
+      {"raw", required_argument, nullptr, 'R'},
+      {"replay", required_argument, nullptr, 'r'},
+      {"format", required_argument, nullptr, 'f'},
+      {"size", required_argument, nullptr, 'S'},
+      {"writer", required_argument, nullptr, 'W'},
+      {"fsync", required_argument, nullptr, 'Y'},
+      {"help", no_argument, nullptr, 'h'},
+      {nullptr, 0, nullptr, 0},
+  };
+
+  bool check_only = false;
+  bool run_convert = true;
+  bool run_pipeline = true;
+  size_t frame_count = 30;
+  auto backend = EncoderBackend::AUTO;
+  auto output_path =
+      std::filesystem::temp_directory_path() / "v4l2-mmal-bench.jpg";
+  std::filesystem::path raw_path;
+  std::filesystem::path replay_path;
+  std::optional<uint32_t> raw_four_cc;
+  uint32_t raw_width = 0, raw_height = 0;
+  std::optional<WriterBackend> writer_backend;
+  auto fsync_policy = FsyncPolicy::DATA;
+  int opt;
+  while ((opt = getopt_long(argc, argv, "kCPn:e:o:R:r:f:S:W:Y:h",
+                            long_options, nullptr)) != -1) {
+    switch (opt) {
+    case 'k':
+      check_only = true;
+      break;
+    case 'C':
+      run_pipeline = false;
+      break;
+    case 'P':
+      run_convert = false;
+      break;
+    case 'n':
+      frame_count = std::stoul(optarg);
+      break;
+    case 'e':
+      backend = encoder_backend_from_name(optarg);
+      break;
+    case 'o':
+      output_path = optarg;
+      break;
+    case 'R':
+      raw_path = optarg;
+      break;
+    case 'r':
+      replay_path = optarg;
+      break;
+    case 'f':
+      raw_four_cc = fourcc_from_string(optarg);
+      break;
+    case 'S':
+      if (sscanf(optarg, "%ux%u", &raw_width, &raw_height) != 2) {
+        usage(argv[0]);
+        return -1;
+      }
+      break;
+    case 'W':
+      writer_backend = writer_backend_from_name(optarg);
+      break;
+    case 'Y':
+      fsync_policy = fsync_policy_from_name(optarg);
+      break;
+    case 'h':
+      usage(argv[0]);
+      return 0;
+    default:
+      usage(argv[0]);
+      return -1;
+    }
+  }
+  if (!raw_path.empty() && (!raw_four_cc.has_value() || raw_width == 0)) {
+    usage(argv[0]);
+    return -1;
+  }
+
+  const auto kernels = available_convert_kernels();
+
+  if (!check(kernels)) {
+    return 1;
+  }
+  printf("All kernels match scalar reference\n");
+  if (!check_handoff()) {
+    return 1;
+  }
+  printf("Imported frames encode the same as copied ones\n");
+
+  if (check_only) {
+    return 0;
+  }
+  if (run_convert) {
+    measure(kernels, 1920, 1080);
+  }
+  if (!run_pipeline) {
+    return 0;
+  }
+
+  const auto output_four_cc = fourcc_from_path(output_path);
+  std::unique_ptr<OutputWriter> writer;
+  if (writer_backend.has_value()) {
+    writer = OutputWriter::create(writer_backend.value(), fsync_policy);
+    printf("Output writer: %s, fsync %s\n",
+           writer_backend_name(writer->backend()),
+           fsync_policy_name(fsync_policy));
+  }
+  const auto &native = encoder_native_formats();
+  const auto run_cases = [&](FrameSource &source) {
+    if (std::find(native.begin(), native.end(), source.fourcc()) !=
+        native.end()) {
+      measure_pipeline(source, false, backend, output_four_cc, frame_count,
+                       output_path, writer.get());
+    }
+    if (Converter::supports(source.fourcc())) {
+      measure_pipeline(source, true, backend, output_four_cc, frame_count,
+                       output_path, writer.get());
+    }
+  };
+
+  printf("Convert, encode and write, %zu frames each\n", frame_count);
+  if (!raw_path.empty()) {
+    RawFileSource source{raw_path, raw_four_cc.value(), raw_width,
+                         raw_height};
+    run_cases(source);
+    return 0;
+  }
+  if (!replay_path.empty()) {
+    // Loop, so short recordings still give frame_count frames.
+    ReplaySource source{replay_path, false, true};
+    run_cases(source);
+    return 0;
+  }
+
+  struct Size {
+    uint32_t width, height;
+  };
+  static const Size sizes[] = {{640, 480}, {1280, 720}, {1920, 1080}};
+  for (const auto &format : FORMATS) {
+    for (const auto &size : sizes) {
+      SyntheticSource source{format.four_cc, size.width, size.height};
+      run_cases(source);
+    }
+  }
+  return 0;
+}
@@ -1,34 +1,77 @@
 #include "./camera.h"
 
+#include <algorithm>
 #include <assert.h>
+#include <cmath>
+#include <stdexcept>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-
-#include <getopt.h> /* getopt_long() */
+#include <thread>
+#include <tuple>
 
 #include <errno.h>
 #include <fcntl.h> /* low-level i/o */
+#include <poll.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/time.h>
+#include <time.h>
 #include <sys/types.h>
 #include <unistd.h>
 
 // v4l2
 #include <linux/videodev2.h>
 
+#include "./fourcc.h"
+#include "./metrics.h"
+#include "./mjpeg.h"
+
 #define CLEAR(x) memset(&(x), 0, sizeof(x))
 
 struct Buffer {
   void *start;
   size_t length;
+  int dmabuf_fd = -1;
 };
 
-static void errno_exit(const char *s) {
-  fprintf(stderr, "%s error %d, %s\n", s, errno, strerror(errno));
-  exit(EXIT_FAILURE);
+std::atomic<bool> Camera::recovery_cancelled = false;
+
+static std::string error_message(const std::filesystem::path &device,
+                                 const std::string &what, int error) {
+  auto message = device.string() + ": " + what;
+  if (error != 0) {
+    message += std::string(": ") + strerror(error);
+  }
+  return message;
+}
+
+CameraError::CameraError(const std::filesystem::path &device,
+                         const std::string &what, int error)
+    : std::runtime_error(error_message(device, what, error)), _error(error) {}
+
+bool CameraError::recoverable() const {
+  switch (_error) {
+  case ENODEV:
+  case ENXIO:
+  case EIO:
+  case ETIMEDOUT:
+    return true;
+  }
+  return false;
+}
+
+static std::chrono::microseconds to_microseconds(const timeval &tv) {
+  return std::chrono::seconds(tv.tv_sec) +
+         std::chrono::microseconds(tv.tv_usec);
+}
+
+std::chrono::microseconds monotonic_now() {
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return std::chrono::seconds(ts.tv_sec) +
+         std::chrono::microseconds(ts.tv_nsec / 1000);
 }
 
 static int xioctl(int fh, int request, void *arg) {
@@ -41,62 +84,76 @@ static int xioctl(int fh, int request, void *arg) {
   return r;
 }
 
-Camera::Camera(const std::filesystem::path &device, IOMethod method)
-    : io_method(method), device(device), v4l2_buf(new v4l2_buffer()) {
+FormatPreference format_preference_from_name(const std::string &name) {
+  if (name == "any") {
+    return FormatPreference::ANY;
+  }
+  if (name == "compressed") {
+    return FormatPreference::COMPRESSED;
+  }
+  if (name == "native") {
+    return FormatPreference::NATIVE;
+  }
+
+  throw std::invalid_argument("Unknown format preference " + name);
+}
+
+Camera::Camera(const std::filesystem::path &device, IOMethod method,
+               const FormatRequest &request, const QueueSettings &queue)
+    : io_method(method), request(request), queue(queue), device(device),
+      v4l2_buf(new v4l2_buffer()) {
+  try {
+    open_device();
+    init(request);
+  } catch (...) {
+    release();
+    throw;
+  }
+}
+
+void Camera::open_device(void) {
   struct stat st;
 
   if (-1 == stat(device.c_str(), &st)) {
-    fprintf(stderr, "Cannot identify '%s': %d, %s\\n", device.c_str(), errno,
-            strerror(errno));
-    exit(EXIT_FAILURE);
+    throw CameraError(device, "Cannot identify", errno);
   }
 
   if (!S_ISCHR(st.st_mode)) {
-    fprintf(stderr, "%s is no devicen", device.c_str());
-    exit(EXIT_FAILURE);
+    throw CameraError(device, "is no device");
   }
 
-  fd = open(device.c_str(), O_RDWR /* required */ | O_NONBLOCK, 0);
+  fd = open(device.c_str(), O_RDWR /* required */ | O_NONBLOCK | O_CLOEXEC, 0);
 
   if (-1 == fd) {
-    fprintf(stderr, "Cannot open '%s': %d, %s\\n", device.c_str(), errno,
-            strerror(errno));
-    exit(EXIT_FAILURE);
+    throw CameraError(device, "Cannot open", errno);
   }
-
-  init();
 }
 
-void Camera::init() {  
+void Camera::init(const FormatRequest &request) {
   struct v4l2_capability cap;
 
   if (xioctl(fd, VIDIOC_QUERYCAP, &cap) == -1) {
     if (EINVAL == errno) {
-      fprintf(stderr, "%s is no V4L2 device\\n", device.c_str());
-      exit(EXIT_FAILURE);
-    } else {
-      errno_exit("VIDIOC_QUERYCAP");
+      throw CameraError(device, "is no V4L2 device");
     }
+    throw CameraError(device, "VIDIOC_QUERYCAP", errno);
   }
 
   if (!(cap.capabilities & V4L2_CAP_VIDEO_CAPTURE)) {
-    fprintf(stderr, "%s is no video capture device\\n", device.c_str());
-    exit(EXIT_FAILURE);
+    throw CameraError(device, "is no video capture device");
   }
 
   switch (io_method) {
   case IOMethod::READ:
     if (!(cap.capabilities & V4L2_CAP_READWRITE)) {
-      fprintf(stderr, "%s does not support read i/o\\n", device.c_str());
-      exit(EXIT_FAILURE);
+      throw CameraError(device, "does not support read i/o");
     }
     break;
 
   case IOMethod::MMAP:
   case IOMethod::USERPTR:
     if (!(cap.capabilities & V4L2_CAP_STREAMING)) {
-      fprintf(stderr, "%s does not support streaming i/o\\n", device.c_str());
-      exit(EXIT_FAILURE);
+      throw CameraError(device, "does not support streaming i/o");
     }
     break;
   }
@@ -107,8 +164,46 @@ void Camera::init() {
 
   fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
   if (-1 == xioctl(fd, VIDIOC_G_FMT, &fmt)) {
-    errno_exit("VIDIOC_G_FMT");
-  }
+    throw CameraError(device, "VIDIOC_G_FMT", errno);
+  }
+
+  // Size and format the device had stand in for what isn't requested.
+  FormatRequest wanted = request;
+  wanted.width = request.width.value_or(fmt.fmt.pix.width);
+  wanted.height = request.height.value_or(fmt.fmt.pix.height);
+  const auto current_four_cc = fmt.fmt.pix.pixelformat;
+
+  enumerate_modes(wanted);
+  if (!_modes.empty()) {
+    const auto mode = select_mode(_modes, wanted, current_four_cc);
+    if (mode == nullptr) {
+      throw CameraError(device, "has no " +
+                                    fourcc_to_string(request.four_cc.value()) +
+                                    " format");
+    }
+    apply_mode(*mode, fmt);
+  } else if (request.four_cc.has_value() || request.width.has_value()) {
+    // Device can't enumerate, but may still take what is asked.
+    apply_mode({request.four_cc.value_or(current_four_cc),
+                wanted.width.value(), wanted.height.value(), 0, 0},
+               fmt);
+  }
+
+  v4l2_streamparm parm;
+  CLEAR(parm);
+  parm.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  if (xioctl(fd, VIDIOC_G_PARM, &parm) == 0 &&
+      parm.parm.capture.timeperframe.numerator != 0) {
+    _fps = double(parm.parm.capture.timeperframe.denominator) /
+           parm.parm.capture.timeperframe.numerator;
+  }
+  fprintf(stderr, "Capturing %s %ux%u at %.2f fps\n",
+          fourcc_to_string(fmt.fmt.pix.pixelformat).c_str(),
+          fmt.fmt.pix.width, fmt.fmt.pix.height, _fps);
+
+  // As reported, since the check below assumes 2 bytes per pixel. Buggy
+  // drivers report 0, which means tightly packed.
+  _bytesperline = fmt.fmt.pix.bytesperline;
 
   /* Buggy driver paranoia. */
   auto min = fmt.fmt.pix.width * 2;
@@ -137,19 +232,201 @@ void Camera::init() {
   }
 }
 
-Camera::~Camera() { uninit(); }
+// Adds modes for every frame interval of a size. Stepwise ranges are
+// represented by their fastest interval and the requested one.
+static void add_intervals(int fd, uint32_t four_cc, uint32_t width,
+                          uint32_t height, std::optional<double> fps,
+                          std::vector<CaptureMode> &modes) {
+  const auto count = modes.size();
+
+  v4l2_frmivalenum interval;
+  CLEAR(interval);
+  interval.pixel_format = four_cc;
+  interval.width = width;
+  interval.height = height;
+  for (; xioctl(fd, VIDIOC_ENUM_FRAMEINTERVALS, &interval) == 0;
+       ++interval.index) {
+    if (interval.type == V4L2_FRMIVAL_TYPE_DISCRETE) {
+      modes.push_back({four_cc, width, height, interval.discrete.numerator,
+                       interval.discrete.denominator});
+      continue;
+    }
+
+    const auto &fastest = interval.stepwise.min;
+    const auto &slowest = interval.stepwise.max;
+    modes.push_back(
+        {four_cc, width, height, fastest.numerator, fastest.denominator});
+    if (fps.has_value() && fps.value() > 0 &&
+        1 / fps.value() >= double(fastest.numerator) / fastest.denominator &&
+        1 / fps.value() <= double(slowest.numerator) / slowest.denominator) {
+      modes.push_back({four_cc, width, height, 1000,
+                       static_cast<uint32_t>(std::lround(fps.value() * 1000))});
+    }
+    break;
+  }
+
+  if (modes.size() == count) {
+    modes.push_back({four_cc, width, height, 0, 0});
+  }
+}
+
+static uint32_t snap(uint32_t value, uint32_t min, uint32_t max,
+                     uint32_t step) {
+  value = std::clamp(value, min, max);
+  step = std::max(step, 1u);
+  return min + (value - min) / step * step;
+}
+
+void Camera::enumerate_modes(const FormatRequest &request) {
+  _modes.clear();
+  const auto width = request.width.value();
+  const auto height = request.height.value();
+
+  v4l2_fmtdesc desc;
+  CLEAR(desc);
+  desc.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  for (; xioctl(fd, VIDIOC_ENUM_FMT, &desc) == 0; ++desc.index) {
+    const auto four_cc = desc.pixelformat;
+    const auto count = _modes.size();
+
+    v4l2_frmsizeenum size;
+    CLEAR(size);
+    size.pixel_format = four_cc;
+    for (; xioctl(fd, VIDIOC_ENUM_FRAMESIZES, &size) == 0; ++size.index) {
+      if (size.type == V4L2_FRMSIZE_TYPE_DISCRETE) {
+        add_intervals(fd, four_cc, size.discrete.width, size.discrete.height,
+                      request.fps, _modes);
+        continue;
+      }
+
+      // Stepwise or continuous, offer requested size and the largest one.
+      const auto &range = size.stepwise;
+      const auto w =
+          snap(width, range.min_width, range.max_width, range.step_width);
+      const auto h =
+          snap(height, range.min_height, range.max_height, range.step_height);
+      add_intervals(fd, four_cc, w, h, request.fps, _modes);
+      if (w != range.max_width || h != range.max_height) {
+        add_intervals(fd, four_cc, range.max_width, range.max_height,
+                      request.fps, _modes);
+      }
+      break;
+    }
+
+    if (_modes.size() == count) {
+      add_intervals(fd, four_cc, width, height, request.fps, _modes);
+    }
+  }
+}
+
+static int format_rank(const FormatRequest &request, uint32_t current_four_cc,
+                       uint32_t four_cc) {
+  const auto &native = request.native_formats;
+  const int native_index =
+      std::find(native.begin(), native.end(), four_cc) - native.begin();
+
+  switch (request.prefer) {
+  case FormatPreference::ANY:
+    return four_cc == current_four_cc ? 0 : 1;
+  case FormatPreference::COMPRESSED:
+    return is_compressed_fourcc(four_cc) ? 0 : 1 + native_index;
+  case FormatPreference::NATIVE:
+    return native_index < int(native.size())
+               ? native_index
+               : int(native.size()) + (is_compressed_fourcc(four_cc) ? 0 : 1);
+  }
+  return 0;
+}
+
+const CaptureMode *select_mode(const std::vector<CaptureMode> &modes,
+                               const FormatRequest &request,
+                               uint32_t current_four_cc) {
+  // Closest size first, then preferred format, then frame rate.
+  using Key = std::tuple<int64_t, int, double>;
+  const CaptureMode *best = nullptr;
+  Key best_key;
+
+  for (const auto &mode : modes) {
+    if (request.four_cc.has_value() && mode.four_cc != request.four_cc) {
+      continue;
+    }
+
+    const int64_t distance =
+        std::abs(int64_t(mode.width) - request.width.value()) +
+        std::abs(int64_t(mode.height) - request.height.value());
+    // Lowest rate reaching requested one, or the highest when none does.
+    double rate = -mode.fps();
+    if (request.fps.has_value()) {
+      const auto wanted = request.fps.value();
+      rate = mode.fps() >= wanted ? mode.fps() - wanted : 1e9 - mode.fps();
+    }
+
+    const Key key{distance, format_rank(request, current_four_cc, mode.four_cc),
+                  rate};
+    if (best == nullptr || key < best_key) {
+      best = &mode;
+      best_key = key;
+    }
+  }
+  return best;
+}
+
+void Camera::apply_mode(const CaptureMode &mode, v4l2_format &fmt) {
+  CLEAR(fmt);
+  fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  fmt.fmt.pix.pixelformat = mode.four_cc;
+  fmt.fmt.pix.width = mode.width;
+  fmt.fmt.pix.height = mode.height;
+  fmt.fmt.pix.field = V4L2_FIELD_ANY;
+  if (-1 == xioctl(fd, VIDIOC_S_FMT, &fmt)) {
+    throw CameraError(device, "VIDIOC_S_FMT", errno);
+  }
+  if (fmt.fmt.pix.pixelformat != mode.four_cc ||
+      fmt.fmt.pix.width != mode.width || fmt.fmt.pix.height != mode.height) {
+    fprintf(stderr, "Device adjusted %s %ux%u to %s %ux%u\n",
+            fourcc_to_string(mode.four_cc).c_str(), mode.width, mode.height,
+            fourcc_to_string(fmt.fmt.pix.pixelformat).c_str(),
+            fmt.fmt.pix.width, fmt.fmt.pix.height);
+  }
+
+  if (mode.interval_numerator == 0) {
+    return;
+  }
+  v4l2_streamparm parm;
+  CLEAR(parm);
+  parm.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  if (xioctl(fd, VIDIOC_G_PARM, &parm) == -1 ||
+      !(parm.parm.capture.capability & V4L2_CAP_TIMEPERFRAME)) {
+    return;
+  }
+  parm.parm.capture.timeperframe.numerator = mode.interval_numerator;
+  parm.parm.capture.timeperframe.denominator = mode.interval_denominator;
+  if (xioctl(fd, VIDIOC_S_PARM, &parm) == -1) {
+    fprintf(stderr, "VIDIOC_S_PARM error %d, %s\n", errno, strerror(errno));
+  }
+}
+
+Camera::~Camera() { release(); }
 
 void Camera::uninit(void) {
+  if (!buffers) {
+    return;
+  }
+
   switch (io_method) {
   case IOMethod::READ:
     free(buffers[0].start);
     break;
 
   case IOMethod::MMAP:
-    for (unsigned int i = 0; i < buffer_count; ++i)
+    for (unsigned int i = 0; i < buffer_count; ++i) {
+      if (buffers[i].dmabuf_fd != -1) {
+        ::close(buffers[i].dmabuf_fd);
+      }
       if (munmap(buffers[i].start, buffers[i].length) == -1) {
-        errno_exit("munmap");
+        fprintf(stderr, "munmap error %d, %s\n", errno, strerror(errno));
       }
+    }
     break;
 
   case IOMethod::USERPTR:
@@ -158,30 +435,47 @@ void Camera::uninit(void) {
     }
     break;
   }
+  buffers.reset();
+  buffer_count = 0;
+}
+
+void Camera::release(void) {
+  if (streaming) {
+    v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    xioctl(fd, VIDIOC_STREAMOFF, &type);
+    streaming = false;
+  }
+  uninit();
+  if (fd != -1) {
+    ::close(fd);
+    fd = -1;
+  }
 }
 
 void Camera::start_capturing(void) {
+  warmup_left = queue.warmup_frames;
+  // Driver counts sequence from 0 again.
+  last_sequence.reset();
+
   switch (io_method) {
   case IOMethod::READ:
     /* Nothing to do. */
     return;
   case IOMethod::MMAP:
-    for (unsigned int i = 0; i < buffer_count; ++i) {
-      enqueue_buffer_mmap(i);
-    }
-    break;
-
   case IOMethod::USERPTR:
     for (unsigned int i = 0; i < buffer_count; ++i) {
-      enqueue_buffer_userp(i);
+      if (!enqueue_buffer(i)) {
+        throw CameraError(device, "VIDIOC_QBUF", errno);
+      }
     }
     break;
   }
 
   v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
   if (xioctl(fd, VIDIOC_STREAMON, &type) == -1) {
-    errno_exit("VIDIOC_STREAMON");
+    throw CameraError(device, "VIDIOC_STREAMON", errno);
   }
+  streaming = true;
 }
 
 void Camera::stop_capturing(void) {
@@ -193,65 +487,182 @@ void Camera::stop_capturing(void) {
   case IOMethod::USERPTR:
     break;
   }
+  // Already stopped, like by time-lapse across a gap.
+  if (!streaming) {
+    return;
+  }
 
+  streaming = false;
   v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-  if (xioctl(fd, VIDIOC_STREAMOFF, &type) == -1) {
-    errno_exit("VIDIOC_STREAMOFF");
+  // A device which is gone has stopped anyway.
+  if (xioctl(fd, VIDIOC_STREAMOFF, &type) == -1 && errno != ENODEV) {
+    throw CameraError(device, "VIDIOC_STREAMOFF", errno);
   }
 }
 
-FrameView Camera::read_frame(void) {
+FrameView Camera::read_frame(std::chrono::milliseconds timeout) {
   for (;;) {
-    fd_set fds;
-
-    FD_ZERO(&fds);
-    FD_SET(fd, &fds);
-
-    /* Timeout. */
-    timeval tv;
-    tv.tv_sec = 2;
-    tv.tv_usec = 0;
+    if (!wait_frame(timeout)) {
+      throw CameraError(device, "Timed out waiting for frame", ETIMEDOUT);
+    }
+    auto frame = dequeue_frame();
+    // Ready frame may have been dropped as warm-up or stale one.
+    if (frame.data() != nullptr) {
+      return frame;
+    }
+  }
+}
 
-    auto r = select(fd + 1, &fds, NULL, NULL, &tv);
+bool Camera::wait_frame(std::chrono::milliseconds timeout) {
+  StageTimer timer{Stage::WAIT};
+  pollfd pfd;
+  pfd.fd = fd;
+  pfd.events = POLLIN;
 
+  for (;;) {
+    const auto r = poll(&pfd, 1, timeout.count());
     if (r == -1) {
       if (EINTR == errno) {
         continue;
       }
-      errno_exit("select");
+      throw CameraError(device, "poll", errno);
+    }
+    return r > 0;
+  }
+}
+
+FrameView Camera::read_frame_recovering(std::chrono::milliseconds timeout) {
+  for (;;) {
+    try {
+      return read_frame(timeout);
+    } catch (const CameraError &e) {
+      if (!recover(e)) {
+        throw;
+      }
+    }
+  }
+}
+
+void Camera::cancel_recovery(void) { recovery_cancelled.store(true); }
+
+bool Camera::recover(const CameraError &error) {
+  if (!error.recoverable() || recovery_cancelled.load()) {
+    return false;
+  }
+  fprintf(stderr, "%s, reconnecting\n", error.what());
+
+  const auto start = std::chrono::steady_clock::now();
+  try {
+    reconnect();
+  } catch (const CameraError &e) {
+    fprintf(stderr, "%s\n", e.what());
+    return false;
+  }
+  const auto took = std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::steady_clock::now() - start);
+  auto &m = metrics();
+  m.reconnects.fetch_add(1, std::memory_order_relaxed);
+  m.recovery.record(took);
+  fprintf(stderr, "%s: recovered in %.3f s\n", device.c_str(),
+          took.count() / 1e6);
+  return true;
+}
+
+void Camera::reconnect(void) {
+  // Buffers are unmapped, so frames other stages still work on go first.
+  while (frames_out.load() != 0) {
+    if (recovery_cancelled.load()) {
+      throw CameraError(device, "Reconnect cancelled");
     }
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+
+  const auto was_streaming = streaming;
+  const auto four_cc = _fourcc;
+  const auto width = _width, height = _height;
+  release();
 
-    if (r == 0) {
-      fprintf(stderr, "select timeout\n");
-      exit(EXIT_FAILURE);
+  // USB devices take a while to enumerate again after they drop off.
+  const auto deadline = std::chrono::steady_clock::now() + RECONNECT_TIMEOUT;
+  auto delay = std::chrono::milliseconds(100);
+  for (;;) {
+    if (recovery_cancelled.load()) {
+      throw CameraError(device, "Reconnect cancelled");
     }
+    try {
+      open_device();
+      init(request);
+      break;
+    } catch (const CameraError &e) {
+      release();
+      // Failures without errno mean device came back as something else.
+      if (e.error() == 0 ||
+          std::chrono::steady_clock::now() + delay > deadline) {
+        throw;
+      }
+    }
+    std::this_thread::sleep_for(delay);
+    delay = std::min(delay * 2, std::chrono::milliseconds(2000));
+  }
 
-    if (FD_ISSET(fd, &fds)) {
+  // Encoders stay set up for the old format.
+  if (_fourcc != four_cc || _width != width || _height != height) {
+    throw CameraError(device, "Came back with another format");
+  }
+  _generation.fetch_add(1);
+  if (was_streaming) {
+    start_capturing();
+  }
+}
+
+FrameView Camera::dequeue_frame(void) {
+  std::optional<FrameView> frame;
+  frame.emplace(dequeue_buffer());
+  // Dropped frames are re-queued as they are reset.
+  while (frame->data() != nullptr && warmup_left > 0) {
+    --warmup_left;
+    frame.reset();
+    frame.emplace(dequeue_buffer());
+  }
+  if (frame->data() == nullptr || !queue.freshest ||
+      io_method == IOMethod::READ) {
+    return std::move(frame.value());
+  }
+
+  size_t dequeued = 1;
+  for (;;) {
+    auto next = dequeue_buffer();
+    if (next.data() == nullptr) {
       break;
     }
+    ++dequeued;
+    frame.reset();
+    frame.emplace(std::move(next));
   }
+  // With every buffer filled, driver had nowhere to capture into, so even the
+  // newest frame may be much older than one interval. Wait for the next one.
+  if (dequeued == buffer_count && buffer_count > 1) {
+    return FrameView(*this);
+  }
+  return std::move(frame.value());
+}
+
+FrameView Camera::dequeue_buffer(void) {
+  const auto start = std::chrono::steady_clock::now();
 
   switch (io_method) {
   case IOMethod::READ:
     if (read(fd, buffers[0].start, buffers[0].length) == -1) {
-      switch (errno) {
-      case EAGAIN:
-        fprintf(stderr, "eagain");
+      if (errno == EAGAIN) {
         return FrameView(*this);
-
-      case EIO:
-        /* Could ignore EIO, see spec. */
-
-        /* fall through */
-
-      default:
-        errno_exit("read");
       }
+      throw CameraError(device, "read", errno);
     }
 
-    return FrameView(*this, {},
+    count_frame(start, read_sequence);
+    return FrameView(*this, std::nullopt,
                      reinterpret_cast<const uint8_t *>(buffers[0].start),
-                     buffers[0].length);
+                     buffers[0].length, monotonic_now(), read_sequence++);
   case IOMethod::MMAP: {
     v4l2_buffer v4l2_buf;
     CLEAR(v4l2_buf);
@@ -260,27 +671,21 @@ FrameView Camera::read_frame(void) {
     v4l2_buf.memory = V4L2_MEMORY_MMAP;
 
     if (xioctl(fd, VIDIOC_DQBUF, &v4l2_buf) == -1) {
-      switch (errno) {
-      case EAGAIN:
-        fprintf(stderr, "eagain");
+      if (errno == EAGAIN) {
         return FrameView(*this);
-
-      case EIO:
-        /* Could ignore EIO, see spec. */
-
-        /* fall through */
-
-      default:
-        errno_exit("VIDIOC_DQBUF");
       }
+      throw CameraError(device, "VIDIOC_DQBUF", errno);
     }
 
     assert(v4l2_buf.index < buffer_count);
 
+    count_frame(start, v4l2_buf.sequence);
+    frames_out.fetch_add(1);
     return FrameView(
         *this, v4l2_buf.index,
         reinterpret_cast<const uint8_t *>(buffers[v4l2_buf.index].start),
-        v4l2_buf.bytesused);
+        v4l2_buf.bytesused, to_microseconds(v4l2_buf.timestamp),
+        v4l2_buf.sequence);
   }
   case IOMethod::USERPTR: {
     v4l2_buffer v4l2_buf;
@@ -290,19 +695,10 @@ FrameView Camera::read_frame(void) {
     v4l2_buf.memory = V4L2_MEMORY_USERPTR;
 
     if (xioctl(fd, VIDIOC_DQBUF, &v4l2_buf) == -1) {
-      switch (errno) {
-      case EAGAIN:
-        fprintf(stderr, "eagain");
+      if (errno == EAGAIN) {
         return FrameView(*this);
-
-      case EIO:
-        /* Could ignore EIO, see spec. */
-
-        /* fall through */
-
-      default:
-        errno_exit("VIDIOC_DQBUF");
       }
+      throw CameraError(device, "VIDIOC_DQBUF", errno);
     }
 
     for (unsigned int i = 0; i < buffer_count; ++i) {
@@ -312,47 +708,91 @@ FrameView Camera::read_frame(void) {
       }
     }
 
+    count_frame(start, v4l2_buf.sequence);
+    frames_out.fetch_add(1);
     return FrameView(*this, v4l2_buf.index,
                      reinterpret_cast<const uint8_t *>(v4l2_buf.m.userptr),
-                     v4l2_buf.bytesused);
+                     v4l2_buf.bytesused, to_microseconds(v4l2_buf.timestamp),
+                     v4l2_buf.sequence);
   }
   default:
     throw std::runtime_error("Invalid io method");
   }
 }
 
+void Camera::count_frame(std::chrono::steady_clock::time_point start,
+                         uint32_t sequence) {
+  auto &m = metrics();
+  m.record(Stage::DEQUEUE,
+           std::chrono::duration_cast<std::chrono::microseconds>(
+               std::chrono::steady_clock::now() - start));
+  m.frames.fetch_add(1, std::memory_order_relaxed);
+  if (last_sequence.has_value() && sequence > last_sequence.value() + 1) {
+    m.dropped_frames.fetch_add(sequence - last_sequence.value() - 1,
+                               std::memory_order_relaxed);
+  }
+  last_sequence = sequence;
+}
+
 void Camera::clean_after_read(unsigned int index) {
+  // Called as frames are dropped, so failures wait for the next dequeue,
+  // which fails the same way.
+  if (!enqueue_buffer(index)) {
+    fprintf(stderr, "%s: VIDIOC_QBUF error %d, %s\n", device.c_str(), errno,
+            strerror(errno));
+  }
+  frames_out.fetch_sub(1);
+}
+
+bool Camera::enqueue_buffer(unsigned int idx) {
   switch (io_method) {
-  case IOMethod::MMAP:
-    enqueue_buffer_mmap(index);
+  case IOMethod::READ:
     break;
+  case IOMethod::MMAP:
+    return enqueue_buffer_mmap(idx);
   case IOMethod::USERPTR:
-    enqueue_buffer_userp(index);
-    break;
+    return enqueue_buffer_userp(idx);
   }
+  return true;
 }
 
-void Camera::close(void) {
-  if (-1 == ::close(fd))
-    errno_exit("close");
+int Camera::export_buffer(unsigned int index) {
+  if (io_method != IOMethod::MMAP || index >= buffer_count) {
+    return -1;
+  }
+
+  auto &buffer = buffers[index];
+  if (buffer.dmabuf_fd != -1) {
+    return buffer.dmabuf_fd;
+  }
+
+  v4l2_exportbuffer expbuf;
+  CLEAR(expbuf);
+  expbuf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  expbuf.index = index;
+  expbuf.flags = O_RDONLY | O_CLOEXEC;
 
-  fd = -1;
+  if (xioctl(fd, VIDIOC_EXPBUF, &expbuf) == -1) {
+    fprintf(stderr, "VIDIOC_EXPBUF error %d, %s\n", errno, strerror(errno));
+    return -1;
+  }
+
+  buffer.dmabuf_fd = expbuf.fd;
+  return buffer.dmabuf_fd;
+}
+
+size_t Camera::buffer_length(unsigned int index) const {
+  return buffers[index].length;
 }
 
 void Camera::init_read(unsigned int buffer_size) {
   buffers.reset(new Buffer[1]);
 
-  if (!buffers) {
-    fprintf(stderr, "Out of memory\\n");
-    exit(EXIT_FAILURE);
-  }
-
   buffers[0].length = buffer_size;
   buffers[0].start = malloc(buffer_size);
 
   if (!buffers[0].start) {
-    fprintf(stderr, "Out of memory\\n");
-    exit(EXIT_FAILURE);
+    throw std::bad_alloc();
   }
 }
 
@@ -361,34 +801,23 @@ void Camera::init_mmap(void) {
 
   CLEAR(req);
 
-  req.count = 4;
+  req.count = queue.buffer_count;
   req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
   req.memory = V4L2_MEMORY_MMAP;
 
   if (-1 == xioctl(fd, VIDIOC_REQBUFS, &req)) {
     if (EINVAL == errno) {
-      fprintf(stderr,
-              "%s does not support "
-              "memory mappingn",
-              device.c_str());
-      exit(EXIT_FAILURE);
-    } else {
-      errno_exit("VIDIOC_REQBUFS");
+      throw CameraError(device, "does not support memory mapping");
     }
+    throw CameraError(device, "VIDIOC_REQBUFS", errno);
   }
 
   if (req.count < 2) {
-    fprintf(stderr, "Insufficient buffer memory on %s\\n", device.c_str());
-    exit(EXIT_FAILURE);
+    throw CameraError(device, "Insufficient buffer memory");
   }
 
   buffers.reset(new Buffer[req.count]);
 
-  if (!buffers) {
-    fprintf(stderr, "Out of memory\\n");
-    exit(EXIT_FAILURE);
-  }
-
   for (buffer_count = 0; buffer_count < req.count; ++buffer_count) {
     struct v4l2_buffer buf;
 
@@ -399,7 +828,7 @@ void Camera::init_mmap(void) {
     buf.index = buffer_count;
 
     if (-1 == xioctl(fd, VIDIOC_QUERYBUF, &buf))
-      errno_exit("VIDIOC_QUERYBUF");
+      throw CameraError(device, "VIDIOC_QUERYBUF", errno);
 
     buffers[buffer_count].length = buf.length;
     buffers[buffer_count].start =
@@ -407,8 +836,9 @@ void Camera::init_mmap(void) {
              PROT_READ | PROT_WRITE /* required */,
              MAP_SHARED /* recommended */, fd, buf.m.offset);
 
+    // Buffers before buffer_count are unmapped on failure.
     if (MAP_FAILED == buffers[buffer_count].start)
-      errno_exit("mmap");
+      throw CameraError(device, "mmap", errno);
   }
 }
 
@@ -417,41 +847,30 @@ void Camera::init_userp(unsigned int buffer_size) {
 
   CLEAR(req);
 
-  req.count = 4;
+  req.count = queue.buffer_count;
   req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
   req.memory = V4L2_MEMORY_USERPTR;
 
   if (-1 == xioctl(fd, VIDIOC_REQBUFS, &req)) {
     if (EINVAL == errno) {
-      fprintf(stderr,
-              "%s does not support "
-              "user pointer i/on",
-              device.c_str());
-      exit(EXIT_FAILURE);
-    } else {
-      errno_exit("VIDIOC_REQBUFS");
+      throw CameraError(device, "does not support user pointer i/o");
     }
+    throw CameraError(device, "VIDIOC_REQBUFS", errno);
   }
 
-  buffers.reset(new Buffer[4]);
-
-  if (!buffers) {
-    fprintf(stderr, "Out of memory\\n");
-    exit(EXIT_FAILURE);
-  }
+  buffers.reset(new Buffer[req.count]);
 
-  for (buffer_count = 0; buffer_count < 4; ++buffer_count) {
+  for (buffer_count = 0; buffer_count < req.count; ++buffer_count) {
     buffers[buffer_count].length = buffer_size;
     buffers[buffer_count].start = malloc(buffer_size);
 
     if (!buffers[buffer_count].start) {
-      fprintf(stderr, "Out of memory\\n");
-      exit(EXIT_FAILURE);
+      throw std::bad_alloc();
     }
   }
 }
 
-void Camera::enqueue_buffer_mmap(unsigned int idx) {
+bool Camera::enqueue_buffer_mmap(unsigned int idx) {
   v4l2_buffer v4l2_buf;
   CLEAR(v4l2_buf);
   v4l2_buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
@@ -459,12 +878,10 @@ void Camera::enqueue_buffer_mmap(unsigned int idx) {
   v4l2_buf.index = idx;
   v4l2_buf.bytesused = 0;
 
-  if (-1 == xioctl(fd, VIDIOC_QBUF, &v4l2_buf)) {
-    errno_exit("VIDIOC_QBUF start");
-  }
+  return xioctl(fd, VIDIOC_QBUF, &v4l2_buf) != -1;
 }
 
-void Camera::enqueue_buffer_userp(unsigned int idx) {
+bool Camera::enqueue_buffer_userp(unsigned int idx) {
   v4l2_buffer v4l2_buf;
   CLEAR(v4l2_buf);
   v4l2_buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
@@ -474,21 +891,34 @@ void Camera::enqueue_buffer_userp(unsigned int idx) {
   v4l2_buf.length = buffers[idx].length;
   v4l2_buf.bytesused = 0;
 
-  if (-1 == xioctl(fd, VIDIOC_QBUF, &v4l2_buf)) {
-    errno_exit("VIDIOC_QBUF start");
-  }
+  return xioctl(fd, VIDIOC_QBUF, &v4l2_buf) != -1;
 }
 
-FrameView::FrameView(Camera &camera)
-    : std::basic_string_view<uint8_t>(nullptr, 0), camera(camera),
-      buffer_index(std::nullopt) {}
-FrameView::FrameView(Camera &camera, unsigned int buffer_index,
-                     const uint8_t *s, size_t len)
-    : std::basic_string_view<uint8_t>(s, len), camera(camera),
-      buffer_index(buffer_index) {}
+void report_latency(const Camera &camera, const FrameView &frame,
+                    std::chrono::microseconds requested) {
+  fprintf(stderr, "%s: capture to request latency %+.3f ms with %zu buffers\n",
+          camera.device_path().c_str(),
+          (requested - frame.timestamp()).count() / 1000.0, camera.count());
+}
+
+FrameView::FrameView(FrameOwner &owner)
+    : std::basic_string_view<uint8_t>(nullptr, 0), owner(owner),
+      buffer_index(std::nullopt), _timestamp(0), _sequence(0) {}
+FrameView::FrameView(FrameOwner &owner, std::optional<unsigned int> buffer_index,
+                     const uint8_t *s, size_t len,
+                     std::chrono::microseconds timestamp, uint32_t sequence)
+    : std::basic_string_view<uint8_t>(s, len), owner(owner),
+      buffer_index(buffer_index), _timestamp(timestamp), _sequence(sequence) {}
+
+FrameView::FrameView(FrameView &&other)
+    : std::basic_string_view<uint8_t>(other), owner(other.owner),
+      buffer_index(other.buffer_index), _timestamp(other._timestamp),
+      _sequence(other._sequence) {
+  other.buffer_index.reset();
+}
 
 FrameView::~FrameView() {
   if (buffer_index.has_value()) {
-    camera.clean_after_read(buffer_index.value());
+    owner.clean_after_read(buffer_index.value());
   }
 }
@@ -1,13 +1,18 @@
 #pragma once
 
+#include <atomic>
+#include <chrono>
 #include <memory>
 #include <optional>
+#include <stdexcept>
 #include <string>
 #include <string_view>
 #include <filesystem>
+#include <vector>
 
 // v4l2
 struct v4l2_buffer;
+struct v4l2_format;
 
 enum IOMethod {
   READ,
@@ -15,30 +20,193 @@ enum IOMethod {
   USERPTR,
 };
 
+// One combination of format, frame size and frame interval a device offers.
+struct CaptureMode {
+  uint32_t four_cc;
+  uint32_t width, height;
+  // Seconds per frame, 0/0 when device doesn't enumerate intervals.
+  uint32_t interval_numerator, interval_denominator;
+
+  double fps() const {
+    return interval_numerator == 0
+               ? 0
+               : double(interval_denominator) / interval_numerator;
+  }
+};
+
+enum class FormatPreference {
+  // Keep current format of device when it has the requested size.
+  ANY,
+  // MJPEG or JPEG, which are written without encoding.
+  COMPRESSED,
+  // Raw formats encoders take without conversion.
+  NATIVE,
+};
+
+FormatPreference format_preference_from_name(const std::string &name);
+
+// Policy for picking capture mode. Size defaults to current size of device,
+// rate defaults to the highest one.
+struct FormatRequest {
+  std::optional<uint32_t> four_cc;
+  std::optional<uint32_t> width, height;
+  std::optional<double> fps;
+  FormatPreference prefer = FormatPreference::ANY;
+  // Best first, used by NATIVE.
+  std::vector<uint32_t> native_formats;
+};
+
+// Mode closest to request, nullptr when none has the requested format.
+// Request must have its size set.
+const CaptureMode *select_mode(const std::vector<CaptureMode> &modes,
+                               const FormatRequest &request,
+                               uint32_t current_four_cc);
+
+// How frames are queued on device and handed out.
+struct QueueSettings {
+  // V4L2 buffers to request. Driver may allocate a different number.
+  unsigned int buffer_count = 4;
+  // Frames dropped after STREAMON, while the sensor settles.
+  unsigned int warmup_frames = 0;
+  // Drain the queue down to the newest frame on dequeue, re-queueing older
+  // ones at once.
+  bool freshest = false;
+};
+
+// Failure of a device, or of a V4L2 call on it.
+class CameraError : public std::runtime_error {
+public:
+  // error is errno of the call which failed, 0 when the device can't do what
+  // is asked.
+  CameraError(const std::filesystem::path &device, const std::string &what,
+              int error = 0);
+
+  int error() const {
+    return _error;
+  }
+  // Device went away, failed i/o or stopped delivering frames. Reopening it
+  // may help.
+  bool recoverable() const;
+
+protected:
+  int _error;
+};
+
+// Now in CLOCK_MONOTONIC, the clock of V4L2 timestamps.
+std::chrono::microseconds monotonic_now();
+
 struct Buffer;
 class Camera;
 
+// Source of frames which takes their buffers back once they are dropped.
+class FrameOwner {
+public:
+  virtual ~FrameOwner() = default;
+
+  virtual void clean_after_read(unsigned int index) = 0;
+};
+
+// Owner of frame buffers which can be exported as dmabuf fds.
+class BufferExporter {
+public:
+  virtual ~BufferExporter() = default;
+
+  virtual size_t count() const = 0;
+  virtual size_t buffer_length(unsigned int index) const = 0;
+  // Returns -1 when buffer can't be exported. Exporter owns returned fd.
+  virtual int export_buffer(unsigned int index) = 0;
+  // Changes whenever buffers and their fds do.
+  virtual unsigned int generation() const = 0;
+};
+
 class FrameView : public std::basic_string_view<uint8_t> {
 public:
-  FrameView(Camera &camera);
-  FrameView(Camera &camera, unsigned int buffer_index, const uint8_t *s,
-            size_t len);
+  FrameView(FrameOwner &owner);
+  FrameView(FrameOwner &owner, std::optional<unsigned int> buffer_index,
+            const uint8_t *s, size_t len,
+            std::chrono::microseconds timestamp = {}, uint32_t sequence = 0);
+  // Ownership of the buffer moves, so it is re-queued only once.
+  FrameView(FrameView &&other);
+  FrameView(const FrameView &) = delete;
+  FrameView &operator=(const FrameView &) = delete;
   ~FrameView();
 
+  // Index of buffer holding this frame, which goes back to owner when frame
+  // is dropped. Empty for read i/o and frames owner doesn't take back.
+  std::optional<unsigned int> index() const {
+    return buffer_index;
+  }
+  // Capture time in CLOCK_MONOTONIC, as reported by the driver.
+  std::chrono::microseconds timestamp() const {
+    return _timestamp;
+  }
+  // Frame sequence number counted by the driver. Gaps mean dropped frames.
+  uint32_t sequence() const {
+    return _sequence;
+  }
+
 protected:
-  Camera &camera;
+  FrameOwner &owner;
   std::optional<unsigned int> buffer_index;
+  std::chrono::microseconds _timestamp;
+  uint32_t _sequence;
 };
 
-class Camera {
+// Failures are thrown as CameraError. After a recoverable one, recover()
+// reopens the device with the same request and queue settings and resumes
+// streaming, so encoders set up for it can be kept.
+class Camera : public FrameOwner, public BufferExporter {
 public:
-  Camera(const std::filesystem::path &device, IOMethod method);
+  static constexpr std::chrono::milliseconds FRAME_TIMEOUT{2000};
+  // How long recover() waits for the device to come back.
+  static constexpr std::chrono::seconds RECONNECT_TIMEOUT{30};
+
+  Camera(const std::filesystem::path &device, IOMethod method,
+         const FormatRequest &request = {}, const QueueSettings &queue = {});
   ~Camera();
 
   void start_capturing(void);
+  // Does nothing when not streaming.
   void stop_capturing(void);
-  FrameView read_frame(void);
-  void clean_after_read(unsigned int index);
+  // Wait for next frame and dequeue it. Throws when no frame arrives in
+  // timeout.
+  FrameView read_frame(std::chrono::milliseconds timeout = FRAME_TIMEOUT);
+  // read_frame(), recovering from failures which allow it.
+  FrameView read_frame_recovering(
+      std::chrono::milliseconds timeout = FRAME_TIMEOUT);
+  // Returns false when no frame is ready in timeout.
+  bool wait_frame(std::chrono::milliseconds timeout);
+  // Dequeue ready frame without blocking. Frame is empty when none is ready,
+  // so it suits event loops watching poll_fd(). Warm-up frames and frames
+  // drained in freshest mode are re-queued without being returned.
+  FrameView dequeue_frame(void);
+  void clean_after_read(unsigned int index) override;
+  // Export V4L2 buffer as dmabuf fd. Returns -1 when it can't be exported.
+  // Camera owns returned fd.
+  int export_buffer(unsigned int index) override;
+
+  // Reconnect when error is recoverable, waiting for frames other threads
+  // hold to be dropped first, as buffers are unmapped. Returns false when
+  // error isn't recoverable or device didn't come back the same. Time to
+  // recover is recorded in metrics.
+  bool recover(const CameraError &error);
+  // Make recover() give up. Async-signal-safe.
+  static void cancel_recovery(void);
+  // Counts reconnects. Buffers, their dmabuf fds and poll_fd() change with
+  // it.
+  unsigned int generation() const override {
+    return _generation.load();
+  }
+
+  // Readable when a frame can be dequeued. Changes when device reconnects.
+  int poll_fd() const {
+    return fd;
+  }
+
+  size_t count() const override {
+    return buffer_count;
+  }
+  size_t buffer_length(unsigned int index) const override;
 
   uint32_t fourcc() const {
     return _fourcc;
@@ -49,26 +217,71 @@ public:
   uint32_t height() const {
     return _height;
   }
+  uint32_t bytesperline() const {
+    return _bytesperline;
+  }
+  // Frames per second set on device, 0 when unknown.
+  double fps() const {
+    return _fps;
+  }
+  const std::filesystem::path &device_path() const {
+    return device;
+  }
+  // Modes device enumerated, empty when it doesn't support enumeration.
+  const std::vector<CaptureMode> &modes() const {
+    return _modes;
+  }
 
 protected:
-  void init();
+  void open_device(void);
+  void init(const FormatRequest &request);
+  void enumerate_modes(const FormatRequest &request);
+  void apply_mode(const CaptureMode &mode, v4l2_format &fmt);
   void uninit(void);
-  void close(void);
+  // Stop streaming, unmap buffers and close device, ignoring failures.
+  void release(void);
+  void reconnect(void);
 
   void init_read(unsigned int buffer_size);
   void init_mmap(void);
   void init_userp(unsigned int buffer_size);
 
-  void enqueue_buffer_mmap(unsigned int idx);
-  void enqueue_buffer_userp(unsigned int idx);
+  FrameView dequeue_buffer(void);
+  // Record dequeue started at start, and frames dropped before sequence.
+  void count_frame(std::chrono::steady_clock::time_point start,
+                   uint32_t sequence);
+  // Returns false when buffer can't be queued, errno tells why.
+  bool enqueue_buffer(unsigned int idx);
+  bool enqueue_buffer_mmap(unsigned int idx);
+  bool enqueue_buffer_userp(unsigned int idx);
+
+  static std::atomic<bool> recovery_cancelled;
 
   const IOMethod io_method;
+  const FormatRequest request;
+  const QueueSettings queue;
+  unsigned int warmup_left = 0;
   uint32_t _fourcc;
   uint32_t _width, _height;
+  uint32_t _bytesperline;
+  double _fps = 0;
+  std::vector<CaptureMode> _modes;
 
-  int fd;
+  int fd = -1;
   std::unique_ptr<Buffer[]> buffers;
-  size_t buffer_count;
+  size_t buffer_count = 0;
+  bool streaming = false;
+  // Frames handed out which still hold a buffer.
+  std::atomic<size_t> frames_out{0};
+  std::atomic<unsigned int> _generation{0};
   std::filesystem::path device;
   std::unique_ptr<v4l2_buffer> v4l2_buf;
+  uint32_t read_sequence = 0;
+  std::optional<uint32_t> last_sequence;
 };
+
+// Print time from capture of frame to the request it serves, along with the
+// queue depth, for tuning the depth. Negative when frame was captured after
+// the request.
+void report_latency(const Camera &camera, const FrameView &frame,
+                    std::chrono::microseconds requested);
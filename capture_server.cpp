@@ -0,0 +1,236 @@
+#include "./capture_server.h"
+
+#include <stdexcept>
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "./camera.h"
+#include "./encoder.h"
+#include "./manifest.h"
+#include "./metrics.h"
+#include "./output.h"
+#include "./output_writer.h"
+#include "./thumbnail.h"
+
+std::atomic<bool> CaptureServer::stop_requested = false;
+
+static bool send_all(int fd, const void *data, size_t length) {
+  auto *p = reinterpret_cast<const uint8_t *>(data);
+  while (length > 0) {
+    const auto r = send(fd, p, length, MSG_NOSIGNAL);
+    if (r == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    p += r;
+    length -= r;
+  }
+  return true;
+}
+
+static bool send_line(int fd, const std::string &line) {
+  const auto s = line + "\n";
+  return send_all(fd, s.data(), s.size());
+}
+
+CaptureServer::CaptureServer(const std::filesystem::path &socket_path,
+                             Camera &camera, Encoder &encoder,
+                             OutputWriter &writer, uint32_t output_four_cc,
+                             const std::filesystem::path &output_dir,
+                             bool use_dmabuf, Converter *converter,
+                             Thumbnailer *thumbnailer, Manifest *manifest)
+    : camera(camera), handoff(camera, encoder, use_dmabuf), writer(writer),
+      thumbnailer(thumbnailer), manifest(manifest),
+      output_four_cc(output_four_cc),
+      output_dir(output_dir), socket_path(socket_path), listen_fd(-1) {
+  handoff.set_converter(converter);
+
+  sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (socket_path.native().size() >= sizeof(addr.sun_path)) {
+    throw std::invalid_argument("Socket path is too long");
+  }
+  strcpy(addr.sun_path, socket_path.c_str());
+
+  listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (listen_fd == -1) {
+    throw std::runtime_error(std::string("socket: ") + strerror(errno));
+  }
+
+  // Remove stale socket left by previous instance.
+  unlink(socket_path.c_str());
+
+  if (bind(listen_fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) ==
+          -1 ||
+      listen(listen_fd, 4) == -1) {
+    const auto err = errno;
+    ::close(listen_fd);
+    throw std::runtime_error(std::string("bind ") + socket_path.string() +
+                             ": " + strerror(err));
+  }
+}
+
+CaptureServer::~CaptureServer() {
+  if (listen_fd != -1) {
+    ::close(listen_fd);
+    unlink(socket_path.c_str());
+  }
+}
+
+void CaptureServer::request_stop(void) { stop_requested.store(true); }
+
+void CaptureServer::run(void) {
+  fprintf(stderr, "Listening on %s\n", socket_path.c_str());
+
+  while (!stop_requested.load()) {
+    const auto client_fd = accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+    if (client_fd == -1) {
+      if (errno == EINTR || errno == ECONNABORTED) {
+        continue;
+      }
+      fprintf(stderr, "accept error %d, %s\n", errno, strerror(errno));
+      break;
+    }
+
+    serve_client(client_fd);
+    ::close(client_fd);
+  }
+}
+
+void CaptureServer::serve_client(int client_fd) {
+  std::string pending;
+  char buf[256];
+
+  while (!stop_requested.load()) {
+    const auto r = recv(client_fd, buf, sizeof(buf), 0);
+    if (r == -1 && errno == EINTR) {
+      continue;
+    }
+    if (r <= 0) {
+      return;
+    }
+    pending.append(buf, r);
+
+    size_t newline;
+    while ((newline = pending.find('\n')) != std::string::npos) {
+      auto line = pending.substr(0, newline);
+      pending.erase(0, newline + 1);
+      if (!line.empty() && line.back() == '\r') {
+        line.pop_back();
+      }
+      if (!handle_request(client_fd, line)) {
+        return;
+      }
+    }
+  }
+}
+
+bool CaptureServer::handle_request(int client_fd, const std::string &line) {
+  const auto space = line.find(' ');
+  const auto command = line.substr(0, space);
+  const auto argument =
+      space == std::string::npos ? std::string() : line.substr(space + 1);
+
+  if (command == "capture") {
+    std::filesystem::path path =
+        argument.empty() ? output_dir : std::filesystem::path(argument);
+    if (path.is_relative()) {
+      path = output_dir / path;
+    }
+    if (std::filesystem::is_directory(path)) {
+      append_filename(path);
+    }
+
+    try {
+      if (fourcc_from_path(path) != output_four_cc) {
+        return send_line(client_fd, "error output format differs from the "
+                                    "encoder of this server");
+      }
+    } catch (const std::invalid_argument &e) {
+      return send_line(client_fd, std::string("error ") + e.what());
+    }
+
+    auto data = writer.buffer();
+    VectorSink sink{data};
+    Captured captured;
+    try {
+      captured = capture(sink, path);
+    } catch (const FrameError &e) {
+      return send_line(client_fd, std::string("error ") + e.what());
+    }
+    const auto size = data.size();
+    if (!writer.write_now(path, std::move(data))) {
+      return send_line(client_fd, "error failed to write " + path.string());
+    }
+    if (manifest) {
+      manifest->record(path, camera.width(), camera.height(),
+                       captured.timestamp, captured.sequence, size);
+    }
+    fprintf(stderr, "Encoded : %zu bytes to %s\n", size, path.c_str());
+    return send_line(client_fd, "ok " + path.string());
+  }
+
+  if (command == "data") {
+    // Length goes first, so frame is gathered before sending.
+    encoded.clear();
+    try {
+      capture(encoded);
+    } catch (const FrameError &e) {
+      return send_line(client_fd, std::string("error ") + e.what());
+    }
+    if (!send_line(client_fd, "data " + std::to_string(encoded.size()))) {
+      return false;
+    }
+    FdSink sink{client_fd, true};
+    sink.consume(EncodedView(encoded.data().data(), encoded.size()));
+    sink.flush();
+    return sink.ok();
+  }
+
+  if (command == "metrics") {
+    const auto text = metrics().prometheus();
+    if (!send_line(client_fd, "metrics " + std::to_string(text.size()))) {
+      return false;
+    }
+    FdSink sink{client_fd, true};
+    sink.consume(EncodedView(reinterpret_cast<const uint8_t *>(text.data()),
+                             text.size()));
+    sink.flush();
+    return sink.ok();
+  }
+
+  if (command == "quit") {
+    request_stop();
+    send_line(client_fd, "ok");
+    return false;
+  }
+
+  return send_line(client_fd, "error unknown command " + command);
+}
+
+CaptureServer::Captured
+CaptureServer::capture(EncodedSink &sink, const std::filesystem::path &path) {
+  const auto requested = monotonic_now();
+  while (true) {
+    const auto frame = camera.read_frame_recovering();
+    if (frame.length() == 0) {
+      fprintf(stderr, "Read 0 sized frame. retry\n");
+      continue;
+    }
+    report_latency(camera, frame, requested);
+
+    handoff.encode(frame, sink);
+    if (thumbnailer && !path.empty()) {
+      thumbnailer->write(writer, path, frame.data(), frame.length());
+    }
+    return {frame.timestamp(), frame.sequence()};
+  }
+}
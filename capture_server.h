@@ -0,0 +1,70 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+#include "./dmabuf.h"
+#include "./sink.h"
+
+class Camera;
+class Converter;
+class Encoder;
+class Manifest;
+class OutputWriter;
+class Thumbnailer;
+
+// Serves capture requests over an unix domain socket. Camera keeps streaming
+// and encoder component stays enabled between requests, so a snapshot only
+// costs one dequeue and one encode. With a thumbnailer, captures written into
+// files get a thumbnail too, and with a manifest they are put into it.
+//
+// Protocol is line based, one request per line.
+//   capture [PATH]  writes image to PATH (or output dir), replies "ok <path>"
+//                   once it is published
+//   data            replies "data <length>" followed by encoded bytes
+//   quit            stops the server
+// Failures are replied with "error <message>".
+class CaptureServer {
+public:
+  CaptureServer(const std::filesystem::path &socket_path, Camera &camera,
+                Encoder &encoder, OutputWriter &writer,
+                uint32_t output_four_cc,
+                const std::filesystem::path &output_dir, bool use_dmabuf,
+                Converter *converter = nullptr,
+                Thumbnailer *thumbnailer = nullptr,
+                Manifest *manifest = nullptr);
+  ~CaptureServer();
+
+  void run(void);
+  // Async-signal-safe.
+  static void request_stop(void);
+
+protected:
+  void serve_client(int client_fd);
+  bool handle_request(int client_fd, const std::string &line);
+  struct Captured {
+    std::chrono::microseconds timestamp;
+    uint32_t sequence;
+  };
+
+  // Also writes thumbnail of path, unless it is empty.
+  Captured capture(EncodedSink &sink, const std::filesystem::path &path = {});
+
+  static std::atomic<bool> stop_requested;
+
+  Camera &camera;
+  DmabufHandoff handoff;
+  OutputWriter &writer;
+  Thumbnailer *thumbnailer;
+  Manifest *manifest;
+  // Kept between data requests.
+  ArenaSink encoded;
+  const uint32_t output_four_cc;
+  const std::filesystem::path output_dir;
+  const std::filesystem::path socket_path;
+  int listen_fd;
+};
@@ -0,0 +1,342 @@
+#include "./convert.h"
+
+#include <algorithm>
+#include <array>
+#include <stdexcept>
+
+#include <linux/videodev2.h>
+#if defined(HAVE_NEON) && defined(__arm__)
+#include <asm/hwcap.h>
+#include <sys/auxv.h>
+#endif
+
+#include "./convert_kernels.h"
+#include "./fourcc.h"
+#include "./frame_error.h"
+
+static const ConvertKernels SCALAR_KERNELS{
+    "scalar", nullptr, nullptr, nullptr, nullptr, nullptr, nullptr};
+
+std::vector<const ConvertKernels *> available_convert_kernels() {
+  std::vector<const ConvertKernels *> kernels{&SCALAR_KERNELS};
+  // Kernel files are built with their own ISA flags, so CPU is checked here.
+#ifdef HAVE_SSE2
+  if (__builtin_cpu_supports("sse2")) {
+    kernels.push_back(sse2_convert_kernels());
+  }
+#endif
+#ifdef HAVE_AVX2
+  if (__builtin_cpu_supports("avx2")) {
+    kernels.push_back(avx2_convert_kernels());
+  }
+#endif
+#ifdef HAVE_NEON
+#ifdef __arm__
+  if (getauxval(AT_HWCAP) & HWCAP_NEON)
+#endif
+  {
+    kernels.push_back(neon_convert_kernels());
+  }
+#endif
+  return kernels;
+}
+
+const char *convert_kernels_name(const ConvertKernels &kernels) {
+  return kernels.name;
+}
+
+static const ConvertKernels &best_convert_kernels() {
+  static const ConvertKernels &best = *available_convert_kernels().back();
+  return best;
+}
+
+size_t output_size_i420(uint32_t width, uint32_t height) {
+  const size_t chroma_width = (width + 1) / 2;
+  const size_t chroma_height = (height + 1) / 2;
+  return size_t(width) * height + 2 * chroma_width * chroma_height;
+}
+
+static uint32_t bytes_per_pixel(uint32_t four_cc) {
+  switch (four_cc) {
+  case V4L2_PIX_FMT_YUYV:
+  case V4L2_PIX_FMT_UYVY:
+    return 2;
+  case V4L2_PIX_FMT_NV12:
+    return 1;
+  case V4L2_PIX_FMT_RGB24:
+    return 3;
+  default:
+    return 0;
+  }
+}
+
+static RowPairKernel row_pair_kernel(const ConvertKernels &kernels,
+                                     uint32_t input_four_cc) {
+  switch (input_four_cc) {
+  case V4L2_PIX_FMT_YUYV:
+    return kernels.yuyv;
+  case V4L2_PIX_FMT_UYVY:
+    return kernels.uyvy;
+  case V4L2_PIX_FMT_NV12:
+    return kernels.nv12;
+  case V4L2_PIX_FMT_RGB24:
+    return kernels.rgb24;
+  default:
+    throw std::invalid_argument("Input format can't be converted to I420");
+  }
+}
+
+// Run kernel over a row pair, and scalar code over what it left.
+static void convert_row_pair(RowPairKernel kernel, uint32_t input_four_cc,
+                             const uint8_t *row0, const uint8_t *row1,
+                             const uint8_t *chroma, uint32_t width,
+                             uint8_t *y0, uint8_t *y1, uint8_t *u,
+                             uint8_t *v) {
+  const auto done =
+      kernel ? kernel(row0, row1, chroma, width, y0, y1, u, v) : 0;
+  switch (input_four_cc) {
+  case V4L2_PIX_FMT_YUYV:
+    packed422_rows_scalar<0>(row0, row1, done, width, y0, y1, u, v);
+    break;
+  case V4L2_PIX_FMT_UYVY:
+    packed422_rows_scalar<1>(row0, row1, done, width, y0, y1, u, v);
+    break;
+  case V4L2_PIX_FMT_NV12:
+    nv12_rows_scalar(row0, row1, chroma, done, width, y0, y1, u, v);
+    break;
+  case V4L2_PIX_FMT_RGB24:
+    rgb24_rows_scalar(row0, row1, done, width, y0, y1, u, v);
+    break;
+  }
+}
+
+void convert_to_i420(const ConvertKernels &kernels, uint32_t input_four_cc,
+                     const uint8_t *input, uint32_t stride, uint32_t width,
+                     uint32_t height, uint8_t *output) {
+  const auto kernel = row_pair_kernel(kernels, input_four_cc);
+
+  const size_t chroma_width = (width + 1) / 2;
+  const size_t chroma_height = (height + 1) / 2;
+  uint8_t *const y_plane = output;
+  uint8_t *const u_plane = y_plane + size_t(width) * height;
+  uint8_t *const v_plane = u_plane + chroma_width * chroma_height;
+  const uint8_t *const chroma_plane = input + size_t(stride) * height;
+
+  for (uint32_t row = 0; row < height; row += 2) {
+    // Last row of odd height pairs with itself.
+    const bool pair = row + 1 < height;
+    const auto row0 = input + size_t(stride) * row;
+    const auto row1 = pair ? row0 + stride : row0;
+    const auto y0 = y_plane + size_t(width) * row;
+    const auto y1 = pair ? y0 + width : y0;
+    const auto u = u_plane + chroma_width * (row / 2);
+    const auto v = v_plane + chroma_width * (row / 2);
+    const auto chroma = chroma_plane + size_t(stride) * (row / 2);
+
+    convert_row_pair(kernel, input_four_cc, row0, row1, chroma, width, y0, y1,
+                     u, v);
+  }
+}
+
+static void halve_rows(const ConvertKernels &kernels, const uint8_t *row0,
+                       const uint8_t *row1, uint32_t width, uint8_t *out) {
+  const auto done = kernels.halve ? kernels.halve(row0, row1, width, out) : 0;
+  halve_rows_scalar(row0, row1, done, width, out);
+}
+
+void halve_plane(const ConvertKernels &kernels, const uint8_t *input,
+                 uint32_t stride, uint32_t width, uint32_t height,
+                 uint8_t *output) {
+  for (uint32_t row = 0; row < height; ++row) {
+    const auto row0 = input + size_t(stride) * 2 * row;
+    halve_rows(kernels, row0, row0 + stride, width,
+               output + size_t(width) * row);
+  }
+}
+
+void sad_plane(const ConvertKernels &kernels, const uint8_t *a,
+               const uint8_t *b, uint32_t width, uint32_t height,
+               uint32_t *sums) {
+  const auto columns = (width + SAD_BLOCK - 1) / SAD_BLOCK;
+  const auto rows = (height + SAD_BLOCK - 1) / SAD_BLOCK;
+  std::fill(sums, sums + size_t(columns) * rows, 0);
+  for (uint32_t y = 0; y < height; ++y) {
+    const auto offset = size_t(width) * y;
+    const auto row_sums = sums + size_t(columns) * (y / SAD_BLOCK);
+    const auto done =
+        kernels.sad ? kernels.sad(a + offset, b + offset, width, row_sums) : 0;
+    sad_row_scalar(a + offset, b + offset, done, width, row_sums);
+  }
+}
+
+Converter::Converter(uint32_t input_four_cc, uint32_t width, uint32_t height,
+                     uint32_t stride)
+    : input_four_cc(input_four_cc), width(width), height(height),
+      stride(stride), kernels(best_convert_kernels()),
+      output(output_size_i420(width, height)) {
+  const auto bpp = bytes_per_pixel(input_four_cc);
+  if (bpp == 0) {
+    throw std::invalid_argument("Input format can't be converted to I420");
+  }
+  if (bpp == 2 && width % 2 != 0) {
+    throw std::invalid_argument("Packed 4:2:2 input needs even width");
+  }
+  if (this->stride == 0) {
+    this->stride = width * bpp;
+  }
+  if (this->stride < width * bpp) {
+    throw std::invalid_argument("Stride is shorter than a row");
+  }
+
+  input_size = size_t(this->stride) * height;
+  if (input_four_cc == V4L2_PIX_FMT_NV12) {
+    input_size += size_t(this->stride) * ((height + 1) / 2);
+  }
+}
+
+bool Converter::supports(uint32_t four_cc) {
+  return bytes_per_pixel(four_cc) != 0;
+}
+
+ByteView Converter::convert(const uint8_t *input, size_t length) {
+  convert(input, length, output.data());
+  return ByteView(output.data(), output.size());
+}
+
+void Converter::convert(const uint8_t *input, size_t length,
+                        uint8_t *output) const {
+  if (length < input_size) {
+    throw FrameError("Frame is shorter than expected");
+  }
+  convert_to_i420(kernels, input_four_cc, input, stride, width, height,
+                  output);
+}
+
+const char *Converter::kernels_name() const { return kernels.name; }
+
+bool Downscaler::supports(uint32_t four_cc) {
+  return four_cc == ENCODING_I420 || four_cc == V4L2_PIX_FMT_YUV420 ||
+         Converter::supports(four_cc);
+}
+
+Downscaler::Downscaler(uint32_t input_four_cc, uint32_t width,
+                       uint32_t height, uint32_t stride, uint32_t max_width,
+                       uint32_t max_height)
+    : input_four_cc(input_four_cc), width(width), height(height),
+      stride(stride), kernels(best_convert_kernels()) {
+  const auto planar =
+      input_four_cc == ENCODING_I420 || input_four_cc == V4L2_PIX_FMT_YUV420;
+  const auto bpp = planar ? 1 : bytes_per_pixel(input_four_cc);
+  if (bpp == 0) {
+    throw std::invalid_argument("Input format can't be downscaled");
+  }
+  if (this->stride == 0) {
+    this->stride = width * bpp;
+  }
+  if (this->stride < width * bpp) {
+    throw std::invalid_argument("Stride is shorter than a row");
+  }
+
+  input_size = size_t(this->stride) * height;
+  if (planar) {
+    input_size += 2 * size_t((this->stride + 1) / 2) * ((height + 1) / 2);
+  } else if (input_four_cc == V4L2_PIX_FMT_NV12) {
+    input_size += size_t(this->stride) * ((height + 1) / 2);
+  }
+
+  // Every level is even sized, so its chroma planes are exactly half.
+  uint32_t level_width = width, level_height = height;
+  do {
+    if (level_width < 4 || level_height < 4) {
+      throw std::invalid_argument("Frame is too small to downscale");
+    }
+    level_width = level_width / 4 * 2;
+    level_height = level_height / 4 * 2;
+    levels.push_back({level_width, level_height});
+  } while (level_width > max_width || level_height > max_height);
+
+  const auto &first = levels.front();
+  for (auto &buffer : buffers) {
+    buffer.resize(output_size_i420(first.width, first.height));
+  }
+  if (!planar) {
+    // Four luma rows and two rows of each chroma plane, converted at twice
+    // the width of the first level.
+    rows.resize(4 * size_t(2 * first.width) + 4 * size_t(first.width));
+  }
+}
+
+ByteView Downscaler::downscale(const uint8_t *input, size_t length) {
+  if (length < input_size) {
+    throw FrameError("Frame is shorter than expected");
+  }
+
+  // Level i is in buffers[i % 2].
+  const auto plane_pointers = [](uint8_t *buffer, const Level &level) {
+    const auto u = buffer + size_t(level.width) * level.height;
+    return std::array<uint8_t *, 3>{
+        buffer, u, u + size_t(level.width / 2) * (level.height / 2)};
+  };
+
+  const auto &first = levels.front();
+  const auto out = plane_pointers(buffers[0].data(), first);
+  if (input_four_cc == ENCODING_I420 ||
+      input_four_cc == V4L2_PIX_FMT_YUV420) {
+    const auto chroma_stride = (stride + 1) / 2;
+    const auto u = input + size_t(stride) * height;
+    const auto v = u + size_t(chroma_stride) * ((height + 1) / 2);
+    halve_plane(kernels, input, stride, first.width, first.height, out[0]);
+    halve_plane(kernels, u, chroma_stride, first.width / 2, first.height / 2,
+                out[1]);
+    halve_plane(kernels, v, chroma_stride, first.width / 2, first.height / 2,
+                out[2]);
+  } else {
+    // Converted a row pair at a time and halved right away, so the full
+    // sized frame is read once and never written.
+    const auto kernel = row_pair_kernel(kernels, input_four_cc);
+    const auto converted_width = 2 * first.width;
+    const auto chroma_plane = input + size_t(stride) * height;
+    uint8_t *y[4], *u[2], *v[2];
+    for (int i = 0; i < 4; ++i) {
+      y[i] = rows.data() + size_t(converted_width) * i;
+    }
+    for (int i = 0; i < 2; ++i) {
+      u[i] = y[3] + converted_width + size_t(first.width) * i;
+      v[i] = u[i] + 2 * size_t(first.width);
+    }
+
+    for (uint32_t row = 0; row < first.height / 2; ++row) {
+      for (int pair = 0; pair < 2; ++pair) {
+        const auto source = 4 * row + 2 * pair;
+        const auto row0 = input + size_t(stride) * source;
+        convert_row_pair(kernel, input_four_cc, row0, row0 + stride,
+                         chroma_plane + size_t(stride) * (source / 2),
+                         converted_width, y[2 * pair], y[2 * pair + 1],
+                         u[pair], v[pair]);
+      }
+      halve_rows(kernels, y[0], y[1], first.width,
+                 out[0] + size_t(first.width) * 2 * row);
+      halve_rows(kernels, y[2], y[3], first.width,
+                 out[0] + size_t(first.width) * (2 * row + 1));
+      halve_rows(kernels, u[0], u[1], first.width / 2,
+                 out[1] + size_t(first.width / 2) * row);
+      halve_rows(kernels, v[0], v[1], first.width / 2,
+                 out[2] + size_t(first.width / 2) * row);
+    }
+  }
+
+  for (size_t i = 1; i < levels.size(); ++i) {
+    const auto &from = levels[i - 1], &to = levels[i];
+    const auto in = plane_pointers(buffers[(i - 1) % 2].data(), from);
+    const auto out = plane_pointers(buffers[i % 2].data(), to);
+    halve_plane(kernels, in[0], from.width, to.width, to.height, out[0]);
+    for (int plane = 1; plane < 3; ++plane) {
+      halve_plane(kernels, in[plane], from.width / 2, to.width / 2,
+                  to.height / 2, out[plane]);
+    }
+  }
+
+  const auto &last = levels.back();
+  return ByteView(buffers[(levels.size() - 1) % 2].data(),
+                  output_size_i420(last.width, last.height));
+}
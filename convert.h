@@ -0,0 +1,99 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "./mjpeg.h"
+
+struct ConvertKernels;
+
+// Kernel sets usable on running CPU, scalar reference first and fastest last.
+std::vector<const ConvertKernels *> available_convert_kernels();
+const char *convert_kernels_name(const ConvertKernels &kernels);
+
+// Convert a frame of input_four_cc into I420 of output_size_i420() bytes.
+// stride is bytes per line of the input, and of both planes for NV12.
+void convert_to_i420(const ConvertKernels &kernels, uint32_t input_four_cc,
+                     const uint8_t *input, uint32_t stride, uint32_t width,
+                     uint32_t height, uint8_t *output);
+size_t output_size_i420(uint32_t width, uint32_t height);
+// Halve a plane into width x height, averaging each 2x2 block of input.
+// Input must have at least twice as many rows and columns.
+void halve_plane(const ConvertKernels &kernels, const uint8_t *input,
+                 uint32_t stride, uint32_t width, uint32_t height,
+                 uint8_t *output);
+
+// Side of blocks sad_plane() sums over.
+constexpr uint32_t SAD_BLOCK = 16;
+// Sums of absolute differences of planes a and b of tightly packed rows, over
+// blocks of SAD_BLOCK x SAD_BLOCK pixels, into sums of one entry per block in
+// row order. Blocks at right and bottom edge may be smaller.
+void sad_plane(const ConvertKernels &kernels, const uint8_t *a,
+               const uint8_t *b, uint32_t width, uint32_t height,
+               uint32_t *sums);
+
+// Converts camera frames into planar I420 with the fastest kernels for the
+// CPU. Output buffer is allocated once, so converting doesn't allocate.
+class Converter {
+public:
+  // Throws std::invalid_argument when input format can't be converted.
+  // stride defaults to tightly packed rows.
+  Converter(uint32_t input_four_cc, uint32_t width, uint32_t height,
+            uint32_t stride = 0);
+
+  static bool supports(uint32_t four_cc);
+
+  // Returned view is valid until next call.
+  ByteView convert(const uint8_t *input, size_t length);
+  // Convert into caller owned buffer of output_size() bytes.
+  void convert(const uint8_t *input, size_t length, uint8_t *output) const;
+
+  size_t output_size() const { return output.size(); }
+  const char *kernels_name() const;
+
+protected:
+  const uint32_t input_four_cc;
+  const uint32_t width, height;
+  uint32_t stride;
+  size_t input_size;
+  const ConvertKernels &kernels;
+  std::vector<uint8_t> output;
+};
+
+// Downscales camera frames into I420 by halving them until they fit, which
+// averages blocks of a power of two pixels. First halving is fused with
+// conversion, so the full sized frame is only read once.
+class Downscaler {
+public:
+  // Takes formats Converter takes and I420. Sizes of output are even and at
+  // most max_width x max_height, and at least halved. Throws
+  // std::invalid_argument when frame can't be downscaled.
+  Downscaler(uint32_t input_four_cc, uint32_t width, uint32_t height,
+             uint32_t stride, uint32_t max_width, uint32_t max_height);
+
+  static bool supports(uint32_t four_cc);
+
+  // Returned view is valid until next call.
+  ByteView downscale(const uint8_t *input, size_t length);
+
+  uint32_t output_width() const { return levels.back().width; }
+  uint32_t output_height() const { return levels.back().height; }
+
+protected:
+  struct Level {
+    uint32_t width, height;
+  };
+
+  const uint32_t input_four_cc;
+  const uint32_t width, height;
+  uint32_t stride;
+  size_t input_size;
+  const ConvertKernels &kernels;
+  // Sizes after each halving.
+  std::vector<Level> levels;
+  // Halvings go back and forth between these.
+  std::vector<uint8_t> buffers[2];
+  // Converted rows waiting to be halved.
+  std::vector<uint8_t> rows;
+};
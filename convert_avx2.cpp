@@ -0,0 +1,225 @@
+#include "./convert_kernels.h"
+
+#include <immintrin.h>
+
+// Packs in AVX2 work within 128 bit lanes, so results are put back in order
+// by permuting 64 bit quarters.
+constexpr int LANE_ORDER = _MM_SHUFFLE(3, 1, 2, 0);
+
+static inline __m256i load(const uint8_t *p) {
+  return _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p));
+}
+static inline void store(uint8_t *p, __m256i value) {
+  _mm256_storeu_si256(reinterpret_cast<__m256i *>(p), value);
+}
+
+// Splits 16 interleaved UV pairs into 16 U and 16 V.
+static inline void store_uv(__m256i uv, uint8_t *u, uint8_t *v) {
+  const __m256i low = _mm256_set1_epi16(0x00FF);
+  const auto split = _mm256_permute4x64_epi64(
+      _mm256_packus_epi16(_mm256_and_si256(uv, low), _mm256_srli_epi16(uv, 8)),
+      LANE_ORDER);
+  _mm_storeu_si128(reinterpret_cast<__m128i *>(u),
+                   _mm256_castsi256_si128(split));
+  _mm_storeu_si128(reinterpret_cast<__m128i *>(v),
+                   _mm256_extracti128_si256(split, 1));
+}
+
+// 32 pixels per iteration.
+template <int Y_OFFSET>
+static uint32_t packed422_rows_avx2(const uint8_t *row0, const uint8_t *row1,
+                                    const uint8_t *, uint32_t width,
+                                    uint8_t *y0, uint8_t *y1, uint8_t *u,
+                                    uint8_t *v) {
+  const __m256i low = _mm256_set1_epi16(0x00FF);
+  const auto pick = [&](__m256i a, __m256i b, bool high) {
+    return _mm256_permute4x64_epi64(
+        high ? _mm256_packus_epi16(_mm256_srli_epi16(a, 8),
+                                   _mm256_srli_epi16(b, 8))
+             : _mm256_packus_epi16(_mm256_and_si256(a, low),
+                                   _mm256_and_si256(b, low)),
+        LANE_ORDER);
+  };
+
+  uint32_t x = 0;
+  for (; x + 32 <= width; x += 32) {
+    const auto a0 = load(row0 + 2 * x), b0 = load(row0 + 2 * x + 32);
+    const auto a1 = load(row1 + 2 * x), b1 = load(row1 + 2 * x + 32);
+
+    store(y0 + x, pick(a0, b0, Y_OFFSET != 0));
+    store(y1 + x, pick(a1, b1, Y_OFFSET != 0));
+    store_uv(_mm256_avg_epu8(pick(a0, b0, Y_OFFSET == 0),
+                             pick(a1, b1, Y_OFFSET == 0)),
+             u + x / 2, v + x / 2);
+  }
+  return x;
+}
+
+static uint32_t nv12_rows_avx2(const uint8_t *row0, const uint8_t *row1,
+                               const uint8_t *chroma, uint32_t width,
+                               uint8_t *y0, uint8_t *y1, uint8_t *u,
+                               uint8_t *v) {
+  uint32_t x = 0;
+  for (; x + 32 <= width; x += 32) {
+    store(y0 + x, load(row0 + x));
+    store(y1 + x, load(row1 + x));
+    store_uv(load(chroma + x), u + x / 2, v + x / 2);
+  }
+  return x;
+}
+
+// pshufb masks picking channel c of 16 RGB24 pixels out of each of the three
+// 16 byte loads.
+struct RgbMasks {
+  alignas(16) int8_t bytes[3][3][16];
+};
+
+static constexpr RgbMasks make_rgb_masks() {
+  RgbMasks masks{};
+  for (int c = 0; c < 3; ++c) {
+    for (int i = 0; i < 16; ++i) {
+      const int byte = 3 * i + c;
+      for (int k = 0; k < 3; ++k) {
+        masks.bytes[c][k][i] = byte / 16 == k ? byte % 16 : -1;
+      }
+    }
+  }
+  return masks;
+}
+
+static constexpr RgbMasks RGB_MASKS = make_rgb_masks();
+
+// Deinterleaves 16 RGB24 pixels into 16 bit R, G and B.
+static inline void load_rgb(const uint8_t *p, __m256i &r, __m256i &g,
+                            __m256i &b) {
+  __m128i parts[3];
+  for (int k = 0; k < 3; ++k) {
+    parts[k] = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + 16 * k));
+  }
+  const auto channel = [&](int c) {
+    __m128i bytes = _mm_setzero_si128();
+    for (int k = 0; k < 3; ++k) {
+      const auto mask = _mm_load_si128(
+          reinterpret_cast<const __m128i *>(RGB_MASKS.bytes[c][k]));
+      bytes = _mm_or_si128(bytes, _mm_shuffle_epi8(parts[k], mask));
+    }
+    return _mm256_cvtepu8_epi16(bytes);
+  };
+  r = channel(0);
+  g = channel(1);
+  b = channel(2);
+}
+
+// Packs 16 16-bit values into bytes.
+static inline __m128i pack16(__m256i value) {
+  return _mm_packus_epi16(_mm256_castsi256_si128(value),
+                          _mm256_extracti128_si256(value, 1));
+}
+
+// Packs 8 32-bit values into bytes, in the low half.
+static inline __m128i pack8(__m256i value) {
+  const auto words = _mm_packs_epi32(_mm256_castsi256_si128(value),
+                                     _mm256_extracti128_si256(value, 1));
+  return _mm_packus_epi16(words, words);
+}
+
+// Averages 2x2 blocks of a row pair of 16 pixels into 8 values.
+static inline __m256i average_2x2(__m256i c0, __m256i c1) {
+  const auto pairs =
+      _mm256_madd_epi16(_mm256_add_epi16(c0, c1), _mm256_set1_epi16(1));
+  return _mm256_srli_epi32(_mm256_add_epi32(pairs, _mm256_set1_epi32(2)), 2);
+}
+
+static inline __m256i rgb_to_y(__m256i r, __m256i g, __m256i b) {
+  // Sum fits in unsigned 16 bits.
+  auto y = _mm256_add_epi16(_mm256_mullo_epi16(r, _mm256_set1_epi16(66)),
+                            _mm256_mullo_epi16(g, _mm256_set1_epi16(129)));
+  y = _mm256_add_epi16(y, _mm256_mullo_epi16(b, _mm256_set1_epi16(25)));
+  y = _mm256_srli_epi16(_mm256_add_epi16(y, _mm256_set1_epi16(128)), 8);
+  return _mm256_add_epi16(y, _mm256_set1_epi16(16));
+}
+
+static inline __m256i rgb_to_chroma(__m256i r, __m256i g, __m256i b, int kr,
+                                    int kg, int kb) {
+  auto c = _mm256_add_epi32(_mm256_mullo_epi32(r, _mm256_set1_epi32(kr)),
+                            _mm256_mullo_epi32(g, _mm256_set1_epi32(kg)));
+  c = _mm256_add_epi32(c, _mm256_mullo_epi32(b, _mm256_set1_epi32(kb)));
+  c = _mm256_srai_epi32(_mm256_add_epi32(c, _mm256_set1_epi32(128)), 8);
+  return _mm256_add_epi32(c, _mm256_set1_epi32(128));
+}
+
+// 16 pixels per iteration.
+static uint32_t rgb24_rows_avx2(const uint8_t *row0, const uint8_t *row1,
+                                const uint8_t *, uint32_t width, uint8_t *y0,
+                                uint8_t *y1, uint8_t *u, uint8_t *v) {
+  uint32_t x = 0;
+  for (; x + 16 <= width; x += 16) {
+    __m256i r0, g0, b0, r1, g1, b1;
+    load_rgb(row0 + 3 * x, r0, g0, b0);
+    load_rgb(row1 + 3 * x, r1, g1, b1);
+
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(y0 + x),
+                     pack16(rgb_to_y(r0, g0, b0)));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(y1 + x),
+                     pack16(rgb_to_y(r1, g1, b1)));
+
+    const auto r = average_2x2(r0, r1);
+    const auto g = average_2x2(g0, g1);
+    const auto b = average_2x2(b0, b1);
+    _mm_storel_epi64(reinterpret_cast<__m128i *>(u + x / 2),
+                     pack8(rgb_to_chroma(r, g, b, -38, -74, 112)));
+    _mm_storel_epi64(reinterpret_cast<__m128i *>(v + x / 2),
+                     pack8(rgb_to_chroma(r, g, b, 112, -94, -18)));
+  }
+  return x;
+}
+
+// 64 pixels of both rows make 32. Packing works within 128 bit lanes, so
+// halves are put back in order after it.
+static uint32_t halve_rows_avx2(const uint8_t *row0, const uint8_t *row1,
+                                uint32_t width, uint8_t *out) {
+  const __m256i ones = _mm256_set1_epi8(1);
+  const __m256i two = _mm256_set1_epi16(2);
+  const auto block = [&](__m256i a, __m256i b) {
+    const auto sum = _mm256_add_epi16(_mm256_maddubs_epi16(a, ones),
+                                      _mm256_maddubs_epi16(b, ones));
+    return _mm256_srli_epi16(_mm256_add_epi16(sum, two), 2);
+  };
+
+  uint32_t x = 0;
+  for (; x + 32 <= width; x += 32) {
+    const auto p0 = reinterpret_cast<const __m256i *>(row0 + 2 * x);
+    const auto p1 = reinterpret_cast<const __m256i *>(row1 + 2 * x);
+    const auto lo = block(_mm256_loadu_si256(p0), _mm256_loadu_si256(p1));
+    const auto hi =
+        block(_mm256_loadu_si256(p0 + 1), _mm256_loadu_si256(p1 + 1));
+    _mm256_storeu_si256(
+        reinterpret_cast<__m256i *>(out + x),
+        _mm256_permute4x64_epi64(_mm256_packus_epi16(lo, hi), 0xD8));
+  }
+  return x;
+}
+
+// 32 pixels make two blocks, the low and high 128 bit lanes.
+static uint32_t sad_row_avx2(const uint8_t *a, const uint8_t *b,
+                             uint32_t width, uint32_t *sums) {
+  uint32_t x = 0;
+  for (; x + 32 <= width; x += 32) {
+    const auto sad = _mm256_sad_epu8(
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(a + x)),
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(b + x)));
+    const auto lo = _mm256_castsi256_si128(sad);
+    const auto hi = _mm256_extracti128_si256(sad, 1);
+    sums[x / SAD_BLOCK] +=
+        _mm_cvtsi128_si32(lo) + _mm_cvtsi128_si32(_mm_srli_si128(lo, 8));
+    sums[x / SAD_BLOCK + 1] +=
+        _mm_cvtsi128_si32(hi) + _mm_cvtsi128_si32(_mm_srli_si128(hi, 8));
+  }
+  return x;
+}
+
+static const ConvertKernels AVX2_KERNELS{
+    "avx2", packed422_rows_avx2<0>, packed422_rows_avx2<1>, nv12_rows_avx2,
+    rgb24_rows_avx2, halve_rows_avx2, sad_row_avx2};
+
+const ConvertKernels *avx2_convert_kernels() { return &AVX2_KERNELS; }
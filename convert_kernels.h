@@ -0,0 +1,122 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+
+#include "./convert.h"
+
+// Row pair kernels converting camera formats into I420. Each call converts
+// two source rows into two Y rows and one row of U and V.
+//
+// SIMD kernels convert a prefix of the rows and return the number of pixels
+// done, the scalar kernels finish the rest from x0. chroma is the interleaved
+// CbCr row of NV12 and unused for other formats.
+using RowPairKernel = uint32_t (*)(const uint8_t *row0, const uint8_t *row1,
+                                   const uint8_t *chroma, uint32_t width,
+                                   uint8_t *y0, uint8_t *y1, uint8_t *u,
+                                   uint8_t *v);
+
+// Halves a pair of rows of a plane into one row of width pixels, averaging
+// each 2x2 block. Returns pixels done like row pair kernels.
+using RowHalveKernel = uint32_t (*)(const uint8_t *row0, const uint8_t *row1,
+                                    uint32_t width, uint8_t *out);
+
+// Adds sum of absolute differences of a and b over each SAD_BLOCK pixels of
+// a row into sums[x / SAD_BLOCK]. Returns pixels done like row pair kernels.
+using RowSadKernel = uint32_t (*)(const uint8_t *a, const uint8_t *b,
+                                  uint32_t width, uint32_t *sums);
+
+struct ConvertKernels {
+  const char *name;
+  RowPairKernel yuyv;
+  RowPairKernel uyvy;
+  RowPairKernel nv12;
+  RowPairKernel rgb24;
+  RowHalveKernel halve;
+  RowSadKernel sad;
+};
+
+// Returns nullptr when not built in or not supported by running CPU.
+const ConvertKernels *sse2_convert_kernels();
+const ConvertKernels *avx2_convert_kernels();
+const ConvertKernels *neon_convert_kernels();
+
+// Scalar reference. SIMD kernels must produce identical output.
+
+inline uint8_t average2(uint8_t a, uint8_t b) {
+  return static_cast<uint8_t>((a + b + 1) >> 1);
+}
+
+// BT.601 limited range.
+inline uint8_t rgb_to_y(int r, int g, int b) {
+  return static_cast<uint8_t>(((66 * r + 129 * g + 25 * b + 128) >> 8) + 16);
+}
+inline uint8_t rgb_to_u(int r, int g, int b) {
+  return static_cast<uint8_t>(((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128);
+}
+inline uint8_t rgb_to_v(int r, int g, int b) {
+  return static_cast<uint8_t>(((112 * r - 94 * g - 18 * b + 128) >> 8) + 128);
+}
+
+template <int Y_OFFSET>
+inline void packed422_rows_scalar(const uint8_t *row0, const uint8_t *row1,
+                                  uint32_t x0, uint32_t width, uint8_t *y0,
+                                  uint8_t *y1, uint8_t *u, uint8_t *v) {
+  constexpr int C_OFFSET = 1 - Y_OFFSET;
+  for (uint32_t x = x0; x < width; ++x) {
+    y0[x] = row0[2 * x + Y_OFFSET];
+    y1[x] = row1[2 * x + Y_OFFSET];
+  }
+  for (uint32_t x = x0 / 2; x < width / 2; ++x) {
+    u[x] = average2(row0[4 * x + C_OFFSET], row1[4 * x + C_OFFSET]);
+    v[x] = average2(row0[4 * x + C_OFFSET + 2], row1[4 * x + C_OFFSET + 2]);
+  }
+}
+
+inline void nv12_rows_scalar(const uint8_t *row0, const uint8_t *row1,
+                             const uint8_t *chroma, uint32_t x0,
+                             uint32_t width, uint8_t *y0, uint8_t *y1,
+                             uint8_t *u, uint8_t *v) {
+  std::copy(row0 + x0, row0 + width, y0 + x0);
+  std::copy(row1 + x0, row1 + width, y1 + x0);
+  for (uint32_t x = x0 / 2; x < (width + 1) / 2; ++x) {
+    u[x] = chroma[2 * x];
+    v[x] = chroma[2 * x + 1];
+  }
+}
+
+inline void rgb24_rows_scalar(const uint8_t *row0, const uint8_t *row1,
+                              uint32_t x0, uint32_t width, uint8_t *y0,
+                              uint8_t *y1, uint8_t *u, uint8_t *v) {
+  for (uint32_t x = x0; x < width; ++x) {
+    y0[x] = rgb_to_y(row0[3 * x], row0[3 * x + 1], row0[3 * x + 2]);
+    y1[x] = rgb_to_y(row1[3 * x], row1[3 * x + 1], row1[3 * x + 2]);
+  }
+  for (uint32_t x = x0 / 2; x < (width + 1) / 2; ++x) {
+    // Last column of odd width is averaged with itself.
+    const auto l = 6 * x;
+    const auto r = std::min(2 * x + 1, width - 1) * 3;
+    int sum[3];
+    for (int c = 0; c < 3; ++c) {
+      sum[c] = (row0[l + c] + row0[r + c] + row1[l + c] + row1[r + c] + 2) >> 2;
+    }
+    u[x] = rgb_to_u(sum[0], sum[1], sum[2]);
+    v[x] = rgb_to_v(sum[0], sum[1], sum[2]);
+  }
+}
+
+inline void sad_row_scalar(const uint8_t *a, const uint8_t *b, uint32_t x0,
+                           uint32_t width, uint32_t *sums) {
+  for (uint32_t x = x0; x < width; ++x) {
+    sums[x / SAD_BLOCK] += a[x] > b[x] ? a[x] - b[x] : b[x] - a[x];
+  }
+}
+
+inline void halve_rows_scalar(const uint8_t *row0, const uint8_t *row1,
+                              uint32_t x0, uint32_t width, uint8_t *out) {
+  for (uint32_t x = x0; x < width; ++x) {
+    out[x] = static_cast<uint8_t>(
+        (row0[2 * x] + row0[2 * x + 1] + row1[2 * x] + row1[2 * x + 1] + 2) >>
+        2);
+  }
+}
@@ -0,0 +1,131 @@
+#include "./convert_kernels.h"
+
+#include <arm_neon.h>
+
+// 32 pixels per iteration. vld4 splits YUYV into Y0, U, Y1 and V.
+template <int Y_OFFSET>
+static uint32_t packed422_rows_neon(const uint8_t *row0, const uint8_t *row1,
+                                    const uint8_t *, uint32_t width,
+                                    uint8_t *y0, uint8_t *y1, uint8_t *u,
+                                    uint8_t *v) {
+  constexpr int C_OFFSET = 1 - Y_OFFSET;
+
+  uint32_t x = 0;
+  for (; x + 32 <= width; x += 32) {
+    const auto p0 = vld4q_u8(row0 + 2 * x);
+    const auto p1 = vld4q_u8(row1 + 2 * x);
+
+    vst2q_u8(y0 + x, (uint8x16x2_t{{p0.val[Y_OFFSET], p0.val[Y_OFFSET + 2]}}));
+    vst2q_u8(y1 + x, (uint8x16x2_t{{p1.val[Y_OFFSET], p1.val[Y_OFFSET + 2]}}));
+    vst1q_u8(u + x / 2, vrhaddq_u8(p0.val[C_OFFSET], p1.val[C_OFFSET]));
+    vst1q_u8(v + x / 2, vrhaddq_u8(p0.val[C_OFFSET + 2], p1.val[C_OFFSET + 2]));
+  }
+  return x;
+}
+
+static uint32_t nv12_rows_neon(const uint8_t *row0, const uint8_t *row1,
+                               const uint8_t *chroma, uint32_t width,
+                               uint8_t *y0, uint8_t *y1, uint8_t *u,
+                               uint8_t *v) {
+  uint32_t x = 0;
+  for (; x + 32 <= width; x += 32) {
+    vst1q_u8(y0 + x, vld1q_u8(row0 + x));
+    vst1q_u8(y0 + x + 16, vld1q_u8(row0 + x + 16));
+    vst1q_u8(y1 + x, vld1q_u8(row1 + x));
+    vst1q_u8(y1 + x + 16, vld1q_u8(row1 + x + 16));
+
+    const auto uv = vld2q_u8(chroma + x);
+    vst1q_u8(u + x / 2, uv.val[0]);
+    vst1q_u8(v + x / 2, uv.val[1]);
+  }
+  return x;
+}
+
+static inline uint8x8_t rgb_to_y(uint8x8_t r, uint8x8_t g, uint8x8_t b) {
+  // Sum fits in unsigned 16 bits.
+  auto y = vmull_u8(r, vdup_n_u8(66));
+  y = vmlal_u8(y, g, vdup_n_u8(129));
+  y = vmlal_u8(y, b, vdup_n_u8(25));
+  return vadd_u8(vshrn_n_u16(vaddq_u16(y, vdupq_n_u16(128)), 8),
+                 vdup_n_u8(16));
+}
+
+static inline uint8x8_t rgb_to_chroma(int16x8_t r, int16x8_t g, int16x8_t b,
+                                      int16_t kr, int16_t kg, int16_t kb) {
+  // Partial sums stay within signed 16 bits for these coefficients.
+  auto c = vmulq_n_s16(r, kr);
+  c = vmlaq_n_s16(c, g, kg);
+  c = vmlaq_n_s16(c, b, kb);
+  c = vshrq_n_s16(vaddq_s16(c, vdupq_n_s16(128)), 8);
+  return vqmovun_s16(vaddq_s16(c, vdupq_n_s16(128)));
+}
+
+// Averages 2x2 blocks of a row pair of 16 pixels into 8 values.
+static inline int16x8_t average_2x2(uint8x16_t c0, uint8x16_t c1) {
+  return vreinterpretq_s16_u16(
+      vrshrq_n_u16(vaddq_u16(vpaddlq_u8(c0), vpaddlq_u8(c1)), 2));
+}
+
+// 16 pixels per iteration.
+static uint32_t rgb24_rows_neon(const uint8_t *row0, const uint8_t *row1,
+                                const uint8_t *, uint32_t width, uint8_t *y0,
+                                uint8_t *y1, uint8_t *u, uint8_t *v) {
+  uint32_t x = 0;
+  for (; x + 16 <= width; x += 16) {
+    const auto p0 = vld3q_u8(row0 + 3 * x);
+    const auto p1 = vld3q_u8(row1 + 3 * x);
+
+    vst1q_u8(y0 + x, vcombine_u8(rgb_to_y(vget_low_u8(p0.val[0]),
+                                          vget_low_u8(p0.val[1]),
+                                          vget_low_u8(p0.val[2])),
+                                 rgb_to_y(vget_high_u8(p0.val[0]),
+                                          vget_high_u8(p0.val[1]),
+                                          vget_high_u8(p0.val[2]))));
+    vst1q_u8(y1 + x, vcombine_u8(rgb_to_y(vget_low_u8(p1.val[0]),
+                                          vget_low_u8(p1.val[1]),
+                                          vget_low_u8(p1.val[2])),
+                                 rgb_to_y(vget_high_u8(p1.val[0]),
+                                          vget_high_u8(p1.val[1]),
+                                          vget_high_u8(p1.val[2]))));
+
+    const auto r = average_2x2(p0.val[0], p1.val[0]);
+    const auto g = average_2x2(p0.val[1], p1.val[1]);
+    const auto b = average_2x2(p0.val[2], p1.val[2]);
+    vst1_u8(u + x / 2, rgb_to_chroma(r, g, b, -38, -74, 112));
+    vst1_u8(v + x / 2, rgb_to_chroma(r, g, b, 112, -94, -18));
+  }
+  return x;
+}
+
+// 16 pixels per iteration. Pairwise adds widen, rounding shift narrows back.
+static uint32_t halve_rows_neon(const uint8_t *row0, const uint8_t *row1,
+                                uint32_t width, uint8_t *out) {
+  uint32_t x = 0;
+  for (; x + 16 <= width; x += 16) {
+    const auto lo =
+        vpadalq_u8(vpaddlq_u8(vld1q_u8(row0 + 2 * x)), vld1q_u8(row1 + 2 * x));
+    const auto hi = vpadalq_u8(vpaddlq_u8(vld1q_u8(row0 + 2 * x + 16)),
+                               vld1q_u8(row1 + 2 * x + 16));
+    vst1q_u8(out + x, vcombine_u8(vrshrn_n_u16(lo, 2), vrshrn_n_u16(hi, 2)));
+  }
+  return x;
+}
+
+// Absolute differences are widened by pairwise adds down to two halves.
+static uint32_t sad_row_neon(const uint8_t *a, const uint8_t *b,
+                             uint32_t width, uint32_t *sums) {
+  uint32_t x = 0;
+  for (; x + 16 <= width; x += 16) {
+    const auto sad = vpaddlq_u32(
+        vpaddlq_u16(vpaddlq_u8(vabdq_u8(vld1q_u8(a + x), vld1q_u8(b + x)))));
+    sums[x / SAD_BLOCK] +=
+        vgetq_lane_u64(sad, 0) + vgetq_lane_u64(sad, 1);
+  }
+  return x;
+}
+
+static const ConvertKernels NEON_KERNELS{
+    "neon", packed422_rows_neon<0>, packed422_rows_neon<1>, nv12_rows_neon,
+    rgb24_rows_neon, halve_rows_neon, sad_row_neon};
+
+const ConvertKernels *neon_convert_kernels() { return &NEON_KERNELS; }
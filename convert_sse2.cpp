@@ -0,0 +1,115 @@
+#include "./convert_kernels.h"
+
+#include <emmintrin.h>
+
+// 16 pixels per iteration.
+
+template <int Y_OFFSET>
+static uint32_t packed422_rows_sse2(const uint8_t *row0, const uint8_t *row1,
+                                    const uint8_t *, uint32_t width,
+                                    uint8_t *y0, uint8_t *y1, uint8_t *u,
+                                    uint8_t *v) {
+  const __m128i low = _mm_set1_epi16(0x00FF);
+  const auto luma = [&](__m128i a, __m128i b) {
+    return Y_OFFSET == 0
+               ? _mm_packus_epi16(_mm_and_si128(a, low), _mm_and_si128(b, low))
+               : _mm_packus_epi16(_mm_srli_epi16(a, 8), _mm_srli_epi16(b, 8));
+  };
+  const auto chroma = [&](__m128i a, __m128i b) {
+    return Y_OFFSET == 0
+               ? _mm_packus_epi16(_mm_srli_epi16(a, 8), _mm_srli_epi16(b, 8))
+               : _mm_packus_epi16(_mm_and_si128(a, low), _mm_and_si128(b, low));
+  };
+
+  uint32_t x = 0;
+  for (; x + 16 <= width; x += 16) {
+    const auto p0 = reinterpret_cast<const __m128i *>(row0 + 2 * x);
+    const auto p1 = reinterpret_cast<const __m128i *>(row1 + 2 * x);
+    const auto a0 = _mm_loadu_si128(p0), b0 = _mm_loadu_si128(p0 + 1);
+    const auto a1 = _mm_loadu_si128(p1), b1 = _mm_loadu_si128(p1 + 1);
+
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(y0 + x), luma(a0, b0));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(y1 + x), luma(a1, b1));
+
+    // U and V interleaved, averaged over both rows.
+    const auto uv = _mm_avg_epu8(chroma(a0, b0), chroma(a1, b1));
+    const auto zero = _mm_setzero_si128();
+    _mm_storel_epi64(reinterpret_cast<__m128i *>(u + x / 2),
+                     _mm_packus_epi16(_mm_and_si128(uv, low), zero));
+    _mm_storel_epi64(reinterpret_cast<__m128i *>(v + x / 2),
+                     _mm_packus_epi16(_mm_srli_epi16(uv, 8), zero));
+  }
+  return x;
+}
+
+static uint32_t nv12_rows_sse2(const uint8_t *row0, const uint8_t *row1,
+                               const uint8_t *chroma, uint32_t width,
+                               uint8_t *y0, uint8_t *y1, uint8_t *u,
+                               uint8_t *v) {
+  const __m128i low = _mm_set1_epi16(0x00FF);
+  const auto zero = _mm_setzero_si128();
+
+  uint32_t x = 0;
+  for (; x + 16 <= width; x += 16) {
+    _mm_storeu_si128(
+        reinterpret_cast<__m128i *>(y0 + x),
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(row0 + x)));
+    _mm_storeu_si128(
+        reinterpret_cast<__m128i *>(y1 + x),
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(row1 + x)));
+
+    const auto uv =
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(chroma + x));
+    _mm_storel_epi64(reinterpret_cast<__m128i *>(u + x / 2),
+                     _mm_packus_epi16(_mm_and_si128(uv, low), zero));
+    _mm_storel_epi64(reinterpret_cast<__m128i *>(v + x / 2),
+                     _mm_packus_epi16(_mm_srli_epi16(uv, 8), zero));
+  }
+  return x;
+}
+
+// Pairs are summed in 16 bit lanes, 32 pixels of both rows make 16.
+static uint32_t halve_rows_sse2(const uint8_t *row0, const uint8_t *row1,
+                                uint32_t width, uint8_t *out) {
+  const __m128i low = _mm_set1_epi16(0x00FF);
+  const __m128i two = _mm_set1_epi16(2);
+  const auto block = [&](__m128i a, __m128i b) {
+    const auto sum = _mm_add_epi16(
+        _mm_add_epi16(_mm_and_si128(a, low), _mm_srli_epi16(a, 8)),
+        _mm_add_epi16(_mm_and_si128(b, low), _mm_srli_epi16(b, 8)));
+    return _mm_srli_epi16(_mm_add_epi16(sum, two), 2);
+  };
+
+  uint32_t x = 0;
+  for (; x + 16 <= width; x += 16) {
+    const auto p0 = reinterpret_cast<const __m128i *>(row0 + 2 * x);
+    const auto p1 = reinterpret_cast<const __m128i *>(row1 + 2 * x);
+    const auto lo = block(_mm_loadu_si128(p0), _mm_loadu_si128(p1));
+    const auto hi = block(_mm_loadu_si128(p0 + 1), _mm_loadu_si128(p1 + 1));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(out + x),
+                     _mm_packus_epi16(lo, hi));
+  }
+  return x;
+}
+
+// psadbw sums each 8 byte half, the two make a block.
+static uint32_t sad_row_sse2(const uint8_t *a, const uint8_t *b,
+                             uint32_t width, uint32_t *sums) {
+  uint32_t x = 0;
+  for (; x + 16 <= width; x += 16) {
+    const auto sad = _mm_sad_epu8(
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(a + x)),
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(b + x)));
+    sums[x / SAD_BLOCK] += _mm_cvtsi128_si32(sad) +
+                           _mm_cvtsi128_si32(_mm_srli_si128(sad, 8));
+  }
+  return x;
+}
+
+// SSE2 has no byte shuffle to deinterleave RGB24 cheaply, so it's left to
+// scalar here and to AVX2 on CPUs which have it.
+static const ConvertKernels SSE2_KERNELS{
+    "sse2", packed422_rows_sse2<0>, packed422_rows_sse2<1>, nv12_rows_sse2,
+    nullptr, halve_rows_sse2, sad_row_sse2};
+
+const ConvertKernels *sse2_convert_kernels() { return &SSE2_KERNELS; }
@@ -0,0 +1,123 @@
+#include "./dmabuf.h"
+
+#include <algorithm>
+#include <stdio.h>
+
+#include "./camera.h"
+#include "./convert.h"
+#include "./metrics.h"
+#include "./sink.h"
+#include "./size_budget.h"
+
+DmabufHandoff::DmabufHandoff(BufferExporter &camera,
+                             DmabufImporter &importer, bool enabled,
+                             unsigned int first_index)
+    : camera(camera), importer(importer), enabled(enabled),
+      first_index(first_index), reserved(camera.count()),
+      generation(camera.generation()) {
+  import_buffers();
+  if (enabled) {
+    fprintf(stderr, "Imported %zu of %zu buffers by dmabuf\n",
+            imported_count(), imported.size());
+  }
+}
+
+void DmabufHandoff::import_buffers(void) {
+  imported.assign(camera.count(), false);
+  if (!enabled) {
+    return;
+  }
+
+  // Indices past the reserved ones belong to other cameras.
+  const auto count = std::min<size_t>(camera.count(), reserved);
+  for (unsigned int i = 0; i < count; ++i) {
+    const auto fd = camera.export_buffer(i);
+    if (fd == -1) {
+      break;
+    }
+    imported[i] =
+        importer.import_buffer(first_index + i, fd, camera.buffer_length(i));
+  }
+}
+
+template <typename Encode>
+void DmabufHandoff::encode_budgeted(Encode &&encode, EncodedSink &sink) {
+  if (budget) {
+    budget->encode(encode, sink);
+  } else {
+    encode(sink);
+  }
+}
+
+void DmabufHandoff::encode(const FrameView &frame, EncodedSink &sink) {
+  metrics().encoded_frames.fetch_add(1, std::memory_order_relaxed);
+  importer.set_timestamp(frame.timestamp());
+
+  if (converter) {
+    ByteView converted;
+    {
+      StageTimer timer{Stage::CONVERT};
+      converted = converter->convert(frame.data(), frame.length());
+    }
+    StageTimer timer{Stage::ENCODE};
+    encode_budgeted(
+        [&](EncodedSink &out) {
+          importer.encode(converted.data(), converted.size(), out);
+        },
+        sink);
+    return;
+  }
+
+  if (camera.generation() != generation) {
+    generation = camera.generation();
+    import_buffers();
+  }
+
+  StageTimer timer{Stage::ENCODE};
+  const auto index = frame.index();
+  if (index.has_value() && index.value() < imported.size() &&
+      imported[index.value()]) {
+    encode_budgeted(
+        [&](EncodedSink &out) {
+          importer.encode_imported(first_index + index.value(),
+                                   frame.length(), out);
+        },
+        sink);
+    return;
+  }
+
+  encode_budgeted(
+      [&](EncodedSink &out) {
+        importer.encode(frame.data(), frame.length(), out);
+      },
+      sink);
+}
+
+void DmabufHandoff::encode(const uint8_t *input, size_t length,
+                           EncodedSink &sink,
+                           std::chrono::microseconds timestamp) {
+  metrics().encoded_frames.fetch_add(1, std::memory_order_relaxed);
+  importer.set_timestamp(timestamp);
+  StageTimer timer{Stage::ENCODE};
+  encode_budgeted(
+      [&](EncodedSink &out) { importer.encode(input, length, out); }, sink);
+}
+
+std::vector<uint8_t> DmabufHandoff::encode(const FrameView &frame) {
+  std::vector<uint8_t> out;
+  VectorSink sink{out};
+  encode(frame, sink);
+  return out;
+}
+
+void DmabufHandoff::set_converter(Converter *converter) {
+  this->converter = converter;
+}
+
+void DmabufHandoff::set_budget(SizeBudget *budget) {
+  this->budget = budget;
+}
+
+size_t DmabufHandoff::imported_count() const {
+  return std::count(imported.begin(), imported.end(), true);
+}
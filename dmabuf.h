@@ -0,0 +1,80 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+class BufferExporter;
+class Converter;
+class EncodedSink;
+class FrameView;
+class SizeBudget;
+
+// Consumer which can take V4L2 buffers through exported dmabuf fds instead of
+// copying frames out of them.
+class DmabufImporter {
+public:
+  virtual ~DmabufImporter() = default;
+
+  // Returns false when buffer can't be imported. fd stays owned by the
+  // caller and is valid while the camera is alive.
+  virtual bool import_buffer(unsigned int index, int fd, size_t length) = 0;
+  // Encode imported buffer which holds a frame of length bytes.
+  virtual void encode_imported(unsigned int index, uint32_t length,
+                               EncodedSink &sink) = 0;
+  // Encode by copying frame. Used when buffer isn't imported.
+  virtual void encode(const uint8_t *input, uint32_t length,
+                      EncodedSink &sink) = 0;
+  // Capture time of the frame encoded next, in CLOCK_MONOTONIC. Video
+  // encoders take it as presentation time, image encoders ignore it.
+  virtual void set_timestamp(std::chrono::microseconds) {}
+};
+
+// Hands frames of camera, or of other exporter of their buffers, over to
+// importer without copying when buffers could be exported and imported,
+// copying them otherwise.
+class DmabufHandoff {
+public:
+  // Always copy when enabled is false. Buffers are imported from first_index
+  // on, so cameras sharing one importer don't overlap.
+  DmabufHandoff(BufferExporter &camera, DmabufImporter &importer,
+                bool enabled = true, unsigned int first_index = 0);
+
+  // Buffers of a camera which reconnected are imported again first.
+  void encode(const FrameView &frame, EncodedSink &sink);
+  // Encode frame which isn't in a camera buffer, by copying. timestamp is
+  // the one of the camera frame it came from.
+  void encode(const uint8_t *input, size_t length, EncodedSink &sink,
+              std::chrono::microseconds timestamp = {});
+
+  // Collect output into a vector, for callers which keep frames around.
+  std::vector<uint8_t> encode(const FrameView &frame);
+
+  // Convert frames before encoding, so they are copied instead of imported.
+  void set_converter(Converter *converter);
+  // Encode frames again at lower quality until they fit budget, which uses
+  // the same encoder as importer. nullptr leaves quality alone.
+  void set_budget(SizeBudget *budget);
+
+  size_t imported_count() const;
+
+protected:
+  void import_buffers(void);
+  // Call encode once, or as many times as budget needs. Defined and used in
+  // dmabuf.cpp only.
+  template <typename Encode>
+  void encode_budgeted(Encode &&encode, EncodedSink &sink);
+
+  BufferExporter &camera;
+  DmabufImporter &importer;
+  const bool enabled;
+  const unsigned int first_index;
+  // Import indices past first_index reserved for camera.
+  const size_t reserved;
+  // Camera generation buffers were imported from.
+  unsigned int generation;
+  std::vector<bool> imported;
+  Converter *converter = nullptr;
+  SizeBudget *budget = nullptr;
+};
@@ -1,22 +1,130 @@
 #pragma once
 
-#include <atomic>
 #include <cstdint>
+#include <map>
 #include <memory>
+#include <stdexcept>
+#include <string>
+#include <tuple>
 #include <vector>
 
-struct EncoderContext;
+#include "./dmabuf.h"
+#include "./frame_error.h"
 
-class Encoder {
+enum class EncoderBackend {
+  AUTO,
+  MMAL,
+  SOFTWARE,
+  // Selected for compressed inputs regardless of requested backend.
+  PASSTHROUGH,
+};
+
+EncoderBackend encoder_backend_from_name(const std::string &name);
+const char *encoder_backend_name(EncoderBackend backend);
+
+enum class H264Profile {
+  BASELINE,
+  MAIN,
+  HIGH,
+};
+
+H264Profile h264_profile_from_name(const std::string &name);
+const char *h264_profile_name(H264Profile profile);
+
+// How video is encoded.
+struct VideoSettings {
+  // Bits per second.
+  uint32_t bitrate = 4000000;
+  // Frames from one keyframe to the next.
+  uint32_t gop = 30;
+  H264Profile profile = H264Profile::HIGH;
+  // Frame rate bitrate is budgeted for, the one of the camera.
+  double fps = 30;
+};
+
+// Failure to encode a frame. Encoder stays usable for the next one.
+class EncoderError : public FrameError {
 public:
-  static void Init();
-  Encoder(uint32_t input_four_cc, uint32_t input_width, uint32_t input_height,
-          uint32_t output_four_cc);
-  ~Encoder();
+  using FrameError::FrameError;
+};
 
-  std::vector<uint8_t> encode(const uint8_t *input, uint32_t length);
+// Raw camera formats every backend takes without conversion, best first.
+const std::vector<uint32_t> &encoder_native_formats();
+
+class Encoder : public DmabufImporter {
+public:
+  // AUTO picks MMAL when it is built in and VideoCore is usable, software
+  // otherwise. Compressed inputs are always passed through. input_stride is
+  // bytesperline of raw input, tightly packed rows when 0.
+  static std::unique_ptr<Encoder> create(EncoderBackend backend,
+                                         uint32_t input_four_cc,
+                                         uint32_t input_width,
+                                         uint32_t input_height,
+                                         uint32_t output_four_cc,
+                                         uint32_t input_stride = 0);
+  // H.264 encoder, which only MMAL has. Every encode() takes one frame and
+  // gives out its access unit in Annex B format, with SPS and PPS in front of
+  // keyframes. Presentation time comes from set_timestamp().
+  static std::unique_ptr<Encoder> create_video(EncoderBackend backend,
+                                               uint32_t input_four_cc,
+                                               uint32_t input_width,
+                                               uint32_t input_height,
+                                               const VideoSettings &settings,
+                                               uint32_t input_stride = 0);
+  virtual ~Encoder() = default;
+
+  virtual EncoderBackend backend() const = 0;
+
+  // JPEG quality from 1 to 100 for frames encoded next, instead of the
+  // default of the backend. Other encodings ignore it, and so does
+  // passthrough.
+  virtual void set_quality(int) {}
+  // Put a JPEG restart marker every interval MCUs, so decoders can decode
+  // parts of the image in parallel. 0 leaves them out.
+  virtual void set_restart_interval(uint32_t) {}
+
+  // Encoders can't import buffers unless they override these.
+  bool import_buffer(unsigned int index, int fd, size_t length) override;
+  void encode_imported(unsigned int index, uint32_t length,
+                       EncodedSink &sink) override;
+};
+
+// Encoders shared by several cameras, one for each input format and output
+// encoding. Cameras capturing the same format use one warm encoder instead
+// of each holding its own VideoCore component.
+class EncoderPool {
+public:
+  struct Lease {
+    Encoder &encoder;
+    // First import index reserved for buffers of the caller.
+    unsigned int first_import;
+  };
+
+  explicit EncoderPool(EncoderBackend backend) : backend(backend) {}
+
+  // Encoder for the format, created on first use. Reserves import_count
+  // import indices in it. Unshared encoders are created for every call, for
+  // callers encoding from several threads.
+  Lease acquire(uint32_t input_four_cc, uint32_t input_width,
+                uint32_t input_height, uint32_t output_four_cc,
+                unsigned int import_count, bool shared = true,
+                uint32_t input_stride = 0);
+
+  size_t size() const {
+    return entries.size();
+  }
 
 protected:
-  static std::atomic<bool> initialized;
-  std::unique_ptr<EncoderContext> context;
+  // Input format, size, stride and output format. Last member is 0 for
+  // shared encoders, unique for unshared ones.
+  using Key =
+      std::tuple<uint32_t, uint32_t, uint32_t, uint32_t, uint32_t, size_t>;
+  struct Entry {
+    std::unique_ptr<Encoder> encoder;
+    unsigned int next_import = 0;
+  };
+
+  const EncoderBackend backend;
+  std::map<Key, Entry> entries;
+  size_t unshared_count = 0;
 };
@@ -0,0 +1,832 @@
+#include "./encoder_mmal.h"
+
+#include <exception>
+#include <string>
+#include <vector>
+
+#include <bcm_host.h>
+#include <interface/mmal/mmal.h>
+#include <interface/mmal/mmal_queue.h>
+#include <interface/mmal/util/mmal_connection.h>
+#include <interface/mmal/util/mmal_default_components.h>
+#include <interface/mmal/util/mmal_util.h>
+#include <interface/mmal/util/mmal_util_params.h>
+#include <interface/vcos/vcos.h>
+#include <user-vcsm.h>
+
+#include "./metrics.h"
+#include "./sink.h"
+
+struct ImportedBuffer {
+  unsigned int vcsm_handle = 0;
+  uint32_t vc_handle = 0;
+  size_t length = 0;
+};
+
+struct EncoderContext {
+  MMAL_COMPONENT_T *component = nullptr;
+  MMAL_POOL_T *pool_in = nullptr, *pool_out = nullptr;
+  // Payload-less headers pointing to imported dmabufs.
+  MMAL_POOL_T *pool_import = nullptr;
+  std::vector<ImportedBuffer> imported;
+  bool input_zero_copy = false;
+  MMAL_QUEUE_T *queue = nullptr;
+  VCOS_SEMAPHORE_T semaphore;
+  MMAL_STATUS_T mmal_status = MMAL_SUCCESS;
+};
+
+std::atomic<bool> MmalEncoder::initialized = false;
+static std::atomic<bool> vcsm_initialized = false;
+
+constexpr uint32_t MAX_BUFFERS = 2;
+
+static void log_format(MMAL_ES_FORMAT_T *format, MMAL_PORT_T *port) {
+  const char *name_type;
+
+  if (port)
+    fprintf(stderr, "%s:%s:%i", port->component->name,
+            port->type == MMAL_PORT_TYPE_CONTROL
+                ? "ctr"
+                : port->type == MMAL_PORT_TYPE_INPUT
+                      ? "in"
+                      : port->type == MMAL_PORT_TYPE_OUTPUT ? "out" : "invalid",
+            (int)port->index);
+
+  switch (format->type) {
+  case MMAL_ES_TYPE_AUDIO:
+    name_type = "audio";
+    break;
+  case MMAL_ES_TYPE_VIDEO:
+    name_type = "video";
+    break;
+  case MMAL_ES_TYPE_SUBPICTURE:
+    name_type = "subpicture";
+    break;
+  default:
+    name_type = "unknown";
+    break;
+  }
+
+  fprintf(stderr, "type: %s, fourcc: %4.4s\n", name_type,
+          (char *)&format->encoding);
+  fprintf(stderr, " bitrate: %i, framed: %i\n", format->bitrate,
+          !!(format->flags & MMAL_ES_FORMAT_FLAG_FRAMED));
+  fprintf(stderr, " extra data: %i, %p\n", format->extradata_size,
+          format->extradata);
+  switch (format->type) {
+  case MMAL_ES_TYPE_AUDIO:
+    fprintf(stderr, " samplerate: %i, channels: %i, bps: %i, block align: %i\n",
+            format->es->audio.sample_rate, format->es->audio.channels,
+            format->es->audio.bits_per_sample, format->es->audio.block_align);
+    break;
+
+  case MMAL_ES_TYPE_VIDEO:
+    fprintf(stderr, " width: %i, height: %i, (%i,%i,%i,%i)\n",
+            format->es->video.width, format->es->video.height,
+            format->es->video.crop.x, format->es->video.crop.y,
+            format->es->video.crop.width, format->es->video.crop.height);
+    fprintf(stderr, " pixel aspect ratio: %i/%i, frame rate: %i/%i\n",
+            format->es->video.par.num, format->es->video.par.den,
+            format->es->video.frame_rate.num, format->es->video.frame_rate.den);
+    break;
+
+  case MMAL_ES_TYPE_SUBPICTURE:
+    break;
+
+  default:
+    break;
+  }
+
+  if (!port)
+    return;
+
+  fprintf(stderr,
+          " buffers num: %i(opt %i, min %i), size: %i(opt %i, min: %i), align: "
+          "%i\n",
+          port->buffer_num, port->buffer_num_recommended, port->buffer_num_min,
+          port->buffer_size, port->buffer_size_recommended,
+          port->buffer_size_min, port->buffer_alignment_min);
+}
+
+static void control_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer) {
+  auto &ctx = *reinterpret_cast<EncoderContext *>(port->userdata);
+
+  switch (buffer->cmd) {
+  case MMAL_EVENT_EOS:
+    /* Only sink component generate EOS events */
+    break;
+  case MMAL_EVENT_ERROR:
+    /* Something went wrong. Signal this to the application */
+    ctx.mmal_status = *reinterpret_cast<MMAL_STATUS_T *>(buffer->data);
+    break;
+  default:
+    break;
+  }
+
+  /* Done with the event, recycle it */
+  mmal_buffer_header_release(buffer);
+
+  /* Kick the processing thread */
+  vcos_semaphore_post(&ctx.semaphore);
+}
+
+static void input_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer) {
+  auto &ctx = *reinterpret_cast<EncoderContext *>(port->userdata);
+
+  /* The component is done with the data, just recycle the buffer header into
+   * its pool */
+  mmal_buffer_header_release(buffer);
+
+  /* Kick the processing thread */
+  vcos_semaphore_post(&ctx.semaphore);
+}
+
+static void output_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer) {
+  auto &ctx = *reinterpret_cast<EncoderContext *>(port->userdata);
+
+  /* Queue the decoded video frame */
+  mmal_queue_put(ctx.queue, buffer);
+
+  /* Kick the processing thread */
+  vcos_semaphore_post(&ctx.semaphore);
+}
+
+// Bytes of a pixel in a row of input, of luma for planar encodings.
+static uint32_t bytes_per_pixel(uint32_t encoding) {
+  switch (encoding) {
+  case MMAL_ENCODING_YUYV:
+  case MMAL_ENCODING_UYVY:
+    return 2;
+  case MMAL_ENCODING_RGB24:
+  case MMAL_ENCODING_BGR24:
+    return 3;
+  default:
+    return 1;
+  }
+}
+
+static void release_header(void *header) {
+  mmal_buffer_header_release(static_cast<MMAL_BUFFER_HEADER_T *>(header));
+}
+
+inline void check_status(int32_t status, const char *call) {
+  if (status != MMAL_SUCCESS) {
+    throw EncoderError(
+        std::string(call) + " failed: " +
+        mmal_status_to_string(static_cast<MMAL_STATUS_T>(status)));
+  }
+}
+
+void MmalEncoder::Init() {
+  if (initialized.load()) {
+    return;
+  }
+
+  bcm_host_init();
+
+  initialized.store(true);
+}
+
+MmalEncoder::MmalEncoder(const char *component_name) {
+  MmalEncoder::Init();
+
+  context.reset(new EncoderContext());
+
+  vcos_semaphore_create(&context->semaphore, "encoder", 1);
+
+  auto &component = context->component;
+
+  check_status(mmal_component_create(component_name, &component),
+               "mmal_component_create");
+
+  component->control->userdata =
+      reinterpret_cast<MMAL_PORT_USERDATA_T *>(context.get());
+  check_status(mmal_port_enable(component->control, control_callback),
+               "mmal_port_enable");
+}
+
+MmalEncoder::MmalEncoder(uint32_t input_four_cc, uint32_t input_width,
+                         uint32_t input_height, uint32_t output_four_cc,
+                         uint32_t input_stride)
+    : MmalEncoder(MMAL_COMPONENT_DEFAULT_IMAGE_ENCODER) {
+  auto &component = context->component;
+
+  check_status(mmal_port_parameter_set_boolean(
+                   component->output[0], MMAL_PARAMETER_ZERO_COPY, MMAL_TRUE),
+               "mmal_port_parameter_set_boolean");
+  // Input buffers are copied into when zero copy is not available, so it's
+  // not an error.
+  context->input_zero_copy =
+      mmal_port_parameter_set_boolean(component->input[0],
+                                      MMAL_PARAMETER_ZERO_COPY,
+                                      MMAL_TRUE) == MMAL_SUCCESS;
+
+  auto &format_in = *component->input[0]->format;
+  format_in.type = MMAL_ES_TYPE_VIDEO;
+  format_in.encoding = input_four_cc;
+  // Width of the port is that of whole rows, the picture is cropped out.
+  const auto row_width =
+      input_stride == 0 ? input_width
+                        : input_stride / bytes_per_pixel(input_four_cc);
+  if (row_width < input_width) {
+    throw std::invalid_argument("Stride is shorter than a row");
+  }
+  format_in.es->video.width = row_width;
+  format_in.es->video.height = input_height;
+  format_in.es->video.frame_rate.num = 0;
+  format_in.es->video.frame_rate.den = 1;
+  format_in.es->video.par.num = 1;
+  format_in.es->video.par.den = 1;
+  format_in.es->video.crop.x = format_in.es->video.crop.y = 0;
+  if (row_width == input_width) {
+    format_in.es->video.crop.width = format_in.es->video.crop.height = 0;
+  } else {
+    format_in.es->video.crop.width = input_width;
+    format_in.es->video.crop.height = input_height;
+  }
+
+  check_status(mmal_port_format_commit(component->input[0]),
+               "mmal_port_format_commit");
+
+  fprintf(stderr, "%s\n", component->input[0]->name);
+  fprintf(stderr, " type: %i, fourcc: %4.4s\n", format_in.type,
+          (char *)&format_in.encoding);
+  fprintf(stderr, " bitrate: %i, framed: %i\n", format_in.bitrate,
+          !!(format_in.flags & MMAL_ES_FORMAT_FLAG_FRAMED));
+  fprintf(stderr, " extra data: %i, %p\n", format_in.extradata_size,
+          format_in.extradata);
+  fprintf(stderr, " width: %i, height: %i, (%i,%i,%i,%i)\n",
+          format_in.es->video.width, format_in.es->video.height,
+          format_in.es->video.crop.x, format_in.es->video.crop.y,
+          format_in.es->video.crop.width, format_in.es->video.crop.height);
+
+  auto &format_out = *component->output[0]->format;
+  format_out.encoding = output_four_cc;
+
+  check_status(mmal_port_format_commit(component->output[0]),
+               "mmal_port_format_commit");
+
+  fprintf(stderr, "%s\n", component->output[0]->name);
+  fprintf(stderr, " type: %i, fourcc: %4.4s\n", format_out.type,
+          (char *)&format_out.encoding);
+  fprintf(stderr, " bitrate: %i, framed: %i\n", format_out.bitrate,
+          !!(format_out.flags & MMAL_ES_FORMAT_FLAG_FRAMED));
+  fprintf(stderr, " extra data: %i, %p\n", format_out.extradata_size,
+          format_out.extradata);
+  fprintf(stderr, " width: %i, height: %i, (%i,%i,%i,%i)\n",
+          format_out.es->video.width, format_out.es->video.height,
+          format_out.es->video.crop.x, format_out.es->video.crop.y,
+          format_out.es->video.crop.width, format_out.es->video.crop.height);
+
+  start();
+}
+
+void MmalEncoder::set_quality(int quality) {
+  auto *output = context->component->output[0];
+  if (output->format->encoding != MMAL_ENCODING_JPEG) {
+    return;
+  }
+  check_status(mmal_port_parameter_set_uint32(
+                   output, MMAL_PARAMETER_JPEG_Q_FACTOR, quality),
+               "mmal_port_parameter_set_uint32");
+}
+
+void MmalEncoder::set_restart_interval(uint32_t interval) {
+  auto *output = context->component->output[0];
+  if (output->format->encoding != MMAL_ENCODING_JPEG) {
+    return;
+  }
+  check_status(mmal_port_parameter_set_uint32(
+                   output, MMAL_PARAMETER_JPEG_RESTART_INTERVAL, interval),
+               "mmal_port_parameter_set_uint32");
+}
+
+void MmalEncoder::start(void) {
+  auto &component = context->component;
+
+  component->input[0]->buffer_num = component->input[0]->buffer_num_recommended;
+  component->input[0]->buffer_size =
+      component->input[0]->buffer_size_recommended;
+  component->output[0]->buffer_num =
+      component->output[0]->buffer_num_recommended;
+  component->output[0]->buffer_size =
+      component->output[0]->buffer_size_recommended;
+  context->pool_in = mmal_port_pool_create(component->input[0],
+                                           component->input[0]->buffer_num,
+                                           component->input[0]->buffer_size);
+
+  context->queue = mmal_queue_create();
+
+  component->input[0]->userdata =
+      reinterpret_cast<MMAL_PORT_USERDATA_T *>(context.get());
+  component->output[0]->userdata =
+      reinterpret_cast<MMAL_PORT_USERDATA_T *>(context.get());
+
+  check_status(mmal_port_enable(component->input[0], input_callback),
+               "mmal_port_enable");
+  check_status(mmal_port_enable(component->output[0], output_callback),
+               "mmal_port_enable");
+
+  context->pool_out = mmal_port_pool_create(component->output[0],
+                                            component->output[0]->buffer_num,
+                                            component->output[0]->buffer_size);
+
+  MMAL_BUFFER_HEADER_T *buffer = nullptr;
+  while ((buffer = mmal_queue_get(context->pool_out->queue)) != nullptr) {
+    // printf("Sending buf %p\n", buffer);
+    check_status(mmal_port_send_buffer(component->output[0], buffer),
+                 "mmal_port_send_buffer");
+  }
+
+  mmal_component_enable(component);
+}
+
+void MmalEncoder::encode(const uint8_t *input, uint32_t length,
+                         EncodedSink &sink) {
+  process(input, length, -1, sink);
+}
+
+bool MmalEncoder::import_buffer(unsigned int index, int fd, size_t length) {
+  if (!context->input_zero_copy) {
+    return false;
+  }
+
+  if (!vcsm_initialized.load()) {
+    if (vcsm_init_ex(1, -1) != 0) {
+      fprintf(stderr, "vcsm_init_ex failed\n");
+      return false;
+    }
+    vcsm_initialized.store(true);
+  }
+
+  auto &component = context->component;
+  if (context->pool_import == nullptr) {
+    context->pool_import =
+        mmal_port_pool_create(component->input[0],
+                              component->input[0]->buffer_num, 0);
+    if (context->pool_import == nullptr) {
+      return false;
+    }
+  }
+
+  ImportedBuffer imported;
+  imported.vcsm_handle = vcsm_import_dmabuf(fd, "v4l2-mmal-cap");
+  if (imported.vcsm_handle == 0) {
+    fprintf(stderr, "vcsm_import_dmabuf failed for buffer %u\n", index);
+    return false;
+  }
+  imported.vc_handle = vcsm_vc_hdl_from_hdl(imported.vcsm_handle);
+  imported.length = length;
+
+  if (context->imported.size() <= index) {
+    context->imported.resize(index + 1);
+  }
+  // Buffers of a reconnected camera are imported over the old ones.
+  if (context->imported[index].vcsm_handle != 0) {
+    vcsm_free(context->imported[index].vcsm_handle);
+  }
+  context->imported[index] = imported;
+
+  return true;
+}
+
+void MmalEncoder::encode_imported(unsigned int index, uint32_t length,
+                                  EncodedSink &sink) {
+  process(nullptr, length, index, sink);
+}
+
+void MmalEncoder::process(const uint8_t *input, uint32_t length,
+                          const int imported_index, EncodedSink &sink) {
+  bool in_eos = false;
+  bool out_eos = false;
+  auto &component = context->component;
+  auto &pool_out = context->pool_out;
+  auto &pool_in = context->pool_in;
+
+  while (!out_eos) {
+    MMAL_BUFFER_HEADER_T *buffer = nullptr;
+
+    VCOS_STATUS_T vcos_status;
+    {
+      StageTimer timer{Stage::ENCODER_WAIT};
+      vcos_status = vcos_semaphore_wait_timeout(&context->semaphore, 2000);
+    }
+    if (vcos_status != VCOS_SUCCESS) {
+      abandon_frame(sink, "Image encoder timed out");
+    }
+    if (context->mmal_status != MMAL_SUCCESS) {
+      const auto status = context->mmal_status;
+      context->mmal_status = MMAL_SUCCESS;
+      abandon_frame(sink, std::string("image_encode failed: ") +
+                              mmal_status_to_string(status));
+    }
+
+    if (imported_index >= 0 && !in_eos &&
+        (buffer = mmal_queue_get(context->pool_import->queue)) != nullptr) {
+      // Whole frame is handed over by one header, so it's also the last one.
+      const auto &imported = context->imported[imported_index];
+      buffer->data = reinterpret_cast<uint8_t *>(
+          static_cast<uintptr_t>(imported.vc_handle));
+      buffer->alloc_size = imported.length;
+      buffer->length = length;
+      buffer->offset = 0;
+      buffer->flags =
+          MMAL_BUFFER_HEADER_FLAG_FRAME_END | MMAL_BUFFER_HEADER_FLAG_EOS;
+      buffer->pts = buffer->dts = MMAL_TIME_UNKNOWN;
+      in_eos = true;
+      check_status(mmal_port_send_buffer(component->input[0], buffer),
+                   "mmal_port_send_buffer");
+    }
+
+    while (imported_index < 0 && !in_eos &&
+           (buffer = mmal_queue_get(pool_in->queue)) != nullptr) {
+      const auto copy_len = std::min(buffer->alloc_size - 128, length);
+      if (copy_len > 0) {
+        {
+          StageTimer timer{Stage::COPY_IN};
+          memcpy(buffer->data, input, copy_len);
+        }
+        buffer->offset = 0;
+        length -= copy_len;
+        buffer->flags = 0;
+        input += copy_len;
+      } else {
+        buffer->flags = MMAL_BUFFER_HEADER_FLAG_EOS;
+        in_eos = true;
+      }
+      buffer->length = copy_len;
+
+      buffer->pts = buffer->dts = MMAL_TIME_UNKNOWN;
+      check_status(mmal_port_send_buffer(component->input[0], buffer),
+                   "mmal_port_send_buffer");
+    }
+
+    while ((buffer = mmal_queue_get(context->queue)) != nullptr) {
+      out_eos = (buffer->flags & MMAL_BUFFER_HEADER_FLAG_EOS) != 0;
+
+      if (buffer->cmd != 0) {
+        fprintf(stderr, "received event length %d, %4.4s\n", buffer->length,
+                (char *)&buffer->cmd);
+        if (buffer->cmd == MMAL_EVENT_FORMAT_CHANGED) {
+          auto *event = mmal_event_format_changed_get(buffer);
+          if (event) {
+            fprintf(stderr, "----------Port format changed----------\n");
+            log_format(component->output[0]->format, component->output[0]);
+            fprintf(stderr, "-----------------to---------------------\n");
+            log_format(event->format, 0);
+            fprintf(stderr,
+                    " buffers num (opt %i, min %i), size (opt %i, min: %i)\n",
+                    event->buffer_num_recommended, event->buffer_num_min,
+                    event->buffer_size_recommended, event->buffer_size_min);
+            fprintf(stderr, "----------------------------------------\n");
+          }
+          mmal_buffer_header_release(buffer);
+          // Headers held by sink are waited for below.
+          sink.flush();
+          mmal_port_disable(component->output[0]);
+
+          // Clear out the queue and release the buffers.
+          while (mmal_queue_length(pool_out->queue) < pool_out->headers_num) {
+            buffer = mmal_queue_wait(context->queue);
+            mmal_buffer_header_release(buffer);
+            fprintf(stderr, "Retrieved buffer %p\n", buffer);
+          }
+
+          // Assume we can't reuse the output buffers, so have to disable,
+          // destroy pool, create new pool, enable port, feed in buffers.
+          mmal_port_pool_destroy(component->output[0], pool_out);
+
+          check_status(mmal_format_full_copy(component->output[0]->format,
+                                             event->format),
+                       "mmal_format_full_copy");
+          component->output[0]->format->encoding = MMAL_ENCODING_I420;
+          component->output[0]->buffer_num = MAX_BUFFERS;
+          component->output[0]->buffer_size =
+              component->output[0]->buffer_size_recommended;
+
+          check_status(mmal_port_format_commit(component->output[0]),
+                       "mmal_port_format_commit");
+
+          mmal_port_enable(component->output[0], output_callback);
+          pool_out = mmal_port_pool_create(component->output[0],
+                                           component->output[0]->buffer_num,
+                                           component->output[0]->buffer_size);
+        } else {
+          mmal_buffer_header_release(buffer);
+        }
+        continue;
+      } else if (buffer->length == 0) {
+        mmal_buffer_header_release(buffer);
+      } else {
+        // Header goes back to pool when sink drops the view.
+        sink.consume(EncodedView(buffer->data + buffer->offset,
+                                 buffer->length, release_header, buffer));
+      }
+    }
+
+    // Every header is either at the port or held by sink, get them back.
+    if (out_eos || mmal_queue_length(pool_out->queue) == 0) {
+      sink.flush();
+    }
+
+    while ((buffer = mmal_queue_get(pool_out->queue)) != NULL) {
+      check_status(mmal_port_send_buffer(component->output[0], buffer),
+                   "mmal_port_send_buffer");
+    }
+  }
+
+  sink.flush();
+}
+
+void MmalEncoder::abandon_frame(EncodedSink &sink,
+                                const std::string &message) {
+  auto &component = context->component;
+  sink.flush();
+  mmal_port_flush(component->input[0]);
+  mmal_port_flush(component->output[0]);
+  // Output of the failed frame, which the next one must not take as its own.
+  // Headers are sent to the port again by the next process().
+  MMAL_BUFFER_HEADER_T *buffer;
+  while ((buffer = mmal_queue_get(context->queue)) != nullptr) {
+    mmal_buffer_header_release(buffer);
+  }
+  throw EncoderError(message);
+}
+
+MmalEncoder::~MmalEncoder() {
+  auto &component = context->component;
+  mmal_port_disable(component->input[0]);
+  mmal_port_disable(component->output[0]);
+  mmal_component_disable(component);
+
+  if (context->pool_import != nullptr) {
+    mmal_port_pool_destroy(component->input[0], context->pool_import);
+  }
+  for (const auto &imported : context->imported) {
+    if (imported.vcsm_handle != 0) {
+      vcsm_free(imported.vcsm_handle);
+    }
+  }
+}
+
+static MMAL_VIDEO_PROFILE_T mmal_profile(H264Profile profile) {
+  switch (profile) {
+  case H264Profile::BASELINE:
+    return MMAL_VIDEO_PROFILE_H264_BASELINE;
+  case H264Profile::MAIN:
+    return MMAL_VIDEO_PROFILE_H264_MAIN;
+  case H264Profile::HIGH:
+    break;
+  }
+  return MMAL_VIDEO_PROFILE_H264_HIGH;
+}
+
+size_t FrameLayout::size() const {
+  return size_t(stride) * rows +
+         size_t(chroma_planes) * chroma_stride * chroma_rows;
+}
+
+// Planes of I420 and NV12 follow luma, with chroma subsampled 2x2.
+static FrameLayout video_layout(uint32_t encoding, uint32_t width,
+                                uint32_t stride, uint32_t rows) {
+  FrameLayout layout;
+  layout.row_size = width * bytes_per_pixel(encoding);
+  layout.stride = stride;
+  layout.rows = rows;
+  if (encoding == MMAL_ENCODING_I420) {
+    layout.chroma_row_size = (width + 1) / 2;
+    layout.chroma_stride = (stride + 1) / 2;
+    layout.chroma_rows = (rows + 1) / 2;
+    layout.chroma_planes = 2;
+  } else if (encoding == MMAL_ENCODING_NV12) {
+    // Rows hold both chroma samples of a pair of pixels.
+    layout.chroma_row_size = (width + 1) / 2 * 2;
+    layout.chroma_stride = stride;
+    layout.chroma_rows = (rows + 1) / 2;
+    layout.chroma_planes = 1;
+  }
+  return layout;
+}
+
+// Whether planes of frames laid out as a start where those of b do. Rows
+// past the last one of packed pixels are cropped, so only planar layouts
+// need as many.
+static bool same_planes(const FrameLayout &a, const FrameLayout &b) {
+  return a.stride == b.stride && (a.chroma_planes == 0 || a.rows == b.rows);
+}
+
+MmalVideoEncoder::MmalVideoEncoder(uint32_t input_four_cc,
+                                   uint32_t input_width,
+                                   uint32_t input_height,
+                                   const VideoSettings &settings,
+                                   uint32_t input_stride)
+    : MmalEncoder(MMAL_COMPONENT_DEFAULT_VIDEO_ENCODER) {
+  auto &component = context->component;
+  auto *input = component->input[0];
+  auto *output = component->output[0];
+
+  const auto row_size = input_width * bytes_per_pixel(input_four_cc);
+  if (input_stride != 0 && input_stride < row_size) {
+    throw std::invalid_argument("Stride is shorter than a row");
+  }
+  input_layout =
+      video_layout(input_four_cc, input_width,
+                   input_stride == 0 ? row_size : input_stride, input_height);
+  port_layout = video_layout(input_four_cc, input_width,
+                             VCOS_ALIGN_UP(input_width, 32) *
+                                 bytes_per_pixel(input_four_cc),
+                             VCOS_ALIGN_UP(input_height, 16));
+
+  check_status(mmal_port_parameter_set_boolean(output,
+                                               MMAL_PARAMETER_ZERO_COPY,
+                                               MMAL_TRUE),
+               "mmal_port_parameter_set_boolean");
+  context->input_zero_copy =
+      mmal_port_parameter_set_boolean(input, MMAL_PARAMETER_ZERO_COPY,
+                                      MMAL_TRUE) == MMAL_SUCCESS;
+
+  // Encoder works on 32x16 aligned frames, cropped to the camera size.
+  auto &format_in = *input->format;
+  format_in.type = MMAL_ES_TYPE_VIDEO;
+  format_in.encoding = input_four_cc;
+  format_in.es->video.width = port_layout.stride /
+                              bytes_per_pixel(input_four_cc);
+  format_in.es->video.height = port_layout.rows;
+  format_in.es->video.crop.x = format_in.es->video.crop.y = 0;
+  format_in.es->video.crop.width = input_width;
+  format_in.es->video.crop.height = input_height;
+  // Rate control budgets bitrate by frame rate, in 1/1000 frames.
+  format_in.es->video.frame_rate.num =
+      static_cast<int32_t>(settings.fps * 1000 + 0.5);
+  format_in.es->video.frame_rate.den = 1000;
+  format_in.es->video.par.num = 1;
+  format_in.es->video.par.den = 1;
+  check_status(mmal_port_format_commit(input), "mmal_port_format_commit");
+
+  mmal_format_copy(output->format, input->format);
+  output->format->encoding = MMAL_ENCODING_H264;
+  output->format->bitrate = settings.bitrate;
+  check_status(mmal_port_format_commit(output), "mmal_port_format_commit");
+
+  check_status(mmal_port_parameter_set_uint32(output, MMAL_PARAMETER_INTRAPERIOD,
+                                              settings.gop),
+               "mmal_port_parameter_set_uint32");
+  MMAL_PARAMETER_VIDEO_PROFILE_T profile;
+  profile.hdr.id = MMAL_PARAMETER_PROFILE;
+  profile.hdr.size = sizeof(profile);
+  profile.profile[0].profile = mmal_profile(settings.profile);
+  profile.profile[0].level = MMAL_VIDEO_LEVEL_H264_4;
+  check_status(mmal_port_parameter_set(output, &profile.hdr),
+               "mmal_port_parameter_set");
+  // SPS and PPS in front of every keyframe, so muxer can start anywhere.
+  check_status(mmal_port_parameter_set_boolean(
+                   output, MMAL_PARAMETER_VIDEO_ENCODE_INLINE_HEADER,
+                   MMAL_TRUE),
+               "mmal_port_parameter_set_boolean");
+
+  start();
+
+  if (!same_planes(input_layout, port_layout)) {
+    fprintf(stderr, "Frames are copied into rows aligned for the video "
+                    "encoder\n");
+  }
+}
+
+void MmalVideoEncoder::encode(const uint8_t *input, uint32_t length,
+                              EncodedSink &sink) {
+  process_frame(input, length, -1, sink);
+}
+
+void MmalVideoEncoder::encode_imported(unsigned int index, uint32_t length,
+                                       EncodedSink &sink) {
+  process_frame(nullptr, length, index, sink);
+}
+
+bool MmalVideoEncoder::import_buffer(unsigned int index, int fd,
+                                     size_t length) {
+  // Encoder reads imported frames as they are, so they can't be realigned.
+  if (!same_planes(input_layout, port_layout) || length < port_layout.size()) {
+    return false;
+  }
+  return MmalEncoder::import_buffer(index, fd, length);
+}
+
+void MmalVideoEncoder::copy_aligned(const uint8_t *input,
+                                    uint8_t *output) const {
+  StageTimer timer{Stage::COPY_IN};
+  for (uint32_t row = 0; row < input_layout.rows; ++row) {
+    memcpy(output + size_t(row) * port_layout.stride,
+           input + size_t(row) * input_layout.stride, input_layout.row_size);
+  }
+
+  const auto *input_plane =
+      input + size_t(input_layout.stride) * input_layout.rows;
+  auto *output_plane = output + size_t(port_layout.stride) * port_layout.rows;
+  for (unsigned int plane = 0; plane < input_layout.chroma_planes; ++plane) {
+    for (uint32_t row = 0; row < input_layout.chroma_rows; ++row) {
+      memcpy(output_plane + size_t(row) * port_layout.chroma_stride,
+             input_plane + size_t(row) * input_layout.chroma_stride,
+             input_layout.chroma_row_size);
+    }
+    input_plane +=
+        size_t(input_layout.chroma_stride) * input_layout.chroma_rows;
+    output_plane +=
+        size_t(port_layout.chroma_stride) * port_layout.chroma_rows;
+  }
+}
+
+void MmalVideoEncoder::process_frame(const uint8_t *input, uint32_t length,
+                                     const int imported_index,
+                                     EncodedSink &sink) {
+  auto &component = context->component;
+  auto *pool_in =
+      imported_index >= 0 ? context->pool_import : context->pool_in;
+  bool sent = false;
+  bool frame_end = false;
+
+  while (!frame_end) {
+    MMAL_BUFFER_HEADER_T *buffer = nullptr;
+
+    VCOS_STATUS_T vcos_status;
+    {
+      StageTimer timer{Stage::ENCODER_WAIT};
+      vcos_status = vcos_semaphore_wait_timeout(&context->semaphore, 2000);
+    }
+    // Unlike images, a frame which doesn't come out would stall the stream.
+    // What it left at the ports would be taken as part of the next one.
+    if (vcos_status != VCOS_SUCCESS) {
+      abandon_frame(sink, "Video encoder timed out");
+    }
+    if (context->mmal_status != MMAL_SUCCESS) {
+      const auto status = context->mmal_status;
+      context->mmal_status = MMAL_SUCCESS;
+      abandon_frame(sink, std::string("video_encode failed: ") +
+                              mmal_status_to_string(status));
+    }
+
+    if (!sent && (buffer = mmal_queue_get(pool_in->queue)) != nullptr) {
+      // Whole frame goes in one header.
+      if (imported_index >= 0) {
+        const auto &imported = context->imported[imported_index];
+        buffer->data = reinterpret_cast<uint8_t *>(
+            static_cast<uintptr_t>(imported.vc_handle));
+        buffer->alloc_size = imported.length;
+      } else {
+        const auto aligned = same_planes(input_layout, port_layout);
+        if (!aligned && length < input_layout.size()) {
+          mmal_buffer_header_release(buffer);
+          throw EncoderError("Frame is shorter than expected");
+        }
+        if (!aligned) {
+          length = port_layout.size();
+        }
+        if (length > buffer->alloc_size) {
+          mmal_buffer_header_release(buffer);
+          throw EncoderError("Frame doesn't fit into video encoder buffer");
+        }
+        if (aligned) {
+          StageTimer timer{Stage::COPY_IN};
+          memcpy(buffer->data, input, length);
+        } else {
+          copy_aligned(input, buffer->data);
+        }
+      }
+      buffer->length = length;
+      buffer->offset = 0;
+      buffer->flags = MMAL_BUFFER_HEADER_FLAG_FRAME_END;
+      buffer->pts = timestamp.count();
+      buffer->dts = MMAL_TIME_UNKNOWN;
+      check_status(mmal_port_send_buffer(component->input[0], buffer),
+                   "mmal_port_send_buffer");
+      sent = true;
+    }
+
+    while ((buffer = mmal_queue_get(context->queue)) != nullptr) {
+      if (buffer->cmd != 0) {
+        mmal_buffer_header_release(buffer);
+        continue;
+      }
+      // SPS and PPS come in buffers flagged as config, ahead of the frame.
+      frame_end = frame_end ||
+                  ((buffer->flags & MMAL_BUFFER_HEADER_FLAG_FRAME_END) != 0 &&
+                   (buffer->flags & MMAL_BUFFER_HEADER_FLAG_CONFIG) == 0);
+      if (buffer->length == 0) {
+        mmal_buffer_header_release(buffer);
+      } else {
+        sink.consume(EncodedView(buffer->data + buffer->offset,
+                                 buffer->length, release_header, buffer));
+      }
+    }
+
+    if (frame_end || mmal_queue_length(context->pool_out->queue) == 0) {
+      sink.flush();
+    }
+
+    while ((buffer = mmal_queue_get(context->pool_out->queue)) != nullptr) {
+      check_status(mmal_port_send_buffer(component->output[0], buffer),
+                   "mmal_port_send_buffer");
+    }
+  }
+
+  sink.flush();
+}
@@ -0,0 +1,99 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "./encoder.h"
+
+struct EncoderContext;
+
+// Encodes on VideoCore through MMAL image_encode component.
+class MmalEncoder : public Encoder {
+public:
+  static void Init();
+  // Padded input_stride is taken as a wider frame cropped to input_width.
+  MmalEncoder(uint32_t input_four_cc, uint32_t input_width,
+              uint32_t input_height, uint32_t output_four_cc,
+              uint32_t input_stride = 0);
+  ~MmalEncoder();
+
+  EncoderBackend backend() const override { return EncoderBackend::MMAL; }
+  // Sets Q factor of JPEG output port, which takes effect from next frame.
+  void set_quality(int quality) override;
+  void set_restart_interval(uint32_t interval) override;
+
+  // Output buffer headers are handed to sink as they are, and go back to
+  // the port once sink drops them.
+  void encode(const uint8_t *input, uint32_t length,
+              EncodedSink &sink) override;
+
+  // Wrap dmabuf into input buffer header through vcsm. Requires zero copy on
+  // input port.
+  bool import_buffer(unsigned int index, int fd, size_t length) override;
+  void encode_imported(unsigned int index, uint32_t length,
+                       EncodedSink &sink) override;
+
+protected:
+  // Creates component and enables its control port, for subclasses which
+  // set its ports up their own way and call start().
+  explicit MmalEncoder(const char *component_name);
+  // Allocate buffers of committed ports and enable them and the component.
+  void start(void);
+  void process(const uint8_t *input, uint32_t length,
+               const int imported_index, EncodedSink &sink);
+  // Take back headers of a frame which failed and throw EncoderError with
+  // message, so the next frame starts from a clean component.
+  [[noreturn]] void abandon_frame(EncodedSink &sink,
+                                  const std::string &message);
+
+  static std::atomic<bool> initialized;
+  std::unique_ptr<EncoderContext> context;
+};
+
+// Rows of a frame, luma or packed pixels followed by chroma planes.
+struct FrameLayout {
+  // Bytes of the picture in a row, and of rows with their padding.
+  uint32_t row_size = 0;
+  uint32_t stride = 0;
+  uint32_t rows = 0;
+  uint32_t chroma_row_size = 0;
+  uint32_t chroma_stride = 0;
+  uint32_t chroma_rows = 0;
+  unsigned int chroma_planes = 0;
+
+  size_t size() const;
+};
+
+// Encodes H.264 through MMAL video_encode component. Frames go in one by one,
+// each held until its access unit has come out, so encoder state is the only
+// thing kept between frames.
+class MmalVideoEncoder : public MmalEncoder {
+public:
+  // input_stride is bytesperline of input, tightly packed rows when 0.
+  MmalVideoEncoder(uint32_t input_four_cc, uint32_t input_width,
+                   uint32_t input_height, const VideoSettings &settings,
+                   uint32_t input_stride = 0);
+
+  void encode(const uint8_t *input, uint32_t length,
+              EncodedSink &sink) override;
+  // Refused unless camera rows and planes are where the port expects them.
+  bool import_buffer(unsigned int index, int fd, size_t length) override;
+  void encode_imported(unsigned int index, uint32_t length,
+                       EncodedSink &sink) override;
+  void set_timestamp(std::chrono::microseconds timestamp) override {
+    this->timestamp = timestamp;
+  }
+
+protected:
+  void process_frame(const uint8_t *input, uint32_t length,
+                     const int imported_index, EncodedSink &sink);
+  // Copy rows of a frame laid out as input into the aligned one of the port.
+  void copy_aligned(const uint8_t *input, uint8_t *output) const;
+
+  std::chrono::microseconds timestamp{};
+  FrameLayout input_layout;
+  FrameLayout port_layout;
+};
@@ -0,0 +1,28 @@
+#include "./encoder_passthrough.h"
+
+#include <stdexcept>
+
+#include "./fourcc.h"
+#include "./mjpeg.h"
+#include "./sink.h"
+
+PassthroughEncoder::PassthroughEncoder(uint32_t input_four_cc,
+                                       uint32_t output_four_cc) {
+  if (!is_compressed_fourcc(input_four_cc)) {
+    throw std::invalid_argument("Passthrough requires compressed input");
+  }
+  if (output_four_cc != ENCODING_JPEG) {
+    throw std::invalid_argument("Compressed input can only be written as "
+                                "JPEG");
+  }
+}
+
+void PassthroughEncoder::encode(const uint8_t *input, uint32_t length,
+                                EncodedSink &sink) {
+  for (const auto &part : jpeg_parts(input, length)) {
+    if (!part.empty()) {
+      sink.consume(EncodedView(part.data(), part.size()));
+    }
+  }
+  sink.flush();
+}
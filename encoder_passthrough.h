@@ -0,0 +1,21 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "./encoder.h"
+
+// Writes frames of cameras delivering MJPEG/JPEG as is. Missing Huffman
+// tables are inserted, nothing is encoded.
+class PassthroughEncoder : public Encoder {
+public:
+  PassthroughEncoder(uint32_t input_four_cc, uint32_t output_four_cc);
+
+  EncoderBackend backend() const override {
+    return EncoderBackend::PASSTHROUGH;
+  }
+
+  // Frame is handed to sink in place, in up to three pieces.
+  void encode(const uint8_t *input, uint32_t length,
+              EncodedSink &sink) override;
+};
@@ -0,0 +1,528 @@
+#include "./encoder_sw.h"
+
+#include <algorithm>
+#include <setjmp.h>
+#include <stdexcept>
+#include <stdio.h>
+#include <string.h>
+
+#include <jpeglib.h>
+#include <png.h>
+
+#include <linux/dma-buf.h>
+#include <linux/videodev2.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+
+#include "./fourcc.h"
+#include "./sink.h"
+
+enum class InputLayout {
+  YUV420P,
+  NV12,
+  YUYV,
+  UYVY,
+  RGB24,
+  BGR24,
+  GREY,
+};
+
+struct ErrorManager {
+  jpeg_error_mgr pub;
+  jmp_buf setjmp_buffer;
+  char message[JMSG_LENGTH_MAX];
+};
+
+struct SinkDestination {
+  jpeg_destination_mgr pub;
+  SoftwareEncoderContext *context;
+};
+
+struct MappedBuffer {
+  int fd = -1;
+  void *start = MAP_FAILED;
+  size_t length = 0;
+};
+
+struct SoftwareEncoderContext {
+  InputLayout layout;
+  // Bytes from one row of input to the next, and from one row of chroma
+  // planes to the next for planar layouts.
+  uint32_t stride;
+  uint32_t chroma_stride;
+  size_t input_size;
+  jpeg_compress_struct cinfo;
+  ErrorManager error;
+  SinkDestination destination;
+
+  // Output is gathered here and handed to sink whenever it fills up.
+  std::vector<uint8_t> chunk;
+  size_t chunk_used = 0;
+  EncodedSink *sink = nullptr;
+
+  // Rows of raw YCbCr handed to libjpeg, padded to MCU width.
+  uint32_t padded_width;
+  std::vector<uint8_t> scratch;
+  JSAMPROW rows[3][2 * DCTSIZE];
+
+  std::vector<MappedBuffer> imported;
+};
+
+static InputLayout layout_from_fourcc(uint32_t four_cc) {
+  switch (four_cc) {
+  case ENCODING_I420:
+  case V4L2_PIX_FMT_YUV420:
+    return InputLayout::YUV420P;
+  case V4L2_PIX_FMT_NV12:
+    return InputLayout::NV12;
+  case V4L2_PIX_FMT_YUYV:
+    return InputLayout::YUYV;
+  case V4L2_PIX_FMT_UYVY:
+    return InputLayout::UYVY;
+  case V4L2_PIX_FMT_RGB24:
+    return InputLayout::RGB24;
+  case V4L2_PIX_FMT_BGR24:
+    return InputLayout::BGR24;
+  case V4L2_PIX_FMT_GREY:
+    return InputLayout::GREY;
+  default:
+    throw std::invalid_argument("Input format is not supported by software "
+                                "encoder");
+  }
+}
+
+// Bytes of a pixel in a row of input, of luma for planar layouts.
+static uint32_t bytes_per_pixel(InputLayout layout) {
+  switch (layout) {
+  case InputLayout::YUYV:
+  case InputLayout::UYVY:
+    return 2;
+  case InputLayout::RGB24:
+  case InputLayout::BGR24:
+    return 3;
+  case InputLayout::YUV420P:
+  case InputLayout::NV12:
+  case InputLayout::GREY:
+    break;
+  }
+  return 1;
+}
+
+static void error_exit(j_common_ptr cinfo) {
+  auto *error = reinterpret_cast<ErrorManager *>(cinfo->err);
+  (*cinfo->err->format_message)(cinfo, error->message);
+  longjmp(error->setjmp_buffer, 1);
+}
+
+constexpr size_t CHUNK_SIZE = 64 * 1024;
+
+// Hand filled part of chunk to sink. Sink drops the view by flush(), so the
+// chunk can be refilled right after.
+static void emit_chunk(SoftwareEncoderContext &ctx) {
+  if (ctx.chunk_used > 0) {
+    ctx.sink->consume(EncodedView(ctx.chunk.data(), ctx.chunk_used));
+  }
+  ctx.sink->flush();
+  ctx.chunk_used = 0;
+}
+
+static void init_destination(j_compress_ptr cinfo) {
+  auto *dest = reinterpret_cast<SinkDestination *>(cinfo->dest);
+  dest->pub.next_output_byte = dest->context->chunk.data();
+  dest->pub.free_in_buffer = dest->context->chunk.size();
+}
+
+static boolean empty_output_buffer(j_compress_ptr cinfo) {
+  auto *dest = reinterpret_cast<SinkDestination *>(cinfo->dest);
+  auto &ctx = *dest->context;
+  // Whole buffer is due, regardless of free_in_buffer.
+  ctx.chunk_used = ctx.chunk.size();
+  emit_chunk(ctx);
+  init_destination(cinfo);
+  return TRUE;
+}
+
+static void term_destination(j_compress_ptr cinfo) {
+  auto *dest = reinterpret_cast<SinkDestination *>(cinfo->dest);
+  auto &ctx = *dest->context;
+  ctx.chunk_used = ctx.chunk.size() - dest->pub.free_in_buffer;
+  emit_chunk(ctx);
+}
+
+// BT.601 limited range
+static inline uint8_t clamp_u8(int v) {
+  return static_cast<uint8_t>(std::min(std::max(v, 0), 255));
+}
+
+static inline void yuv_to_rgb(int y, int u, int v, uint8_t *rgb) {
+  const auto c = 298 * (y - 16) + 128;
+  const auto d = u - 128;
+  const auto e = v - 128;
+  rgb[0] = clamp_u8((c + 409 * e) >> 8);
+  rgb[1] = clamp_u8((c - 100 * d - 208 * e) >> 8);
+  rgb[2] = clamp_u8((c + 516 * d) >> 8);
+}
+
+SoftwareEncoder::SoftwareEncoder(uint32_t input_four_cc, uint32_t input_width,
+                                 uint32_t input_height,
+                                 uint32_t output_four_cc, uint32_t input_stride)
+    : input_four_cc(input_four_cc), width(input_width), height(input_height),
+      output_four_cc(output_four_cc), context(new SoftwareEncoderContext()) {
+  if (output_four_cc != ENCODING_JPEG && output_four_cc != ENCODING_PNG) {
+    throw std::invalid_argument("Output format is not supported by software "
+                                "encoder");
+  }
+
+  const auto layout = layout_from_fourcc(input_four_cc);
+  context->layout = layout;
+  const auto row_size = width * bytes_per_pixel(layout);
+  auto &stride = context->stride;
+  stride = input_stride == 0 ? row_size : input_stride;
+  if (stride < row_size) {
+    throw std::invalid_argument("Stride is shorter than a row");
+  }
+  // Chroma planes follow luma, rows of I420 ones half as long.
+  context->chroma_stride =
+      layout == InputLayout::YUV420P ? (stride + 1) / 2 : stride;
+  context->input_size = size_t(stride) * height;
+  const size_t chroma_height = (height + 1) / 2;
+  if (layout == InputLayout::YUV420P) {
+    context->input_size += 2 * size_t(context->chroma_stride) * chroma_height;
+  } else if (layout == InputLayout::NV12) {
+    context->input_size += size_t(context->chroma_stride) * chroma_height;
+  }
+
+  auto &cinfo = context->cinfo;
+  cinfo.err = jpeg_std_error(&context->error.pub);
+  context->error.pub.error_exit = error_exit;
+  if (setjmp(context->error.setjmp_buffer)) {
+    throw EncoderError(context->error.message);
+  }
+  jpeg_create_compress(&cinfo);
+
+  context->destination.pub.init_destination = init_destination;
+  context->destination.pub.empty_output_buffer = empty_output_buffer;
+  context->destination.pub.term_destination = term_destination;
+  context->destination.context = context.get();
+  context->chunk.resize(CHUNK_SIZE);
+  cinfo.dest = &context->destination.pub;
+
+  // Y rows, then Cb and Cr rows of half width.
+  const auto mcu_width = 2 * DCTSIZE;
+  context->padded_width = (width + mcu_width - 1) / mcu_width * mcu_width;
+  const auto row_count = 2 * DCTSIZE;
+  context->scratch.resize(row_count * context->padded_width * 2);
+  auto *p = context->scratch.data();
+  for (int i = 0; i < row_count; ++i) {
+    context->rows[0][i] = p;
+    p += context->padded_width;
+  }
+  for (int c = 1; c < 3; ++c) {
+    for (int i = 0; i < row_count; ++i) {
+      context->rows[c][i] = p;
+      p += context->padded_width / 2;
+    }
+  }
+}
+
+SoftwareEncoder::~SoftwareEncoder() {
+  jpeg_destroy_compress(&context->cinfo);
+
+  for (const auto &buffer : context->imported) {
+    if (buffer.start != MAP_FAILED) {
+      munmap(buffer.start, buffer.length);
+    }
+  }
+}
+
+void SoftwareEncoder::encode(const uint8_t *input, uint32_t length,
+                             EncodedSink &sink) {
+  if (length < context->input_size) {
+    throw EncoderError("Frame is shorter than expected");
+  }
+
+  context->sink = &sink;
+  context->chunk_used = 0;
+  if (output_four_cc == ENCODING_PNG) {
+    encode_png(input);
+  } else {
+    encode_jpeg(input);
+  }
+}
+
+bool SoftwareEncoder::import_buffer(unsigned int index, int fd,
+                                    size_t length) {
+  auto *start = mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
+  if (start == MAP_FAILED) {
+    fprintf(stderr, "mmap dmabuf error %d, %s\n", errno, strerror(errno));
+    return false;
+  }
+
+  if (context->imported.size() <= index) {
+    context->imported.resize(index + 1);
+  }
+  auto &buffer = context->imported[index];
+  // Buffers of a reconnected camera are imported over the old ones.
+  if (buffer.start != MAP_FAILED) {
+    munmap(buffer.start, buffer.length);
+  }
+  buffer.fd = fd;
+  buffer.start = start;
+  buffer.length = length;
+
+  return true;
+}
+
+void SoftwareEncoder::encode_imported(unsigned int index, uint32_t length,
+                                     EncodedSink &sink) {
+  const auto &buffer = context->imported.at(index);
+
+  dma_buf_sync sync;
+  sync.flags = DMA_BUF_SYNC_START | DMA_BUF_SYNC_READ;
+  ioctl(buffer.fd, DMA_BUF_IOCTL_SYNC, &sync);
+
+  encode(reinterpret_cast<const uint8_t *>(buffer.start),
+         std::min<size_t>(length, buffer.length), sink);
+
+  sync.flags = DMA_BUF_SYNC_END | DMA_BUF_SYNC_READ;
+  ioctl(buffer.fd, DMA_BUF_IOCTL_SYNC, &sync);
+}
+
+// Fill raw rows [row, row + count) of each component. Rows past the bottom
+// repeat the last row.
+static void fill_raw_rows(SoftwareEncoderContext &ctx, const uint8_t *input,
+                          uint32_t width, uint32_t height, uint32_t row,
+                          int count) {
+  const auto padded = ctx.padded_width;
+  const auto stride = ctx.stride;
+  const auto chroma_stride = ctx.chroma_stride;
+  const auto chroma_width = (width + 1) / 2;
+  const auto chroma_height = (height + 1) / 2;
+
+  for (int i = 0; i < count; ++i) {
+    auto *y = ctx.rows[0][i];
+    const auto src_row = std::min(row + i, height - 1);
+
+    switch (ctx.layout) {
+    case InputLayout::YUV420P:
+    case InputLayout::NV12:
+      memcpy(y, input + size_t(src_row) * stride, width);
+      break;
+    case InputLayout::YUYV:
+    case InputLayout::UYVY: {
+      const auto *src = input + size_t(src_row) * stride;
+      const auto y_offset = ctx.layout == InputLayout::YUYV ? 0 : 1;
+      const auto c_offset = 1 - y_offset;
+      auto *u = ctx.rows[1][i];
+      auto *v = ctx.rows[2][i];
+      for (uint32_t x = 0; x < width; ++x) {
+        y[x] = src[2 * x + y_offset];
+      }
+      // Packed 4:2:2 has whole pairs only.
+      const auto pairs = std::max(width / 2, 1u);
+      for (uint32_t x = 0; x < pairs; ++x) {
+        u[x] = src[4 * x + c_offset];
+        v[x] = src[4 * x + c_offset + 2];
+      }
+      memset(u + pairs, u[pairs - 1], padded / 2 - pairs);
+      memset(v + pairs, v[pairs - 1], padded / 2 - pairs);
+      break;
+    }
+    default:
+      break;
+    }
+    memset(y + width, y[width - 1], padded - width);
+  }
+
+  if (ctx.layout != InputLayout::YUV420P && ctx.layout != InputLayout::NV12) {
+    return;
+  }
+
+  const auto *u_plane = input + size_t(stride) * height;
+  const auto *v_plane = u_plane + size_t(chroma_stride) * chroma_height;
+  for (int i = 0; i < count / 2; ++i) {
+    auto *u = ctx.rows[1][i];
+    auto *v = ctx.rows[2][i];
+    const auto src_row = std::min(row / 2 + i, chroma_height - 1);
+
+    if (ctx.layout == InputLayout::YUV420P) {
+      memcpy(u, u_plane + size_t(src_row) * chroma_stride, chroma_width);
+      memcpy(v, v_plane + size_t(src_row) * chroma_stride, chroma_width);
+    } else {
+      const auto *uv = u_plane + size_t(src_row) * chroma_stride;
+      for (uint32_t x = 0; x < chroma_width; ++x) {
+        u[x] = uv[2 * x];
+        v[x] = uv[2 * x + 1];
+      }
+    }
+    memset(u + chroma_width, u[chroma_width - 1], padded / 2 - chroma_width);
+    memset(v + chroma_width, v[chroma_width - 1], padded / 2 - chroma_width);
+  }
+}
+
+void SoftwareEncoder::encode_jpeg(const uint8_t *input) {
+  auto &cinfo = context->cinfo;
+
+  if (setjmp(context->error.setjmp_buffer)) {
+    jpeg_abort_compress(&cinfo);
+    throw EncoderError(context->error.message);
+  }
+
+  cinfo.image_width = width;
+  cinfo.image_height = height;
+
+  const auto layout = context->layout;
+  const bool raw = layout != InputLayout::RGB24 &&
+                   layout != InputLayout::BGR24 && layout != InputLayout::GREY;
+  switch (layout) {
+  case InputLayout::RGB24:
+    cinfo.input_components = 3;
+    cinfo.in_color_space = JCS_RGB;
+    break;
+  case InputLayout::BGR24:
+    cinfo.input_components = 3;
+    cinfo.in_color_space = JCS_EXT_BGR;
+    break;
+  case InputLayout::GREY:
+    cinfo.input_components = 1;
+    cinfo.in_color_space = JCS_GRAYSCALE;
+    break;
+  default:
+    cinfo.input_components = 3;
+    cinfo.in_color_space = JCS_YCbCr;
+    break;
+  }
+  jpeg_set_defaults(&cinfo);
+  if (quality != 0) {
+    jpeg_set_quality(&cinfo, quality, TRUE);
+  }
+  cinfo.restart_interval = restart_interval;
+
+  if (!raw) {
+    jpeg_start_compress(&cinfo, TRUE);
+    const auto stride = context->stride;
+    while (cinfo.next_scanline < cinfo.image_height) {
+      auto row = const_cast<JSAMPROW>(
+          input + size_t(cinfo.next_scanline) * stride);
+      jpeg_write_scanlines(&cinfo, &row, 1);
+    }
+    jpeg_finish_compress(&cinfo);
+    return;
+  }
+
+  const int v_samp =
+      layout == InputLayout::YUYV || layout == InputLayout::UYVY ? 1 : 2;
+  cinfo.raw_data_in = TRUE;
+  cinfo.comp_info[0].h_samp_factor = 2;
+  cinfo.comp_info[0].v_samp_factor = v_samp;
+  cinfo.comp_info[1].h_samp_factor = cinfo.comp_info[1].v_samp_factor = 1;
+  cinfo.comp_info[2].h_samp_factor = cinfo.comp_info[2].v_samp_factor = 1;
+
+  jpeg_start_compress(&cinfo, TRUE);
+  const int rows_per_pass = DCTSIZE * v_samp;
+  JSAMPARRAY planes[3] = {context->rows[0], context->rows[1],
+                          context->rows[2]};
+  while (cinfo.next_scanline < cinfo.image_height) {
+    fill_raw_rows(*context, input, width, height, cinfo.next_scanline,
+                  rows_per_pass);
+    jpeg_write_raw_data(&cinfo, planes, rows_per_pass);
+  }
+  jpeg_finish_compress(&cinfo);
+}
+
+static void png_write_chunk(png_structp png, png_bytep data,
+                            png_size_t length) {
+  auto &ctx = *reinterpret_cast<SoftwareEncoderContext *>(png_get_io_ptr(png));
+  while (length > 0) {
+    const auto n = std::min(length, ctx.chunk.size() - ctx.chunk_used);
+    memcpy(ctx.chunk.data() + ctx.chunk_used, data, n);
+    ctx.chunk_used += n;
+    data += n;
+    length -= n;
+    if (ctx.chunk_used == ctx.chunk.size()) {
+      emit_chunk(ctx);
+    }
+  }
+}
+
+static void png_flush_nothing(png_structp) {}
+
+void SoftwareEncoder::encode_png(const uint8_t *input) {
+  auto png = png_create_write_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr,
+                                     nullptr);
+  auto info = png ? png_create_info_struct(png) : nullptr;
+  if (info == nullptr) {
+    png_destroy_write_struct(&png, nullptr);
+    throw EncoderError("Failed to create png writer");
+  }
+
+  // Row of converted RGB. Reuse Y scratch which is wide enough.
+  const auto layout = context->layout;
+  auto *rgb = context->scratch.data();
+
+  if (setjmp(png_jmpbuf(png))) {
+    png_destroy_write_struct(&png, &info);
+    throw EncoderError("Failed to encode png");
+  }
+
+  png_set_write_fn(png, context.get(), png_write_chunk, png_flush_nothing);
+  // Captures are written while camera is waiting, prefer speed over size.
+  png_set_compression_level(png, 1);
+  png_set_IHDR(png, info, width, height, 8,
+               layout == InputLayout::GREY ? PNG_COLOR_TYPE_GRAY
+                                           : PNG_COLOR_TYPE_RGB,
+               PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT,
+               PNG_FILTER_TYPE_DEFAULT);
+  png_write_info(png, info);
+  if (layout == InputLayout::BGR24) {
+    png_set_bgr(png);
+  }
+
+  const auto stride = context->stride;
+  const auto chroma_stride = context->chroma_stride;
+  const auto chroma_height = (height + 1) / 2;
+  const auto *u_plane = input + size_t(stride) * height;
+  const auto *v_plane = u_plane + size_t(chroma_stride) * chroma_height;
+  for (uint32_t row = 0; row < height; ++row) {
+    const auto *src = input + size_t(row) * stride;
+    switch (layout) {
+    case InputLayout::RGB24:
+    case InputLayout::BGR24:
+    case InputLayout::GREY:
+      png_write_row(png, src);
+      continue;
+    case InputLayout::YUYV:
+    case InputLayout::UYVY: {
+      const auto y_offset = layout == InputLayout::YUYV ? 0 : 1;
+      const auto c_offset = 1 - y_offset;
+      for (uint32_t x = 0; x < width; ++x) {
+        const auto pair = src + std::min(x / 2, width / 2 - 1) * 4;
+        yuv_to_rgb(src[2 * x + y_offset], pair[c_offset], pair[c_offset + 2],
+                   rgb + x * 3);
+      }
+      break;
+    }
+    case InputLayout::YUV420P:
+    case InputLayout::NV12: {
+      const auto chroma_row = size_t(row / 2) * chroma_stride;
+      for (uint32_t x = 0; x < width; ++x) {
+        int u, v;
+        if (layout == InputLayout::YUV420P) {
+          u = u_plane[chroma_row + x / 2];
+          v = v_plane[chroma_row + x / 2];
+        } else {
+          u = u_plane[chroma_row + (x & ~1u)];
+          v = u_plane[chroma_row + (x & ~1u) + 1];
+        }
+        yuv_to_rgb(src[x], u, v, rgb + x * 3);
+      }
+      break;
+    }
+    }
+    png_write_row(png, rgb);
+  }
+
+  png_write_end(png, nullptr);
+  png_destroy_write_struct(&png, &info);
+  emit_chunk(*context);
+}
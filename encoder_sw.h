@@ -0,0 +1,51 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "./encoder.h"
+
+struct SoftwareEncoderContext;
+
+// Encodes on CPU. JPEG is encoded by libjpeg-turbo which uses its NEON/SSE
+// paths, PNG by libpng.
+//
+// Planar and packed YUV inputs are fed to libjpeg as raw downsampled data, so
+// no color conversion is done for JPEG.
+class SoftwareEncoder : public Encoder {
+public:
+  // input_stride defaults to tightly packed rows. Throws
+  // std::invalid_argument for formats it can't take.
+  SoftwareEncoder(uint32_t input_four_cc, uint32_t input_width,
+                  uint32_t input_height, uint32_t output_four_cc,
+                  uint32_t input_stride = 0);
+  ~SoftwareEncoder();
+
+  EncoderBackend backend() const override { return EncoderBackend::SOFTWARE; }
+  void set_quality(int quality) override { this->quality = quality; }
+  void set_restart_interval(uint32_t interval) override {
+    restart_interval = interval;
+  }
+
+  // Output goes to sink in chunks of a buffer kept between frames.
+  void encode(const uint8_t *input, uint32_t length,
+              EncodedSink &sink) override;
+
+  // Map dmabuf to read frames without going through V4L2 mapping.
+  bool import_buffer(unsigned int index, int fd, size_t length) override;
+  void encode_imported(unsigned int index, uint32_t length,
+                       EncodedSink &sink) override;
+
+protected:
+  void encode_jpeg(const uint8_t *input);
+  void encode_png(const uint8_t *input);
+
+  const uint32_t input_four_cc;
+  const uint32_t width, height;
+  const uint32_t output_four_cc;
+  // Default of libjpeg when 0.
+  int quality = 0;
+  uint32_t restart_interval = 0;
+  std::unique_ptr<SoftwareEncoderContext> context;
+};
@@ -0,0 +1,198 @@
+#include "./fan_out.h"
+
+#include <set>
+#include <stdexcept>
+#include <thread>
+#include <tuple>
+
+#include <stdio.h>
+
+#include "./camera.h"
+#include "./convert.h"
+#include "./dmabuf.h"
+#include "./encoder.h"
+#include "./fourcc.h"
+#include "./metrics.h"
+#include "./output.h"
+#include "./output_writer.h"
+#include "./sink.h"
+#include "./size_budget.h"
+
+OutputSpec output_spec_from_string(const std::string &text) {
+  OutputSpec spec;
+  auto rest = text;
+  // Options are taken from the end, so paths may have colons.
+  for (;;) {
+    const auto colon = rest.rfind(':');
+    if (colon == std::string::npos) {
+      break;
+    }
+    const auto option = rest.substr(colon + 1);
+    try {
+      if (option.rfind("size=", 0) == 0) {
+        spec.max_size = std::stoul(option.substr(5));
+      } else if (option.rfind("quality=", 0) == 0) {
+        spec.quality = std::stoi(option.substr(8));
+        if (spec.quality < 1 || spec.quality > 100) {
+          throw std::out_of_range(option);
+        }
+      } else if (option.rfind("bytes=", 0) == 0) {
+        spec.max_bytes = std::stoul(option.substr(6));
+      } else if (option.rfind("restart=", 0) == 0) {
+        spec.restart_interval = std::stoul(option.substr(8));
+      } else {
+        break;
+      }
+    } catch (const std::logic_error &) {
+      throw std::invalid_argument("Bad output option " + option);
+    }
+    rest.erase(colon);
+  }
+  if (rest.empty()) {
+    throw std::invalid_argument("Output " + text + " has no path");
+  }
+  spec.path = rest;
+  return spec;
+}
+
+FanOut::FanOut(Camera &camera, EncoderPool &pool,
+               const std::vector<OutputSpec> &outputs, bool use_dmabuf,
+               Converter *converter)
+    : camera(camera), converter(converter), use_dmabuf(use_dmabuf),
+      generation(camera.generation()) {
+  const auto raw = !is_compressed_fourcc(camera.fourcc());
+  std::set<std::tuple<uint32_t, uint32_t, uint32_t, uint32_t, uint32_t>>
+      leased;
+  for (const auto &spec : outputs) {
+    const auto output_four_cc = fourcc_from_path(spec.path);
+    if (output_four_cc == ENCODING_H264) {
+      throw std::invalid_argument("Video can't be one of several outputs");
+    }
+
+    Target target{spec, camera.width(), camera.height(),
+                  EncoderBackend::AUTO, nullptr, nullptr, nullptr};
+    auto input_four_cc = converter ? ENCODING_I420 : camera.fourcc();
+    if (spec.max_size != 0) {
+      if (!raw) {
+        throw std::invalid_argument("Compressed frames can't be scaled for " +
+                                    spec.path.string());
+      }
+      target.downscaler = std::make_unique<Downscaler>(
+          camera.fourcc(), camera.width(), camera.height(),
+          camera.bytesperline(), spec.max_size, spec.max_size);
+      target.width = target.downscaler->output_width();
+      target.height = target.downscaler->output_height();
+      input_four_cc = ENCODING_I420;
+    }
+
+    // Only whole sized camera frames are imported, the rest is copied.
+    const auto camera_frames = !converter && !target.downscaler;
+    const auto import = use_dmabuf && camera_frames;
+    // Converted and scaled frames are tightly packed.
+    const auto stride = camera_frames ? camera.bytesperline() : 0;
+    const auto key = std::make_tuple(input_four_cc, target.width,
+                                     target.height, stride, output_four_cc);
+    const auto shared = leased.insert(key).second;
+    const auto lease =
+        pool.acquire(input_four_cc, target.width, target.height,
+                     output_four_cc, import ? camera.count() : 0, shared,
+                     stride);
+    target.backend = lease.encoder.backend();
+    if (spec.quality != 0) {
+      lease.encoder.set_quality(spec.quality);
+    }
+    if (spec.restart_interval != 0) {
+      lease.encoder.set_restart_interval(spec.restart_interval);
+    }
+    target.handoff = std::make_unique<DmabufHandoff>(
+        camera, lease.encoder, import, lease.first_import);
+    if (spec.max_bytes != 0) {
+      if (output_four_cc != ENCODING_JPEG ||
+          target.backend == EncoderBackend::PASSTHROUGH) {
+        throw std::invalid_argument("Only JPEG encoded from raw frames fits "
+                                    "a size budget, not " +
+                                    spec.path.string());
+      }
+      target.budget = std::make_unique<SizeBudget>(
+          lease.encoder, spec.max_bytes, spec.quality);
+      target.handoff->set_budget(target.budget.get());
+    }
+    targets.push_back(std::move(target));
+  }
+}
+
+FanOut::~FanOut() = default;
+
+std::vector<std::vector<uint8_t>> FanOut::encode(const FrameView &frame,
+                                                 OutputWriter &writer) {
+  if (use_dmabuf && camera.generation() != generation) {
+    // Buffers of a reconnected camera are exported here once, so handoffs
+    // importing them again on worker threads only read fds it keeps.
+    generation = camera.generation();
+    for (unsigned int i = 0; i < camera.count(); ++i) {
+      camera.export_buffer(i);
+    }
+  }
+
+  ByteView converted;
+  if (converter) {
+    for (const auto &target : targets) {
+      if (!target.downscaler) {
+        StageTimer timer{Stage::CONVERT};
+        converted = converter->convert(frame.data(), frame.length());
+        break;
+      }
+    }
+  }
+
+  std::vector<std::vector<uint8_t>> encoded;
+  for (size_t i = 0; i < targets.size(); ++i) {
+    encoded.push_back(writer.buffer());
+  }
+  // Not vector<bool>, as workers set their own element.
+  std::vector<char> ok(targets.size());
+  std::vector<std::thread> workers;
+  for (size_t i = 1; i < targets.size(); ++i) {
+    workers.emplace_back([&, i] {
+      ok[i] = encode_target(targets[i], frame, converted, encoded[i]);
+    });
+  }
+  ok[0] = encode_target(targets[0], frame, converted, encoded[0]);
+  for (auto &worker : workers) {
+    worker.join();
+  }
+
+  for (size_t i = 0; i < targets.size(); ++i) {
+    if (!ok[i]) {
+      writer.recycle(std::move(encoded[i]));
+      encoded[i].clear();
+    }
+  }
+  return encoded;
+}
+
+bool FanOut::encode_target(Target &target, const FrameView &frame,
+                           ByteView converted, std::vector<uint8_t> &data) {
+  try {
+    VectorSink sink{data};
+    if (target.downscaler) {
+      ByteView scaled;
+      {
+        StageTimer timer{Stage::SCALE};
+        scaled = target.downscaler->downscale(frame.data(), frame.length());
+      }
+      target.handoff->encode(scaled.data(), scaled.size(), sink,
+                             frame.timestamp());
+    } else if (converter) {
+      target.handoff->encode(converted.data(), converted.size(), sink,
+                             frame.timestamp());
+    } else {
+      target.handoff->encode(frame, sink);
+    }
+    return true;
+  } catch (const std::runtime_error &e) {
+    fprintf(stderr, "Failed to encode %s: %s\n", target.spec.path.c_str(),
+            e.what());
+    return false;
+  }
+}
@@ -0,0 +1,105 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "./encoder.h"
+#include "./mjpeg.h"
+
+class Camera;
+class Converter;
+class DmabufHandoff;
+class Downscaler;
+class FrameView;
+class OutputWriter;
+class SizeBudget;
+
+// One file made of every capture.
+struct OutputSpec {
+  // Extension picks the encoding.
+  std::filesystem::path path;
+  // Frames are halved until they fit max_size x max_size, 0 keeps them whole.
+  uint32_t max_size = 0;
+  // JPEG quality from 1 to 100, 0 for the default of the encoder. With
+  // max_bytes, the one first tried.
+  int quality = 0;
+  // Highest JPEG quality which fits this many bytes is picked for each frame,
+  // 0 for no limit.
+  size_t max_bytes = 0;
+  // MCUs between JPEG restart markers, 0 for none.
+  uint32_t restart_interval = 0;
+};
+
+// Parse "PATH[:size=N][:quality=Q][:bytes=B][:restart=R]". Throws
+// std::invalid_argument.
+OutputSpec output_spec_from_string(const std::string &text);
+
+// Encodes each captured frame into several outputs, each with its own
+// encoding, size and quality or size budget.
+//
+// Encoders come from the pool, one for each input format, size and encoding,
+// so components are set up once and stay warm across captures. Outputs which
+// would share one get one of their own instead, as all outputs are encoded
+// at once: every output but the first on a thread of its own. encode()
+// returns after the last of them, so the V4L2 buffer is re-queued once.
+//
+// Whole sized outputs of raw frames import camera buffers by dmabuf. With a
+// converter, frame is converted once for all of them. Scaled outputs
+// downscale the camera frame on their own thread.
+class FanOut {
+public:
+  // Throws std::invalid_argument for outputs which can't be made of frames
+  // of camera.
+  FanOut(Camera &camera, EncoderPool &pool,
+         const std::vector<OutputSpec> &outputs, bool use_dmabuf,
+         Converter *converter = nullptr);
+  ~FanOut();
+
+  // Encode frame for every output, into buffers of writer in order of
+  // outputs. Failures are reported and leave buffer of that output empty.
+  std::vector<std::vector<uint8_t>> encode(const FrameView &frame,
+                                           OutputWriter &writer);
+
+  size_t size() const {
+    return targets.size();
+  }
+  const OutputSpec &spec(size_t index) const {
+    return targets[index].spec;
+  }
+  uint32_t width(size_t index) const {
+    return targets[index].width;
+  }
+  uint32_t height(size_t index) const {
+    return targets[index].height;
+  }
+  EncoderBackend backend(size_t index) const {
+    return targets[index].backend;
+  }
+
+protected:
+  struct Target {
+    OutputSpec spec;
+    uint32_t width, height;
+    EncoderBackend backend;
+    // Set for scaled outputs.
+    std::unique_ptr<Downscaler> downscaler;
+    // Set for outputs with max_bytes.
+    std::unique_ptr<SizeBudget> budget;
+    std::unique_ptr<DmabufHandoff> handoff;
+  };
+
+  // Encode frame for target into data, taking converted frame for whole
+  // sized outputs when there is a converter. Returns false on failure.
+  bool encode_target(Target &target, const FrameView &frame,
+                     ByteView converted, std::vector<uint8_t> &data);
+
+  Camera &camera;
+  Converter *converter;
+  const bool use_dmabuf;
+  std::vector<Target> targets;
+  // Camera generation buffers were exported from.
+  unsigned int generation;
+};
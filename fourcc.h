@@ -0,0 +1,39 @@
+#pragma once
+
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+
+// Four character codes. V4L2 and MMAL share the same layout.
+constexpr uint32_t make_fourcc(char a, char b, char c, char d) {
+  return static_cast<uint32_t>(a) | (static_cast<uint32_t>(b) << 8) |
+         (static_cast<uint32_t>(c) << 16) | (static_cast<uint32_t>(d) << 24);
+}
+
+constexpr uint32_t ENCODING_JPEG = make_fourcc('J', 'P', 'E', 'G');
+constexpr uint32_t ENCODING_GIF = make_fourcc('G', 'I', 'F', ' ');
+constexpr uint32_t ENCODING_PNG = make_fourcc('P', 'N', 'G', ' ');
+constexpr uint32_t ENCODING_TGA = make_fourcc('T', 'G', 'A', ' ');
+constexpr uint32_t ENCODING_BMP = make_fourcc('B', 'M', 'P', ' ');
+constexpr uint32_t ENCODING_H264 = make_fourcc('H', '2', '6', '4');
+// MMAL name of planar YUV 4:2:0. V4L2 calls it YU12.
+constexpr uint32_t ENCODING_I420 = make_fourcc('I', '4', '2', '0');
+
+// Four character code as text, e.g. "YUYV".
+inline std::string fourcc_to_string(uint32_t four_cc) {
+  std::string name;
+  for (int i = 0; i < 4; ++i) {
+    name += static_cast<char>((four_cc >> (8 * i)) & 0xFF);
+  }
+  return name;
+}
+
+// Shorter names are padded by spaces. Throws std::invalid_argument when name
+// is empty or too long.
+inline uint32_t fourcc_from_string(const std::string &name) {
+  if (name.empty() || name.size() > 4) {
+    throw std::invalid_argument("Invalid four character code " + name);
+  }
+  const auto padded = name + std::string(4 - name.size(), ' ');
+  return make_fourcc(padded[0], padded[1], padded[2], padded[3]);
+}
@@ -0,0 +1,10 @@
+#pragma once
+
+#include <stdexcept>
+
+// Frame which can't be converted, looked at or encoded, such as a truncated
+// one. Only it is lost, the next frame may be fine.
+class FrameError : public std::runtime_error {
+public:
+  using std::runtime_error::runtime_error;
+};
@@ -0,0 +1,195 @@
+#include "./frame_source.h"
+
+#include <stdexcept>
+#include <string>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <linux/videodev2.h>
+
+#include "./fourcc.h"
+
+std::optional<size_t> raw_frame_size(uint32_t four_cc, uint32_t bytesperline,
+                                     uint32_t height) {
+  const auto luma = size_t(bytesperline) * height;
+  switch (four_cc) {
+  case V4L2_PIX_FMT_YUYV:
+  case V4L2_PIX_FMT_UYVY:
+  case V4L2_PIX_FMT_RGB24:
+  case V4L2_PIX_FMT_BGR24:
+    return luma;
+  case V4L2_PIX_FMT_NV12:
+    return luma + size_t(bytesperline) * ((height + 1) / 2);
+  case V4L2_PIX_FMT_YUV420:
+    return luma + 2 * size_t((bytesperline + 1) / 2) * ((height + 1) / 2);
+  }
+  return std::nullopt;
+}
+
+static uint32_t packed_bytes_per_pixel(uint32_t four_cc) {
+  switch (four_cc) {
+  case V4L2_PIX_FMT_YUYV:
+  case V4L2_PIX_FMT_UYVY:
+    return 2;
+  case V4L2_PIX_FMT_RGB24:
+  case V4L2_PIX_FMT_BGR24:
+    return 3;
+  }
+  return 1;
+}
+
+static std::chrono::microseconds interval_of(double fps) {
+  return std::chrono::microseconds(fps > 0 ? int64_t(1e6 / fps) : 0);
+}
+
+// Fine detail moving right, over colour gradients.
+static void draw_pattern(uint32_t four_cc, uint32_t width, uint32_t height,
+                         uint32_t bytesperline, uint32_t t, uint8_t *out) {
+  const auto luma = [&](uint32_t x, uint32_t y) -> uint8_t {
+    return ((x + t * 8) ^ y) + (x + y) / 4;
+  };
+  const auto u = [&](uint32_t x) -> uint8_t { return x * 255 / width; };
+  const auto v = [&](uint32_t y) -> uint8_t { return y * 255 / height; };
+
+  for (uint32_t y = 0; y < height; ++y) {
+    auto *row = out + size_t(y) * bytesperline;
+    for (uint32_t x = 0; x < width; ++x) {
+      switch (four_cc) {
+      case V4L2_PIX_FMT_YUYV:
+        row[x * 2] = luma(x, y);
+        row[x * 2 + 1] = x % 2 == 0 ? u(x) : v(y);
+        break;
+      case V4L2_PIX_FMT_UYVY:
+        row[x * 2] = x % 2 == 0 ? u(x) : v(y);
+        row[x * 2 + 1] = luma(x, y);
+        break;
+      case V4L2_PIX_FMT_RGB24:
+        row[x * 3] = luma(x, y);
+        row[x * 3 + 1] = u(x);
+        row[x * 3 + 2] = v(y);
+        break;
+      case V4L2_PIX_FMT_BGR24:
+        row[x * 3] = v(y);
+        row[x * 3 + 1] = u(x);
+        row[x * 3 + 2] = luma(x, y);
+        break;
+      default:
+        row[x] = luma(x, y);
+        break;
+      }
+    }
+  }
+
+  auto *chroma = out + size_t(bytesperline) * height;
+  const auto chroma_width = (width + 1) / 2;
+  const auto chroma_height = (height + 1) / 2;
+  if (four_cc == V4L2_PIX_FMT_NV12) {
+    for (uint32_t y = 0; y < chroma_height; ++y) {
+      auto *row = chroma + size_t(y) * bytesperline;
+      for (uint32_t x = 0; x < chroma_width; ++x) {
+        row[x * 2] = u(x * 2);
+        row[x * 2 + 1] = v(y * 2);
+      }
+    }
+  } else if (four_cc == V4L2_PIX_FMT_YUV420) {
+    const auto chroma_stride = (bytesperline + 1) / 2;
+    auto *v_plane = chroma + size_t(chroma_stride) * chroma_height;
+    for (uint32_t y = 0; y < chroma_height; ++y) {
+      for (uint32_t x = 0; x < chroma_width; ++x) {
+        chroma[size_t(y) * chroma_stride + x] = u(x * 2);
+        v_plane[size_t(y) * chroma_stride + x] = v(y * 2);
+      }
+    }
+  }
+}
+
+SyntheticSource::SyntheticSource(uint32_t four_cc, uint32_t width,
+                                 uint32_t height, size_t frame_count,
+                                 double fps)
+    : FrameSource(four_cc, width, height,
+                  width * packed_bytes_per_pixel(four_cc)),
+      frame_count(frame_count), interval(interval_of(fps)) {
+  const auto size = raw_frame_size(four_cc, _bytesperline, height);
+  if (!size.has_value()) {
+    throw std::invalid_argument("Can't generate " +
+                                fourcc_to_string(four_cc) + " frames");
+  }
+  for (uint32_t t = 0; t < PATTERN_FRAMES; ++t) {
+    frames.emplace_back(size.value());
+    draw_pattern(four_cc, width, height, _bytesperline, t,
+                 frames.back().data());
+  }
+}
+
+std::optional<SourceFrame> SyntheticSource::next(void) {
+  if (frame_count != 0 && sequence == frame_count) {
+    return std::nullopt;
+  }
+  const auto &frame = frames[sequence % frames.size()];
+  const auto number = sequence++;
+  return SourceFrame{ByteView(frame.data(), frame.size()), interval * number,
+                     number};
+}
+
+RawFileSource::RawFileSource(const std::filesystem::path &path,
+                             uint32_t four_cc, uint32_t width, uint32_t height,
+                             uint32_t bytesperline, bool loop, double fps)
+    : FrameSource(four_cc, width, height,
+                  bytesperline != 0 ? bytesperline
+                                    : width * packed_bytes_per_pixel(four_cc)),
+      mapped(nullptr), mapped_length(0), loop(loop),
+      interval(interval_of(fps)) {
+  const auto size = raw_frame_size(four_cc, _bytesperline, height);
+  if (!size.has_value() || size.value() == 0) {
+    throw std::invalid_argument(fourcc_to_string(four_cc) +
+                                " frames don't have fixed size");
+  }
+  frame_size = size.value();
+
+  const auto fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    throw std::runtime_error("Cannot open " + path.string() + ": " +
+                             strerror(errno));
+  }
+  struct stat st;
+  if (fstat(fd, &st) == -1) {
+    const auto err = errno;
+    ::close(fd);
+    throw std::runtime_error("Cannot stat " + path.string() + ": " +
+                             strerror(err));
+  }
+  frame_count = st.st_size / frame_size;
+  if (frame_count == 0) {
+    ::close(fd);
+    throw std::runtime_error(path.string() + " is shorter than a frame");
+  }
+
+  mapped_length = frame_count * frame_size;
+  auto *address = mmap(nullptr, mapped_length, PROT_READ, MAP_PRIVATE, fd, 0);
+  const auto err = errno;
+  ::close(fd);
+  if (address == MAP_FAILED) {
+    throw std::runtime_error("Cannot map " + path.string() + ": " +
+                             strerror(err));
+  }
+  mapped = static_cast<const uint8_t *>(address);
+}
+
+RawFileSource::~RawFileSource() {
+  munmap(const_cast<uint8_t *>(mapped), mapped_length);
+}
+
+std::optional<SourceFrame> RawFileSource::next(void) {
+  if (!loop && sequence == frame_count) {
+    return std::nullopt;
+  }
+  const auto number = sequence++;
+  return SourceFrame{
+      ByteView(mapped + (number % frame_count) * frame_size, frame_size),
+      interval * number, number};
+}
@@ -0,0 +1,97 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <optional>
+#include <vector>
+
+#include "./mjpeg.h"
+
+// Size of one raw frame, nullopt for formats without fixed frame size.
+std::optional<size_t> raw_frame_size(uint32_t four_cc, uint32_t bytesperline,
+                                     uint32_t height);
+
+struct SourceFrame {
+  ByteView data;
+  std::chrono::microseconds timestamp;
+  uint32_t sequence;
+};
+
+// Raw frames which don't come from a device, for benchmarks.
+class FrameSource {
+public:
+  virtual ~FrameSource() = default;
+
+  // Frame stays valid until next call. Empty when source ran out.
+  virtual std::optional<SourceFrame> next(void) = 0;
+
+  uint32_t fourcc() const {
+    return _fourcc;
+  }
+  uint32_t width() const {
+    return _width;
+  }
+  uint32_t height() const {
+    return _height;
+  }
+  uint32_t bytesperline() const {
+    return _bytesperline;
+  }
+
+protected:
+  FrameSource(uint32_t four_cc, uint32_t width, uint32_t height,
+              uint32_t bytesperline)
+      : _fourcc(four_cc), _width(width), _height(height),
+        _bytesperline(bytesperline) {}
+
+  uint32_t _fourcc;
+  uint32_t _width, _height;
+  uint32_t _bytesperline;
+};
+
+// Moving pattern in YUYV, UYVY, NV12, YU12, RGB24 or BGR24. A few frames are
+// generated up front and cycled, so generating them isn't measured.
+class SyntheticSource : public FrameSource {
+public:
+  // Endless when frame_count is 0.
+  SyntheticSource(uint32_t four_cc, uint32_t width, uint32_t height,
+                  size_t frame_count = 0, double fps = 30);
+
+  std::optional<SourceFrame> next(void) override;
+
+protected:
+  static constexpr size_t PATTERN_FRAMES = 8;
+
+  std::vector<std::vector<uint8_t>> frames;
+  const size_t frame_count;
+  const std::chrono::microseconds interval;
+  uint32_t sequence = 0;
+};
+
+// Frames recorded back to back in a file, mapped into memory. Starts over at
+// the end of file when looping.
+class RawFileSource : public FrameSource {
+public:
+  RawFileSource(const std::filesystem::path &path, uint32_t four_cc,
+                uint32_t width, uint32_t height, uint32_t bytesperline = 0,
+                bool loop = true, double fps = 30);
+  ~RawFileSource();
+  RawFileSource(const RawFileSource &) = delete;
+  RawFileSource &operator=(const RawFileSource &) = delete;
+
+  std::optional<SourceFrame> next(void) override;
+
+  size_t count() const {
+    return frame_count;
+  }
+
+protected:
+  const uint8_t *mapped;
+  size_t mapped_length;
+  size_t frame_size;
+  size_t frame_count;
+  const bool loop;
+  const std::chrono::microseconds interval;
+  uint32_t sequence = 0;
+};
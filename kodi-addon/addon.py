@@ -1,4 +1,5 @@
 import sys
+import socket
 import subprocess
 import os
 import os.path
@@ -19,10 +20,56 @@ PLUGIN_PATH = addon.getAddonInfo("path")
 CAPTURE_PATH = os.path.join(PLUGIN_PATH, 'resources', 'bin', 'v4l2-mmal-cap')
 CAPTURE_SAVE_PATH = addon.getSetting('capture_path')
 CAPTURE_DEVICE = addon.getSetting('capture_device')
+CAPTURE_SOCKET = addon.getSetting('capture_socket')
+THUMBNAIL_SIZE = '320'
+
+def thumbnail_path(filename):
+    # written by capture next to the image, falls back to the image itself
+    path = os.path.join(CAPTURE_SAVE_PATH, '.thumbnails', filename)
+    if os.path.exists(path):
+        return path
+    return os.path.join(CAPTURE_SAVE_PATH, filename)
+
+def read_manifest():
+    # (filename, thumbnail) of captures newest first, None without a manifest
+    try:
+        with open(os.path.join(CAPTURE_SAVE_PATH, '.manifest')) as f:
+            lines = f.read().split('\n')
+    except IOError:
+        return None
+    entries = {}
+    # last line is still being written unless it is empty
+    for line in lines[:-1]:
+        fields = line.split('\t')
+        if line.startswith('#') or len(fields) != 7:
+            continue
+        # later lines of the same file win
+        entries[fields[0]] = (float(fields[1]), fields[5])
+    captures = sorted(entries.items(), key=lambda entry: entry[1][0], reverse=True)
+    return [(name, thumbnail) for name, (_, thumbnail) in captures]
 
 def build_url(**query):
     return '{}?{}'.format(base_url, urllib.urlencode(query))
 
+def capture_with_daemon():
+    # returns captured path, or None when daemon is not available
+    if not CAPTURE_SOCKET:
+        return None
+    try:
+        s = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        s.connect(CAPTURE_SOCKET)
+    except socket.error:
+        return None
+    try:
+        s.sendall('capture {}\n'.format(CAPTURE_SAVE_PATH))
+        reply = s.makefile().readline().strip()
+    finally:
+        s.close()
+    if not reply.startswith('ok '):
+        gui.Dialog().ok("RPi Capture", "Failed to capture from {}".format(CAPTURE_SOCKET), reply)
+        return ''
+    return reply[3:]
+
 def main_menu():
     plugin.setContent(handle, 'pictures')
 
@@ -39,9 +86,20 @@ def main_menu():
 def album():
     plugin.setPluginCategory(handle, 'Album')
     plugin.setContent(handle, 'pictures')
-    for filename in os.listdir(CAPTURE_SAVE_PATH):
+    captures = read_manifest()
+    if captures is None:
+        # thumbnails and files still being written are hidden
+        captures = [(filename, None) for filename in os.listdir(CAPTURE_SAVE_PATH)
+                    if not filename.startswith('.')]
+    for filename, thumbnail in captures:
         full_path = os.path.join(CAPTURE_SAVE_PATH, filename)
-        item = gui.ListItem(filename, iconImage=full_path, thumbnailImage=full_path)
+        if thumbnail is None:
+            thumbnail = thumbnail_path(filename)
+        elif thumbnail == '-':
+            thumbnail = full_path
+        else:
+            thumbnail = os.path.join(CAPTURE_SAVE_PATH, thumbnail)
+        item = gui.ListItem(filename, iconImage=thumbnail, thumbnailImage=thumbnail)
         item.addContextMenuItems([
             ('Remove', 'xbmc.RunPlugin({})'.format(build_url(action='remove', file=filename)))
         ])
@@ -57,7 +115,12 @@ if __name__ == '__main__':
     if action is None:
         main_menu()
     elif action[0] == 'capture':
-        p = subprocess.Popen([CAPTURE_PATH, CAPTURE_DEVICE], stdout=subprocess.PIPE, stderr=subprocess.PIPE, cwd=CAPTURE_SAVE_PATH)
+        path = capture_with_daemon()
+        if path is not None:
+            if path:
+                xbmc.executebuiltin('ShowPicture({})'.format(path))
+            sys.exit(0)
+        p = subprocess.Popen([CAPTURE_PATH, '-T', THUMBNAIL_SIZE, '-m', CAPTURE_DEVICE], stdout=subprocess.PIPE, stderr=subprocess.PIPE, cwd=CAPTURE_SAVE_PATH)
         ret = p.wait()
         if ret != 0:
             se = p.stderr.read()
@@ -70,4 +133,8 @@ if __name__ == '__main__':
     elif action[0] == 'remove':
         file = args.get('file', None)
         full_path = os.path.join(CAPTURE_SAVE_PATH, file[0])
-        os.remove(full_path)
+        # takes thumbnail and manifest entry along
+        p = subprocess.Popen([CAPTURE_PATH, '--remove', full_path], stderr=subprocess.PIPE)
+        if p.wait() != 0:
+            gui.Dialog().ok("RPi Capture", "Failed to remove {}".format(file[0]), p.stderr.read())
+        xbmc.executebuiltin('Container.Refresh')
@@ -1,61 +1,421 @@
+#include <cmath>
 #include <cstring>
 #include <filesystem>
-#include <chrono>
 #include <limits.h>
+#include <optional>
+#include <signal.h>
+#include <stdexcept>
+#include <vector>
+
+#include <getopt.h> /* getopt_long() */
 
 #include "./camera.h"
+#include "./capture_server.h"
+#include "./convert.h"
+#include "./dmabuf.h"
 #include "./encoder.h"
+#include "./fan_out.h"
+#include "./output.h"
+#include "./output_writer.h"
+#include "./fourcc.h"
+#include "./manifest.h"
+#include "./matroska.h"
+#include "./metrics.h"
+#include "./mjpeg.h"
+#include "./motion.h"
+#include "./multi_capture.h"
+#include "./pipeline.h"
+#include "./recording.h"
+#include "./sink.h"
+#include "./size_budget.h"
+#include "./stream_server.h"
+#include "./thumbnail.h"
+#include "./timelapse.h"
 
-#include <interface/mmal/mmal_encodings.h>
+static void usage(const char *name) {
+  printf("Usage: %s [OPTIONS] INPUT_DEVICE [OUTPUT_PATH]\n"
+         "       %s --remove FILE\n"
+         "Default OUTPUT_PATH is <captured date>.jpg\n"
+         "With several devices, files are named <stem>-<device><ext>\n"
+         "OUTPUT_PATH ending in .mkv records H.264 video with --continuous\n"
+         "With --interval or --cron, --continuous N stops after N shots\n"
+         "--output SPEC is PATH[:size=N][:quality=Q][:bytes=B][:restart=R], "
+         "scaled to fit NxN\n"
+         "\n"
+         "Options:\n"
+         "  -b, --burst N        capture N consecutive frames into numbered "
+         "files and report their timing\n"
+         "  -c, --continuous N   capture N frames into numbered files, until "
+         "interrupted when N is 0\n"
+         "  -d, --daemon SOCKET  keep capturing and serve capture requests on "
+         "unix socket\n"
+         "  -s, --stream PORT    serve MJPEG stream over HTTP on PORT\n"
+         "  -e, --encoder NAME   encoder backend: auto, mmal or software "
+         "(default: auto)\n"
+         "  -n, --no-dmabuf      always copy frames into encoder\n"
+         "  -i, --i420           convert frames into I420 before encoding\n"
+         "  -S, --size WxH       capture size, closest one device has "
+         "(default: current)\n"
+         "  -f, --format FOURCC  capture format, e.g. YUYV or MJPG\n"
+         "  -r, --fps RATE       lowest frame rate to pick (default: "
+         "highest)\n"
+         "  -p, --prefer KIND    format to prefer: any, compressed or native "
+         "(default: any)\n"
+         "  -a, --add-device DEV also capture from DEV, can be repeated\n"
+         "  -u, --on-signal      capture a frame of every device on each "
+         "SIGUSR1\n"
+         "  -y, --sync           capture sets of frames taken closest in time "
+         "from all devices\n"
+         "  -B, --buffers N      V4L2 buffers to queue (default: 4)\n"
+         "  -F, --fresh          hand out only the newest queued frame\n"
+         "  -w, --warmup N       drop N frames after capture starts\n"
+         "  -M, --metrics FILE   write stage timings and counters into FILE "
+         "every second\n"
+         "  -R, --record PATH    also record raw frames into PATH and "
+         "PATH.idx, with -c or -b\n"
+         "  -T, --thumbnails N   also write thumbnails of at most NxN into "
+         ".thumbnails next to captures\n"
+         "  -m, --manifest       list captures in .manifest next to them\n"
+         "  -x, --remove FILE    remove capture, its thumbnail and manifest "
+         "entry, then exit\n"
+         "  -W, --writer NAME    output writer: auto, io_uring or threads "
+         "(default: auto)\n"
+         "  -Y, --fsync POLICY   flush before publishing files: none, data or "
+         "full (default: data)\n"
+         "  -V, --bitrate BPS    video bitrate (default: 4000000)\n"
+         "  -g, --gop N          video frames from one keyframe to the next "
+         "(default: 30)\n"
+         "  -P, --profile NAME   H.264 profile: baseline, main or high "
+         "(default: high)\n"
+         "  -I, --interval SECS  take time-lapse shots every SECS seconds into "
+         "numbered files\n"
+         "  -C, --cron EXPR      take time-lapse shots by crontab line, e.g. "
+         "\"*/5 6-20 * * *\"\n"
+         "  -D, --motion LEVEL   with -c, only keep frames in which a block "
+         "differs from background\n"
+         "                       by more than LEVEL on average (e.g. 10)\n"
+         "  -A, --motion-area P  percent of blocks which must differ "
+         "(default: 0.5)\n"
+         "  -O, --roi X,Y,WxH    only watch this region for motion, can be "
+         "repeated\n"
+         "  -q, --quality Q      JPEG quality from 1 to 100 (default: of the "
+         "encoder)\n"
+         "  -Q, --max-bytes N    pick the highest JPEG quality at which each "
+         "frame fits N bytes\n"
+         "  -k, --restart N      put a JPEG restart marker every N MCUs, for "
+         "parallel decoding\n"
+         "  -o, --output SPEC    also encode each one-shot or time-lapse "
+         "capture into SPEC, can be\n"
+         "                       repeated\n"
+         "  -l, --list-formats   print formats, sizes and rates of device and "
+         "exit\n"
+         "  -h, --help           print this message\n",
+         name, name);
+}
 
-uint32_t fourcc_from_path(const std::filesystem::path &p) {
-  if (!p.has_extension()) {
-    throw std::invalid_argument("Output path doesn't have extension. extension is required.");
-  }
-  const auto s = p.extension().string();
+static void on_stop_signal(int) {
+  Camera::cancel_recovery();
+  CaptureServer::request_stop();
+  MultiCapture::request_stop();
+  Pipeline::request_stop();
+  StreamServer::request_stop();
+  TimeLapse::request_stop();
+}
 
-  if (s == ".jpg" || s == ".jpeg") {
-    return MMAL_ENCODING_JPEG;
+static void on_snapshot_signal(int) { MultiCapture::request_snapshot(); }
+
+// Converter of camera frames into I420, nullptr when frames are compressed
+// and passed through.
+static std::unique_ptr<Converter> create_i420_converter(const Camera &camera) {
+  if (is_compressed_fourcc(camera.fourcc())) {
+    return nullptr;
   }
-  if (s == ".gif") {
-    return MMAL_ENCODING_GIF;
+  if (!Converter::supports(camera.fourcc())) {
+    throw std::invalid_argument(camera.device_path().string() +
+                                " format can't be converted to I420");
   }
-  if (s == ".png") {
-    return MMAL_ENCODING_PNG;
+  auto converter = std::make_unique<Converter>(
+      camera.fourcc(), camera.width(), camera.height(), camera.bytesperline());
+  fprintf(stderr, "Converting to I420 with %s kernels\n",
+          converter->kernels_name());
+  return converter;
+}
+
+// Capture from camera and extra devices in one event loop, sharing encoders.
+static void capture_devices(Camera &camera,
+                            const std::vector<std::filesystem::path> &extra,
+                            const FormatRequest &format_request,
+                            const QueueSettings &queue, bool to_i420,
+                            EncoderBackend backend, OutputWriter &writer,
+                            const std::filesystem::path &output_path,
+                            uint32_t output_four_cc, bool use_dmabuf,
+                            size_t frame_count, bool on_signal,
+                            bool synchronized, Manifest *manifest) {
+  std::vector<std::unique_ptr<Camera>> extra_cameras;
+  std::vector<Camera *> cameras{&camera};
+  for (const auto &device : extra) {
+    extra_cameras.push_back(std::make_unique<Camera>(device, IOMethod::MMAP,
+                                                     format_request, queue));
+    cameras.push_back(extra_cameras.back().get());
   }
-  if (s == ".tga") {
-    return MMAL_ENCODING_TGA;
+
+  std::vector<std::unique_ptr<Converter>> converters;
+  std::vector<MultiCapture::Device> devices;
+  for (const auto camera : cameras) {
+    converters.push_back(to_i420 ? create_i420_converter(*camera) : nullptr);
+    devices.push_back(MultiCapture::Device{
+        *camera, converters.back().get(),
+        device_output_path(output_path, camera->device_path())});
   }
-  if (s == ".bmp") {
-    return MMAL_ENCODING_BMP;
+
+  EncoderPool pool{backend};
+  MultiCapture capture{devices, pool, writer, output_four_cc, use_dmabuf,
+                       synchronized, manifest};
+
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = on_stop_signal;
+  sigaction(SIGINT, &action, nullptr);
+  sigaction(SIGTERM, &action, nullptr);
+  if (on_signal) {
+    action.sa_handler = on_snapshot_signal;
+    sigaction(SIGUSR1, &action, nullptr);
   }
 
-  throw std::invalid_argument("Can't specify output encoder from extension of output path");
+  for (const auto camera : cameras) {
+    camera->start_capturing();
+  }
+  capture.run(frame_count, on_signal);
+  for (const auto camera : cameras) {
+    camera->stop_capturing();
+  }
 }
 
-void append_filename(std::filesystem::path& dir) {
-    const auto now = std::chrono::system_clock::now();
-    const auto now_c = std::chrono::system_clock::to_time_t(now);
-    char date_buf[32];
+static int run(int argc, char **argv) {
+  static const option long_options[] = {
+      {"burst", required_argument, nullptr, 'b'},
+      {"continuous", required_argument, nullptr, 'c'},
+      {"daemon", required_argument, nullptr, 'd'},
+      {"stream", required_argument, nullptr, 's'},
+      {"encoder", required_argument, nullptr, 'e'},
+      {"no-dmabuf", no_argument, nullptr, 'n'},
+      {"i420", no_argument, nullptr, 'i'},
+      {"size", required_argument, nullptr, 'S'},
+      {"format", required_argument, nullptr, 'f'},
+      {"fps", required_argument, nullptr, 'r'},
+      {"prefer", required_argument, nullptr, 'p'},
+      {"add-device", required_argument, nullptr, 'a'},
+      {"on-signal", no_argument, nullptr, 'u'},
+      {"sync", no_argument, nullptr, 'y'},
+      {"buffers", required_argument, nullptr, 'B'},
+      {"fresh", no_argument, nullptr, 'F'},
+      {"warmup", required_argument, nullptr, 'w'},
+      {"metrics", required_argument, nullptr, 'M'},
+      {"record", required_argument, nullptr, 'R'},
+      {"writer", required_argument, nullptr, 'W'},
+      {"fsync", required_argument, nullptr, 'Y'},
+      {"thumbnails", required_argument, nullptr, 'T'},
+      {"manifest", no_argument, nullptr, 'm'},
+      {"remove", required_argument, nullptr, 'x'},
+      {"bitrate", required_argument, nullptr, 'V'},
+      {"gop", required_argument, nullptr, 'g'},
+      {"profile", required_argument, nullptr, 'P'},
+      {"interval", required_argument, nullptr, 'I'},
+      {"cron", required_argument, nullptr, 'C'},
+      {"motion", required_argument, nullptr, 'D'},
+      {"motion-area", required_argument, nullptr, 'A'},
+      {"roi", required_argument, nullptr, 'O'},
+      {"quality", required_argument, nullptr, 'q'},
+      {"max-bytes", required_argument, nullptr, 'Q'},
+      {"restart", required_argument, nullptr, 'k'},
+      {"output", required_argument, nullptr, 'o'},
+      {"list-formats", no_argument, nullptr, 'l'},
+      {"help", no_argument, nullptr, 'h'},
+      {nullptr, 0, nullptr, 0},
+  };
 
-    strftime(date_buf, 32, "%F %T.jpg", std::localtime(&now_c));
-    dir /= date_buf;
-}
+  std::filesystem::path socket_path;
+  std::optional<size_t> continuous_count;
+  bool burst = false;
+  std::optional<uint16_t> stream_port;
+  bool use_dmabuf = true;
+  bool to_i420 = false;
+  FormatRequest format_request;
+  format_request.native_formats = encoder_native_formats();
+  QueueSettings queue;
+  std::filesystem::path metrics_path;
+  std::filesystem::path record_path;
+  bool list_formats = false;
+  std::vector<std::filesystem::path> extra_devices;
+  bool on_signal = false;
+  bool synchronized = false;
+  auto backend = EncoderBackend::AUTO;
+  auto writer_backend = WriterBackend::AUTO;
+  auto fsync_policy = FsyncPolicy::DATA;
+  uint32_t thumbnail_size = 0;
+  bool use_manifest = false;
+  std::filesystem::path remove_path;
+  VideoSettings video;
+  std::optional<Schedule> schedule;
+  bool detect_motion = false;
+  MotionSettings motion;
+  std::vector<OutputSpec> extra_outputs;
+  // Options of OUTPUT_PATH.
+  OutputSpec main_output;
+  int opt;
+  while ((opt = getopt_long(argc, argv,
+                            "b:c:d:s:e:niS:f:r:p:a:uyB:Fw:M:R:W:Y:T:mx:V:g:P:I:C:D:A:O:q:Q:k:o:lh",
+                            long_options, nullptr)) != -1) {
+    switch (opt) {
+    case 'b':
+      continuous_count = std::stoul(optarg);
+      burst = true;
+      break;
+    case 'c':
+      continuous_count = std::stoul(optarg);
+      burst = false;
+      break;
+    case 'd':
+      socket_path = optarg;
+      break;
+    case 's':
+      stream_port = std::stoul(optarg);
+      break;
+    case 'e':
+      backend = encoder_backend_from_name(optarg);
+      break;
+    case 'n':
+      use_dmabuf = false;
+      break;
+    case 'i':
+      to_i420 = true;
+      break;
+    case 'S': {
+      uint32_t width, height;
+      if (sscanf(optarg, "%ux%u", &width, &height) != 2) {
+        usage(argv[0]);
+        return -1;
+      }
+      format_request.width = width;
+      format_request.height = height;
+      break;
+    }
+    case 'f':
+      format_request.four_cc = fourcc_from_string(optarg);
+      break;
+    case 'r':
+      format_request.fps = std::stod(optarg);
+      break;
+    case 'p':
+      format_request.prefer = format_preference_from_name(optarg);
+      break;
+    case 'a':
+      extra_devices.push_back(optarg);
+      break;
+    case 'u':
+      on_signal = true;
+      break;
+    case 'y':
+      synchronized = true;
+      break;
+    case 'B':
+      queue.buffer_count = std::stoul(optarg);
+      break;
+    case 'F':
+      queue.freshest = true;
+      break;
+    case 'w':
+      queue.warmup_frames = std::stoul(optarg);
+      break;
+    case 'M':
+      metrics_path = optarg;
+      break;
+    case 'R':
+      record_path = optarg;
+      break;
+    case 'W':
+      writer_backend = writer_backend_from_name(optarg);
+      break;
+    case 'Y':
+      fsync_policy = fsync_policy_from_name(optarg);
+      break;
+    case 'T':
+      thumbnail_size = std::stoul(optarg);
+      break;
+    case 'm':
+      use_manifest = true;
+      break;
+    case 'x':
+      remove_path = optarg;
+      break;
+    case 'V':
+      video.bitrate = std::stoul(optarg);
+      break;
+    case 'g':
+      video.gop = std::stoul(optarg);
+      break;
+    case 'P':
+      video.profile = h264_profile_from_name(optarg);
+      break;
+    case 'I':
+      schedule = Schedule::every(
+          std::chrono::milliseconds(std::llround(std::stod(optarg) * 1000)),
+          std::chrono::system_clock::now());
+      break;
+    case 'C':
+      schedule = Schedule::cron(optarg);
+      break;
+    case 'D':
+      motion.threshold = std::stoul(optarg);
+      detect_motion = true;
+      break;
+    case 'A':
+      motion.min_area = std::stod(optarg);
+      break;
+    case 'O':
+      motion.regions.push_back(region_from_string(optarg));
+      break;
+    case 'q':
+      main_output.quality = std::stoi(optarg);
+      if (main_output.quality < 1 || main_output.quality > 100) {
+        fprintf(stderr, "--quality is from 1 to 100\n");
+        return -1;
+      }
+      break;
+    case 'Q':
+      main_output.max_bytes = std::stoul(optarg);
+      break;
+    case 'k':
+      main_output.restart_interval = std::stoul(optarg);
+      break;
+    case 'o':
+      extra_outputs.push_back(output_spec_from_string(optarg));
+      break;
+    case 'l':
+      list_formats = true;
+      break;
+    case 'h':
+      usage(argv[0]);
+      return 0;
+    default:
+      usage(argv[0]);
+      return -1;
+    }
+  }
 
-int main(int argc, char **argv) {
-  if (argc < 2) {
-    printf("Usage: %s INPUT_DEVICE [OUTPUT_PATH]\nDefault OUTPUT_PATH is <captured date>.jpg", argv[0]);
+  if (!remove_path.empty()) {
+    return remove_capture(remove_path) ? 0 : 1;
+  }
+
+  if (optind >= argc) {
+    usage(argv[0]);
     return -1;
   }
 
-  std::filesystem::path input_path = argv[1];
+  std::filesystem::path input_path = argv[optind];
   std::filesystem::path output_path;
-  if (argc >= 3) {
-    output_path = argv[2];
-
-    if (std::filesystem::is_directory(output_path)) {
-      append_filename(output_path);
-    }
+  if (optind + 1 < argc) {
+    output_path = argv[optind + 1];
   } else {
     char cwd[PATH_MAX];
     if (getcwd(cwd, sizeof(cwd)) == NULL) {
@@ -63,35 +423,329 @@ int main(int argc, char **argv) {
       return 1;
     } else {
       output_path = cwd;
-      append_filename(output_path);
     }
   }
 
-  Camera camera{input_path, IOMethod::MMAP};
+  const bool output_is_dir = std::filesystem::is_directory(output_path);
+  std::filesystem::path output_dir =
+      output_is_dir ? output_path : output_path.parent_path();
+  if (output_is_dir) {
+    append_filename(output_path);
+  }
+  // Stream is always MJPEG.
+  const auto output_four_cc =
+      stream_port.has_value() ? ENCODING_JPEG : fourcc_from_path(output_path);
+
+  // Written last as it is destroyed, after every other stage finished.
+  std::optional<MetricsWriter> metrics_writer;
+  if (!metrics_path.empty()) {
+    metrics_writer.emplace(metrics_path, std::chrono::seconds(1));
+  }
+
+  Camera camera{input_path, IOMethod::MMAP, format_request, queue};
+
+  if (list_formats) {
+    for (const auto &mode : camera.modes()) {
+      printf("%s %ux%u %.2f fps\n", fourcc_to_string(mode.four_cc).c_str(),
+             mode.width, mode.height, mode.fps());
+    }
+    return 0;
+  }
+
+  if (!record_path.empty() && !continuous_count.has_value()) {
+    fprintf(stderr, "--record needs --continuous or --burst\n");
+    return -1;
+  }
+  if (thumbnail_size != 0 &&
+      (stream_port.has_value() || !extra_devices.empty() || on_signal ||
+       synchronized)) {
+    fprintf(stderr, "--thumbnails only works with a single device, "
+                    "without --stream\n");
+    return -1;
+  }
+  if (thumbnail_size != 0 && !Downscaler::supports(camera.fourcc())) {
+    fprintf(stderr, "--thumbnails needs a raw capture format\n");
+    return -1;
+  }
+  const bool record_video = output_four_cc == ENCODING_H264;
+  if (record_video &&
+      (!continuous_count.has_value() || burst || !socket_path.empty() ||
+       !extra_devices.empty() || on_signal || synchronized ||
+       thumbnail_size != 0)) {
+    fprintf(stderr, "Video is only recorded from a single device with "
+                    "--continuous, without thumbnails\n");
+    return -1;
+  }
+  if (detect_motion &&
+      (!continuous_count.has_value() || burst || !socket_path.empty() ||
+       stream_port.has_value() || !extra_devices.empty() || on_signal ||
+       synchronized || record_video || schedule.has_value())) {
+    fprintf(stderr, "--motion only works with --continuous from a single "
+                    "device, without video\n");
+    return -1;
+  }
+  if (detect_motion && !MotionDetector::supports(camera.fourcc())) {
+    fprintf(stderr, "--motion needs a raw capture format\n");
+    return -1;
+  }
+  const bool time_lapse = schedule.has_value();
+  if (time_lapse &&
+      (burst || !socket_path.empty() || stream_port.has_value() ||
+       !extra_devices.empty() || on_signal || synchronized ||
+       !record_path.empty() || record_video)) {
+    fprintf(stderr, "--interval and --cron take still images from a single "
+                    "device, without --daemon, --stream or --record\n");
+    return -1;
+  }
+  // One-shot and time-lapse captures are encoded into every output.
+  const bool fan_out =
+      time_lapse || (!continuous_count.has_value() && socket_path.empty() &&
+                     !stream_port.has_value() && extra_devices.empty() &&
+                     !on_signal && !synchronized);
+  if (!extra_outputs.empty() && (!fan_out || record_video)) {
+    fprintf(stderr, "--output only works with one-shot or time-lapse still "
+                    "images from a single device\n");
+    return -1;
+  }
+  if ((main_output.quality != 0 || main_output.max_bytes != 0 ||
+       main_output.restart_interval != 0) &&
+      (!extra_devices.empty() || on_signal || synchronized || record_video)) {
+    fprintf(stderr, "--quality, --max-bytes and --restart only work for "
+                    "still images from a single device\n");
+    return -1;
+  }
+  if (main_output.max_bytes != 0 &&
+      (output_four_cc != ENCODING_JPEG ||
+       is_compressed_fourcc(camera.fourcc()) || !socket_path.empty())) {
+    fprintf(stderr, "--max-bytes only works for JPEG of a raw capture "
+                    "format, without --daemon\n");
+    return -1;
+  }
+
+  // Thumbnails are written with captures, so manifest can point at them.
+  std::optional<Manifest> manifest;
+  if (use_manifest) {
+    manifest.emplace(thumbnail_size != 0);
+  }
 
-  Encoder encoder{camera.fourcc(), camera.width(), camera.height(), fourcc_from_path(output_path)};
+  // Destroyed after the stages using it, once every file is published.
+  const auto writer = OutputWriter::create(writer_backend, fsync_policy);
+  fprintf(stderr, "Output writer: %s, fsync %s\n",
+          writer_backend_name(writer->backend()),
+          fsync_policy_name(fsync_policy));
+
+  if (!extra_devices.empty() || on_signal || synchronized) {
+    if (!socket_path.empty() || stream_port.has_value() || burst ||
+        !record_path.empty()) {
+      fprintf(stderr, "Several devices, --on-signal and --sync only work "
+                      "with continuous or one-shot capture\n");
+      return -1;
+    }
+    // Without count, take one frame of every device, or keep taking them on
+    // each signal.
+    const size_t frame_count =
+        continuous_count.value_or(on_signal ? 0 : 1);
+    capture_devices(camera, extra_devices, format_request, queue, to_i420,
+                    backend, *writer, output_path, output_four_cc, use_dmabuf,
+                    frame_count, on_signal, synchronized,
+                    manifest ? &*manifest : nullptr);
+    return 0;
+  }
+
+  std::unique_ptr<Converter> converter;
+  if (to_i420) {
+    converter = create_i420_converter(camera);
+    // Converted frames are copied into encoder anyway.
+    use_dmabuf = use_dmabuf && !converter;
+  }
+
+  const auto input_four_cc = converter ? ENCODING_I420 : camera.fourcc();
+  std::unique_ptr<Encoder> encoder;
+  // Outputs lease encoders of their own.
+  EncoderPool pool{backend};
+  std::optional<FanOut> outputs;
+  if (fan_out) {
+    main_output.path = output_path;
+    std::vector<OutputSpec> specs{main_output};
+    specs.insert(specs.end(), extra_outputs.begin(), extra_outputs.end());
+    outputs.emplace(camera, pool, specs, use_dmabuf, converter.get());
+    for (size_t i = 0; i < outputs->size(); ++i) {
+      fprintf(stderr, "Output %s: %ux%u, %s encoder\n",
+              outputs->spec(i).path.c_str(), outputs->width(i),
+              outputs->height(i), encoder_backend_name(outputs->backend(i)));
+    }
+  } else if (record_video) {
+    if (camera.fps() > 0) {
+      video.fps = camera.fps();
+    }
+    encoder = Encoder::create_video(backend, input_four_cc, camera.width(),
+                                    camera.height(), video,
+                                    converter ? 0 : camera.bytesperline());
+    fprintf(stderr, "H.264 %s profile, %u bit/s, keyframe every %u frames\n",
+            h264_profile_name(video.profile), video.bitrate, video.gop);
+  } else {
+    encoder = Encoder::create(backend, input_four_cc, camera.width(),
+                              camera.height(), output_four_cc,
+                              converter ? 0 : camera.bytesperline());
+  }
+  std::optional<SizeBudget> budget;
+  if (encoder) {
+    fprintf(stderr, "Encoder backend: %s\n",
+            encoder_backend_name(encoder->backend()));
+    if (main_output.quality != 0) {
+      encoder->set_quality(main_output.quality);
+    }
+    if (main_output.restart_interval != 0) {
+      encoder->set_restart_interval(main_output.restart_interval);
+    }
+    if (main_output.max_bytes != 0) {
+      budget.emplace(*encoder, main_output.max_bytes, main_output.quality);
+    }
+  }
+
+  std::unique_ptr<Thumbnailer> thumbnailer;
+  if (thumbnail_size != 0) {
+    // Pipeline hands converted frames over, the others camera frames.
+    const auto converted =
+        converter && continuous_count.has_value() && !time_lapse;
+    thumbnailer = std::make_unique<Thumbnailer>(
+        converted ? ENCODING_I420 : camera.fourcc(), camera.width(),
+        camera.height(), converted ? 0 : camera.bytesperline(), backend,
+        output_four_cc, thumbnail_size);
+    fprintf(stderr, "Thumbnails: %ux%u\n", thumbnailer->width(),
+            thumbnailer->height());
+  }
 
   camera.start_capturing();
 
+  if (!socket_path.empty() || continuous_count.has_value() ||
+      stream_port.has_value() || time_lapse) {
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    // No SA_RESTART, so blocking accept() and epoll_wait() return on signal.
+    action.sa_handler = on_stop_signal;
+    sigaction(SIGINT, &action, nullptr);
+    sigaction(SIGTERM, &action, nullptr);
+  }
+
+  if (!socket_path.empty()) {
+    CaptureServer server{socket_path, camera, *encoder, *writer,
+                         output_four_cc, output_dir.empty() ? "." : output_dir,
+                         use_dmabuf, converter.get(), thumbnailer.get(),
+                         manifest ? &*manifest : nullptr};
+    server.run();
+    camera.stop_capturing();
+    return 0;
+  }
+
+  if (time_lapse) {
+    TimeLapse lapse{camera, *outputs, *writer, *schedule, thumbnailer.get(),
+                    manifest ? &*manifest : nullptr};
+    lapse.run(continuous_count.value_or(0));
+    camera.stop_capturing();
+    return 0;
+  }
+
+  if (continuous_count.has_value()) {
+    DmabufHandoff handoff{camera, *encoder, use_dmabuf};
+    handoff.set_budget(budget ? &*budget : nullptr);
+    std::unique_ptr<Recorder> recorder;
+    if (!record_path.empty()) {
+      recorder = std::make_unique<Recorder>(
+          record_path, camera.fourcc(), camera.width(), camera.height(),
+          camera.bytesperline(), camera.buffer_length(0));
+    }
+    std::optional<MatroskaWriter> muxer;
+    if (record_video) {
+      muxer.emplace(output_path, camera.width(), camera.height(),
+                    fsync_policy);
+    }
+    std::optional<MotionDetector> detector;
+    if (detect_motion) {
+      detector.emplace(camera.fourcc(), camera.width(), camera.height(),
+                       camera.bytesperline(), motion);
+      fprintf(stderr, "Motion: every %u pixels sampled, %zu blocks watched, "
+                      "%s kernels\n",
+              detector->step(), detector->watched_blocks(),
+              detector->kernels_name());
+    }
+    // Pipeline converts on its own stage.
+    Pipeline pipeline{camera, handoff, *writer, output_path, burst,
+                      converter.get(), recorder.get(), thumbnailer.get(),
+                      manifest ? &*manifest : nullptr,
+                      muxer ? &*muxer : nullptr,
+                      detector ? &*detector : nullptr};
+    pipeline.run(continuous_count.value());
+    camera.stop_capturing();
+    return 0;
+  }
+
+  if (stream_port.has_value()) {
+    DmabufHandoff handoff{camera, *encoder, use_dmabuf};
+    handoff.set_converter(converter.get());
+    handoff.set_budget(budget ? &*budget : nullptr);
+    StreamServer server{stream_port.value(), camera, handoff};
+    server.run();
+    camera.stop_capturing();
+    return 0;
+  }
+
+  const auto requested = monotonic_now();
   while (true) {
-    const auto frame = camera.read_frame();
+    const auto frame = camera.read_frame_recovering();
     if (frame.length() == 0) {
       fprintf(stderr, "Read 0 sized frame. retry\n");
     } else {
-      auto out = fopen(output_path.c_str(), "wb");
       fprintf(stderr, "Read raw input: %lu bytes\n", frame.length());
-      const auto encoded = encoder.encode(frame.data(), frame.length());
-      fprintf(stderr, "Encoded : %lu bytes\n", encoded.size());
-      fwrite(reinterpret_cast<const char *>(encoded.data()), 1, encoded.size(),
-             out);
-      fclose(out);
+      report_latency(camera, frame, requested);
+      auto encoded = outputs->encode(frame, *writer);
+      if (thumbnailer && !encoded.front().empty()) {
+        thumbnailer->write(*writer, output_path, frame.data(),
+                           frame.length());
+      }
+      // Every output is written, even when an earlier one failed.
+      bool written = true;
+      for (size_t i = 0; i < encoded.size(); ++i) {
+        if (encoded[i].empty()) {
+          written = false;
+          continue;
+        }
+        const auto &path = outputs->spec(i).path;
+        const auto size = encoded[i].size();
+        if (!writer->write_now(path, std::move(encoded[i]))) {
+          written = false;
+          continue;
+        }
+        if (manifest) {
+          // Only the first output has a thumbnail.
+          manifest->record(path, outputs->width(i), outputs->height(i),
+                           frame.timestamp(), frame.sequence(), size, i == 0);
+        }
+        fprintf(stderr, "Encoded %s: %zu bytes\n", path.c_str(), size);
+      }
+      if (!written) {
+        return 1;
+      }
       break;
     }
   }
 
   camera.stop_capturing();
 
-  fprintf(stdout, output_path.c_str());
+  // One path per line.
+  for (size_t i = 0; i < outputs->size(); ++i) {
+    fprintf(stdout, i == 0 ? "%s" : "\n%s", outputs->spec(i).path.c_str());
+  }
 
   return 0;
 }
+
+int main(int argc, char **argv) {
+  try {
+    return run(argc, argv);
+  } catch (const std::exception &e) {
+    // Camera which can't be reconnected ends up here too.
+    fprintf(stderr, "%s\n", e.what());
+    return 1;
+  }
+}
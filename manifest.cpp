@@ -0,0 +1,263 @@
+#include "./manifest.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "./camera.h"
+#include "./thumbnail.h"
+
+static const char HEADER[] = "#v4l2-mmal-cap manifest 1\n";
+
+std::filesystem::path manifest_path(const std::filesystem::path &directory) {
+  return (directory.empty() ? std::filesystem::path(".") : directory) /
+         ".manifest";
+}
+
+static std::string format_entry(const ManifestEntry &entry) {
+  char buf[128];
+  snprintf(buf, sizeof(buf), "\t%lld.%06lld\t%u\t%u\t%llu\t",
+           static_cast<long long>(entry.time.count() / 1000000),
+           static_cast<long long>(entry.time.count() % 1000000), entry.width,
+           entry.height, static_cast<unsigned long long>(entry.size));
+  return entry.name + buf +
+         (entry.thumbnail.empty() ? "-" : entry.thumbnail) + "\t" +
+         std::to_string(entry.sequence) + "\n";
+}
+
+static bool parse_entry(const std::string &line, ManifestEntry &entry) {
+  std::vector<std::string> fields;
+  size_t start = 0;
+  while (true) {
+    const auto tab = line.find('\t', start);
+    fields.push_back(line.substr(start, tab - start));
+    if (tab == std::string::npos) {
+      break;
+    }
+    start = tab + 1;
+  }
+  if (fields.size() != 7 || fields[0].empty()) {
+    return false;
+  }
+
+  char *end;
+  const auto seconds = strtod(fields[1].c_str(), &end);
+  if (*end != '\0') {
+    return false;
+  }
+  entry.name = fields[0];
+  entry.time = std::chrono::microseconds(
+      static_cast<long long>(seconds * 1e6 + (seconds < 0 ? -0.5 : 0.5)));
+  entry.width = strtoul(fields[2].c_str(), nullptr, 10);
+  entry.height = strtoul(fields[3].c_str(), nullptr, 10);
+  entry.size = strtoull(fields[4].c_str(), nullptr, 10);
+  entry.thumbnail = fields[5] == "-" ? std::string() : fields[5];
+  entry.sequence = strtoul(fields[6].c_str(), nullptr, 10);
+  return true;
+}
+
+// Open manifest and lock it. Compaction may rename a new file over path
+// while waiting for the lock, so it is opened again until the locked file is
+// the one at path. Returns -1 with errno set on failure.
+static int open_locked(const std::filesystem::path &path, int flags) {
+  while (true) {
+    const auto fd = open(path.c_str(), flags | O_CLOEXEC, 0644);
+    if (fd == -1) {
+      return -1;
+    }
+    struct stat opened, current;
+    if (flock(fd, LOCK_EX) == -1 || fstat(fd, &opened) == -1) {
+      const auto error = errno;
+      close(fd);
+      errno = error;
+      return -1;
+    }
+    if (stat(path.c_str(), &current) == 0 &&
+        current.st_ino == opened.st_ino && current.st_dev == opened.st_dev) {
+      return fd;
+    }
+    close(fd);
+  }
+}
+
+static bool write_all(int fd, const std::string &text) {
+  size_t written = 0;
+  while (written < text.size()) {
+    const auto r = ::write(fd, text.data() + written, text.size() - written);
+    if (r == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    written += r;
+  }
+  return true;
+}
+
+static bool read_all(int fd, std::string &text) {
+  char buf[65536];
+  while (true) {
+    const auto r = ::read(fd, buf, sizeof(buf));
+    if (r == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    if (r == 0) {
+      return true;
+    }
+    text.append(buf, r);
+  }
+}
+
+// Complete lines of text, without the partial one a writer may be adding.
+static std::vector<std::string> complete_lines(const std::string &text) {
+  std::vector<std::string> lines;
+  size_t start = 0;
+  while (true) {
+    const auto newline = text.find('\n', start);
+    if (newline == std::string::npos) {
+      return lines;
+    }
+    lines.push_back(text.substr(start, newline - start));
+    start = newline + 1;
+  }
+}
+
+std::vector<ManifestEntry>
+read_manifest(const std::filesystem::path &directory) {
+  std::vector<ManifestEntry> entries;
+  const auto fd = open(manifest_path(directory).c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    return entries;
+  }
+  std::string text;
+  const auto ok = read_all(fd, text);
+  close(fd);
+  if (!ok) {
+    return entries;
+  }
+
+  for (const auto &line : complete_lines(text)) {
+    ManifestEntry entry;
+    if (!line.empty() && line[0] != '#' && parse_entry(line, entry)) {
+      entries.push_back(std::move(entry));
+    }
+  }
+  return entries;
+}
+
+// Rewrite manifest of directory without lines of name.
+static bool compact_manifest(const std::filesystem::path &directory,
+                             const std::string &name) {
+  const auto path = manifest_path(directory);
+  const auto fd = open_locked(path, O_RDONLY);
+  if (fd == -1) {
+    if (errno == ENOENT) {
+      return true;
+    }
+    fprintf(stderr, "Failed to open %s: %s\n", path.c_str(), strerror(errno));
+    return false;
+  }
+
+  std::string text;
+  if (!read_all(fd, text)) {
+    fprintf(stderr, "Failed to read %s: %s\n", path.c_str(), strerror(errno));
+    close(fd);
+    return false;
+  }
+  std::string kept = HEADER;
+  for (const auto &line : complete_lines(text)) {
+    ManifestEntry entry;
+    if (!line.empty() && line[0] != '#' && parse_entry(line, entry) &&
+        entry.name != name) {
+      kept += line + "\n";
+    }
+  }
+
+  // Lock is held until the new file is in place, appenders then find it.
+  auto temp_path = path;
+  temp_path += "." + std::to_string(getpid()) + ".tmp";
+  const auto temp_fd = open(temp_path.c_str(),
+                            O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  auto ok = temp_fd != -1 && write_all(temp_fd, kept) && fsync(temp_fd) == 0;
+  if (temp_fd != -1 && close(temp_fd) == -1) {
+    ok = false;
+  }
+  ok = ok && rename(temp_path.c_str(), path.c_str()) == 0;
+  if (!ok) {
+    fprintf(stderr, "Failed to rewrite %s: %s\n", path.c_str(),
+            strerror(errno));
+    unlink(temp_path.c_str());
+  }
+  close(fd);
+  return ok;
+}
+
+bool remove_capture(const std::filesystem::path &path) {
+  auto ok = true;
+  if (unlink(path.c_str()) == -1 && errno != ENOENT) {
+    fprintf(stderr, "Failed to remove %s: %s\n", path.c_str(),
+            strerror(errno));
+    ok = false;
+  }
+  const auto thumbnail = thumbnail_path(path);
+  if (unlink(thumbnail.c_str()) == -1 && errno != ENOENT) {
+    fprintf(stderr, "Failed to remove %s: %s\n", thumbnail.c_str(),
+            strerror(errno));
+    ok = false;
+  }
+  return compact_manifest(path.parent_path(), path.filename().string()) && ok;
+}
+
+void Manifest::record(const std::filesystem::path &path, uint32_t width,
+                      uint32_t height, std::chrono::microseconds timestamp,
+                      uint32_t sequence, uint64_t size,
+                      bool with_thumbnail) {
+  ManifestEntry entry;
+  entry.name = path.filename().string();
+  if (entry.name.find_first_of("\t\n") != std::string::npos) {
+    fprintf(stderr, "%s can't be put into the manifest\n", path.c_str());
+    return;
+  }
+  // Frame was captured this long before now, on the wall clock too.
+  const auto age = monotonic_now() - timestamp;
+  entry.time = std::chrono::duration_cast<std::chrono::microseconds>(
+                   std::chrono::system_clock::now().time_since_epoch()) -
+               age;
+  entry.width = width;
+  entry.height = height;
+  entry.size = size;
+  if (thumbnails && with_thumbnail) {
+    entry.thumbnail =
+        (std::filesystem::path(".thumbnails") / entry.name).string();
+  }
+  entry.sequence = sequence;
+
+  const auto manifest = manifest_path(path.parent_path());
+  const auto fd = open_locked(manifest, O_WRONLY | O_APPEND | O_CREAT);
+  if (fd == -1) {
+    fprintf(stderr, "Failed to open %s: %s\n", manifest.c_str(),
+            strerror(errno));
+    return;
+  }
+  struct stat st;
+  auto line = format_entry(entry);
+  if (fstat(fd, &st) == 0 && st.st_size == 0) {
+    line = HEADER + line;
+  }
+  // One write, so readers see whole lines or none.
+  if (!write_all(fd, line)) {
+    fprintf(stderr, "Failed to append to %s: %s\n", manifest.c_str(),
+            strerror(errno));
+  }
+  close(fd);
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+// Manifest of captures, an append-only file of tab separated lines in the
+// directory of the captures, so they can be listed by one sequential read
+// instead of a directory scan and a stat or decode per file.
+//
+//   #v4l2-mmal-cap manifest 1
+//   <name> <unix time> <width> <height> <bytes> <thumbnail> <sequence>
+//
+// Time is in seconds with microseconds. Thumbnail is a path relative to the
+// directory, "-" when there is none. A line is appended in one write once its
+// capture is published, so readers skip a last line without newline. When a
+// name comes again, the last line counts.
+struct ManifestEntry {
+  std::string name;
+  std::chrono::microseconds time;
+  uint32_t width, height;
+  uint64_t size;
+  std::string thumbnail;
+  uint32_t sequence;
+};
+
+std::filesystem::path manifest_path(const std::filesystem::path &directory);
+
+// Entries in order they were appended, empty when there is no manifest.
+std::vector<ManifestEntry> read_manifest(const std::filesystem::path &directory);
+
+// Remove capture at path, its thumbnail and its lines of the manifest. The
+// manifest is rewritten without them and renamed over the old one. Returns
+// false when something couldn't be removed.
+bool remove_capture(const std::filesystem::path &path);
+
+// Appends published captures to the manifest of their directory. Writers of
+// the same manifest, in this process or others, are serialized by flock().
+class Manifest {
+public:
+  // With thumbnails, entries point at thumbnails written next to captures.
+  explicit Manifest(bool thumbnails) : thumbnails(thumbnails) {}
+
+  // timestamp is the V4L2 one, in CLOCK_MONOTONIC. Thread safe. Failures are
+  // reported and leave capture out of the manifest. Captures which got no
+  // thumbnail of their own pass with_thumbnail false.
+  void record(const std::filesystem::path &path, uint32_t width,
+              uint32_t height, std::chrono::microseconds timestamp,
+              uint32_t sequence, uint64_t size, bool with_thumbnail = true);
+
+protected:
+  const bool thumbnails;
+};
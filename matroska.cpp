@@ -0,0 +1,476 @@
+#include "./matroska.h"
+
+#include <stdexcept>
+#include <stdio.h>
+#include <string>
+#include <utility>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "./metrics.h"
+
+// Element IDs, with their length marker.
+enum : uint32_t {
+  EBML = 0x1A45DFA3,
+  EBML_VERSION = 0x4286,
+  EBML_READ_VERSION = 0x42F7,
+  EBML_MAX_ID_LENGTH = 0x42F2,
+  EBML_MAX_SIZE_LENGTH = 0x42F3,
+  DOC_TYPE = 0x4282,
+  DOC_TYPE_VERSION = 0x4287,
+  DOC_TYPE_READ_VERSION = 0x4285,
+  VOID = 0xEC,
+  SEGMENT = 0x18538067,
+  SEEK_HEAD = 0x114D9B74,
+  SEEK = 0x4DBB,
+  SEEK_ID = 0x53AB,
+  SEEK_POSITION = 0x53AC,
+  INFO = 0x1549A966,
+  TIMESTAMP_SCALE = 0x2AD7B1,
+  MUXING_APP = 0x4D80,
+  WRITING_APP = 0x5741,
+  DURATION = 0x4489,
+  TRACKS = 0x1654AE6B,
+  TRACK_ENTRY = 0xAE,
+  TRACK_NUMBER = 0xD7,
+  TRACK_UID = 0x73C5,
+  TRACK_TYPE = 0x83,
+  FLAG_LACING = 0x9C,
+  CODEC_ID = 0x86,
+  CODEC_PRIVATE = 0x63A2,
+  VIDEO = 0xE0,
+  PIXEL_WIDTH = 0xB0,
+  PIXEL_HEIGHT = 0xBA,
+  CLUSTER = 0x1F43B675,
+  TIMESTAMP = 0xE7,
+  SIMPLE_BLOCK = 0xA3,
+  CUES = 0x1C53BB6B,
+  CUE_POINT = 0xBB,
+  CUE_TIME = 0xB3,
+  CUE_TRACK_POSITIONS = 0xB7,
+  CUE_TRACK = 0xF7,
+  CUE_CLUSTER_POSITION = 0xF1,
+};
+
+static const char APP_NAME[] = "v4l2-mmal-cap";
+// Room for seek head, which is written by finish().
+constexpr size_t SEEK_HEAD_SPACE = 96;
+// Duration element, a float of 8 bytes.
+constexpr size_t DURATION_SIZE = 11;
+
+static void put_id(std::vector<uint8_t> &out, uint32_t id) {
+  const int bytes = id > 0xFFFFFF ? 4 : id > 0xFFFF ? 3 : id > 0xFF ? 2 : 1;
+  for (int i = bytes - 1; i >= 0; --i) {
+    out.push_back(id >> (8 * i));
+  }
+}
+
+// Shortest size unless bytes is given. Value of all ones means unknown size,
+// so it is avoided.
+static void put_size(std::vector<uint8_t> &out, uint64_t size, int bytes = 0) {
+  if (bytes == 0) {
+    bytes = 1;
+    while (size >= (uint64_t(1) << (7 * bytes)) - 1) {
+      ++bytes;
+    }
+  }
+  const auto value = size | (uint64_t(1) << (7 * bytes));
+  for (int i = bytes - 1; i >= 0; --i) {
+    out.push_back(value >> (8 * i));
+  }
+}
+
+static void put_uint(std::vector<uint8_t> &out, uint32_t id, uint64_t value,
+                     int bytes = 0) {
+  if (bytes == 0) {
+    bytes = 1;
+    while (bytes < 8 && (value >> (8 * bytes)) != 0) {
+      ++bytes;
+    }
+  }
+  put_id(out, id);
+  put_size(out, bytes);
+  for (int i = bytes - 1; i >= 0; --i) {
+    out.push_back(value >> (8 * i));
+  }
+}
+
+static void put_float(std::vector<uint8_t> &out, uint32_t id, double value) {
+  uint64_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+  put_id(out, id);
+  put_size(out, 8);
+  for (int i = 7; i >= 0; --i) {
+    out.push_back(bits >> (8 * i));
+  }
+}
+
+static void put_bytes(std::vector<uint8_t> &out, uint32_t id,
+                      const uint8_t *data, size_t length) {
+  put_id(out, id);
+  put_size(out, length);
+  out.insert(out.end(), data, data + length);
+}
+
+static void put_string(std::vector<uint8_t> &out, uint32_t id,
+                       const std::string &value) {
+  put_bytes(out, id, reinterpret_cast<const uint8_t *>(value.data()),
+            value.size());
+}
+
+static void put_master(std::vector<uint8_t> &out, uint32_t id,
+                       const std::vector<uint8_t> &body) {
+  put_id(out, id);
+  put_size(out, body.size());
+  out.insert(out.end(), body.begin(), body.end());
+}
+
+// Void element taking exactly total bytes, at least 2.
+static void put_void(std::vector<uint8_t> &out, size_t total) {
+  put_id(out, VOID);
+  if (total - 2 < 127) {
+    put_size(out, total - 2, 1);
+    out.insert(out.end(), total - 2, 0);
+  } else {
+    put_size(out, total - 9, 8);
+    out.insert(out.end(), total - 9, 0);
+  }
+}
+
+static void put_be32(std::vector<uint8_t> &out, uint32_t value) {
+  for (int i = 3; i >= 0; --i) {
+    out.push_back(value >> (8 * i));
+  }
+}
+
+// NAL units of Annex B stream, without start codes.
+static std::vector<ByteView> nal_units(ByteView data) {
+  std::vector<ByteView> units;
+  size_t start = std::string::npos;
+  size_t i = 0;
+  while (i + 2 < data.size()) {
+    if (data[i] != 0 || data[i + 1] != 0 || data[i + 2] != 1) {
+      ++i;
+      continue;
+    }
+    if (start != std::string::npos) {
+      // Zero of a four byte start code belongs to neither unit.
+      auto end = i;
+      while (end > start && data[end - 1] == 0) {
+        --end;
+      }
+      units.push_back(data.substr(start, end - start));
+    }
+    i += 3;
+    start = i;
+  }
+  if (start != std::string::npos && start < data.size()) {
+    units.push_back(data.substr(start));
+  }
+  return units;
+}
+
+MatroskaWriter::MatroskaWriter(const std::filesystem::path &path,
+                               uint32_t width, uint32_t height,
+                               FsyncPolicy policy)
+    : _path(path), width(width), height(height), policy(policy) {
+  fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd == -1) {
+    throw std::runtime_error("Failed to create " + path.string() + ": " +
+                             strerror(errno));
+  }
+  if (policy == FsyncPolicy::FULL) {
+    // New name survives a power loss along with the clusters.
+    auto dir = path.parent_path();
+    if (dir.empty()) {
+      dir = ".";
+    }
+    const auto dir_fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd != -1) {
+      fsync(dir_fd);
+      close(dir_fd);
+    }
+  }
+}
+
+MatroskaWriter::~MatroskaWriter() {
+  if (!finished) {
+    finish();
+  }
+}
+
+bool MatroskaWriter::write_frame(ByteView access_unit,
+                                 std::chrono::microseconds timestamp) {
+  if (failed) {
+    return false;
+  }
+
+  // Blocks take NAL units prefixed by their length. SPS and PPS are kept, so
+  // decoding can start at any keyframe of a cut file.
+  ByteView sps, pps;
+  bool keyframe = false;
+  frame.clear();
+  for (const auto &unit : nal_units(access_unit)) {
+    if (unit.empty()) {
+      continue;
+    }
+    switch (unit[0] & 0x1F) {
+    case 9:
+      // Access unit delimiters are implied by blocks.
+      continue;
+    case 7:
+      sps = unit;
+      break;
+    case 8:
+      pps = unit;
+      break;
+    case 5:
+      keyframe = true;
+      break;
+    }
+    put_be32(frame, unit.size());
+    frame.insert(frame.end(), unit.begin(), unit.end());
+  }
+
+  if (!started) {
+    if (!keyframe || sps.size() < 4 || pps.empty()) {
+      return true;
+    }
+    first_timestamp = timestamp;
+    if (!write_header(sps, pps)) {
+      return false;
+    }
+    started = true;
+  }
+  if (frame.empty()) {
+    return true;
+  }
+
+  auto time = ((timestamp - first_timestamp).count() + 500) / 1000;
+  if (time < last_time) {
+    time = last_time;
+  }
+  if (_frames != 0) {
+    last_delta = time - last_time;
+  }
+  last_time = time;
+
+  // Relative timestamps of blocks must fit 16 bits, which duration keeps.
+  if (cluster_open &&
+      (keyframe || time - cluster_time >= MAX_CLUSTER_DURATION.count()) &&
+      !write_cluster()) {
+    return false;
+  }
+  if (!cluster_open) {
+    cluster.clear();
+    put_uint(cluster, TIMESTAMP, time);
+    cluster_time = time;
+    cluster_keyframe = keyframe;
+    cluster_open = true;
+  }
+
+  const auto relative = static_cast<int16_t>(time - cluster_time);
+  put_id(cluster, SIMPLE_BLOCK);
+  put_size(cluster, 4 + frame.size());
+  // Track number as size, relative timestamp and flags.
+  cluster.push_back(0x81);
+  cluster.push_back(static_cast<uint16_t>(relative) >> 8);
+  cluster.push_back(static_cast<uint16_t>(relative) & 0xFF);
+  cluster.push_back(keyframe ? 0x80 : 0x00);
+  cluster.insert(cluster.end(), frame.begin(), frame.end());
+  ++_frames;
+  return true;
+}
+
+bool MatroskaWriter::write_header(ByteView sps, ByteView pps) {
+  std::vector<uint8_t> out;
+
+  std::vector<uint8_t> body;
+  put_uint(body, EBML_VERSION, 1);
+  put_uint(body, EBML_READ_VERSION, 1);
+  put_uint(body, EBML_MAX_ID_LENGTH, 4);
+  put_uint(body, EBML_MAX_SIZE_LENGTH, 8);
+  put_string(body, DOC_TYPE, "matroska");
+  put_uint(body, DOC_TYPE_VERSION, 4);
+  put_uint(body, DOC_TYPE_READ_VERSION, 2);
+  put_master(out, EBML, body);
+
+  // Unknown size until finished.
+  put_id(out, SEGMENT);
+  segment_size_offset = out.size();
+  put_size(out, (uint64_t(1) << 56) - 1, 8);
+  segment_data_offset = out.size();
+
+  seek_head_offset = out.size();
+  put_void(out, SEEK_HEAD_SPACE);
+
+  info_offset = out.size() - segment_data_offset;
+  body.clear();
+  put_uint(body, TIMESTAMP_SCALE, 1000000);
+  put_string(body, MUXING_APP, APP_NAME);
+  put_string(body, WRITING_APP, APP_NAME);
+  const auto duration_in_info = body.size();
+  put_void(body, DURATION_SIZE);
+  put_master(out, INFO, body);
+  duration_offset = out.size() - body.size() + duration_in_info;
+
+  // AVCDecoderConfigurationRecord of ISO/IEC 14496-15 with 4 byte lengths.
+  std::vector<uint8_t> config{1, sps[1], sps[2], sps[3], 0xFF, 0xE1};
+  config.push_back(sps.size() >> 8);
+  config.push_back(sps.size() & 0xFF);
+  config.insert(config.end(), sps.begin(), sps.end());
+  config.push_back(1);
+  config.push_back(pps.size() >> 8);
+  config.push_back(pps.size() & 0xFF);
+  config.insert(config.end(), pps.begin(), pps.end());
+
+  std::vector<uint8_t> video;
+  put_uint(video, PIXEL_WIDTH, width);
+  put_uint(video, PIXEL_HEIGHT, height);
+  std::vector<uint8_t> track;
+  put_uint(track, TRACK_NUMBER, 1);
+  put_uint(track, TRACK_UID, 1);
+  put_uint(track, TRACK_TYPE, 1);
+  put_uint(track, FLAG_LACING, 0);
+  put_string(track, CODEC_ID, "V_MPEG4/ISO/AVC");
+  put_bytes(track, CODEC_PRIVATE, config.data(), config.size());
+  put_master(track, VIDEO, video);
+  body.clear();
+  put_master(body, TRACK_ENTRY, track);
+  tracks_offset = out.size() - segment_data_offset;
+  put_master(out, TRACKS, body);
+
+  return append(out.data(), out.size());
+}
+
+bool MatroskaWriter::write_cluster(void) {
+  StageTimer timer{Stage::WRITE};
+  cluster_open = false;
+  if (cluster_keyframe) {
+    cues.push_back({cluster_time, offset - segment_data_offset});
+  }
+
+  std::vector<uint8_t> header;
+  put_id(header, CLUSTER);
+  put_size(header, cluster.size());
+  if (!append(header.data(), header.size()) ||
+      !append(cluster.data(), cluster.size())) {
+    return false;
+  }
+  metrics().written_bytes.fetch_add(header.size() + cluster.size(),
+                                    std::memory_order_relaxed);
+  return sync();
+}
+
+bool MatroskaWriter::finish(void) {
+  if (finished) {
+    return !failed;
+  }
+  finished = true;
+
+  if (!started && !failed) {
+    fprintf(stderr, "No keyframe was recorded into %s\n", _path.c_str());
+    failed = true;
+  }
+  if (!failed && cluster_open) {
+    write_cluster();
+  }
+
+  if (!failed) {
+    const auto cues_offset = offset - segment_data_offset;
+    std::vector<uint8_t> body;
+    for (const auto &cue : cues) {
+      std::vector<uint8_t> positions;
+      put_uint(positions, CUE_TRACK, 1);
+      put_uint(positions, CUE_CLUSTER_POSITION, cue.position);
+      std::vector<uint8_t> point;
+      put_uint(point, CUE_TIME, cue.time);
+      put_master(point, CUE_TRACK_POSITIONS, positions);
+      put_master(body, CUE_POINT, point);
+    }
+    std::vector<uint8_t> out;
+    put_master(out, CUES, body);
+    append(out.data(), out.size());
+
+    // Seek head over the void left for it.
+    body.clear();
+    const std::pair<uint32_t, uint64_t> entries[] = {
+        {INFO, info_offset}, {TRACKS, tracks_offset}, {CUES, cues_offset}};
+    for (const auto &entry : entries) {
+      std::vector<uint8_t> seek;
+      put_uint(seek, SEEK_ID, entry.first);
+      put_uint(seek, SEEK_POSITION, entry.second, 8);
+      put_master(body, SEEK, seek);
+    }
+    out.clear();
+    put_master(out, SEEK_HEAD, body);
+    put_void(out, SEEK_HEAD_SPACE - out.size());
+    write_at(seek_head_offset, out);
+
+    out.clear();
+    put_float(out, DURATION, last_time + last_delta);
+    write_at(duration_offset, out);
+
+    out.clear();
+    put_size(out, offset - segment_data_offset, 8);
+    write_at(segment_size_offset, out);
+
+    sync();
+  }
+
+  if (close(fd) == -1 && !failed) {
+    fprintf(stderr, "Failed to write %s: %s\n", _path.c_str(),
+            strerror(errno));
+    failed = true;
+  }
+  fd = -1;
+  return !failed;
+}
+
+bool MatroskaWriter::append(const uint8_t *data, size_t length) {
+  if (!write_at(offset, data, length)) {
+    return false;
+  }
+  offset += length;
+  return true;
+}
+
+bool MatroskaWriter::write_at(uint64_t at, const std::vector<uint8_t> &data) {
+  return write_at(at, data.data(), data.size());
+}
+
+bool MatroskaWriter::write_at(uint64_t at, const uint8_t *data,
+                              size_t length) {
+  if (failed) {
+    return false;
+  }
+  size_t written = 0;
+  while (written < length) {
+    const auto r = pwrite(fd, data + written, length - written, at + written);
+    if (r == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      fprintf(stderr, "Failed to write %s: %s\n", _path.c_str(),
+              strerror(errno));
+      failed = true;
+      return false;
+    }
+    written += r;
+  }
+  return true;
+}
+
+bool MatroskaWriter::sync(void) {
+  if ((policy == FsyncPolicy::DATA && fdatasync(fd) == -1) ||
+      (policy == FsyncPolicy::FULL && fsync(fd) == -1)) {
+    fprintf(stderr, "Failed to flush %s: %s\n", _path.c_str(),
+            strerror(errno));
+    failed = true;
+    return false;
+  }
+  return true;
+}
@@ -0,0 +1,96 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <vector>
+
+#include "./mjpeg.h"
+#include "./output_writer.h"
+
+// Writes H.264 video into a Matroska file as it is recorded.
+//
+// Segment is started with unknown size and frames are gathered into a
+// cluster in memory, which is appended and flushed by the fsync policy once
+// the next keyframe comes, or after MAX_CLUSTER_DURATION. A power cut loses
+// the cluster being gathered at most, and memory doesn't grow with length of
+// the recording. Players take such a file as a live stream. finish() appends
+// cues and writes duration, seek head and segment size into space left for
+// them, so the finished file is seekable.
+//
+// Timestamps are in milliseconds, counted from the first frame.
+class MatroskaWriter {
+public:
+  static constexpr std::chrono::milliseconds MAX_CLUSTER_DURATION{5000};
+
+  // Throws std::runtime_error when file can't be created.
+  MatroskaWriter(const std::filesystem::path &path, uint32_t width,
+                 uint32_t height, FsyncPolicy policy);
+  // Finishes the file unless finish() was called.
+  ~MatroskaWriter();
+  MatroskaWriter(const MatroskaWriter &) = delete;
+  MatroskaWriter &operator=(const MatroskaWriter &) = delete;
+
+  // Add access unit in Annex B format, captured at timestamp. Frames before
+  // the first keyframe with SPS and PPS are dropped. Returns false once
+  // writing failed, frames are dropped from then on.
+  bool write_frame(ByteView access_unit, std::chrono::microseconds timestamp);
+  // Write last cluster and index. Returns false when anything failed.
+  bool finish(void);
+
+  const std::filesystem::path &path() const {
+    return _path;
+  }
+  size_t frames() const {
+    return _frames;
+  }
+  // Bytes in the file.
+  uint64_t size() const {
+    return offset;
+  }
+
+protected:
+  struct Cue {
+    int64_t time;
+    // From start of segment data.
+    uint64_t position;
+  };
+
+  bool write_header(ByteView sps, ByteView pps);
+  bool write_cluster(void);
+  // Failures are reported once, and fail every later write.
+  bool append(const uint8_t *data, size_t length);
+  bool write_at(uint64_t at, const std::vector<uint8_t> &data);
+  bool write_at(uint64_t at, const uint8_t *data, size_t length);
+  // Flush by the fsync policy.
+  bool sync(void);
+
+  const std::filesystem::path _path;
+  const uint32_t width, height;
+  const FsyncPolicy policy;
+  int fd;
+  bool failed = false;
+  bool finished = false;
+  bool started = false;
+  uint64_t offset = 0;
+  // Where reserved elements are, filled in by finish().
+  uint64_t segment_size_offset = 0;
+  uint64_t segment_data_offset = 0;
+  uint64_t seek_head_offset = 0;
+  uint64_t duration_offset = 0;
+  uint64_t info_offset = 0;
+  uint64_t tracks_offset = 0;
+  std::chrono::microseconds first_timestamp{};
+  int64_t last_time = 0;
+  int64_t last_delta = 0;
+  // Cluster being gathered.
+  std::vector<uint8_t> cluster;
+  int64_t cluster_time = 0;
+  bool cluster_open = false;
+  // Cluster starts with a keyframe, so cues point at it.
+  bool cluster_keyframe = false;
+  std::vector<Cue> cues;
+  // Access unit with length prefixed NAL units.
+  std::vector<uint8_t> frame;
+  size_t _frames = 0;
+};
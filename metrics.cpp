@@ -0,0 +1,186 @@
+#include "./metrics.h"
+
+#include <cstdio>
+
+static const char PREFIX[] = "v4l2_mmal_cap_";
+
+const char *stage_name(Stage stage) {
+  switch (stage) {
+  case Stage::WAIT:
+    return "wait";
+  case Stage::DEQUEUE:
+    return "dequeue";
+  case Stage::DETECT:
+    return "detect";
+  case Stage::CONVERT:
+    return "convert";
+  case Stage::SCALE:
+    return "scale";
+  case Stage::COPY_IN:
+    return "copy_in";
+  case Stage::ENCODE:
+    return "encode";
+  case Stage::ENCODER_WAIT:
+    return "encoder_wait";
+  case Stage::ASSEMBLE:
+    return "assemble";
+  case Stage::WRITE:
+    return "write";
+  case Stage::WRITE_WAIT:
+    return "write_wait";
+  case Stage::COUNT:
+    break;
+  }
+  return "unknown";
+}
+
+void Histogram::record(std::chrono::microseconds duration) {
+  const uint64_t us = duration.count() < 0 ? 0 : duration.count();
+  // Index of smallest power of two bound which is not below duration.
+  size_t index = us <= 1 ? 0 : 64 - __builtin_clzll(us - 1);
+  if (index >= BUCKETS) {
+    index = BUCKETS - 1;
+  }
+  buckets[index].fetch_add(1, std::memory_order_relaxed);
+  _count.fetch_add(1, std::memory_order_relaxed);
+  _sum.fetch_add(us, std::memory_order_relaxed);
+}
+
+static void append_counter(std::string &out, const char *name,
+                           const char *help, uint64_t value) {
+  char buf[256];
+  snprintf(buf, sizeof(buf),
+           "# HELP %s%s %s\n# TYPE %s%s counter\n%s%s %llu\n", PREFIX, name,
+           help, PREFIX, name, PREFIX, name,
+           static_cast<unsigned long long>(value));
+  out += buf;
+}
+
+// Buckets, sum and count of histogram, labels inside braces if not empty.
+static void append_histogram(std::string &out, const char *name,
+                             const char *labels, const Histogram &histogram) {
+  char buf[256];
+  const auto separator = labels[0] != '\0' ? "," : "";
+  uint64_t cumulative = 0;
+  for (size_t bucket = 0; bucket < Histogram::BUCKETS; ++bucket) {
+    cumulative += histogram.bucket(bucket);
+    if (bucket + 1 < Histogram::BUCKETS) {
+      snprintf(buf, sizeof(buf), "%s%s_bucket{%s%sle=\"%.6f\"} %llu\n",
+               PREFIX, name, labels, separator, (1ull << bucket) / 1e6,
+               static_cast<unsigned long long>(cumulative));
+    } else {
+      snprintf(buf, sizeof(buf), "%s%s_bucket{%s%sle=\"+Inf\"} %llu\n",
+               PREFIX, name, labels, separator,
+               static_cast<unsigned long long>(cumulative));
+    }
+    out += buf;
+  }
+  const auto braces = labels[0] != '\0';
+  snprintf(buf, sizeof(buf), "%s%s_sum%s%s%s %.6f\n%s%s_count%s%s%s %llu\n",
+           PREFIX, name, braces ? "{" : "", labels, braces ? "}" : "",
+           histogram.sum().count() / 1e6, PREFIX, name, braces ? "{" : "",
+           labels, braces ? "}" : "",
+           static_cast<unsigned long long>(histogram.count()));
+  out += buf;
+}
+
+std::string Metrics::prometheus() const {
+  std::string out;
+  char buf[256];
+
+  snprintf(buf, sizeof(buf),
+           "# HELP %sstage_seconds Time spent in each step of the hot path.\n"
+           "# TYPE %sstage_seconds histogram\n",
+           PREFIX, PREFIX);
+  out += buf;
+  for (size_t i = 0; i < stages.size(); ++i) {
+    snprintf(buf, sizeof(buf), "stage=\"%s\"",
+             stage_name(static_cast<Stage>(i)));
+    append_histogram(out, "stage_seconds", buf, stages[i]);
+  }
+
+  append_counter(out, "frames_total", "Frames dequeued from cameras.",
+                 frames.load());
+  append_counter(out, "dropped_frames_total",
+                 "Frames dropped by drivers, from gaps in sequence numbers.",
+                 dropped_frames.load());
+  append_counter(out, "unchanged_frames_total",
+                 "Frames skipped by motion detection as unchanged.",
+                 unchanged_frames.load());
+  append_counter(out, "encoded_frames_total", "Frames encoded.",
+                 encoded_frames.load());
+  append_counter(out, "budget_reencodes_total",
+                 "Frames encoded again at lower quality to fit the budget.",
+                 budget_reencodes.load());
+  append_counter(out, "over_budget_frames_total",
+                 "Frames over the budget even at the lowest quality tried.",
+                 over_budget_frames.load());
+  append_counter(out, "written_bytes_total",
+                 "Encoded bytes written into files and sockets.",
+                 written_bytes.load());
+  append_counter(out, "reconnects_total",
+                 "Cameras reconnected after they dropped off or stalled.",
+                 reconnects.load());
+
+  snprintf(buf, sizeof(buf),
+           "# HELP %srecovery_seconds Time taken to reconnect a camera.\n"
+           "# TYPE %srecovery_seconds histogram\n",
+           PREFIX, PREFIX);
+  out += buf;
+  append_histogram(out, "recovery_seconds", "", recovery);
+
+  snprintf(buf, sizeof(buf),
+           "# HELP %sshot_jitter_seconds Distance of time-lapse shots from "
+           "their scheduled time.\n"
+           "# TYPE %sshot_jitter_seconds histogram\n",
+           PREFIX, PREFIX);
+  out += buf;
+  append_histogram(out, "shot_jitter_seconds", "", shot_jitter);
+  return out;
+}
+
+Metrics &metrics() {
+  static Metrics instance;
+  return instance;
+}
+
+MetricsWriter::MetricsWriter(const std::filesystem::path &path,
+                             std::chrono::milliseconds interval)
+    : path(path), interval(interval) {
+  thread = std::thread([this] {
+    std::unique_lock<std::mutex> lock{mutex};
+    while (!stopped.wait_for(lock, this->interval, [this] { return stop; })) {
+      write();
+    }
+  });
+}
+
+MetricsWriter::~MetricsWriter() {
+  {
+    std::lock_guard<std::mutex> lock{mutex};
+    stop = true;
+  }
+  stopped.notify_one();
+  thread.join();
+  write();
+}
+
+void MetricsWriter::write(void) {
+  const auto text = metrics().prometheus();
+  auto temp_path = path;
+  temp_path += ".tmp";
+  // Through stdio, as sinks would count this write in the metrics.
+  auto *file = fopen(temp_path.c_str(), "w");
+  const auto written = file != nullptr && fwrite(text.data(), 1, text.size(),
+                                                 file) == text.size();
+  if (file == nullptr || fclose(file) != 0 || !written) {
+    fprintf(stderr, "Failed to write %s\n", temp_path.c_str());
+    return;
+  }
+  std::error_code error;
+  std::filesystem::rename(temp_path, path, error);
+  if (error) {
+    fprintf(stderr, "Failed to replace %s: %s\n", path.c_str(),
+            error.message().c_str());
+  }
+}
@@ -0,0 +1,139 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <filesystem>
+#include <mutex>
+#include <string>
+#include <thread>
+
+// Steps of the hot path which are timed.
+enum class Stage {
+  // Waiting for camera to have a frame ready.
+  WAIT,
+  // VIDIOC_DQBUF.
+  DEQUEUE,
+  // Comparing frames with background for motion.
+  DETECT,
+  // Pixel format conversion.
+  CONVERT,
+  // Downscaling frames into thumbnails.
+  SCALE,
+  // Copying frame into encoder input buffers.
+  COPY_IN,
+  // Whole encoder round trip, including output handed to the sink.
+  ENCODE,
+  // Waiting for encoder callbacks inside the round trip.
+  ENCODER_WAIT,
+  // Gathering encoded output into buffers.
+  ASSEMBLE,
+  // Writing encoded output into sockets, and into files from queueing to
+  // publishing them.
+  WRITE,
+  // Waiting for the output writer to take another file.
+  WRITE_WAIT,
+  COUNT,
+};
+
+const char *stage_name(Stage stage);
+
+// Histogram of durations with power of two buckets in microseconds. Updated
+// with relaxed atomics, so recording is cheap enough to stay on.
+class Histogram {
+public:
+  // Upper bounds are 1us, 2us, ... 2^(BUCKETS-2)us, then +Inf.
+  static constexpr size_t BUCKETS = 25;
+
+  void record(std::chrono::microseconds duration);
+
+  uint64_t bucket(size_t index) const {
+    return buckets[index].load(std::memory_order_relaxed);
+  }
+  uint64_t count() const {
+    return _count.load(std::memory_order_relaxed);
+  }
+  std::chrono::microseconds sum() const {
+    return std::chrono::microseconds(_sum.load(std::memory_order_relaxed));
+  }
+
+protected:
+  std::array<std::atomic<uint64_t>, BUCKETS> buckets{};
+  std::atomic<uint64_t> _count{0};
+  std::atomic<uint64_t> _sum{0};
+};
+
+// Process wide histograms and counters.
+class Metrics {
+public:
+  void record(Stage stage, std::chrono::microseconds duration) {
+    stages[static_cast<size_t>(stage)].record(duration);
+  }
+  const Histogram &stage(Stage stage) const {
+    return stages[static_cast<size_t>(stage)];
+  }
+
+  // Frames dequeued from cameras.
+  std::atomic<uint64_t> frames{0};
+  // Frames driver dropped, counted from gaps in sequence numbers.
+  std::atomic<uint64_t> dropped_frames{0};
+  // Frames skipped by motion detection as the scene didn't change.
+  std::atomic<uint64_t> unchanged_frames{0};
+  std::atomic<uint64_t> encoded_frames{0};
+  // Frames encoded again at lower quality to fit --max-bytes, and frames
+  // which didn't fit even so.
+  std::atomic<uint64_t> budget_reencodes{0};
+  std::atomic<uint64_t> over_budget_frames{0};
+  std::atomic<uint64_t> written_bytes{0};
+  // Cameras brought back after they dropped off or stalled.
+  std::atomic<uint64_t> reconnects{0};
+  // How long each of those took.
+  Histogram recovery;
+  // How far time-lapse shots were from their scheduled time, either way.
+  Histogram shot_jitter;
+
+  // Prometheus text exposition format.
+  std::string prometheus() const;
+
+protected:
+  std::array<Histogram, static_cast<size_t>(Stage::COUNT)> stages;
+};
+
+Metrics &metrics();
+
+// Records time from construction to destruction as stage.
+class StageTimer {
+public:
+  explicit StageTimer(Stage stage)
+      : stage(stage), start(std::chrono::steady_clock::now()) {}
+  ~StageTimer() {
+    metrics().record(stage,
+                     std::chrono::duration_cast<std::chrono::microseconds>(
+                         std::chrono::steady_clock::now() - start));
+  }
+
+protected:
+  const Stage stage;
+  const std::chrono::steady_clock::time_point start;
+};
+
+// Writes metrics into a file every interval and once more when destroyed.
+// File is replaced by rename, so readers never see it half written.
+class MetricsWriter {
+public:
+  MetricsWriter(const std::filesystem::path &path,
+                std::chrono::milliseconds interval);
+  ~MetricsWriter();
+
+protected:
+  void write(void);
+
+  const std::filesystem::path path;
+  const std::chrono::milliseconds interval;
+  std::mutex mutex;
+  std::condition_variable stopped;
+  bool stop = false;
+  std::thread thread;
+};
@@ -0,0 +1,125 @@
+#include "./mjpeg.h"
+
+#include <vector>
+
+#include <linux/videodev2.h>
+
+constexpr uint8_t MARKER_SOI = 0xD8;
+constexpr uint8_t MARKER_SOS = 0xDA;
+constexpr uint8_t MARKER_DHT = 0xC4;
+constexpr uint8_t MARKER_TEM = 0x01;
+constexpr uint8_t MARKER_RST0 = 0xD0;
+constexpr uint8_t MARKER_RST7 = 0xD7;
+
+struct HuffmanTable {
+  uint8_t class_id;
+  uint8_t bits[16];
+  std::vector<uint8_t> values;
+};
+
+// ITU T.81 K.3, same tables as MJPEG AVI1 assumes.
+static const HuffmanTable STANDARD_TABLES[] = {
+    {0x00,
+     {0, 1, 5, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0},
+     {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11}},
+    {0x10,
+     {0, 2, 1, 3, 3, 2, 4, 3, 5, 5, 4, 4, 0, 0, 1, 0x7d},
+     {0x01, 0x02, 0x03, 0x00, 0x04, 0x11, 0x05, 0x12, 0x21, 0x31, 0x41, 0x06,
+      0x13, 0x51, 0x61, 0x07, 0x22, 0x71, 0x14, 0x32, 0x81, 0x91, 0xa1, 0x08,
+      0x23, 0x42, 0xb1, 0xc1, 0x15, 0x52, 0xd1, 0xf0, 0x24, 0x33, 0x62, 0x72,
+      0x82, 0x09, 0x0a, 0x16, 0x17, 0x18, 0x19, 0x1a, 0x25, 0x26, 0x27, 0x28,
+      0x29, 0x2a, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45,
+      0x46, 0x47, 0x48, 0x49, 0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59,
+      0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a, 0x73, 0x74, 0x75,
+      0x76, 0x77, 0x78, 0x79, 0x7a, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89,
+      0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3,
+      0xa4, 0xa5, 0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6,
+      0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3, 0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9,
+      0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda, 0xe1, 0xe2,
+      0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf1, 0xf2, 0xf3, 0xf4,
+      0xf5, 0xf6, 0xf7, 0xf8, 0xf9, 0xfa}},
+    {0x01,
+     {0, 3, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0},
+     {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11}},
+    {0x11,
+     {0, 2, 1, 2, 4, 4, 3, 4, 7, 5, 4, 4, 0, 1, 2, 0x77},
+     {0x00, 0x01, 0x02, 0x03, 0x11, 0x04, 0x05, 0x21, 0x31, 0x06, 0x12, 0x41,
+      0x51, 0x07, 0x61, 0x71, 0x13, 0x22, 0x32, 0x81, 0x08, 0x14, 0x42, 0x91,
+      0xa1, 0xb1, 0xc1, 0x09, 0x23, 0x33, 0x52, 0xf0, 0x15, 0x62, 0x72, 0xd1,
+      0x0a, 0x16, 0x24, 0x34, 0xe1, 0x25, 0xf1, 0x17, 0x18, 0x19, 0x1a, 0x26,
+      0x27, 0x28, 0x29, 0x2a, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44,
+      0x45, 0x46, 0x47, 0x48, 0x49, 0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58,
+      0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a, 0x73, 0x74,
+      0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87,
+      0x88, 0x89, 0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a,
+      0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4,
+      0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3, 0xc4, 0xc5, 0xc6, 0xc7,
+      0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda,
+      0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf2, 0xf3, 0xf4,
+      0xf5, 0xf6, 0xf7, 0xf8, 0xf9, 0xfa}},
+};
+
+static std::vector<uint8_t> build_dht_segment() {
+  std::vector<uint8_t> segment{0xFF, MARKER_DHT, 0, 0};
+  for (const auto &table : STANDARD_TABLES) {
+    segment.push_back(table.class_id);
+    segment.insert(segment.end(), table.bits, table.bits + 16);
+    segment.insert(segment.end(), table.values.begin(), table.values.end());
+  }
+  // Length counts itself but not the marker.
+  const auto length = segment.size() - 2;
+  segment[2] = length >> 8;
+  segment[3] = length & 0xFF;
+  return segment;
+}
+
+static const std::vector<uint8_t> STANDARD_DHT_SEGMENT = build_dht_segment();
+
+bool is_compressed_fourcc(uint32_t four_cc) {
+  return four_cc == V4L2_PIX_FMT_MJPEG || four_cc == V4L2_PIX_FMT_JPEG;
+}
+
+std::array<ByteView, 3> jpeg_parts(const uint8_t *data, size_t length) {
+  const std::array<ByteView, 3> as_is{ByteView(data, length), ByteView(),
+                                      ByteView()};
+
+  if (length < 4 || data[0] != 0xFF || data[1] != MARKER_SOI) {
+    return as_is;
+  }
+
+  size_t pos = 2;
+  while (pos + 1 < length) {
+    if (data[pos] != 0xFF) {
+      return as_is;
+    }
+    // Markers may be preceded by fill bytes.
+    while (pos + 1 < length && data[pos + 1] == 0xFF) {
+      ++pos;
+    }
+    if (pos + 1 >= length) {
+      break;
+    }
+
+    const auto marker = data[pos + 1];
+    if (marker == MARKER_DHT) {
+      return as_is;
+    }
+    if (marker == MARKER_SOS) {
+      return {ByteView(data, pos),
+              ByteView(STANDARD_DHT_SEGMENT.data(), STANDARD_DHT_SEGMENT.size()),
+              ByteView(data + pos, length - pos)};
+    }
+    if (marker == MARKER_TEM ||
+        (marker >= MARKER_RST0 && marker <= MARKER_RST7)) {
+      pos += 2;
+      continue;
+    }
+
+    if (pos + 3 >= length) {
+      break;
+    }
+    pos += 2 + ((data[pos + 2] << 8) | data[pos + 3]);
+  }
+
+  return as_is;
+}
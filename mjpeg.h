@@ -0,0 +1,17 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+using ByteView = std::basic_string_view<uint8_t>;
+
+// Camera formats which are JPEG already.
+bool is_compressed_fourcc(uint32_t four_cc);
+
+// Split MJPEG frame into parts which form a valid JPEG when written in order.
+// Many cameras omit Huffman tables, so the standard DHT segment (ITU T.81
+// K.3) is inserted before the scan when frame has none. Frames which don't
+// look like JPEG are passed as is.
+std::array<ByteView, 3> jpeg_parts(const uint8_t *data, size_t length);
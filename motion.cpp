@@ -0,0 +1,173 @@
+#include "./motion.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+#include <linux/videodev2.h>
+#include <stdio.h>
+
+#include "./convert.h"
+#include "./convert_kernels.h"
+#include "./fourcc.h"
+#include "./frame_error.h"
+#include "./metrics.h"
+
+Region region_from_string(const std::string &text) {
+  Region region;
+  char end;
+  if (sscanf(text.c_str(), "%u,%u,%ux%u%c", &region.x, &region.y,
+             &region.width, &region.height, &end) != 4 ||
+      region.width == 0 || region.height == 0) {
+    throw std::invalid_argument("Bad region " + text + ", expected X,Y,WxH");
+  }
+  return region;
+}
+
+static bool is_planar(uint32_t four_cc) {
+  return four_cc == ENCODING_I420 || four_cc == V4L2_PIX_FMT_YUV420 ||
+         four_cc == V4L2_PIX_FMT_NV12;
+}
+
+bool MotionDetector::supports(uint32_t four_cc) {
+  return is_planar(four_cc) || Converter::supports(four_cc);
+}
+
+MotionDetector::MotionDetector(uint32_t four_cc, uint32_t width,
+                               uint32_t height, uint32_t stride,
+                               const MotionSettings &settings)
+    : four_cc(four_cc), width(width), height(height), stride(stride),
+      threshold(settings.threshold), min_area(settings.min_area),
+      kernels(*available_convert_kernels().back()) {
+  uint32_t bpp;
+  switch (four_cc) {
+  case V4L2_PIX_FMT_YUYV:
+  case V4L2_PIX_FMT_UYVY:
+    bpp = 2;
+    break;
+  case V4L2_PIX_FMT_RGB24:
+    bpp = 3;
+    break;
+  default:
+    if (!is_planar(four_cc)) {
+      throw std::invalid_argument("Motion can't be detected in this format");
+    }
+    bpp = 1;
+  }
+  if (this->stride == 0) {
+    this->stride = width * bpp;
+  }
+  if (this->stride < width * bpp) {
+    throw std::invalid_argument("Stride is shorter than a row");
+  }
+  // Only luma is read.
+  input_size = size_t(this->stride) * height;
+
+  _step = (width + MAX_GRID_WIDTH - 1) / MAX_GRID_WIDTH;
+  grid_width = width / _step;
+  grid_height = height / _step;
+  if (grid_width == 0 || grid_height == 0) {
+    throw std::invalid_argument("Frame is too small to detect motion");
+  }
+  luma.resize(size_t(grid_width) * grid_height);
+  background.resize(luma.size());
+
+  const auto columns = (grid_width + SAD_BLOCK - 1) / SAD_BLOCK;
+  const auto rows = (grid_height + SAD_BLOCK - 1) / SAD_BLOCK;
+  sums.resize(size_t(columns) * rows);
+  limits.resize(sums.size());
+  for (const auto &region : settings.regions) {
+    if (region.x + region.width > width ||
+        region.y + region.height > height) {
+      throw std::invalid_argument("Region is outside of the frame");
+    }
+  }
+  for (uint32_t row = 0; row < rows; ++row) {
+    for (uint32_t column = 0; column < columns; ++column) {
+      // Block in grid pixels, scaled by step to compare with regions.
+      const auto x = column * SAD_BLOCK, y = row * SAD_BLOCK;
+      const auto block_width = std::min(SAD_BLOCK, grid_width - x);
+      const auto block_height = std::min(SAD_BLOCK, grid_height - y);
+      bool watch = settings.regions.empty();
+      for (const auto &region : settings.regions) {
+        watch = watch ||
+                (x * _step < region.x + region.width &&
+                 region.x < (x + block_width) * _step &&
+                 y * _step < region.y + region.height &&
+                 region.y < (y + block_height) * _step);
+      }
+      if (watch) {
+        // Even a block exactly at threshold is idle, and never 0.
+        limits[size_t(columns) * row + column] =
+            std::max(threshold, 1u) * block_width * block_height;
+        ++watched;
+      }
+    }
+  }
+}
+
+const char *MotionDetector::kernels_name() const { return kernels.name; }
+
+void MotionDetector::sample(const uint8_t *frame) {
+  // Byte of luma within pixel, for packed formats.
+  const auto offset = four_cc == V4L2_PIX_FMT_UYVY ? 1 : 0;
+  for (uint32_t y = 0; y < grid_height; ++y) {
+    const auto row = frame + size_t(stride) * y * _step;
+    auto out = luma.data() + size_t(grid_width) * y;
+    switch (four_cc) {
+    case V4L2_PIX_FMT_YUYV:
+    case V4L2_PIX_FMT_UYVY:
+      for (uint32_t x = 0; x < grid_width; ++x) {
+        out[x] = row[2 * x * _step + offset];
+      }
+      break;
+    case V4L2_PIX_FMT_RGB24:
+      for (uint32_t x = 0; x < grid_width; ++x) {
+        const auto pixel = row + 3 * x * _step;
+        out[x] = rgb_to_y(pixel[0], pixel[1], pixel[2]);
+      }
+      break;
+    default:
+      for (uint32_t x = 0; x < grid_width; ++x) {
+        out[x] = row[x * _step];
+      }
+    }
+  }
+}
+
+void MotionDetector::learn(void) {
+  // Rounded away from zero, so background reaches a scene which stays.
+  // Shift of negative differences rounds down already. Simple enough for
+  // compilers to vectorize.
+  constexpr int ROUNDING = (1 << LEARNING_SHIFT) - 1;
+  for (size_t i = 0; i < luma.size(); ++i) {
+    const int difference = luma[i] - background[i];
+    background[i] += (difference + (difference > 0 ? ROUNDING : 0)) >>
+                     LEARNING_SHIFT;
+  }
+}
+
+bool MotionDetector::detect(const uint8_t *frame, size_t length) {
+  StageTimer timer{Stage::DETECT};
+  if (length < input_size) {
+    throw FrameError("Frame is shorter than expected");
+  }
+
+  sample(frame);
+  if (!primed) {
+    background = luma;
+    primed = true;
+    changed = 0;
+    return false;
+  }
+
+  sad_plane(kernels, luma.data(), background.data(), grid_width, grid_height,
+            sums.data());
+  changed = 0;
+  for (size_t i = 0; i < sums.size(); ++i) {
+    if (limits[i] != 0 && sums[i] > limits[i]) {
+      ++changed;
+    }
+  }
+  learn();
+  return changed > 0 && changed * 100.0 >= min_area * watched;
+}
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+struct ConvertKernels;
+
+// Rectangle of a frame in pixels.
+struct Region {
+  uint32_t x, y, width, height;
+};
+
+// Parse "X,Y,WxH". Throws std::invalid_argument.
+Region region_from_string(const std::string &text);
+
+struct MotionSettings {
+  // Mean difference of luma from background for a block to count as changed.
+  uint32_t threshold = 10;
+  // Percent of watched blocks which must change for a frame to count.
+  double min_area = 0.5;
+  // Blocks touching any of these are watched, all of them when empty.
+  std::vector<Region> regions;
+};
+
+// Tells frames in which the scene changed apart from idle ones, so only those
+// need to be encoded and stored.
+//
+// Luma of every step-th pixel of every step-th row is sampled into a grid at
+// most MAX_GRID_WIDTH wide, so only a fraction of the frame is read. Sums of
+// absolute differences from a running background are taken over blocks of
+// SAD_BLOCK x SAD_BLOCK grid pixels with the fastest kernels for the CPU. A
+// block changed when its mean difference is above threshold, and a frame
+// when enough of the watched blocks did. Background moves towards every
+// frame by 1 / 2^LEARNING_SHIFT of the difference, so changes of light and
+// objects which stay fade into it.
+class MotionDetector {
+public:
+  static constexpr uint32_t MAX_GRID_WIDTH = 320;
+  static constexpr int LEARNING_SHIFT = 4;
+
+  // Takes formats Converter takes and I420. Throws std::invalid_argument for
+  // other formats and regions outside of the frame.
+  MotionDetector(uint32_t four_cc, uint32_t width, uint32_t height,
+                 uint32_t stride, const MotionSettings &settings);
+
+  static bool supports(uint32_t four_cc);
+
+  // Whether frame differs from background, which then learns from it. First
+  // frame only sets background.
+  bool detect(const uint8_t *frame, size_t length);
+
+  // Blocks which changed in the last frame.
+  size_t changed_blocks() const { return changed; }
+  size_t watched_blocks() const { return watched; }
+  uint32_t step() const { return _step; }
+  const char *kernels_name() const;
+
+protected:
+  void sample(const uint8_t *frame);
+  void learn(void);
+
+  const uint32_t four_cc;
+  const uint32_t width, height;
+  uint32_t stride;
+  size_t input_size;
+  const uint32_t threshold;
+  const double min_area;
+  const ConvertKernels &kernels;
+  uint32_t _step;
+  uint32_t grid_width, grid_height;
+  std::vector<uint8_t> luma;
+  std::vector<uint8_t> background;
+  std::vector<uint32_t> sums;
+  // Sum above which each block changed, 0 for blocks not watched.
+  std::vector<uint32_t> limits;
+  size_t watched = 0;
+  size_t changed = 0;
+  bool primed = false;
+};
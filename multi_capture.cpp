@@ -0,0 +1,384 @@
+#include "./multi_capture.h"
+
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+#include <thread>
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "./camera.h"
+#include "./dmabuf.h"
+#include "./encoder.h"
+#include "./fourcc.h"
+#include "./manifest.h"
+#include "./output.h"
+#include "./output_writer.h"
+#include "./sink.h"
+
+std::atomic<bool> MultiCapture::stop_requested = false;
+std::atomic<bool> MultiCapture::snapshot_requested = false;
+std::atomic<int> MultiCapture::control_fd = -1;
+
+constexpr int MAX_EVENTS = 16;
+// epoll data of eventfd. Cameras are tagged with their index.
+constexpr uint32_t CONTROL_TAG = UINT32_MAX;
+// Frames of each camera synchronized set is picked from. At least one buffer
+// is left queued, so cameras with few buffers keep streaming.
+constexpr size_t HELD_FRAMES = 2;
+
+std::vector<size_t> select_synchronized(
+    const std::vector<std::vector<std::chrono::microseconds>> &timestamps) {
+  struct Entry {
+    std::chrono::microseconds timestamp;
+    size_t list, index;
+  };
+  std::vector<Entry> entries;
+  for (size_t list = 0; list < timestamps.size(); ++list) {
+    for (size_t index = 0; index < timestamps[list].size(); ++index) {
+      entries.push_back(Entry{timestamps[list][index], list, index});
+    }
+  }
+  std::sort(entries.begin(), entries.end(),
+            [](const Entry &a, const Entry &b) {
+              return a.timestamp < b.timestamp;
+            });
+
+  // Slide a window over timestamps in order, shrinking it from the front
+  // while it still covers every list. Latest entry of each list inside the
+  // window is the one closest to the others.
+  std::vector<size_t> in_window(timestamps.size(), 0);
+  std::vector<size_t> latest(timestamps.size(), 0);
+  std::vector<size_t> best;
+  std::chrono::microseconds best_spread = std::chrono::microseconds::max();
+  size_t covered = 0;
+  size_t front = 0;
+  for (const auto &entry : entries) {
+    if (in_window[entry.list]++ == 0) {
+      ++covered;
+    }
+    latest[entry.list] = entry.index;
+
+    while (covered == timestamps.size()) {
+      const auto &first = entries[front];
+      const auto spread = entry.timestamp - first.timestamp;
+      if (spread < best_spread) {
+        best_spread = spread;
+        best = latest;
+        // Take the front entry, so the set spans the whole window.
+        best[first.list] = first.index;
+      }
+      if (--in_window[first.list] == 0) {
+        --covered;
+      }
+      ++front;
+    }
+  }
+  return best;
+}
+
+MultiCapture::MultiCapture(const std::vector<Device> &devices,
+                           EncoderPool &pool, OutputWriter &writer,
+                           uint32_t output_four_cc, bool use_dmabuf,
+                           bool synchronized, Manifest *manifest)
+    : synchronized(synchronized), writer(writer), manifest(manifest),
+      epoll_fd(-1) {
+  sources.reserve(devices.size());
+  for (const auto &device : devices) {
+    auto &camera = device.camera;
+    const auto input_four_cc =
+        device.converter ? ENCODING_I420 : camera.fourcc();
+    const auto lease = pool.acquire(
+        input_four_cc, camera.width(), camera.height(), output_four_cc,
+        camera.count(), !synchronized,
+        device.converter ? 0 : camera.bytesperline());
+    // Converted frames are copied into encoder anyway.
+    auto handoff = std::make_unique<DmabufHandoff>(
+        camera, lease.encoder, use_dmabuf && !device.converter,
+        lease.first_import);
+    handoff->set_converter(device.converter);
+    sources.push_back(
+        Source{camera, std::move(handoff), device.output_path});
+    sources.back().held_limit = std::max<size_t>(
+        1, std::min(HELD_FRAMES, camera.count() - 1));
+  }
+  fprintf(stderr, "Capturing from %zu devices with %zu encoders\n",
+          sources.size(), pool.size());
+
+  epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (epoll_fd == -1) {
+    throw std::runtime_error(std::string("epoll_create1: ") + strerror(errno));
+  }
+  const auto fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (fd == -1) {
+    const auto err = errno;
+    ::close(epoll_fd);
+    throw std::runtime_error(std::string("eventfd: ") + strerror(err));
+  }
+  control_fd.store(fd);
+
+  epoll_event event;
+  event.events = EPOLLIN;
+  event.data.u32 = CONTROL_TAG;
+  epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event);
+  for (uint32_t i = 0; i < sources.size(); ++i) {
+    event.data.u32 = i;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sources[i].camera.poll_fd(), &event);
+  }
+}
+
+MultiCapture::~MultiCapture() {
+  ::close(control_fd.exchange(-1));
+  ::close(epoll_fd);
+}
+
+void MultiCapture::request_stop(void) {
+  stop_requested.store(true);
+  wake();
+}
+
+void MultiCapture::request_snapshot(void) {
+  snapshot_requested.store(true);
+  wake();
+}
+
+void MultiCapture::wake(void) {
+  const auto fd = control_fd.load();
+  if (fd == -1) {
+    return;
+  }
+  const uint64_t one = 1;
+  // Counter only saturates, which still wakes the loop.
+  [[maybe_unused]] const auto r = write(fd, &one, sizeof(one));
+}
+
+void MultiCapture::run(size_t frame_count, bool on_request) {
+  for (auto &source : sources) {
+    source.pending = !on_request;
+  }
+
+  epoll_event events[MAX_EVENTS];
+  while (!stop_requested.load() && !all_finished()) {
+    const auto count = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+    if (count == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      fprintf(stderr, "epoll_wait error %d, %s\n", errno, strerror(errno));
+      break;
+    }
+
+    for (int i = 0; i < count; ++i) {
+      const auto tag = events[i].data.u32;
+      if (tag == CONTROL_TAG) {
+        read_control();
+        continue;
+      }
+      try {
+        if (synchronized) {
+          hold(sources[tag], frame_count, on_request);
+        } else {
+          capture(sources[tag], frame_count, on_request);
+        }
+      } catch (const CameraError &e) {
+        if (!recover(tag, e)) {
+          throw;
+        }
+      } catch (const FrameError &e) {
+        fprintf(stderr, "%s: dropped frame: %s\n",
+                sources[tag].camera.device_path().c_str(), e.what());
+      }
+    }
+  }
+
+  writer.drain();
+  for (const auto &source : sources) {
+    fprintf(stderr, "%s: wrote %zu frames\n",
+            source.camera.device_path().c_str(), source.written);
+  }
+}
+
+void MultiCapture::capture(Source &source, size_t frame_count,
+                           bool on_request) {
+  // Frames nobody asked for are dequeued anyway, so the next one written is
+  // fresh.
+  const auto frame = source.camera.dequeue_frame();
+  if (frame.length() == 0 || !source.pending) {
+    return;
+  }
+
+  if (on_request) {
+    report_latency(source.camera, frame, requested);
+  }
+
+  auto data = writer.buffer();
+  VectorSink sink{data};
+  source.handoff->encode(frame, sink);
+  write_frame(source, frame, std::move(data));
+
+  ++source.written;
+  if (on_request) {
+    source.pending = false;
+  }
+  if (frame_count != 0 && source.written == frame_count) {
+    source.finished = true;
+    source.pending = false;
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, source.camera.poll_fd(), nullptr);
+  }
+}
+
+void MultiCapture::hold(Source &source, size_t frame_count,
+                        bool on_request) {
+  auto frame = source.camera.dequeue_frame();
+  if (frame.length() == 0 || !source.pending) {
+    return;
+  }
+  source.held.push_back(std::move(frame));
+  if (source.held.size() > source.held_limit) {
+    // Re-queued as it is dropped.
+    source.held.pop_front();
+  }
+
+  for (const auto &other : sources) {
+    if (other.held.size() < other.held_limit) {
+      return;
+    }
+  }
+  write_synchronized(frame_count, on_request);
+}
+
+void MultiCapture::write_synchronized(size_t frame_count, bool on_request) {
+  std::vector<std::vector<std::chrono::microseconds>> timestamps;
+  for (const auto &source : sources) {
+    timestamps.emplace_back();
+    for (const auto &frame : source.held) {
+      timestamps.back().push_back(frame.timestamp());
+    }
+  }
+  const auto picked = select_synchronized(timestamps);
+
+  // Every camera has an encoder of its own, so frames are encoded at once.
+  std::vector<std::vector<uint8_t>> encoded;
+  std::vector<std::string> errors(sources.size());
+  std::vector<std::thread> workers;
+  for (size_t i = 0; i < sources.size(); ++i) {
+    encoded.push_back(writer.buffer());
+  }
+  for (size_t i = 0; i < sources.size(); ++i) {
+    workers.emplace_back([&, i] {
+      try {
+        VectorSink sink{encoded[i]};
+        sources[i].handoff->encode(sources[i].held[picked[i]], sink);
+      } catch (const std::exception &e) {
+        errors[i] = e.what();
+      }
+    });
+  }
+  for (auto &worker : workers) {
+    worker.join();
+  }
+
+  auto earliest = std::chrono::microseconds::max();
+  auto latest = std::chrono::microseconds::min();
+  for (size_t i = 0; i < sources.size(); ++i) {
+    const auto timestamp = sources[i].held[picked[i]].timestamp();
+    earliest = std::min(earliest, timestamp);
+    latest = std::max(latest, timestamp);
+  }
+  fprintf(stderr, "Set %zu: spread %.3f ms\n", sources.front().written,
+          (latest - earliest).count() / 1000.0);
+
+  for (size_t i = 0; i < sources.size(); ++i) {
+    auto &source = sources[i];
+    const auto &frame = source.held[picked[i]];
+    fprintf(stderr, "  %s seq %8u ts %10.6f +%.3f ms\n",
+            source.camera.device_path().c_str(), frame.sequence(),
+            frame.timestamp().count() / 1e6,
+            (frame.timestamp() - earliest).count() / 1000.0);
+    if (on_request) {
+      report_latency(source.camera, frame, requested);
+    }
+    if (errors[i].empty()) {
+      write_frame(source, frame, std::move(encoded[i]));
+    } else {
+      fprintf(stderr, "%s\n", errors[i].c_str());
+    }
+
+    source.held.clear();
+    ++source.written;
+    source.pending = !on_request;
+    if (frame_count != 0 && source.written == frame_count) {
+      source.finished = true;
+      source.pending = false;
+      epoll_ctl(epoll_fd, EPOLL_CTL_DEL, source.camera.poll_fd(), nullptr);
+    }
+  }
+}
+
+bool MultiCapture::recover(uint32_t tag, const CameraError &error) {
+  auto &source = sources[tag];
+  // Reconnect waits for held frames, which point into the old buffers.
+  source.held.clear();
+  epoll_ctl(epoll_fd, EPOLL_CTL_DEL, source.camera.poll_fd(), nullptr);
+  if (!source.camera.recover(error)) {
+    return false;
+  }
+
+  if (!source.finished) {
+    epoll_event event;
+    event.events = EPOLLIN;
+    event.data.u32 = tag;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, source.camera.poll_fd(), &event);
+  }
+  return true;
+}
+
+void MultiCapture::write_frame(const Source &source, const FrameView &frame,
+                               std::vector<uint8_t> data) {
+  const auto width = source.camera.width();
+  const auto height = source.camera.height();
+  const auto timestamp = frame.timestamp();
+  const auto sequence = frame.sequence();
+  const uint64_t size = data.size();
+  writer.write(numbered_path(source.output_path, source.written),
+               std::move(data),
+               [this, width, height, timestamp, sequence,
+                size](const std::filesystem::path &path, bool ok) {
+                 if (!ok) {
+                   return;
+                 }
+                 if (manifest) {
+                   manifest->record(path, width, height, timestamp, sequence,
+                                    size);
+                 }
+                 fprintf(stdout, "%s\n", path.c_str());
+               });
+}
+
+void MultiCapture::read_control(void) {
+  uint64_t value;
+  if (read(control_fd.load(), &value, sizeof(value)) == -1) {
+    return;
+  }
+
+  if (snapshot_requested.exchange(false)) {
+    requested = monotonic_now();
+    for (auto &source : sources) {
+      source.pending = !source.finished;
+    }
+  }
+}
+
+bool MultiCapture::all_finished(void) const {
+  for (const auto &source : sources) {
+    if (!source.finished) {
+      return false;
+    }
+  }
+  return true;
+}
@@ -0,0 +1,105 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <filesystem>
+#include <memory>
+#include <vector>
+
+#include "./camera.h"
+
+class Converter;
+class DmabufHandoff;
+class EncoderPool;
+class Manifest;
+class OutputWriter;
+
+// Index of one timestamp from each list, picked so that the spread between
+// the earliest and the latest of them is smallest. Lists must not be empty.
+std::vector<size_t> select_synchronized(
+    const std::vector<std::vector<std::chrono::microseconds>> &timestamps);
+
+// Captures from several cameras in one thread.
+//
+// Every camera is watched with epoll and frames are dequeued as they become
+// ready, so a slow device doesn't hold the others back. Cameras with the same
+// format share one encoder of the pool. Stop and snapshot requests come in
+// through an eventfd, which wakes the loop from a signal handler.
+//
+// Synchronized capture writes sets of one frame from every camera instead.
+// Recent frames of each camera are held and the set with the smallest spread
+// of V4L2 timestamps is picked, then encoded in parallel. Every camera gets an
+// encoder of its own for it.
+//
+// Encoded frames are handed to the output writer, so the loop goes back to
+// the cameras while files are written.
+//
+// A camera which drops off is reconnected while the others keep going, and
+// frames failing to encode are left out.
+class MultiCapture {
+public:
+  struct Device {
+    Camera &camera;
+    // Converts frames before encoding when set.
+    Converter *converter;
+    // Frames are written into numbered files next to it.
+    std::filesystem::path output_path;
+  };
+
+  MultiCapture(const std::vector<Device> &devices, EncoderPool &pool,
+               OutputWriter &writer, uint32_t output_four_cc, bool use_dmabuf,
+               bool synchronized = false, Manifest *manifest = nullptr);
+  ~MultiCapture();
+
+  // Write frame_count frames of every camera, until stopped when 0. With
+  // on_request, only the frame following each request_snapshot() is written.
+  // Synchronized capture counts sets of frames the same way.
+  void run(size_t frame_count, bool on_request = false);
+
+  // Async-signal-safe.
+  static void request_stop(void);
+  // Write next frame of every camera. Async-signal-safe.
+  static void request_snapshot(void);
+
+protected:
+  struct Source {
+    Camera &camera;
+    std::unique_ptr<DmabufHandoff> handoff;
+    std::filesystem::path output_path;
+    size_t written = 0;
+    bool pending = false;
+    bool finished = false;
+    // Frames synchronized set is picked from, oldest first.
+    std::deque<FrameView> held{};
+    size_t held_limit = 0;
+  };
+
+  void capture(Source &source, size_t frame_count, bool on_request);
+  void hold(Source &source, size_t frame_count, bool on_request);
+  void write_synchronized(size_t frame_count, bool on_request);
+  // Reconnect camera of source tag and watch its new fd. Returns false when
+  // error can't be recovered from.
+  bool recover(uint32_t tag, const CameraError &error);
+  // Hand encoded frame to the writer as next file of source. Its path is
+  // printed, and put into the manifest, once published.
+  void write_frame(const Source &source, const FrameView &frame,
+                   std::vector<uint8_t> data);
+  void read_control(void);
+  bool all_finished(void) const;
+
+  static void wake(void);
+
+  static std::atomic<bool> stop_requested;
+  static std::atomic<bool> snapshot_requested;
+  static std::atomic<int> control_fd;
+
+  const bool synchronized;
+  OutputWriter &writer;
+  Manifest *manifest;
+  std::vector<Source> sources;
+  // Time of last snapshot request, for latency reports.
+  std::chrono::microseconds requested{};
+  int epoll_fd;
+};
@@ -0,0 +1,73 @@
+#include "./output.h"
+
+#include <chrono>
+#include <cstdio>
+#include <ctime>
+#include <stdexcept>
+
+#include "./fourcc.h"
+#include "./sink.h"
+
+uint32_t fourcc_from_path(const std::filesystem::path &p) {
+  if (!p.has_extension()) {
+    throw std::invalid_argument("Output path doesn't have extension. extension is required.");
+  }
+  const auto s = p.extension().string();
+
+  if (s == ".jpg" || s == ".jpeg") {
+    return ENCODING_JPEG;
+  }
+  if (s == ".gif") {
+    return ENCODING_GIF;
+  }
+  if (s == ".png") {
+    return ENCODING_PNG;
+  }
+  if (s == ".tga") {
+    return ENCODING_TGA;
+  }
+  if (s == ".bmp") {
+    return ENCODING_BMP;
+  }
+  // Video, recorded as H.264 in Matroska.
+  if (s == ".mkv") {
+    return ENCODING_H264;
+  }
+
+  throw std::invalid_argument("Can't specify output encoder from extension of output path");
+}
+
+void append_filename(std::filesystem::path& dir) {
+    const auto now = std::chrono::system_clock::now();
+    const auto now_c = std::chrono::system_clock::to_time_t(now);
+    char date_buf[32];
+
+    strftime(date_buf, 32, "%F %T.jpg", std::localtime(&now_c));
+    dir /= date_buf;
+}
+
+std::filesystem::path numbered_path(const std::filesystem::path &path,
+                                    size_t number) {
+  char number_buf[32];
+  snprintf(number_buf, sizeof(number_buf), "-%06zu", number);
+
+  auto ret = path;
+  ret.replace_filename(path.stem().string() + number_buf +
+                       path.extension().string());
+  return ret;
+}
+
+std::filesystem::path device_output_path(const std::filesystem::path &path,
+                                         const std::filesystem::path &device) {
+  auto ret = path;
+  ret.replace_filename(path.stem().string() + "-" +
+                       device.filename().string() + path.extension().string());
+  return ret;
+}
+
+bool write_file(const std::filesystem::path &path, const uint8_t *data,
+                size_t length) {
+  FileSink sink{path};
+  sink.consume(EncodedView(data, length));
+  return sink.close();
+}
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+
+// Pick output encoding from the extension of the output path.
+uint32_t fourcc_from_path(const std::filesystem::path &p);
+
+// Append "<captured date>.jpg" to the directory path.
+void append_filename(std::filesystem::path &dir);
+
+// Insert sequence number before the extension, "<stem>-000042<ext>".
+std::filesystem::path numbered_path(const std::filesystem::path &path,
+                                    size_t number);
+
+// Insert name of device before the extension, "<stem>-video0<ext>".
+std::filesystem::path device_output_path(const std::filesystem::path &path,
+                                         const std::filesystem::path &device);
+
+// Write whole buffer into the file, without going through stdio. Returns
+// false when the file can't be written.
+bool write_file(const std::filesystem::path &path, const uint8_t *data,
+                size_t length);
@@ -0,0 +1,304 @@
+#include "./output_writer.h"
+
+#include <future>
+#include <stdexcept>
+#include <stdio.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "./metrics.h"
+#ifdef HAVE_IO_URING
+#include "./output_writer_uring.h"
+#endif
+
+FsyncPolicy fsync_policy_from_name(const std::string &name) {
+  if (name == "none") {
+    return FsyncPolicy::NONE;
+  }
+  if (name == "data") {
+    return FsyncPolicy::DATA;
+  }
+  if (name == "full") {
+    return FsyncPolicy::FULL;
+  }
+
+  throw std::invalid_argument("Unknown fsync policy " + name);
+}
+
+const char *fsync_policy_name(FsyncPolicy policy) {
+  switch (policy) {
+  case FsyncPolicy::NONE:
+    return "none";
+  case FsyncPolicy::DATA:
+    return "data";
+  case FsyncPolicy::FULL:
+    return "full";
+  }
+  return "unknown";
+}
+
+WriterBackend writer_backend_from_name(const std::string &name) {
+  if (name == "auto") {
+    return WriterBackend::AUTO;
+  }
+  if (name == "io_uring") {
+    return WriterBackend::IO_URING;
+  }
+  if (name == "threads") {
+    return WriterBackend::THREADS;
+  }
+
+  throw std::invalid_argument("Unknown writer backend " + name);
+}
+
+const char *writer_backend_name(WriterBackend backend) {
+  switch (backend) {
+  case WriterBackend::AUTO:
+    return "auto";
+  case WriterBackend::IO_URING:
+    return "io_uring";
+  case WriterBackend::THREADS:
+    return "threads";
+  }
+  return "unknown";
+}
+
+std::unique_ptr<OutputWriter> OutputWriter::create(WriterBackend backend,
+                                                   FsyncPolicy policy,
+                                                   size_t max_in_flight) {
+  if (max_in_flight == 0) {
+    throw std::invalid_argument("Writer needs at least one file in flight");
+  }
+
+  switch (backend) {
+  case WriterBackend::IO_URING:
+#ifdef HAVE_IO_URING
+    return std::make_unique<UringWriter>(policy, max_in_flight);
+#else
+    throw std::invalid_argument("io_uring writer backend is not built in");
+#endif
+  case WriterBackend::THREADS:
+    return std::make_unique<ThreadWriter>(policy, max_in_flight);
+  case WriterBackend::AUTO:
+    break;
+  }
+
+#ifdef HAVE_IO_URING
+  try {
+    return std::make_unique<UringWriter>(policy, max_in_flight);
+  } catch (const std::runtime_error &e) {
+    fprintf(stderr, "io_uring is not available, write on threads: %s\n",
+            e.what());
+  }
+#endif
+
+  return std::make_unique<ThreadWriter>(policy, max_in_flight);
+}
+
+OutputWriter::OutputWriter(FsyncPolicy policy, size_t max_in_flight)
+    : policy(policy), max_in_flight(max_in_flight) {}
+
+void OutputWriter::write(const std::filesystem::path &path,
+                         std::vector<uint8_t> data, Done done) {
+  auto job = std::make_unique<Job>();
+  job->path = path;
+  job->data = std::move(data);
+  job->done = std::move(done);
+
+  {
+    std::unique_lock<std::mutex> lock{mutex};
+    if (in_flight == max_in_flight) {
+      StageTimer timer{Stage::WRITE_WAIT};
+      changed.wait(lock, [this] { return in_flight < max_in_flight; });
+    }
+    ++in_flight;
+    // Unique in the process, so writes of the same path don't collide.
+    job->temp_path =
+        path.parent_path() / ("." + path.filename().string() + "." +
+                              std::to_string(getpid()) + "-" +
+                              std::to_string(temp_count++) + ".tmp");
+  }
+
+  job->start = std::chrono::steady_clock::now();
+  submit(std::move(job));
+}
+
+bool OutputWriter::write_now(const std::filesystem::path &path,
+                             std::vector<uint8_t> data) {
+  std::promise<bool> published;
+  auto result = published.get_future();
+  write(path, std::move(data),
+        [&published](const std::filesystem::path &, bool ok) {
+          published.set_value(ok);
+        });
+  return result.get();
+}
+
+void OutputWriter::drain(void) {
+  std::unique_lock<std::mutex> lock{mutex};
+  changed.wait(lock, [this] { return in_flight == 0; });
+}
+
+std::vector<uint8_t> OutputWriter::buffer(void) {
+  std::lock_guard<std::mutex> lock{mutex};
+  if (spare_buffers.empty()) {
+    return {};
+  }
+  auto buffer = std::move(spare_buffers.back());
+  spare_buffers.pop_back();
+  return buffer;
+}
+
+void OutputWriter::recycle(std::vector<uint8_t> buffer) {
+  std::lock_guard<std::mutex> lock{mutex};
+  if (spare_buffers.size() < max_in_flight) {
+    buffer.clear();
+    spare_buffers.push_back(std::move(buffer));
+  }
+}
+
+bool OutputWriter::publish(Job &job) {
+  if (rename(job.temp_path.c_str(), job.path.c_str()) == -1) {
+    job.error = errno;
+    unlink(job.temp_path.c_str());
+    return false;
+  }
+  if (policy != FsyncPolicy::FULL) {
+    return true;
+  }
+
+  auto dir = job.path.parent_path();
+  if (dir.empty()) {
+    dir = ".";
+  }
+  const auto dir_fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (dir_fd == -1) {
+    job.error = errno;
+    return false;
+  }
+  if (fsync(dir_fd) == -1) {
+    job.error = errno;
+  }
+  close(dir_fd);
+  return job.error == 0;
+}
+
+void OutputWriter::discard(Job &job) {
+  if (job.fd != -1) {
+    close(job.fd);
+    job.fd = -1;
+  }
+  unlink(job.temp_path.c_str());
+}
+
+void OutputWriter::finish(std::unique_ptr<Job> job) {
+  const auto ok = job->error == 0;
+  if (ok) {
+    metrics().written_bytes.fetch_add(job->data.size(),
+                                      std::memory_order_relaxed);
+  } else {
+    fprintf(stderr, "Failed to write %s: %s\n", job->path.c_str(),
+            strerror(job->error));
+  }
+  metrics().record(Stage::WRITE,
+                   std::chrono::duration_cast<std::chrono::microseconds>(
+                       std::chrono::steady_clock::now() - job->start));
+
+  if (job->done) {
+    job->done(job->path, ok);
+  }
+
+  std::lock_guard<std::mutex> lock{mutex};
+  if (spare_buffers.size() < max_in_flight) {
+    job->data.clear();
+    spare_buffers.push_back(std::move(job->data));
+  }
+  --in_flight;
+  changed.notify_all();
+}
+
+ThreadWriter::ThreadWriter(FsyncPolicy policy, size_t max_in_flight,
+                           size_t thread_count)
+    : OutputWriter(policy, max_in_flight) {
+  for (size_t i = 0; i < thread_count; ++i) {
+    threads.emplace_back(&ThreadWriter::work, this);
+  }
+}
+
+ThreadWriter::~ThreadWriter() {
+  {
+    std::lock_guard<std::mutex> lock{queue_mutex};
+    stop = true;
+  }
+  queued.notify_all();
+  // Workers empty the queue before they stop.
+  for (auto &thread : threads) {
+    thread.join();
+  }
+}
+
+void ThreadWriter::submit(std::unique_ptr<Job> job) {
+  {
+    std::lock_guard<std::mutex> lock{queue_mutex};
+    queue.push_back(std::move(job));
+  }
+  queued.notify_one();
+}
+
+void ThreadWriter::work(void) {
+  while (true) {
+    std::unique_ptr<Job> job;
+    {
+      std::unique_lock<std::mutex> lock{queue_mutex};
+      queued.wait(lock, [this] { return stop || !queue.empty(); });
+      if (queue.empty()) {
+        return;
+      }
+      job = std::move(queue.front());
+      queue.pop_front();
+    }
+    if (!run(*job)) {
+      discard(*job);
+    }
+    finish(std::move(job));
+  }
+}
+
+bool ThreadWriter::run(Job &job) {
+  job.fd = open(job.temp_path.c_str(),
+                O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (job.fd == -1) {
+    job.error = errno;
+    return false;
+  }
+
+  while (job.written < job.data.size()) {
+    const auto r = ::write(job.fd, job.data.data() + job.written,
+                           job.data.size() - job.written);
+    if (r == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      job.error = errno;
+      return false;
+    }
+    job.written += r;
+  }
+
+  if ((policy == FsyncPolicy::DATA && fdatasync(job.fd) == -1) ||
+      (policy == FsyncPolicy::FULL && fsync(job.fd) == -1)) {
+    job.error = errno;
+    return false;
+  }
+
+  const auto fd = job.fd;
+  job.fd = -1;
+  if (close(fd) == -1) {
+    job.error = errno;
+    return false;
+  }
+  return publish(job);
+}
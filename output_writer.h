@@ -0,0 +1,131 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// What is flushed to storage before a file is published.
+enum class FsyncPolicy {
+  // Nothing. Files survive a crash of the process, not a power loss.
+  NONE,
+  // File data, by fdatasync() before the rename.
+  DATA,
+  // File by fsync() before the rename and its directory after it, so the new
+  // name survives a power loss too.
+  FULL,
+};
+
+FsyncPolicy fsync_policy_from_name(const std::string &name);
+const char *fsync_policy_name(FsyncPolicy policy);
+
+enum class WriterBackend {
+  AUTO,
+  IO_URING,
+  THREADS,
+};
+
+WriterBackend writer_backend_from_name(const std::string &name);
+const char *writer_backend_name(WriterBackend backend);
+
+// Writes files in the background, so storage latency doesn't hold up
+// capture. Every file is written into a hidden temp file next to it and
+// renamed over the path once complete, so readers never see it half written.
+class OutputWriter {
+public:
+  // Called from a writer thread once path is published or has failed.
+  using Done = std::function<void(const std::filesystem::path &path, bool ok)>;
+
+  static constexpr size_t DEFAULT_IN_FLIGHT = 8;
+
+  // AUTO picks io_uring when it is built in and the kernel has it, threads
+  // otherwise.
+  static std::unique_ptr<OutputWriter> create(
+      WriterBackend backend, FsyncPolicy policy,
+      size_t max_in_flight = DEFAULT_IN_FLIGHT);
+  // Backends wait for files still in flight.
+  virtual ~OutputWriter() = default;
+  OutputWriter(const OutputWriter &) = delete;
+  OutputWriter &operator=(const OutputWriter &) = delete;
+
+  virtual WriterBackend backend() const = 0;
+
+  // Queue data to be written as path. Blocks only while max_in_flight files
+  // are being written.
+  void write(const std::filesystem::path &path, std::vector<uint8_t> data,
+             Done done = nullptr);
+  // Write and wait until path is published. Returns false when it failed.
+  bool write_now(const std::filesystem::path &path, std::vector<uint8_t> data);
+  // Wait until every queued file is published.
+  void drain(void);
+  // Empty buffer for the next write, reusing memory of finished ones.
+  std::vector<uint8_t> buffer(void);
+  // Take back buffer which was not written, for buffer() to hand out.
+  void recycle(std::vector<uint8_t> buffer);
+
+protected:
+  struct Job {
+    // Steps of a write, for backends running them one by one.
+    enum class Step { OPEN, WRITE, SYNC, CLOSE };
+
+    std::filesystem::path path;
+    std::filesystem::path temp_path;
+    std::vector<uint8_t> data;
+    Done done;
+    std::chrono::steady_clock::time_point start;
+    Step step = Step::OPEN;
+    size_t written = 0;
+    int fd = -1;
+    // errno of the step which failed.
+    int error = 0;
+  };
+
+  OutputWriter(FsyncPolicy policy, size_t max_in_flight);
+
+  // Takes job over, and hands it to finish() when done.
+  virtual void submit(std::unique_ptr<Job> job) = 0;
+  // Rename temp file over path, then sync directory if policy asks for it.
+  bool publish(Job &job);
+  // Close and remove temp file of a failed job.
+  void discard(Job &job);
+  void finish(std::unique_ptr<Job> job);
+
+  const FsyncPolicy policy;
+  const size_t max_in_flight;
+
+  std::mutex mutex;
+  std::condition_variable changed;
+  size_t in_flight = 0;
+  uint64_t temp_count = 0;
+  std::vector<std::vector<uint8_t>> spare_buffers;
+};
+
+// Runs writes with blocking syscalls on a few threads of its own.
+class ThreadWriter : public OutputWriter {
+public:
+  ThreadWriter(FsyncPolicy policy, size_t max_in_flight,
+               size_t thread_count = 2);
+  ~ThreadWriter();
+
+  WriterBackend backend() const override {
+    return WriterBackend::THREADS;
+  }
+
+protected:
+  void submit(std::unique_ptr<Job> job) override;
+  void work(void);
+  bool run(Job &job);
+
+  std::mutex queue_mutex;
+  std::condition_variable queued;
+  std::deque<std::unique_ptr<Job>> queue;
+  bool stop = false;
+  std::vector<std::thread> threads;
+};
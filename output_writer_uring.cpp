@@ -0,0 +1,290 @@
+#include "./output_writer_uring.h"
+
+#include <algorithm>
+#include <stdexcept>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+static int io_uring_setup(unsigned entries, io_uring_params *params) {
+  return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+                          unsigned flags) {
+  return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+                 nullptr, 0);
+}
+
+static int io_uring_register(int fd, unsigned opcode, void *arg,
+                             unsigned count) {
+  return syscall(__NR_io_uring_register, fd, opcode, arg, count);
+}
+
+template <typename T> static T *ring_field(void *ring, uint32_t offset) {
+  return reinterpret_cast<T *>(static_cast<uint8_t *>(ring) + offset);
+}
+
+UringWriter::UringWriter(FsyncPolicy policy, size_t max_in_flight)
+    : OutputWriter(policy, max_in_flight) {
+  io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  // Every file has one step queued at a time, and one more entry wakes the
+  // reaper up to stop.
+  ring_fd = io_uring_setup(max_in_flight + 1, &params);
+  if (ring_fd == -1) {
+    throw std::runtime_error(std::string("io_uring_setup: ") +
+                             strerror(errno));
+  }
+
+  try {
+    sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_ring_size =
+        params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    const bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mmap) {
+      sq_ring_size = std::max(sq_ring_size, cq_ring_size);
+    }
+    sq_ring = mmap(nullptr, sq_ring_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+    if (sq_ring == MAP_FAILED) {
+      sq_ring = nullptr;
+      throw std::runtime_error(std::string("Cannot map io_uring: ") +
+                               strerror(errno));
+    }
+    if (single_mmap) {
+      // Unmapped along with submission ring.
+      cq_ring = sq_ring;
+      cq_ring_size = 0;
+    } else {
+      cq_ring = mmap(nullptr, cq_ring_size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+      if (cq_ring == MAP_FAILED) {
+        cq_ring = nullptr;
+        throw std::runtime_error(std::string("Cannot map io_uring: ") +
+                                 strerror(errno));
+      }
+    }
+    sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+    auto *address = mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+    if (address == MAP_FAILED) {
+      throw std::runtime_error(std::string("Cannot map io_uring: ") +
+                               strerror(errno));
+    }
+    sqes = static_cast<io_uring_sqe *>(address);
+
+    sq_tail = ring_field<unsigned>(sq_ring, params.sq_off.tail);
+    sq_mask = *ring_field<unsigned>(sq_ring, params.sq_off.ring_mask);
+    sq_array = ring_field<unsigned>(sq_ring, params.sq_off.array);
+    cq_head = ring_field<unsigned>(cq_ring, params.cq_off.head);
+    cq_tail = ring_field<unsigned>(cq_ring, params.cq_off.tail);
+    cq_mask = *ring_field<unsigned>(cq_ring, params.cq_off.ring_mask);
+    cqes = ring_field<io_uring_cqe>(cq_ring, params.cq_off.cqes);
+
+    check_operations();
+  } catch (...) {
+    release_ring();
+    throw;
+  }
+
+  thread = std::thread(&UringWriter::reap, this);
+}
+
+UringWriter::~UringWriter() {
+  drain();
+  {
+    // Nothing is in flight, so the no-op is the last completion.
+    std::lock_guard<std::mutex> lock{sq_mutex};
+    const auto tail = *sq_tail;
+    const auto index = tail & sq_mask;
+    auto &sqe = sqes[index];
+    memset(&sqe, 0, sizeof(sqe));
+    sqe.opcode = IORING_OP_NOP;
+    sqe.user_data = 0;
+    sq_array[index] = index;
+    __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+    while (io_uring_enter(ring_fd, 1, 0, 0) == -1 && errno == EINTR) {
+    }
+  }
+  thread.join();
+  release_ring();
+}
+
+void UringWriter::release_ring(void) {
+  if (sqes != nullptr) {
+    munmap(sqes, sqes_size);
+  }
+  if (cq_ring != nullptr && cq_ring_size != 0) {
+    munmap(cq_ring, cq_ring_size);
+  }
+  if (sq_ring != nullptr) {
+    munmap(sq_ring, sq_ring_size);
+  }
+  close(ring_fd);
+}
+
+void UringWriter::check_operations(void) {
+  constexpr unsigned PROBE_OPS = 256;
+  std::vector<uint8_t> buffer(sizeof(io_uring_probe) +
+                              PROBE_OPS * sizeof(io_uring_probe_op));
+  auto *probe = reinterpret_cast<io_uring_probe *>(buffer.data());
+  if (io_uring_register(ring_fd, IORING_REGISTER_PROBE, probe, PROBE_OPS) ==
+      -1) {
+    throw std::runtime_error(std::string("Cannot probe io_uring: ") +
+                             strerror(errno));
+  }
+
+  for (const auto op : {IORING_OP_OPENAT, IORING_OP_WRITE, IORING_OP_FSYNC,
+                        IORING_OP_CLOSE}) {
+    if (op > probe->last_op ||
+        !(probe->ops[op].flags & IO_URING_OP_SUPPORTED)) {
+      throw std::runtime_error("io_uring lacks operation " +
+                               std::to_string(op));
+    }
+  }
+}
+
+void UringWriter::submit(std::unique_ptr<Job> job) {
+  // Owned by the ring until its last step completes.
+  queue_step(*job.release());
+}
+
+void UringWriter::queue_step(Job &job) {
+  std::lock_guard<std::mutex> lock{sq_mutex};
+  const auto tail = *sq_tail;
+  const auto index = tail & sq_mask;
+  auto &sqe = sqes[index];
+  memset(&sqe, 0, sizeof(sqe));
+
+  switch (job.step) {
+  case Job::Step::OPEN:
+    sqe.opcode = IORING_OP_OPENAT;
+    sqe.fd = AT_FDCWD;
+    sqe.addr = reinterpret_cast<uintptr_t>(job.temp_path.c_str());
+    sqe.len = 0644;
+    sqe.open_flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+    break;
+  case Job::Step::WRITE:
+    sqe.opcode = IORING_OP_WRITE;
+    sqe.fd = job.fd;
+    sqe.addr = reinterpret_cast<uintptr_t>(job.data.data() + job.written);
+    sqe.len = job.data.size() - job.written;
+    sqe.off = job.written;
+    break;
+  case Job::Step::SYNC:
+    sqe.opcode = IORING_OP_FSYNC;
+    sqe.fd = job.fd;
+    sqe.fsync_flags =
+        policy == FsyncPolicy::DATA ? IORING_FSYNC_DATASYNC : 0;
+    break;
+  case Job::Step::CLOSE:
+    sqe.opcode = IORING_OP_CLOSE;
+    sqe.fd = job.fd;
+    break;
+  }
+  sqe.user_data = reinterpret_cast<uintptr_t>(&job);
+  sq_array[index] = index;
+  __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+  while (io_uring_enter(ring_fd, 1, 0, 0) == -1) {
+    if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+      throw std::runtime_error(std::string("io_uring_enter: ") +
+                               strerror(errno));
+    }
+  }
+}
+
+bool UringWriter::complete_step(Job &job, int result) {
+  if (result == -EINTR || result == -EAGAIN) {
+    queue_step(job);
+    return true;
+  }
+  if (result < 0) {
+    job.error = -result;
+    if (job.step == Job::Step::CLOSE) {
+      // Descriptor is gone even when close fails.
+      job.fd = -1;
+    }
+    discard(job);
+    return false;
+  }
+
+  switch (job.step) {
+  case Job::Step::OPEN:
+    job.fd = result;
+    break;
+  case Job::Step::WRITE:
+    if (result == 0) {
+      job.error = EIO;
+      discard(job);
+      return false;
+    }
+    job.written += result;
+    break;
+  case Job::Step::SYNC:
+    break;
+  case Job::Step::CLOSE:
+    job.fd = -1;
+    if (!publish(job)) {
+      discard(job);
+    }
+    return false;
+  }
+
+  // Short writes are continued from where they stopped.
+  if (job.written < job.data.size()) {
+    job.step = Job::Step::WRITE;
+  } else if (policy != FsyncPolicy::NONE && job.step != Job::Step::SYNC) {
+    job.step = Job::Step::SYNC;
+  } else {
+    job.step = Job::Step::CLOSE;
+  }
+  queue_step(job);
+  return true;
+}
+
+void UringWriter::reap(void) {
+  bool stopping = false;
+  while (!stopping) {
+    if (io_uring_enter(ring_fd, 0, 1, IORING_ENTER_GETEVENTS) == -1 &&
+        errno != EINTR) {
+      fprintf(stderr, "io_uring_enter: %s\n", strerror(errno));
+      return;
+    }
+
+    auto head = *cq_head;
+    const auto tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+    while (head != tail) {
+      const auto &cqe = cqes[head & cq_mask];
+      auto *job = reinterpret_cast<Job *>(cqe.user_data);
+      const auto result = cqe.res;
+      ++head;
+      __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+
+      if (job == nullptr) {
+        stopping = true;
+        continue;
+      }
+      bool queued;
+      try {
+        queued = complete_step(*job, result);
+      } catch (const std::runtime_error &e) {
+        fprintf(stderr, "%s\n", e.what());
+        job->error = EIO;
+        discard(*job);
+        queued = false;
+      }
+      if (!queued) {
+        finish(std::unique_ptr<Job>(job));
+      }
+    }
+  }
+}
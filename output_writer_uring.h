@@ -0,0 +1,57 @@
+#pragma once
+
+#include <mutex>
+#include <thread>
+
+#include <linux/io_uring.h>
+
+#include "./output_writer.h"
+
+// Runs writes through io_uring, talking to the kernel by raw syscalls. Steps
+// of every file are submitted one after another as the previous completes, so
+// a single thread keeps all files in flight without blocking on any of them.
+// Only rename and directory sync, which are cheap next to the data, run as
+// plain syscalls on that thread.
+//
+// Needs openat, write, fsync and close operations, from Linux 5.6.
+class UringWriter : public OutputWriter {
+public:
+  // Throws std::runtime_error when kernel can't run the writes.
+  UringWriter(FsyncPolicy policy, size_t max_in_flight);
+  ~UringWriter();
+
+  WriterBackend backend() const override {
+    return WriterBackend::IO_URING;
+  }
+
+protected:
+  void submit(std::unique_ptr<Job> job) override;
+  // Queue next step of job.
+  void queue_step(Job &job);
+  // Take result of the step job was waiting for. Returns false once job is
+  // done, either way.
+  bool complete_step(Job &job, int result);
+  void reap(void);
+  void check_operations(void);
+  void release_ring(void);
+
+  int ring_fd = -1;
+  void *sq_ring = nullptr;
+  size_t sq_ring_size = 0;
+  void *cq_ring = nullptr;
+  size_t cq_ring_size = 0;
+  io_uring_sqe *sqes = nullptr;
+  size_t sqes_size = 0;
+
+  unsigned *sq_tail;
+  unsigned sq_mask;
+  unsigned *sq_array;
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned cq_mask;
+  io_uring_cqe *cqes;
+
+  // Guards submission queue, which is filled by writers and the reaper.
+  std::mutex sq_mutex;
+  std::thread thread;
+};
@@ -0,0 +1,303 @@
+#include "./pipeline.h"
+
+#include <algorithm>
+#include <chrono>
+#include <stdio.h>
+#include <thread>
+
+#include "./convert.h"
+#include "./dmabuf.h"
+#include "./encoder.h"
+#include "./manifest.h"
+#include "./matroska.h"
+#include "./metrics.h"
+#include "./motion.h"
+#include "./output.h"
+#include "./output_writer.h"
+#include "./recording.h"
+#include "./thumbnail.h"
+
+std::atomic<bool> Pipeline::stop_requested = false;
+
+// Raw frame queues hold V4L2 buffers, so keep them short to leave buffers
+// queued in the driver. Burst lets every buffer be in flight instead.
+constexpr size_t RAW_QUEUE_SIZE = 1;
+constexpr size_t ENCODED_QUEUE_SIZE = 8;
+// One being filled, the queued ones and one being consumed by next stage.
+constexpr size_t CONVERSION_SLOTS = RAW_QUEUE_SIZE + 2;
+
+Pipeline::Pipeline(Camera &camera, DmabufHandoff &handoff, OutputWriter &writer,
+                   const std::filesystem::path &output_path, bool burst,
+                   Converter *converter, Recorder *recorder,
+                   Thumbnailer *thumbnailer, Manifest *manifest,
+                   MatroskaWriter *muxer, MotionDetector *detector)
+    : camera(camera), handoff(handoff), writer(writer),
+      output_path(output_path), burst(burst), converter(converter),
+      recorder(recorder), thumbnailer(thumbnailer), manifest(manifest),
+      muxer(muxer), detector(detector),
+      captured(burst ? camera.count() : RAW_QUEUE_SIZE),
+      converted(RAW_QUEUE_SIZE), encoded(ENCODED_QUEUE_SIZE) {
+  if (converter) {
+    conversion_slots.assign(CONVERSION_SLOTS,
+                            std::vector<uint8_t>(converter->output_size()));
+  }
+}
+
+void Pipeline::request_stop(void) { stop_requested.store(true); }
+
+void Pipeline::run(size_t frame_count) {
+  const auto begin = std::chrono::steady_clock::now();
+
+  std::thread convert_thread{&Pipeline::convert_stage, this};
+  std::thread encode_thread{&Pipeline::encode_stage, this};
+  std::thread write_thread{&Pipeline::write_stage, this};
+
+  capture_stage(frame_count);
+
+  convert_thread.join();
+  encode_thread.join();
+  write_thread.join();
+  writer.drain();
+  if (muxer) {
+    finish_video();
+  }
+
+  const std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - begin;
+  fprintf(stderr, "Wrote %zu frames, dropped %zu in %.3f s (%.2f fps)\n",
+          written.load(), dropped.load(), elapsed.count(),
+          written.load() / elapsed.count());
+  if (detector) {
+    fprintf(stderr, "Skipped %zu frames without motion\n", unchanged.load());
+  }
+
+  if (burst) {
+    report_burst();
+  }
+}
+
+void Pipeline::report_burst(void) {
+  if (written_frames.empty()) {
+    return;
+  }
+  // Files can be published out of order.
+  std::sort(written_frames.begin(), written_frames.end(),
+            [](const WrittenFrame &a, const WrittenFrame &b) {
+              return a.sequence < b.sequence;
+            });
+
+  const auto &first = written_frames.front();
+  const auto &last = written_frames.back();
+  size_t missed = 0;
+  for (size_t i = 0; i < written_frames.size(); ++i) {
+    const auto &frame = written_frames[i];
+    if (i > 0) {
+      missed += frame.sequence - written_frames[i - 1].sequence - 1;
+    }
+    fprintf(stderr, "frame %3zu seq %8u ts %10.6f +%9.3f ms %s\n", i,
+            frame.sequence, frame.timestamp.count() / 1e6,
+            (frame.timestamp - first.timestamp).count() / 1e3,
+            frame.path.c_str());
+  }
+
+  const std::chrono::duration<double> span = last.timestamp - first.timestamp;
+  fprintf(stderr, "Burst of %zu frames over %.3f s: %.2f fps, %zu frames "
+          "missed by sequence\n",
+          written_frames.size(), span.count(),
+          span.count() > 0 ? (written_frames.size() - 1) / span.count() : 0.0,
+          missed);
+}
+
+void Pipeline::fail(const char *stage, const std::exception &e) {
+  fprintf(stderr, "%s stage failed: %s\n", stage, e.what());
+  failed.store(true);
+}
+
+bool Pipeline::detect(const FrameView &frame) {
+  try {
+    if (!detector->detect(frame.data(), frame.length())) {
+      unchanged.fetch_add(1);
+      metrics().unchanged_frames.fetch_add(1, std::memory_order_relaxed);
+      return false;
+    }
+  } catch (const FrameError &e) {
+    fprintf(stderr, "Dropped frame: %s\n", e.what());
+    dropped.fetch_add(1);
+    return false;
+  }
+  return true;
+}
+
+void Pipeline::capture_stage(size_t frame_count) {
+  size_t number = 0;
+
+  try {
+    while (!stop_requested.load() && !failed.load() &&
+           (frame_count == 0 || number < frame_count)) {
+      // Waits for frames other stages hold while reconnecting.
+      auto frame = camera.read_frame_recovering();
+      if (frame.length() == 0) {
+        continue;
+      }
+      if (recorder) {
+        recorder->record(frame);
+      }
+      if (detector && !detect(frame)) {
+        continue;
+      }
+      RawFrame raw{number, frame.timestamp(), frame.sequence(),
+                   std::move(frame), {}};
+
+      if (burst) {
+        if (!captured.push(std::move(raw))) {
+          break;
+        }
+      } else if (!captured.try_push(raw)) {
+        // Frame is re-queued when raw goes out of scope.
+        dropped.fetch_add(1);
+        continue;
+      }
+      ++number;
+    }
+  } catch (const std::exception &e) {
+    fail("capture", e);
+  }
+
+  captured.close();
+}
+
+void Pipeline::convert_stage(void) {
+  size_t slot = 0;
+  while (auto raw = captured.pop()) {
+    if (converter && !failed.load()) {
+      try {
+        auto &output = conversion_slots[slot];
+        slot = (slot + 1) % conversion_slots.size();
+        {
+          StageTimer timer{Stage::CONVERT};
+          converter->convert(raw->frame->data(), raw->frame->length(),
+                             output.data());
+        }
+        raw->converted = ByteView(output.data(), output.size());
+        // Buffer is no longer needed, re-queue before waiting for encoder.
+        raw->frame.reset();
+      } catch (const FrameError &e) {
+        // Only this frame is lost.
+        fprintf(stderr, "Dropped frame %zu: %s\n", raw->number, e.what());
+        dropped.fetch_add(1);
+        continue;
+      } catch (const std::exception &e) {
+        fail("convert", e);
+      }
+    }
+    if (!converted.push(std::move(*raw))) {
+      break;
+    }
+  }
+
+  converted.close();
+}
+
+void Pipeline::encode_stage(void) {
+  while (auto raw = converted.pop()) {
+    if (failed.load()) {
+      continue;
+    }
+
+    try {
+      // Buffers come back from the writer, so they stop allocating once
+      // grown to the largest frame.
+      auto output = writer.buffer();
+      VectorSink sink{output};
+      if (raw->frame) {
+        handoff.encode(*raw->frame, sink);
+      } else {
+        handoff.encode(raw->converted.data(), raw->converted.size(), sink,
+                       raw->timestamp);
+      }
+      if (thumbnailer) {
+        const auto path = numbered_path(output_path, raw->number);
+        if (raw->frame) {
+          thumbnailer->write(writer, path, raw->frame->data(),
+                             raw->frame->length());
+        } else {
+          thumbnailer->write(writer, path, raw->converted.data(),
+                             raw->converted.size());
+        }
+      }
+      EncodedFrame frame{raw->number, raw->timestamp, raw->sequence,
+                         std::move(output)};
+      // Buffer is no longer needed, re-queue before waiting for writer.
+      raw.reset();
+      if (!encoded.push(std::move(frame))) {
+        break;
+      }
+    } catch (const FrameError &e) {
+      // Only this frame is lost.
+      fprintf(stderr, "Dropped frame %zu: %s\n", raw->number, e.what());
+      dropped.fetch_add(1);
+    } catch (const std::exception &e) {
+      fail("encode", e);
+    }
+  }
+
+  encoded.close();
+}
+
+void Pipeline::write_stage(void) {
+  while (auto frame = encoded.pop()) {
+    if (muxer) {
+      write_video(*frame);
+      continue;
+    }
+    const auto timestamp = frame->timestamp;
+    const auto sequence = frame->sequence;
+    const uint64_t size = frame->data.size();
+    writer.write(numbered_path(output_path, frame->number),
+                 std::move(frame->data),
+                 [this, timestamp, sequence,
+                  size](const std::filesystem::path &path, bool ok) {
+                   if (!ok) {
+                     failed.store(true);
+                     return;
+                   }
+                   written.fetch_add(1);
+                   if (manifest) {
+                     manifest->record(path, camera.width(), camera.height(),
+                                      timestamp, sequence, size);
+                   }
+                   if (burst) {
+                     std::lock_guard<std::mutex> lock{written_mutex};
+                     written_frames.push_back({path, timestamp, sequence});
+                   }
+                   fprintf(stdout, "%s\n", path.c_str());
+                 });
+  }
+}
+
+void Pipeline::write_video(EncodedFrame &frame) {
+  const auto before = muxer->frames();
+  if (!muxer->write_frame(ByteView(frame.data.data(), frame.data.size()),
+                          frame.timestamp)) {
+    failed.store(true);
+  } else if (muxer->frames() != before) {
+    if (before == 0) {
+      video_start = {muxer->path(), frame.timestamp, frame.sequence};
+    }
+    written.fetch_add(1);
+  }
+  writer.recycle(std::move(frame.data));
+}
+
+void Pipeline::finish_video(void) {
+  if (!muxer->finish()) {
+    failed.store(true);
+    return;
+  }
+  if (manifest) {
+    manifest->record(muxer->path(), camera.width(), camera.height(),
+                     video_start.timestamp, video_start.sequence,
+                     muxer->size());
+  }
+  fprintf(stdout, "%s\n", muxer->path().c_str());
+}
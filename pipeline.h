@@ -0,0 +1,132 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <mutex>
+#include <optional>
+#include <vector>
+
+#include "./camera.h"
+#include "./mjpeg.h"
+#include "./sink.h"
+#include "./spsc_queue.h"
+
+class Converter;
+class DmabufHandoff;
+class Manifest;
+class MatroskaWriter;
+class MotionDetector;
+class OutputWriter;
+class Recorder;
+class Thumbnailer;
+
+// Continuous capture split into dequeue, convert, encode and write stages,
+// each running on its own thread and linked by bounded SPSC queues.
+//
+// Write stage hands encoded frames to the output writer, so it only waits for
+// storage when the writer has too many files in flight.
+//
+// Raw frames move between stages as FrameView, so a V4L2 buffer is re-queued
+// once encode stage is done with it. Capture stage drops frames instead of
+// blocking when convert stage is behind, which keeps buffers queued in the
+// driver.
+//
+// With a converter, convert stage turns frames into I420 in preallocated
+// slots and re-queues the V4L2 buffer right away.
+//
+// With a thumbnailer, encode stage also writes a thumbnail of every frame. It
+// gets converted frames when there is a converter.
+//
+// With a manifest, every published frame is appended to it.
+//
+// With a muxer, write stage puts frames into it as video instead, which is
+// finished once capture stops.
+//
+// With a recorder, capture stage also hands every dequeued frame to it, before
+// frames are dropped for the encoder.
+//
+// With a detector, capture stage skips frames in which it sees no motion, so
+// only changed ones take a frame count and go to the encoder.
+//
+// In burst mode, consecutive frames are kept in flight instead of being
+// dropped, and timestamp and sequence of each frame is reported.
+class Pipeline {
+public:
+  Pipeline(Camera &camera, DmabufHandoff &handoff, OutputWriter &writer,
+           const std::filesystem::path &output_path, bool burst = false,
+           Converter *converter = nullptr, Recorder *recorder = nullptr,
+           Thumbnailer *thumbnailer = nullptr, Manifest *manifest = nullptr,
+           MatroskaWriter *muxer = nullptr,
+           MotionDetector *detector = nullptr);
+
+  // Capture frame_count frames, or until stopped when frame_count is 0.
+  void run(size_t frame_count);
+  // Async-signal-safe.
+  static void request_stop(void);
+
+protected:
+  struct RawFrame {
+    size_t number;
+    std::chrono::microseconds timestamp;
+    uint32_t sequence;
+    // Empty once converted.
+    std::optional<FrameView> frame;
+    ByteView converted;
+  };
+  struct EncodedFrame {
+    size_t number;
+    std::chrono::microseconds timestamp;
+    uint32_t sequence;
+    // Buffer of the writer.
+    std::vector<uint8_t> data;
+  };
+  struct WrittenFrame {
+    std::filesystem::path path;
+    std::chrono::microseconds timestamp;
+    uint32_t sequence;
+  };
+
+  // Whether frame changed enough to keep, counting the ones which didn't and
+  // dropping ones which can't be looked at.
+  bool detect(const FrameView &frame);
+  void capture_stage(size_t frame_count);
+  void convert_stage(void);
+  void encode_stage(void);
+  void write_stage(void);
+  void write_video(EncodedFrame &frame);
+  void finish_video(void);
+  void fail(const char *stage, const std::exception &e);
+  void report_burst(void);
+
+  static std::atomic<bool> stop_requested;
+
+  Camera &camera;
+  DmabufHandoff &handoff;
+  OutputWriter &writer;
+  const std::filesystem::path output_path;
+  const bool burst;
+  Converter *converter;
+  Recorder *recorder;
+  Thumbnailer *thumbnailer;
+  Manifest *manifest;
+  MatroskaWriter *muxer;
+  MotionDetector *detector;
+  // Owned by convert stage until handed to encode stage.
+  std::vector<std::vector<uint8_t>> conversion_slots;
+
+  SpscQueue<RawFrame> captured;
+  SpscQueue<RawFrame> converted;
+  SpscQueue<EncodedFrame> encoded;
+
+  std::atomic<size_t> dropped{0};
+  std::atomic<size_t> unchanged{0};
+  std::atomic<size_t> written{0};
+  std::atomic<bool> failed{false};
+  // Filled as the writer publishes files.
+  std::mutex written_mutex;
+  std::vector<WrittenFrame> written_frames;
+  // First frame of video.
+  WrittenFrame video_start;
+};
@@ -0,0 +1,260 @@
+#include "./recording.h"
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static const char MAGIC[8] = {'V', '4', 'L', 'R', 'E', 'C', '0', '1'};
+// Frames start at aligned offsets, so SIMD loads from the mapping are aligned.
+constexpr uint64_t FRAME_ALIGNMENT = 64;
+
+std::filesystem::path recording_index_path(const std::filesystem::path &path) {
+  auto ret = path;
+  ret += ".idx";
+  return ret;
+}
+
+static int create_file(const std::filesystem::path &path) {
+  const auto fd =
+      open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd == -1) {
+    throw std::runtime_error("Cannot create " + path.string() + ": " +
+                             strerror(errno));
+  }
+  return fd;
+}
+
+Recorder::Recorder(const std::filesystem::path &path, uint32_t four_cc,
+                   uint32_t width, uint32_t height, uint32_t bytesperline,
+                   size_t max_frame_size, size_t slot_count)
+    : data_fd(create_file(path)), index_fd(-1), offset(0),
+      free_slots(slot_count), pending(slot_count) {
+  try {
+    index_fd = create_file(recording_index_path(path));
+  } catch (...) {
+    ::close(data_fd);
+    throw;
+  }
+
+  RecordingHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, MAGIC, sizeof(MAGIC));
+  header.four_cc = four_cc;
+  header.width = width;
+  header.height = height;
+  header.bytesperline = bytesperline;
+  if (!write_all(data_fd, &header, sizeof(header))) {
+    ::close(data_fd);
+    ::close(index_fd);
+    throw std::runtime_error("Cannot write " + path.string() + ": " +
+                             strerror(errno));
+  }
+  offset = sizeof(header);
+
+  slots.resize(slot_count);
+  for (size_t i = 0; i < slot_count; ++i) {
+    slots[i].resize(max_frame_size);
+    free_slots.try_push(i);
+  }
+
+  thread = std::thread(&Recorder::write_frames, this);
+}
+
+Recorder::~Recorder() {
+  pending.close();
+  thread.join();
+  ::close(data_fd);
+  ::close(index_fd);
+
+  fprintf(stderr, "Recorded %zu frames, left out %zu\n", recorded(),
+          dropped());
+}
+
+bool Recorder::record(const FrameView &frame) {
+  std::optional<size_t> slot;
+  if (!failed.load()) {
+    slot = free_slots.try_pop();
+  }
+  if (!slot.has_value() || frame.length() > slots[slot.value()].size()) {
+    if (slot.has_value()) {
+      free_slots.try_push(slot.value());
+    }
+    _dropped.fetch_add(1);
+    return false;
+  }
+
+  std::copy(frame.begin(), frame.end(), slots[slot.value()].begin());
+  Pending entry{slot.value(), static_cast<uint32_t>(frame.length()),
+                frame.sequence(), frame.timestamp()};
+  // Never full, as there are no more pending frames than slots.
+  pending.try_push(entry);
+  return true;
+}
+
+void Recorder::write_frames(void) {
+  static const uint8_t padding[FRAME_ALIGNMENT] = {};
+
+  while (auto entry = pending.pop()) {
+    const auto padded = (offset + FRAME_ALIGNMENT - 1) / FRAME_ALIGNMENT *
+                        FRAME_ALIGNMENT;
+    RecordingIndexEntry index_entry{padded, entry->length, entry->sequence,
+                                    entry->timestamp.count()};
+    const auto ok =
+        !failed.load() && write_all(data_fd, padding, padded - offset) &&
+        write_all(data_fd, slots[entry->slot].data(), entry->length) &&
+        write_all(index_fd, &index_entry, sizeof(index_entry));
+    free_slots.try_push(entry->slot);
+
+    if (!ok) {
+      if (!failed.exchange(true)) {
+        fprintf(stderr, "Recording failed: %s\n", strerror(errno));
+      }
+      _dropped.fetch_add(1);
+      continue;
+    }
+    offset = padded + entry->length;
+    _recorded.fetch_add(1);
+  }
+}
+
+bool Recorder::write_all(int fd, const void *data, size_t length) {
+  const auto *p = static_cast<const uint8_t *>(data);
+  while (length > 0) {
+    const auto r = write(fd, p, length);
+    if (r == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    p += r;
+    length -= r;
+  }
+  return true;
+}
+
+static std::vector<uint8_t> read_whole(const std::filesystem::path &path) {
+  const auto fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    throw std::runtime_error("Cannot open " + path.string() + ": " +
+                             strerror(errno));
+  }
+  std::vector<uint8_t> data;
+  uint8_t buf[65536];
+  ssize_t r;
+  while ((r = read(fd, buf, sizeof(buf))) != 0) {
+    if (r == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      const auto err = errno;
+      ::close(fd);
+      throw std::runtime_error("Cannot read " + path.string() + ": " +
+                               strerror(err));
+    }
+    data.insert(data.end(), buf, buf + r);
+  }
+  ::close(fd);
+  return data;
+}
+
+ReplaySource::ReplaySource(const std::filesystem::path &path, bool real_time,
+                           bool loop)
+    : FrameSource(0, 0, 0, 0), mapped(nullptr), mapped_length(0),
+      real_time(real_time), loop(loop) {
+  const auto fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    throw std::runtime_error("Cannot open " + path.string() + ": " +
+                             strerror(errno));
+  }
+  struct stat st;
+  if (fstat(fd, &st) == -1 || size_t(st.st_size) < sizeof(RecordingHeader)) {
+    ::close(fd);
+    throw std::runtime_error(path.string() + " is not a recording");
+  }
+  mapped_length = st.st_size;
+  auto *address = mmap(nullptr, mapped_length, PROT_READ, MAP_PRIVATE, fd, 0);
+  const auto err = errno;
+  ::close(fd);
+  if (address == MAP_FAILED) {
+    throw std::runtime_error("Cannot map " + path.string() + ": " +
+                             strerror(err));
+  }
+  mapped = static_cast<const uint8_t *>(address);
+
+  RecordingHeader header;
+  memcpy(&header, mapped, sizeof(header));
+  if (memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0) {
+    munmap(address, mapped_length);
+    throw std::runtime_error(path.string() + " is not a recording");
+  }
+  _fourcc = header.four_cc;
+  _width = header.width;
+  _height = header.height;
+  _bytesperline = header.bytesperline;
+
+  // Recording may have been cut short, leave out what isn't in the data.
+  const auto raw_index = read_whole(recording_index_path(path));
+  const auto entries = raw_index.size() / sizeof(RecordingIndexEntry);
+  for (size_t i = 0; i < entries; ++i) {
+    RecordingIndexEntry entry;
+    memcpy(&entry, raw_index.data() + i * sizeof(entry), sizeof(entry));
+    if (entry.offset + entry.length > mapped_length) {
+      break;
+    }
+    index.push_back(entry);
+  }
+  if (index.empty()) {
+    munmap(address, mapped_length);
+    throw std::runtime_error(path.string() + " has no frames");
+  }
+  madvise(address, mapped_length, MADV_SEQUENTIAL);
+}
+
+ReplaySource::~ReplaySource() {
+  munmap(const_cast<uint8_t *>(mapped), mapped_length);
+}
+
+std::optional<SourceFrame> ReplaySource::next(void) {
+  if (position == index.size()) {
+    if (!loop) {
+      return std::nullopt;
+    }
+    position = 0;
+  }
+
+  const auto &entry = index[position];
+  if (real_time) {
+    const auto now = std::chrono::steady_clock::now();
+    if (!due.has_value()) {
+      due = now;
+    } else if (position > 0) {
+      const auto gap = std::chrono::microseconds(
+          entry.timestamp_us - index[position - 1].timestamp_us);
+      *due += std::max(gap, std::chrono::microseconds(0));
+    }
+    std::this_thread::sleep_until(*due);
+  }
+  ++position;
+
+  return SourceFrame{ByteView(mapped + entry.offset, entry.length),
+                     std::chrono::microseconds(entry.timestamp_us),
+                     entry.sequence};
+}
+
+FrameView ReplaySource::read_frame(void) {
+  const auto frame = next();
+  if (!frame.has_value()) {
+    return FrameView(*this);
+  }
+  return FrameView(*this, std::nullopt, frame->data.data(), frame->data.size(),
+                   frame->timestamp, frame->sequence);
+}
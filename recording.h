@@ -0,0 +1,117 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <optional>
+#include <thread>
+#include <vector>
+
+#include "./camera.h"
+#include "./frame_source.h"
+#include "./spsc_queue.h"
+
+// Recording of raw frames is a pair of append-only files. PATH starts with
+// RecordingHeader and holds frames at FRAME_ALIGNMENT aligned offsets.
+// PATH.idx holds one RecordingIndexEntry for each frame, appended after its
+// data, so index never points past what is written.
+struct RecordingHeader {
+  char magic[8];
+  uint32_t four_cc;
+  uint32_t width, height;
+  uint32_t bytesperline;
+  uint64_t reserved;
+};
+static_assert(sizeof(RecordingHeader) == 32, "header layout is fixed");
+
+struct RecordingIndexEntry {
+  uint64_t offset;
+  uint32_t length;
+  uint32_t sequence;
+  // V4L2 timestamp in CLOCK_MONOTONIC.
+  int64_t timestamp_us;
+};
+static_assert(sizeof(RecordingIndexEntry) == 24, "index layout is fixed");
+
+std::filesystem::path recording_index_path(const std::filesystem::path &path);
+
+// Records frames from its own thread. Frames are copied into one of a few
+// slots, so the camera buffer can be re-queued right away. Frames are left
+// out of the recording, instead of holding up capture, when every slot is
+// still waiting for the disk.
+class Recorder {
+public:
+  Recorder(const std::filesystem::path &path, uint32_t four_cc, uint32_t width,
+           uint32_t height, uint32_t bytesperline, size_t max_frame_size,
+           size_t slot_count = 8);
+  // Writes out queued frames.
+  ~Recorder();
+  Recorder(const Recorder &) = delete;
+  Recorder &operator=(const Recorder &) = delete;
+
+  // Returns false when frame is left out.
+  bool record(const FrameView &frame);
+
+  size_t recorded() const {
+    return _recorded.load();
+  }
+  size_t dropped() const {
+    return _dropped.load();
+  }
+
+protected:
+  struct Pending {
+    size_t slot;
+    uint32_t length;
+    uint32_t sequence;
+    std::chrono::microseconds timestamp;
+  };
+
+  void write_frames(void);
+  bool write_all(int fd, const void *data, size_t length);
+
+  int data_fd;
+  int index_fd;
+  uint64_t offset;
+  std::vector<std::vector<uint8_t>> slots;
+  SpscQueue<size_t> free_slots;
+  SpscQueue<Pending> pending;
+  std::atomic<size_t> _recorded{0};
+  std::atomic<size_t> _dropped{0};
+  std::atomic<bool> failed{false};
+  std::thread thread;
+};
+
+// Plays a recording back from a mapping of it. Frames point straight into
+// the mapping. In real time, frames are handed out at the pace they were
+// captured, as fast as they are taken otherwise.
+class ReplaySource : public FrameSource, public FrameOwner {
+public:
+  explicit ReplaySource(const std::filesystem::path &path,
+                        bool real_time = false, bool loop = false);
+  ~ReplaySource();
+  ReplaySource(const ReplaySource &) = delete;
+  ReplaySource &operator=(const ReplaySource &) = delete;
+
+  std::optional<SourceFrame> next(void) override;
+  // Same frame as a view, for code taking camera frames. Empty at the end.
+  FrameView read_frame(void);
+
+  // Frames stay in the mapping, so there is nothing to take back.
+  void clean_after_read(unsigned int) override {}
+
+  size_t count() const {
+    return index.size();
+  }
+
+protected:
+  const uint8_t *mapped;
+  size_t mapped_length;
+  std::vector<RecordingIndexEntry> index;
+  const bool real_time;
+  const bool loop;
+  size_t position = 0;
+  // When frame at position is due in real time.
+  std::optional<std::chrono::steady_clock::time_point> due;
+};
@@ -0,0 +1,131 @@
+#include "./sink.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "./metrics.h"
+
+EncodedView::EncodedView(const uint8_t *data, size_t length, Release release,
+                         void *handle)
+    : ByteView(data, length), release(release), handle(handle) {}
+
+EncodedView::EncodedView(EncodedView &&other)
+    : ByteView(other), release(other.release), handle(other.handle) {
+  other.release = nullptr;
+  other.handle = nullptr;
+}
+
+EncodedView::~EncodedView() {
+  if (release != nullptr) {
+    release(handle);
+  }
+}
+
+FdSink::FdSink(int fd, bool socket) : fd(fd), socket(socket) {}
+
+FdSink::~FdSink() { flush(); }
+
+void FdSink::consume(EncodedView view) {
+  if (view.empty()) {
+    return;
+  }
+  if (view_count == MAX_VIEWS) {
+    flush();
+  }
+  views[view_count++].emplace(std::move(view));
+}
+
+void FdSink::flush() {
+  if (view_count == 0) {
+    return;
+  }
+  StageTimer timer{Stage::WRITE};
+
+  iovec iov[MAX_VIEWS];
+  for (size_t i = 0; i < view_count; ++i) {
+    iov[i] = {const_cast<uint8_t *>(views[i]->data()), views[i]->size()};
+  }
+
+  size_t index = 0;
+  while (fd != -1 && ok() && index < view_count) {
+    ssize_t r;
+    if (socket) {
+      msghdr msg;
+      memset(&msg, 0, sizeof(msg));
+      msg.msg_iov = iov + index;
+      msg.msg_iovlen = view_count - index;
+      r = sendmsg(fd, &msg, MSG_NOSIGNAL);
+    } else {
+      r = writev(fd, iov + index, view_count - index);
+    }
+    if (r == -1) {
+      if (errno != EINTR) {
+        error = errno;
+      }
+      continue;
+    }
+    _written += r;
+    metrics().written_bytes.fetch_add(r, std::memory_order_relaxed);
+
+    // Skip what is written.
+    size_t left = r;
+    while (index < view_count && left >= iov[index].iov_len) {
+      left -= iov[index].iov_len;
+      ++index;
+    }
+    if (index < view_count) {
+      iov[index].iov_base = static_cast<uint8_t *>(iov[index].iov_base) + left;
+      iov[index].iov_len -= left;
+    }
+  }
+
+  for (size_t i = 0; i < view_count; ++i) {
+    views[i].reset();
+  }
+  view_count = 0;
+}
+
+FileSink::FileSink(const std::filesystem::path &path)
+    : FdSink(open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                  0644)) {
+  if (fd == -1) {
+    error = errno;
+  }
+}
+
+FileSink::~FileSink() { close(); }
+
+bool FileSink::close() {
+  if (fd == -1) {
+    return false;
+  }
+  flush();
+  if (::close(fd) == -1 && error == 0) {
+    error = errno;
+  }
+  const auto succeeded = error == 0;
+  fd = -1;
+  return succeeded;
+}
+
+ArenaSink::ArenaSink(size_t capacity) : buffer(capacity) {}
+
+void ArenaSink::consume(EncodedView view) {
+  StageTimer timer{Stage::ASSEMBLE};
+  if (used + view.size() > buffer.size()) {
+    buffer.resize(std::max(buffer.size() * 2, used + view.size()));
+  }
+  std::copy(view.begin(), view.end(), buffer.begin() + used);
+  used += view.size();
+}
+
+void VectorSink::consume(EncodedView view) {
+  StageTimer timer{Stage::ASSEMBLE};
+  out.insert(out.end(), view.begin(), view.end());
+}
@@ -0,0 +1,109 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <optional>
+#include <vector>
+
+#include "./mjpeg.h"
+
+// Piece of encoded output, like a MMAL output buffer. Owner of the memory is
+// told through release when the view is dropped, so the buffer can be reused.
+class EncodedView : public ByteView {
+public:
+  using Release = void (*)(void *handle);
+
+  EncodedView(const uint8_t *data, size_t length, Release release = nullptr,
+              void *handle = nullptr);
+  // Ownership of the buffer moves, so it is released only once.
+  EncodedView(EncodedView &&other);
+  EncodedView(const EncodedView &) = delete;
+  EncodedView &operator=(const EncodedView &) = delete;
+  ~EncodedView();
+
+protected:
+  Release release;
+  void *handle;
+};
+
+// Takes encoded output piece by piece as encoder produces it.
+//
+// Holding on to a view keeps its buffer away from the encoder, so views must
+// be dropped by flush() at the latest. Encoders call flush() when they run
+// out of buffers and at the end of each frame.
+class EncodedSink {
+public:
+  virtual ~EncodedSink() = default;
+
+  virtual void consume(EncodedView view) = 0;
+  virtual void flush() {}
+};
+
+// Writes pieces into fd, gathering up to MAX_VIEWS of them into one writev().
+// Write errors are kept instead of thrown, as they happen in the middle of
+// encoding.
+class FdSink : public EncodedSink {
+public:
+  // Sockets are written with MSG_NOSIGNAL, so a gone peer doesn't raise
+  // SIGPIPE.
+  explicit FdSink(int fd, bool socket = false);
+  ~FdSink();
+
+  void consume(EncodedView view) override;
+  void flush() override;
+
+  // False once a write failed.
+  bool ok() const { return error == 0; }
+  size_t written() const { return _written; }
+
+protected:
+  static constexpr size_t MAX_VIEWS = 8;
+
+  int fd;
+  const bool socket;
+  std::array<std::optional<EncodedView>, MAX_VIEWS> views;
+  size_t view_count = 0;
+  size_t _written = 0;
+  int error = 0;
+};
+
+// FdSink into a file it creates.
+class FileSink : public FdSink {
+public:
+  explicit FileSink(const std::filesystem::path &path);
+  ~FileSink();
+
+  // Flush and close. Returns false when anything failed.
+  bool close();
+};
+
+// Copies pieces into a buffer which is kept between frames, so it only
+// allocates until it has grown to the largest frame.
+class ArenaSink : public EncodedSink {
+public:
+  explicit ArenaSink(size_t capacity = 0);
+
+  void consume(EncodedView view) override;
+
+  // Start next frame, keeping the buffer.
+  void clear() { used = 0; }
+  ByteView data() const { return ByteView(buffer.data(), used); }
+  size_t size() const { return used; }
+
+protected:
+  std::vector<uint8_t> buffer;
+  size_t used = 0;
+};
+
+// Appends pieces to a vector.
+class VectorSink : public EncodedSink {
+public:
+  explicit VectorSink(std::vector<uint8_t> &out) : out(out) {}
+
+  void consume(EncodedView view) override;
+
+protected:
+  std::vector<uint8_t> &out;
+};
@@ -0,0 +1,79 @@
+#include "./size_budget.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include "./encoder.h"
+#include "./metrics.h"
+
+// Percent libjpeg scales its quantization tables by, as jpeg_quality_scaling()
+// does. MMAL takes the same quality scale.
+static double quality_scale(int quality) {
+  return quality < 50 ? 5000.0 / quality : 200.0 - 2 * quality;
+}
+
+static int scale_quality(double scale) {
+  return static_cast<int>(scale > 100 ? 5000 / scale : (200 - scale) / 2);
+}
+
+SizeBudget::SizeBudget(Encoder &encoder, size_t max_bytes, int quality)
+    : encoder(encoder), _max_bytes(max_bytes),
+      _quality(quality ? std::clamp(quality, MIN_QUALITY, MAX_QUALITY)
+                       : DEFAULT_QUALITY),
+      attempt(max_bytes) {}
+
+int SizeBudget::estimate(int quality, size_t size, size_t target) const {
+  const auto scale = quality_scale(quality) *
+                     std::pow(double(size) / target, 1 / exponent);
+  return std::clamp(scale_quality(scale), MIN_QUALITY, MAX_QUALITY);
+}
+
+void SizeBudget::learn(int quality, size_t size) {
+  if (last_quality != 0 && last_quality != quality && last_size != 0 &&
+      size != 0) {
+    // Frames differ too, so it is only averaged in.
+    const auto measured = std::log(double(size) / last_size) /
+                          std::log(quality_scale(last_quality) /
+                                   quality_scale(quality));
+    if (std::isfinite(measured)) {
+      exponent = (exponent + std::clamp(measured, 0.3, 1.5)) / 2;
+    }
+  }
+  last_quality = quality;
+  last_size = size;
+}
+
+int SizeBudget::start_attempt(void) {
+  attempt.clear();
+  encoder.set_quality(_quality);
+  return _quality;
+}
+
+bool SizeBudget::finish_attempt(int quality, int attempts) {
+  // Aimed a bit under the budget, so estimates which are off still fit.
+  const auto target = _max_bytes - _max_bytes / 16;
+  const auto size = attempt.size();
+  learn(quality, size);
+
+  if (size <= _max_bytes) {
+    // Well under it, so the next frame can afford more.
+    if (size < _max_bytes - _max_bytes / 8) {
+      _quality = std::max(quality, estimate(quality, size, target));
+    }
+    return true;
+  }
+  if (quality == MIN_QUALITY || attempts == MAX_ATTEMPTS) {
+    metrics().over_budget_frames.fetch_add(1, std::memory_order_relaxed);
+    // Next frame starts lower still.
+    _quality = std::min(quality, estimate(quality, size, target));
+    return true;
+  }
+  metrics().budget_reencodes.fetch_add(1, std::memory_order_relaxed);
+  _quality = std::min(quality - 1, estimate(quality, size, target));
+  return false;
+}
+
+void SizeBudget::deliver(EncodedSink &sink) {
+  sink.consume(EncodedView(attempt.data().data(), attempt.size()));
+  sink.flush();
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <cstddef>
+
+#include "./sink.h"
+
+class Encoder;
+
+// Encodes JPEG frames at the highest quality at which they fit max_bytes.
+//
+// Consecutive frames of a camera come out at about the same size, so the
+// quality the last frame ended at is tried first and most frames are encoded
+// once. A frame which comes out too large is encoded again at a quality
+// estimated from how far over it was, up to MAX_ATTEMPTS times. Frames well
+// under the budget let the next one try a higher quality.
+//
+// Size is modeled as proportional to a power of the quantizer scale libjpeg
+// derives from quality, and the power is learned from the last two encodes
+// which differed in quality.
+class SizeBudget {
+public:
+  static constexpr int MAX_ATTEMPTS = 4;
+  static constexpr int MIN_QUALITY = 5;
+  static constexpr int MAX_QUALITY = 95;
+  static constexpr int DEFAULT_QUALITY = 85;
+
+  // First frame is tried at quality, DEFAULT_QUALITY when 0.
+  SizeBudget(Encoder &encoder, size_t max_bytes, int quality = 0);
+
+  // Encode a frame into sink by calling encode with a sink of its own, once
+  // for every attempt. Output of the last attempt goes to sink, which is
+  // over max_bytes when MAX_ATTEMPTS or MIN_QUALITY weren't enough. A
+  // template, so callers' lambdas aren't allocated for every frame.
+  template <typename Encode> void encode(Encode &&encode, EncodedSink &sink) {
+    for (int attempts = 1;; ++attempts) {
+      const auto quality = start_attempt();
+      encode(attempt);
+      if (finish_attempt(quality, attempts)) {
+        break;
+      }
+    }
+    deliver(sink);
+  }
+
+  size_t max_bytes() const { return _max_bytes; }
+  // Quality the next frame is tried at.
+  int quality() const { return _quality; }
+
+protected:
+  // Set quality of the next attempt on encoder and return it.
+  int start_attempt(void);
+  // Learn from the attempt and pick quality of the next one. Returns whether
+  // it was the last one of the frame.
+  bool finish_attempt(int quality, int attempts);
+  // Pass output of the last attempt on.
+  void deliver(EncodedSink &sink);
+  // Quality at which a frame which came out size bytes at quality would come
+  // out target bytes.
+  int estimate(int quality, size_t size, size_t target) const;
+  void learn(int quality, size_t size);
+
+  Encoder &encoder;
+  const size_t _max_bytes;
+  int _quality;
+  // Exponent of the size model, size ~ scale^-exponent.
+  double exponent = 0.7;
+  // Last encode, 0 before the first.
+  int last_quality = 0;
+  size_t last_size = 0;
+  ArenaSink attempt;
+};
@@ -0,0 +1,95 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <memory>
+#include <optional>
+#include <thread>
+
+// Bounded lock-free queue for one producer thread and one consumer thread.
+// Blocking push/pop spin briefly and then poll with short sleeps, which is
+// cheap next to frame intervals.
+template <typename T> class SpscQueue {
+public:
+  explicit SpscQueue(size_t capacity) {
+    size_t size = 1;
+    while (size < capacity) {
+      size <<= 1;
+    }
+    mask = size - 1;
+    slots.reset(new std::optional<T>[size]);
+  }
+
+  SpscQueue(const SpscQueue &) = delete;
+  SpscQueue &operator=(const SpscQueue &) = delete;
+
+  size_t capacity() const { return mask + 1; }
+
+  // Returns false when the queue is full. value is left untouched then.
+  bool try_push(T &value) {
+    const auto t = tail.load(std::memory_order_relaxed);
+    if (t - head.load(std::memory_order_acquire) > mask) {
+      return false;
+    }
+    slots[t & mask].emplace(std::move(value));
+    tail.store(t + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Blocks while the queue is full. Returns false when queue is closed.
+  bool push(T value) {
+    for (unsigned int spin = 0; !closed.load(std::memory_order_acquire);
+         ++spin) {
+      if (try_push(value)) {
+        return true;
+      }
+      backoff(spin);
+    }
+    return false;
+  }
+
+  std::optional<T> try_pop() {
+    const auto h = head.load(std::memory_order_relaxed);
+    if (h == tail.load(std::memory_order_acquire)) {
+      return std::nullopt;
+    }
+    auto &slot = slots[h & mask];
+    std::optional<T> ret{std::move(*slot)};
+    slot.reset();
+    head.store(h + 1, std::memory_order_release);
+    return ret;
+  }
+
+  // Blocks while the queue is empty. Returns empty when queue is closed and
+  // every pushed value is popped.
+  std::optional<T> pop() {
+    for (unsigned int spin = 0;; ++spin) {
+      // Check closed before trying, so values pushed before close are not
+      // lost.
+      const auto is_closed = closed.load(std::memory_order_acquire);
+      auto ret = try_pop();
+      if (ret.has_value() || is_closed) {
+        return ret;
+      }
+      backoff(spin);
+    }
+  }
+
+  void close() { closed.store(true, std::memory_order_release); }
+
+protected:
+  static void backoff(unsigned int spin) {
+    if (spin < 64) {
+      std::this_thread::yield();
+    } else {
+      std::this_thread::sleep_for(std::chrono::microseconds(100));
+    }
+  }
+
+  std::unique_ptr<std::optional<T>[]> slots;
+  size_t mask;
+  alignas(64) std::atomic<size_t> head{0};
+  alignas(64) std::atomic<size_t> tail{0};
+  std::atomic<bool> closed{false};
+};
@@ -0,0 +1,393 @@
+#include "./stream_server.h"
+
+#include <stdexcept>
+
+#include <errno.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "./camera.h"
+#include "./dmabuf.h"
+#include "./encoder.h"
+#include "./sink.h"
+
+std::atomic<bool> StreamServer::stop_requested = false;
+
+constexpr int MAX_EVENTS = 16;
+constexpr size_t MAX_REQUEST_SIZE = 8192;
+static const char BOUNDARY[] = "v4l2-mmal-cap-frame";
+static const char TRAILER[] = "\r\n";
+
+StreamServer::StreamServer(uint16_t port, Camera &camera,
+                           DmabufHandoff &handoff)
+    : camera(camera), handoff(handoff), listen_fd(-1), epoll_fd(-1) {
+  listen_fd = socket(AF_INET6, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (listen_fd == -1) {
+    throw std::runtime_error(std::string("socket: ") + strerror(errno));
+  }
+
+  int on = 1;
+  setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+  int off = 0;
+  setsockopt(listen_fd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off));
+
+  sockaddr_in6 addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin6_family = AF_INET6;
+  addr.sin6_addr = in6addr_any;
+  addr.sin6_port = htons(port);
+  if (bind(listen_fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) ==
+          -1 ||
+      listen(listen_fd, 16) == -1) {
+    const auto err = errno;
+    ::close(listen_fd);
+    throw std::runtime_error("bind port " + std::to_string(port) + ": " +
+                             strerror(err));
+  }
+
+  epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (epoll_fd == -1) {
+    const auto err = errno;
+    ::close(listen_fd);
+    throw std::runtime_error(std::string("epoll_create1: ") + strerror(err));
+  }
+
+  epoll_event event;
+  event.events = EPOLLIN;
+  event.data.fd = listen_fd;
+  epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &event);
+  event.data.fd = camera.poll_fd();
+  epoll_ctl(epoll_fd, EPOLL_CTL_ADD, camera.poll_fd(), &event);
+}
+
+StreamServer::~StreamServer() {
+  for (const auto &client : clients) {
+    ::close(client.first);
+  }
+  ::close(epoll_fd);
+  ::close(listen_fd);
+}
+
+void StreamServer::request_stop(void) { stop_requested.store(true); }
+
+void StreamServer::send_frame(void) {
+  const auto frame = camera.dequeue_frame();
+  if (frame.length() == 0 || !wants_frames()) {
+    return;
+  }
+  auto buffer = frame_buffer();
+  VectorSink sink{*buffer};
+  handoff.encode(frame, sink);
+  publish(buffer);
+}
+
+std::shared_ptr<std::vector<uint8_t>> StreamServer::frame_buffer(void) {
+  for (const auto &buffer : frame_buffers) {
+    if (buffer.use_count() == 1) {
+      buffer->clear();
+      return buffer;
+    }
+  }
+  frame_buffers.push_back(std::make_shared<std::vector<uint8_t>>());
+  return frame_buffers.back();
+}
+
+void StreamServer::recover(const CameraError &error) {
+  epoll_ctl(epoll_fd, EPOLL_CTL_DEL, camera.poll_fd(), nullptr);
+  // Clients stay connected and get frames again once camera is back.
+  if (!camera.recover(error)) {
+    throw error;
+  }
+  epoll_event event;
+  event.events = EPOLLIN;
+  event.data.fd = camera.poll_fd();
+  epoll_ctl(epoll_fd, EPOLL_CTL_ADD, camera.poll_fd(), &event);
+}
+
+void StreamServer::run(void) {
+  epoll_event events[MAX_EVENTS];
+
+  while (!stop_requested.load()) {
+    const auto count = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+    if (count == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      fprintf(stderr, "epoll_wait error %d, %s\n", errno, strerror(errno));
+      break;
+    }
+
+    for (int i = 0; i < count; ++i) {
+      const auto fd = events[i].data.fd;
+
+      if (fd == listen_fd) {
+        accept_clients();
+        continue;
+      }
+
+      if (fd == camera.poll_fd()) {
+        try {
+          send_frame();
+        } catch (const CameraError &e) {
+          recover(e);
+        } catch (const FrameError &e) {
+          fprintf(stderr, "Dropped frame: %s\n", e.what());
+        }
+        continue;
+      }
+
+      const auto it = clients.find(fd);
+      if (it == clients.end()) {
+        continue;
+      }
+      auto &client = *it->second;
+      if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+        drop_client(fd);
+        continue;
+      }
+      if (events[i].events & EPOLLIN) {
+        read_request(client);
+        if (clients.count(fd) == 0) {
+          continue;
+        }
+      }
+      if (events[i].events & EPOLLOUT) {
+        if (!flush(client)) {
+          drop_client(fd);
+        }
+      }
+    }
+  }
+}
+
+void StreamServer::accept_clients(void) {
+  while (true) {
+    const auto fd =
+        accept4(listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd == -1) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        fprintf(stderr, "accept error %d, %s\n", errno, strerror(errno));
+      }
+      return;
+    }
+
+    epoll_event event;
+    event.events = EPOLLIN;
+    event.data.fd = fd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event);
+
+    auto client = std::make_unique<Client>();
+    client->fd = fd;
+    clients.emplace(fd, std::move(client));
+  }
+}
+
+void StreamServer::read_request(Client &client) {
+  char buf[1024];
+  while (true) {
+    const auto r = recv(client.fd, buf, sizeof(buf), 0);
+    if (r == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      break;
+    }
+    if (r == -1 && errno == EINTR) {
+      continue;
+    }
+    if (r <= 0) {
+      drop_client(client.fd);
+      return;
+    }
+    // Anything after the request is ignored while streaming.
+    if (client.streaming || client.snapshot) {
+      continue;
+    }
+    client.request.append(buf, r);
+  }
+
+  if (client.streaming || client.snapshot) {
+    return;
+  }
+
+  const auto end = client.request.find("\r\n\r\n");
+  if (end == std::string::npos) {
+    if (client.request.size() > MAX_REQUEST_SIZE) {
+      drop_client(client.fd);
+    }
+    return;
+  }
+
+  const auto line = client.request.substr(0, client.request.find("\r\n"));
+  if (line.compare(0, 4, "GET ") != 0) {
+    static const char response[] =
+        "HTTP/1.0 405 Method Not Allowed\r\nConnection: close\r\n\r\n";
+    send(client.fd, response, sizeof(response) - 1, MSG_NOSIGNAL);
+    drop_client(client.fd);
+    return;
+  }
+
+  const auto target = line.substr(4, line.find(' ', 4) - 4);
+  if (target == "/snapshot" || target == "/snapshot.jpg") {
+    client.snapshot = true;
+    client.header = "HTTP/1.0 200 OK\r\n"
+                    "Cache-Control: no-cache\r\n"
+                    "Connection: close\r\n"
+                    "Content-Type: image/jpeg\r\n";
+    return;
+  }
+
+  client.streaming = true;
+  client.header = std::string("HTTP/1.0 200 OK\r\n"
+                              "Cache-Control: no-cache\r\n"
+                              "Pragma: no-cache\r\n"
+                              "Connection: close\r\n"
+                              "Content-Type: multipart/x-mixed-replace; "
+                              "boundary=") +
+                  BOUNDARY + "\r\n\r\n";
+}
+
+bool StreamServer::wants_frames(void) const {
+  for (const auto &client : clients) {
+    if (client.second->streaming || client.second->snapshot) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void StreamServer::publish(const SharedFrame &frame) {
+  std::vector<int> gone;
+
+  for (auto &entry : clients) {
+    auto &client = *entry.second;
+    if (!client.streaming && !client.snapshot) {
+      continue;
+    }
+
+    if (client.current) {
+      if (client.next) {
+        ++client.dropped;
+      }
+      client.next = frame;
+      continue;
+    }
+
+    start_part(client, frame);
+    if (!flush(client)) {
+      gone.push_back(client.fd);
+    }
+  }
+
+  for (const auto fd : gone) {
+    drop_client(fd);
+  }
+}
+
+void StreamServer::start_part(Client &client, SharedFrame frame) {
+  const auto length = std::to_string(frame->size());
+  if (client.snapshot) {
+    // Response header is prepared already.
+    client.header += "Content-Length: " + length + "\r\n\r\n";
+  } else {
+    client.header += std::string("--") + BOUNDARY +
+                     "\r\nContent-Type: image/jpeg\r\nContent-Length: " +
+                     length + "\r\n\r\n";
+  }
+  client.current = std::move(frame);
+  client.offset = 0;
+}
+
+bool StreamServer::flush(Client &client) {
+  while (client.current) {
+    const auto header_size = client.header.size();
+    const auto frame_size = client.current->size();
+    const auto trailer_size = client.snapshot ? 0 : sizeof(TRAILER) - 1;
+    const auto total = header_size + frame_size + trailer_size;
+
+    iovec iov[3];
+    int iov_count = 0;
+    auto offset = client.offset;
+    if (offset < header_size) {
+      iov[iov_count++] = {const_cast<char *>(client.header.data()) + offset,
+                          header_size - offset};
+      offset = header_size;
+    }
+    if (offset < header_size + frame_size) {
+      const auto in_frame = offset - header_size;
+      iov[iov_count++] = {
+          const_cast<uint8_t *>(client.current->data()) + in_frame,
+          frame_size - in_frame};
+      offset = header_size + frame_size;
+    }
+    if (offset < total) {
+      const auto in_trailer = offset - header_size - frame_size;
+      iov[iov_count++] = {const_cast<char *>(TRAILER) + in_trailer,
+                          trailer_size - in_trailer};
+    }
+
+    // Without SIGPIPE, so a client gone mid-part is only dropped.
+    msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = iov_count;
+    const auto r = sendmsg(client.fd, &msg, MSG_NOSIGNAL);
+    if (r == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        watch_writable(client, true);
+        return true;
+      }
+      return false;
+    }
+
+    client.offset += r;
+    if (client.offset < total) {
+      continue;
+    }
+
+    // Part is done.
+    client.header.clear();
+    client.current.reset();
+    if (client.snapshot) {
+      return false;
+    }
+    if (client.next) {
+      start_part(client, std::move(client.next));
+      client.next.reset();
+    }
+  }
+
+  watch_writable(client, false);
+  return true;
+}
+
+void StreamServer::watch_writable(Client &client, bool writable) {
+  if (client.watching_writable == writable) {
+    return;
+  }
+  client.watching_writable = writable;
+
+  epoll_event event;
+  event.events = EPOLLIN | (writable ? uint32_t(EPOLLOUT) : 0u);
+  event.data.fd = client.fd;
+  epoll_ctl(epoll_fd, EPOLL_CTL_MOD, client.fd, &event);
+}
+
+void StreamServer::drop_client(int fd) {
+  const auto it = clients.find(fd);
+  if (it == clients.end()) {
+    return;
+  }
+  if (it->second->dropped > 0) {
+    fprintf(stderr, "Client %d dropped %zu frames\n", fd,
+            it->second->dropped);
+  }
+  epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+  ::close(fd);
+  clients.erase(it);
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+class Camera;
+class CameraError;
+class DmabufHandoff;
+
+// Serves live preview as multipart/x-mixed-replace JPEG over HTTP.
+//
+// Single thread waits on camera and every socket with epoll. Each frame is
+// encoded once and shared by reference count across clients, into a buffer
+// reused once no client holds it any more. A client which
+// is still sending previous frame only keeps the newest pending one, so slow
+// clients drop frames instead of stalling capture. Clients stay connected
+// while a camera which dropped off is reconnected.
+//
+//   GET /          multipart stream
+//   GET /snapshot  single JPEG
+class StreamServer {
+public:
+  StreamServer(uint16_t port, Camera &camera, DmabufHandoff &handoff);
+  ~StreamServer();
+
+  void run(void);
+  // Async-signal-safe.
+  static void request_stop(void);
+
+protected:
+  using SharedFrame = std::shared_ptr<const std::vector<uint8_t>>;
+
+  struct Client {
+    int fd;
+    std::string request;
+    bool streaming = false;
+    bool snapshot = false;
+    // Part being sent. offset counts across header, frame and trailer.
+    std::string header;
+    SharedFrame current;
+    size_t offset = 0;
+    SharedFrame next;
+    size_t dropped = 0;
+    bool watching_writable = false;
+  };
+
+  void send_frame(void);
+  // Buffer no client holds, emptied, or a new one when all are held.
+  std::shared_ptr<std::vector<uint8_t>> frame_buffer(void);
+  // Reconnect camera and watch its new fd. Rethrows error when it can't.
+  void recover(const CameraError &error);
+  void accept_clients(void);
+  void read_request(Client &client);
+  void publish(const SharedFrame &frame);
+  void start_part(Client &client, SharedFrame frame);
+  // Returns false when client is gone or finished.
+  bool flush(Client &client);
+  void watch_writable(Client &client, bool writable);
+  void drop_client(int fd);
+  bool wants_frames(void) const;
+
+  static std::atomic<bool> stop_requested;
+
+  Camera &camera;
+  DmabufHandoff &handoff;
+  int listen_fd;
+  int epoll_fd;
+  std::map<int, std::unique_ptr<Client>> clients;
+  // Grows to the most frames clients held at once.
+  std::vector<std::shared_ptr<std::vector<uint8_t>>> frame_buffers;
+};
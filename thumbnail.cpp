@@ -0,0 +1,55 @@
+#include "./thumbnail.h"
+
+#include <stdio.h>
+#include <system_error>
+
+#include "./fourcc.h"
+#include "./metrics.h"
+#include "./output_writer.h"
+#include "./sink.h"
+
+std::filesystem::path thumbnail_path(const std::filesystem::path &path) {
+  return path.parent_path() / ".thumbnails" / path.filename();
+}
+
+Thumbnailer::Thumbnailer(uint32_t input_four_cc, uint32_t width,
+                         uint32_t height, uint32_t stride,
+                         EncoderBackend backend, uint32_t output_four_cc,
+                         uint32_t max_size)
+    : downscaler(input_four_cc, width, height, stride, max_size, max_size),
+      encoder(Encoder::create(backend, ENCODING_I420,
+                              downscaler.output_width(),
+                              downscaler.output_height(), output_four_cc)) {}
+
+void Thumbnailer::write(OutputWriter &writer,
+                        const std::filesystem::path &path,
+                        const uint8_t *input, size_t length) {
+  const auto thumbnail = thumbnail_path(path);
+  if (thumbnail.parent_path() != directory) {
+    std::error_code error;
+    std::filesystem::create_directories(thumbnail.parent_path(), error);
+    if (error) {
+      fprintf(stderr, "Failed to create %s: %s\n",
+              thumbnail.parent_path().c_str(), error.message().c_str());
+      return;
+    }
+    directory = thumbnail.parent_path();
+  }
+
+  auto data = writer.buffer();
+  try {
+    ByteView scaled;
+    {
+      StageTimer timer{Stage::SCALE};
+      scaled = downscaler.downscale(input, length);
+    }
+    VectorSink sink{data};
+    StageTimer timer{Stage::ENCODE};
+    encoder->encode(scaled.data(), scaled.size(), sink);
+  } catch (const std::runtime_error &e) {
+    fprintf(stderr, "Failed to make thumbnail of %s: %s\n", path.c_str(),
+            e.what());
+    return;
+  }
+  writer.write(thumbnail, std::move(data));
+}
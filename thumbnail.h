@@ -0,0 +1,44 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <vector>
+
+#include "./convert.h"
+#include "./encoder.h"
+
+class OutputWriter;
+
+// Where thumbnail of path goes, the same name in a .thumbnails directory next
+// to it.
+std::filesystem::path thumbnail_path(const std::filesystem::path &path);
+
+// Small image of every capture, so albums can be browsed without decoding
+// full sized ones. Frames are downscaled to fit max_size and encoded by an
+// encoder of their own in the same pass as the capture.
+class Thumbnailer {
+public:
+  static constexpr uint32_t DEFAULT_SIZE = 320;
+
+  // input_four_cc is the format of frames passed in, a raw camera format or
+  // I420. Throws std::invalid_argument for formats which can't be
+  // downscaled, like compressed ones.
+  Thumbnailer(uint32_t input_four_cc, uint32_t width, uint32_t height,
+              uint32_t stride, EncoderBackend backend,
+              uint32_t output_four_cc, uint32_t max_size = DEFAULT_SIZE);
+
+  // Encode thumbnail of frame and queue it on writer as thumbnail of path.
+  // Failures are reported and leave the capture without thumbnail.
+  void write(OutputWriter &writer, const std::filesystem::path &path,
+             const uint8_t *input, size_t length);
+
+  uint32_t width() const { return downscaler.output_width(); }
+  uint32_t height() const { return downscaler.output_height(); }
+
+protected:
+  Downscaler downscaler;
+  std::unique_ptr<Encoder> encoder;
+  // Directory last made sure to exist.
+  std::filesystem::path directory;
+};
@@ -0,0 +1,333 @@
+#include "./timelapse.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <ctime>
+#include <optional>
+#include <sstream>
+#include <stdexcept>
+#include <vector>
+
+#include <stdio.h>
+#include <time.h>
+
+#include "./camera.h"
+#include "./fan_out.h"
+#include "./manifest.h"
+#include "./metrics.h"
+#include "./output.h"
+#include "./output_writer.h"
+#include "./thumbnail.h"
+
+std::atomic<bool> TimeLapse::stop_requested = false;
+
+Schedule Schedule::every(std::chrono::milliseconds interval,
+                         std::chrono::system_clock::time_point start) {
+  if (interval.count() <= 0) {
+    throw std::invalid_argument("Time-lapse interval must be positive");
+  }
+  Schedule schedule;
+  schedule.interval = interval;
+  schedule.start = start;
+  return schedule;
+}
+
+static int parse_cron_number(const std::string &text, int low, int high,
+                             const std::string &field) {
+  char *end;
+  const auto value = strtol(text.c_str(), &end, 10);
+  if (text.empty() || *end != '\0' || value < low || value > high) {
+    throw std::invalid_argument("Bad cron field " + field + ", " + text +
+                                " is not a number from " +
+                                std::to_string(low) + " to " +
+                                std::to_string(high));
+  }
+  return value;
+}
+
+// Values of field between low and high. Returns whether it was "*".
+template <size_t N>
+static bool parse_cron_field(const std::string &field, int low, int high,
+                             std::bitset<N> &values) {
+  bool any = false;
+  std::istringstream items{field};
+  std::string item;
+  while (std::getline(items, item, ',')) {
+    int step = 1;
+    const auto slash = item.find('/');
+    if (slash != std::string::npos) {
+      step = parse_cron_number(item.substr(slash + 1), 1, high, field);
+      item.erase(slash);
+    }
+    int first = low, last = high;
+    if (item == "*") {
+      any = any || step == 1;
+    } else {
+      const auto dash = item.find('-');
+      first = parse_cron_number(item.substr(0, dash), low, high, field);
+      last = dash == std::string::npos
+                 ? (slash == std::string::npos ? first : high)
+                 : parse_cron_number(item.substr(dash + 1), low, high, field);
+      if (last < first) {
+        throw std::invalid_argument("Bad cron field " + field +
+                                    ", range goes backwards");
+      }
+    }
+    for (int value = first; value <= last; value += step) {
+      values.set(value);
+    }
+  }
+  if (values.none()) {
+    throw std::invalid_argument("Bad cron field " + field);
+  }
+  return any;
+}
+
+Schedule Schedule::cron(const std::string &expression) {
+  std::istringstream stream{expression};
+  std::vector<std::string> fields;
+  std::string field;
+  while (stream >> field) {
+    fields.push_back(field);
+  }
+  if (fields.size() != 5) {
+    throw std::invalid_argument("Cron expression needs 5 fields, got " +
+                                std::to_string(fields.size()));
+  }
+
+  Schedule schedule;
+  parse_cron_field(fields[0], 0, 59, schedule.minutes);
+  parse_cron_field(fields[1], 0, 23, schedule.hours);
+  schedule.any_day = parse_cron_field(fields[2], 1, 31, schedule.days);
+  parse_cron_field(fields[3], 1, 12, schedule.months);
+  // Sunday is both 0 and 7.
+  std::bitset<8> weekdays;
+  schedule.any_weekday = parse_cron_field(fields[4], 0, 7, weekdays);
+  for (int day = 0; day < 7; ++day) {
+    schedule.weekdays[day] = weekdays[day] || (day == 0 && weekdays[7]);
+  }
+  return schedule;
+}
+
+bool Schedule::matches_day(const struct tm &time) const {
+  const bool day = days[time.tm_mday];
+  const bool weekday = weekdays[time.tm_wday];
+  if (!any_day && !any_weekday) {
+    return day || weekday;
+  }
+  return day && weekday;
+}
+
+std::chrono::system_clock::time_point
+Schedule::next(std::chrono::system_clock::time_point after) const {
+  if (interval.count() > 0) {
+    if (after < start) {
+      return start;
+    }
+    // Counted from start, so shots don't drift by how long each took.
+    const auto passed = (after - start) / interval;
+    return start + (passed + 1) * interval;
+  }
+
+  // Walk forward from the next whole minute, skipping a month, day or hour
+  // at a time while those don't match.
+  auto seconds = std::chrono::system_clock::to_time_t(after);
+  struct tm time;
+  localtime_r(&seconds, &time);
+  time.tm_sec = 0;
+  ++time.tm_min;
+  // Leap days come at least once in 8 years.
+  const auto last_year = time.tm_year + 8;
+  for (;;) {
+    time.tm_isdst = -1;
+    seconds = mktime(&time);
+    if (time.tm_year > last_year) {
+      break;
+    }
+    if (!months[time.tm_mon + 1]) {
+      time.tm_mday = 1;
+      time.tm_hour = 0;
+      time.tm_min = 0;
+      ++time.tm_mon;
+    } else if (!matches_day(time)) {
+      time.tm_hour = 0;
+      time.tm_min = 0;
+      ++time.tm_mday;
+    } else if (!hours[time.tm_hour]) {
+      time.tm_min = 0;
+      ++time.tm_hour;
+    } else if (!minutes[time.tm_min]) {
+      ++time.tm_min;
+    } else {
+      return std::chrono::system_clock::from_time_t(seconds);
+    }
+  }
+  throw std::runtime_error("Cron expression never matches");
+}
+
+TimeLapse::TimeLapse(Camera &camera, FanOut &outputs, OutputWriter &writer,
+                     const Schedule &schedule, Thumbnailer *thumbnailer,
+                     Manifest *manifest)
+    : camera(camera), outputs(outputs), writer(writer),
+      thumbnailer(thumbnailer), manifest(manifest), schedule(schedule) {}
+
+void TimeLapse::request_stop(void) { stop_requested.store(true); }
+
+void TimeLapse::run(size_t shot_count) {
+  size_t taken = 0;
+  size_t missed = 0;
+  std::chrono::microseconds jitter_sum{0};
+  std::chrono::microseconds jitter_max{0};
+
+  // Shot due right now, like the first one of an interval, is taken too.
+  auto due = schedule.next(std::chrono::system_clock::now() - MAX_LATENESS);
+  while (!stop_requested.load() && (shot_count == 0 || taken < shot_count)) {
+    // Frame timestamps are in CLOCK_MONOTONIC.
+    const auto now = monotonic_now();
+    const auto scheduled =
+        now + std::chrono::duration_cast<std::chrono::microseconds>(
+                  due - std::chrono::system_clock::now());
+    const auto wall_time = std::chrono::system_clock::to_time_t(due);
+    due = schedule.next(due);
+
+    if (now - scheduled > MAX_LATENESS) {
+      char text[32];
+      struct tm time;
+      strftime(text, sizeof(text), "%F %T",
+               localtime_r(&wall_time, &time));
+      fprintf(stderr, "Missed shot due at %s\n", text);
+      ++missed;
+      continue;
+    }
+
+    if (streaming && scheduled - now > IDLE_STREAM_GAP) {
+      camera.stop_capturing();
+      streaming = false;
+    }
+    if (!streaming) {
+      if (!sleep_until(scheduled - SETTLE_TIME)) {
+        break;
+      }
+      resume();
+    }
+
+    const auto frame = nearest_frame(scheduled);
+    if (frame.data() == nullptr) {
+      break;
+    }
+    const auto jitter = frame.timestamp() - scheduled;
+    const auto distance = std::chrono::abs(jitter);
+    metrics().shot_jitter.record(distance);
+    jitter_sum += distance;
+    jitter_max = std::max(jitter_max, distance);
+    fprintf(stderr, "Shot %zu: %+.1f ms from schedule\n", taken,
+            jitter.count() / 1000.0);
+
+    shoot(frame, taken);
+    ++taken;
+  }
+
+  if (taken > 0) {
+    fprintf(stderr,
+            "Took %zu shots, missed %zu, jitter mean %.1f ms, max %.1f ms\n",
+            taken, missed, jitter_sum.count() / 1000.0 / taken,
+            jitter_max.count() / 1000.0);
+  }
+}
+
+void TimeLapse::resume(void) {
+  try {
+    camera.start_capturing();
+  } catch (const CameraError &e) {
+    // Device may have dropped off while idle. It comes back stopped.
+    if (!camera.recover(e)) {
+      throw;
+    }
+    camera.start_capturing();
+  }
+  streaming = true;
+}
+
+bool TimeLapse::sleep_until(std::chrono::microseconds time) {
+  // In steps, so stop requests are noticed even when signal came before the
+  // sleep started.
+  constexpr std::chrono::microseconds STEP{std::chrono::seconds(1)};
+  while (!stop_requested.load()) {
+    const auto left = time - monotonic_now();
+    if (left.count() <= 0) {
+      return true;
+    }
+    const auto step = std::min(left, STEP);
+    timespec ts;
+    ts.tv_sec = step.count() / 1000000;
+    ts.tv_nsec = step.count() % 1000000 * 1000;
+    clock_nanosleep(CLOCK_MONOTONIC, 0, &ts, nullptr);
+  }
+  return false;
+}
+
+FrameView TimeLapse::nearest_frame(std::chrono::microseconds scheduled) {
+  std::optional<FrameView> previous;
+  while (!stop_requested.load()) {
+    std::optional<FrameView> read;
+    try {
+      read.emplace(camera.read_frame());
+    } catch (const CameraError &e) {
+      // Reconnecting waits for every frame to be dropped.
+      previous.reset();
+      if (!camera.recover(e)) {
+        throw;
+      }
+      continue;
+    }
+    auto &frame = *read;
+    if (frame.length() == 0) {
+      continue;
+    }
+    if (frame.timestamp() < scheduled) {
+      // Earlier one goes back to the driver first.
+      previous.reset();
+      previous.emplace(std::move(frame));
+      continue;
+    }
+    if (previous &&
+        scheduled - previous->timestamp() < frame.timestamp() - scheduled) {
+      return std::move(*previous);
+    }
+    return std::move(frame);
+  }
+  return FrameView(camera);
+}
+
+void TimeLapse::shoot(const FrameView &frame, size_t number) {
+  auto encoded = outputs.encode(frame, writer);
+  if (thumbnailer && !encoded.front().empty()) {
+    thumbnailer->write(writer, numbered_path(outputs.spec(0).path, number),
+                       frame.data(), frame.length());
+  }
+
+  const auto timestamp = frame.timestamp();
+  const auto sequence = frame.sequence();
+  for (size_t i = 0; i < encoded.size(); ++i) {
+    if (encoded[i].empty()) {
+      continue;
+    }
+    const auto width = outputs.width(i);
+    const auto height = outputs.height(i);
+    const uint64_t size = encoded[i].size();
+    writer.write(numbered_path(outputs.spec(i).path, number),
+                 std::move(encoded[i]),
+                 [this, width, height, timestamp, sequence, size,
+                  i](const std::filesystem::path &path, bool ok) {
+                   if (!ok) {
+                     return;
+                   }
+                   if (manifest) {
+                     // Only the first output has a thumbnail.
+                     manifest->record(path, width, height, timestamp,
+                                      sequence, size, i == 0);
+                   }
+                   fprintf(stdout, "%s\n", path.c_str());
+                 });
+  }
+}
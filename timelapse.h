@@ -0,0 +1,95 @@
+#pragma once
+
+#include <atomic>
+#include <bitset>
+#include <chrono>
+#include <cstddef>
+#include <filesystem>
+#include <string>
+
+class Camera;
+class FanOut;
+class FrameView;
+class Manifest;
+class OutputWriter;
+class Thumbnailer;
+
+// When time-lapse shots are due, every interval or by a crontab(5) line.
+class Schedule {
+public:
+  // Every interval, the first shot due at start.
+  static Schedule every(std::chrono::milliseconds interval,
+                        std::chrono::system_clock::time_point start);
+  // Five fields: minute, hour, day of month, month and day of week, each a
+  // "*", number, range or list of those, with optional "/step". Times are
+  // local. Throws std::invalid_argument on malformed expression.
+  static Schedule cron(const std::string &expression);
+
+  // First shot strictly after time. Throws std::runtime_error when cron
+  // expression never matches, like on 30th of February.
+  std::chrono::system_clock::time_point
+  next(std::chrono::system_clock::time_point after) const;
+
+protected:
+  Schedule() = default;
+
+  bool matches_day(const struct tm &time) const;
+
+  // Zero for cron schedules.
+  std::chrono::milliseconds interval{0};
+  std::chrono::system_clock::time_point start;
+  std::bitset<60> minutes;
+  std::bitset<24> hours;
+  std::bitset<32> days;
+  std::bitset<13> months;
+  // Sunday is 0.
+  std::bitset<7> weekdays;
+  // Restricted fields, as cron takes either day when both are.
+  bool any_day = true;
+  bool any_weekday = true;
+};
+
+// Takes shots by schedule into numbered files of every output, with camera
+// and encoders kept alive in between. Streaming is stopped across gaps
+// longer than IDLE_STREAM_GAP, keeping buffers mapped and encoders enabled,
+// and started again SETTLE_TIME ahead of the next shot for exposure to
+// settle. Each shot is the frame captured nearest to its scheduled time, and
+// how far it was off is reported and recorded into metrics.
+class TimeLapse {
+public:
+  static constexpr std::chrono::seconds IDLE_STREAM_GAP{10};
+  static constexpr std::chrono::seconds SETTLE_TIME{2};
+  // Shots overdue by more than this are skipped instead of taken late.
+  static constexpr std::chrono::seconds MAX_LATENESS{1};
+
+  // Camera must be streaming. Thumbnails are made of the first output.
+  TimeLapse(Camera &camera, FanOut &outputs, OutputWriter &writer,
+            const Schedule &schedule, Thumbnailer *thumbnailer = nullptr,
+            Manifest *manifest = nullptr);
+
+  // Take shot_count shots, until stopped when it is 0. Camera may be left
+  // stopped on return.
+  void run(size_t shot_count);
+  // Async-signal-safe.
+  static void request_stop(void);
+
+protected:
+  // Sleep until monotonic time. Returns false when stopped meanwhile.
+  bool sleep_until(std::chrono::microseconds time);
+  // Start streaming again, reconnecting camera when it is gone.
+  void resume(void);
+  // Read frames up to scheduled time and return the one nearer to it of the
+  // last two. Empty once stopped.
+  FrameView nearest_frame(std::chrono::microseconds scheduled);
+  void shoot(const FrameView &frame, size_t number);
+
+  static std::atomic<bool> stop_requested;
+
+  Camera &camera;
+  FanOut &outputs;
+  OutputWriter &writer;
+  Thumbnailer *thumbnailer;
+  Manifest *manifest;
+  const Schedule schedule;
+  bool streaming = true;
+};